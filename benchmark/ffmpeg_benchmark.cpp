@@ -0,0 +1,711 @@
+/**
+* benchmark of codec_utils, FFmpegDecoder, FFmpegTranscoder and FFmpegEncoder.
+*
+* the H264 test streams are generated by FFmpegEncoder from a deterministic
+* pattern, so no external media is needed. the results are written as JSON
+* to stdout or to the file given as the first argument.
+*
+* usage: ffmpeg_benchmark [output.json] [--quick]
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavutil/time.h>
+#include <libavutil/imgutils.h>
+}
+
+#include "../codec_utils.h"
+#include "../h264_analyzer.h"
+#include "../ffmpeg_decoder.h"
+#include "../ffmpeg_encoder.h"
+#include "../ffmpeg_transcoder.h"
+#include "../quality_metrics.h"
+
+namespace
+{
+	struct Resolution
+	{
+		int width;
+		int height;
+	};
+
+	struct PixelFormatName
+	{
+		AVPixelFormat format;
+		const char* name;
+	};
+
+	struct TestStream
+	{
+		int width;
+		int height;
+		// the stream size, data has the decoder padding after it
+		size_t size;
+		std::vector<uint8_t> data;
+		// the offset and size of every access unit in data
+		std::vector<std::pair<size_t, size_t> > packets;
+	};
+
+	const Resolution g_resolutions[] = {
+		{ 320, 240 },
+		{ 640, 480 },
+		{ 1280, 720 },
+		{ 1920, 1080 }
+	};
+
+	const PixelFormatName g_scale_formats[] = {
+		{ AV_PIX_FMT_YUV420P, "yuv420p" },
+		{ AV_PIX_FMT_NV12, "nv12" },
+		{ AV_PIX_FMT_YUV422P, "yuv422p" },
+		{ AV_PIX_FMT_RGB24, "rgb24" },
+		{ AV_PIX_FMT_BGR24, "bgr24" }
+	};
+
+	const char* g_presets[] = {
+		"ultrafast",
+		"superfast",
+		"veryfast",
+		"medium"
+	};
+
+	const int STREAM_FRAMES = 250;
+
+	//get the seconds
+	double GetSeconds()
+	{
+		return av_gettime_relative() / 1000000.0;
+	}
+
+	// a moving gradient with a moving box, the same bytes on every run
+	void fill_frame(uint8_t* data[], int linesize[], int width, int height, int index)
+	{
+		for (int y = 0; y < height; y++)
+		{
+			uint8_t* row = data[0] + y * linesize[0];
+			for (int x = 0; x < width; x++)
+			{
+				row[x] = (uint8_t)(x + y + index * 3);
+			}
+		}
+
+		int boxX = (index * 7) % (width / 2);
+		int boxY = (index * 5) % (height / 2);
+		for (int y = boxY; y < boxY + height / 4; y++)
+		{
+			memset(data[0] + y * linesize[0] + boxX, 235, width / 4);
+		}
+
+		for (int y = 0; y < height / 2; y++)
+		{
+			uint8_t* u = data[1] + y * linesize[1];
+			uint8_t* v = data[2] + y * linesize[2];
+			for (int x = 0; x < width / 2; x++)
+			{
+				u[x] = (uint8_t)(128 + ((x + index) & 0x3F));
+				v[x] = (uint8_t)(128 - ((y + index) & 0x3F));
+			}
+		}
+	}
+
+	bool alloc_image(std::vector<uint8_t>& buffer, uint8_t* data[4], int linesize[4], AVPixelFormat format, int width, int height)
+	{
+		int size = av_image_get_buffer_size(format, width, height, 1);
+		if (size < 0)
+		{
+			return false;
+		}
+
+		buffer.resize(size);
+		return av_image_fill_arrays(data, linesize, buffer.data(), format, width, height, 1) >= 0;
+	}
+
+	bool generate_stream(int width, int height, int frames, TestStream& stream)
+	{
+		FFmpegEncoder encoder;
+		// one thread, so the stream is the same on every machine
+		encoder.set_thread_count(1);
+		if (!encoder.init(width, height, AV_PIX_FMT_YUV420P))
+		{
+			return false;
+		}
+
+		std::vector<uint8_t> buffer;
+		uint8_t* data[4];
+		int linesize[4];
+		if (!alloc_image(buffer, data, linesize, AV_PIX_FMT_YUV420P, width, height))
+		{
+			return false;
+		}
+
+		stream.width = width;
+		stream.height = height;
+		stream.data.clear();
+		stream.packets.clear();
+
+		for (int i = 0; i <= frames; i++)
+		{
+			if (i < frames)
+			{
+				fill_frame(data, linesize, width, height, i);
+				if (!encoder.send_video_data(width, height, data, linesize))
+				{
+					return false;
+				}
+			}
+			else if (!encoder.send_end_of_stream())
+			{
+				return false;
+			}
+
+			AVPacket* packet;
+			while ((packet = encoder.receive_packet()) != NULL)
+			{
+				stream.packets.push_back(std::make_pair(stream.data.size(), (size_t)packet->size));
+				stream.data.insert(stream.data.end(), packet->data, packet->data + packet->size);
+				encoder.end_receive_packet();
+			}
+		}
+
+		// the decoder reads a little beyond the data
+		stream.size = stream.data.size();
+		stream.data.resize(stream.size + AV_INPUT_BUFFER_PADDING_SIZE, 0);
+		return !stream.packets.empty();
+	}
+
+	double percentile(std::vector<double>& values, double p)
+	{
+		if (values.empty())
+		{
+			return 0.0;
+		}
+
+		size_t index = (size_t)(p * (values.size() - 1) + 0.5);
+		std::nth_element(values.begin(), values.begin() + index, values.end());
+		return values[index];
+	}
+
+	void bench_start_codes(FILE* out, const TestStream& stream, int iterations, bool first)
+	{
+		int count = 0;
+		double start = GetSeconds();
+		for (int i = 0; i < iterations; i++)
+		{
+			count += count_frames(stream.data.data(), stream.size);
+		}
+		double elapsed = GetSeconds() - start;
+		double bytes = (double)stream.size * iterations;
+
+		fprintf(out, "%s\n    {\"resolution\": \"%dx%d\", \"bytes\": %zu, \"nal_units\": %d, \"gb_per_s\": %.3f}",
+			first ? "" : ",", stream.width, stream.height, stream.size, count / iterations,
+			elapsed > 0 ? bytes / elapsed / 1e9 : 0.0);
+	}
+
+	bool bench_analyzer(FILE* out, const TestStream& stream, int iterations, bool first)
+	{
+		H264StreamAnalyzer analyzer;
+		if (!analyzer.init())
+		{
+			return false;
+		}
+
+		double start = GetSeconds();
+		for (int i = 0; i < iterations; i++)
+		{
+			analyzer.reset();
+			for (size_t j = 0; j < stream.packets.size(); j++)
+			{
+				analyzer.push(stream.data.data() + stream.packets[j].first, stream.packets[j].second, (int64_t)j * 40000);
+			}
+			analyzer.flush();
+		}
+		double elapsed = GetSeconds() - start;
+		double bytes = (double)stream.size * iterations;
+
+		const H264StreamStats& stats = analyzer.get_stats();
+		fprintf(out, "%s\n    {\"resolution\": \"%dx%d\", \"frames\": %llu, \"gop_length\": %d, \"gb_per_s\": %.3f}",
+			first ? "" : ",", stream.width, stream.height, (unsigned long long)stats.frames, stats.last_gop_length,
+			elapsed > 0 ? bytes / elapsed / 1e9 : 0.0);
+		return true;
+	}
+
+	bool bench_decoder(FILE* out, TestStream& stream, bool first)
+	{
+		FFmpegDecoder decoder;
+		if (!decoder.init(AV_CODEC_ID_H264))
+		{
+			return false;
+		}
+
+		std::vector<double> latencies;
+		latencies.reserve(stream.packets.size());
+
+		int frames = 0;
+		double start = GetSeconds();
+		for (size_t i = 0; i < stream.packets.size(); i++)
+		{
+			double sendTime = GetSeconds();
+			if (!decoder.send_video_data(stream.data.data() + stream.packets[i].first, stream.packets[i].second, (long long)i))
+			{
+				return false;
+			}
+
+			while (decoder.receive_frame() != NULL)
+			{
+				latencies.push_back((GetSeconds() - sendTime) * 1e6);
+				frames++;
+			}
+		}
+		double elapsed = GetSeconds() - start;
+
+		double p50 = percentile(latencies, 0.50);
+		double p90 = percentile(latencies, 0.90);
+		double p99 = percentile(latencies, 0.99);
+		double maxLatency = latencies.empty() ? 0.0 : *std::max_element(latencies.begin(), latencies.end());
+
+		fprintf(out, "%s\n    {\"resolution\": \"%dx%d\", \"frames\": %d, \"fps\": %.1f, "
+			"\"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}}",
+			first ? "" : ",", stream.width, stream.height, frames, elapsed > 0 ? frames / elapsed : 0.0,
+			p50, p90, p99, maxLatency);
+		return true;
+	}
+
+	bool bench_quality(FILE* out, int width, int height, int frames, bool first)
+	{
+		std::vector<uint8_t> refBuffer;
+		std::vector<uint8_t> distBuffer;
+		uint8_t* ref[4];
+		uint8_t* dist[4];
+		int refLinesize[4];
+		int distLinesize[4];
+		if (!alloc_image(refBuffer, ref, refLinesize, AV_PIX_FMT_YUV420P, width, height) ||
+			!alloc_image(distBuffer, dist, distLinesize, AV_PIX_FMT_YUV420P, width, height))
+		{
+			return false;
+		}
+
+		// one thread, the cost per core
+		QualityMetrics metrics;
+		if (!metrics.init(width, height, 1))
+		{
+			return false;
+		}
+
+		fill_frame(ref, refLinesize, width, height, 0);
+		fill_frame(dist, distLinesize, width, height, 1);
+
+		const int flags[2] = { QUALITY_PSNR | QUALITY_FAST_SSIM, QUALITY_SSIM };
+		double ms[2];
+		QualityResult result;
+		for (int i = 0; i < 2; i++)
+		{
+			double start = GetSeconds();
+			for (int j = 0; j < frames; j++)
+			{
+				if (!metrics.compare(ref, refLinesize, dist, distLinesize, flags[i], result))
+				{
+					return false;
+				}
+			}
+			ms[i] = (GetSeconds() - start) * 1e3 / frames;
+		}
+
+		fprintf(out, "%s\n    {\"resolution\": \"%dx%d\", \"psnr_fast_ssim_ms\": %.3f, \"ssim_ms\": %.3f, \"ssim\": %.4f}",
+			first ? "" : ",", width, height, ms[0], ms[1], result.ssim);
+		return true;
+	}
+
+	bool bench_scale(FILE* out, int width, int height, const PixelFormatName& format, int frames, bool first)
+	{
+		std::vector<uint8_t> buffer;
+		uint8_t* data[4];
+		int linesize[4];
+		if (!alloc_image(buffer, data, linesize, format.format, width, height))
+		{
+			return false;
+		}
+
+		for (size_t i = 0; i < buffer.size(); i++)
+		{
+			buffer[i] = (uint8_t)(i * 31);
+		}
+
+		FFmpegTranscoder transcoder;
+		AVFrame* frame = NULL;
+		double start = GetSeconds();
+		for (int i = 0; i < frames; i++)
+		{
+			// scale_yuv takes the plane pointer array
+			if (!transcoder.scale_yuv((uint8_t*)data, linesize, width, height, format.format, &frame))
+			{
+				return false;
+			}
+		}
+		double elapsed = GetSeconds() - start;
+		double fps = elapsed > 0 ? frames / elapsed : 0.0;
+
+		fprintf(out, "%s\n    {\"resolution\": \"%dx%d\", \"format\": \"%s\", \"fps\": %.1f, \"mpixel_per_s\": %.1f}",
+			first ? "" : ",", width, height, format.name, fps, fps * width * height / 1e6);
+		return true;
+	}
+
+	// the spread of the frame sizes, the IDR frames vs the intra refresh
+	bool bench_frame_sizes(FILE* out, int width, int height, bool intraRefresh, int frames, bool first)
+	{
+		FFmpegEncoder encoder;
+		encoder.set_thread_count(1);
+		encoder.set_intra_refresh(intraRefresh);
+		if (!encoder.init(width, height, AV_PIX_FMT_YUV420P))
+		{
+			return false;
+		}
+
+		std::vector<uint8_t> buffer;
+		uint8_t* data[4];
+		int linesize[4];
+		if (!alloc_image(buffer, data, linesize, AV_PIX_FMT_YUV420P, width, height))
+		{
+			return false;
+		}
+
+		std::vector<double> sizes;
+		for (int i = 0; i <= frames; i++)
+		{
+			if (i < frames)
+			{
+				fill_frame(data, linesize, width, height, i);
+				if (!encoder.send_video_data(width, height, data, linesize))
+				{
+					return false;
+				}
+			}
+			else if (!encoder.send_end_of_stream())
+			{
+				return false;
+			}
+
+			AVPacket* packet;
+			while ((packet = encoder.receive_packet()) != NULL)
+			{
+				sizes.push_back((double)packet->size);
+				encoder.end_receive_packet();
+			}
+		}
+
+		if (sizes.empty())
+		{
+			return false;
+		}
+
+		double sum = 0.0;
+		double max = 0.0;
+		for (size_t i = 0; i < sizes.size(); i++)
+		{
+			sum += sizes[i];
+			max = std::max(max, sizes[i]);
+		}
+		double mean = sum / sizes.size();
+		double variance = 0.0;
+		for (size_t i = 0; i < sizes.size(); i++)
+		{
+			variance += (sizes[i] - mean) * (sizes[i] - mean);
+		}
+		double stddev = sqrt(variance / sizes.size());
+
+		fprintf(out, "%s\n    {\"resolution\": \"%dx%d\", \"mode\": \"%s\", \"frames\": %zu, \"mean_bytes\": %.0f, \"max_bytes\": %.0f, \"max_to_mean\": %.2f, \"stddev_to_mean\": %.3f}",
+			first ? "" : ",", width, height, intraRefresh ? "intra_refresh" : "idr", sizes.size(), mean, max,
+			mean > 0 ? max / mean : 0.0, mean > 0 ? stddev / mean : 0.0);
+		return true;
+	}
+
+	// the regions of interest: a center region at a better QP and the background at a worse
+	// QP by the importance map, at 60% of the bitrate of the uniform mode
+	bool bench_roi(FILE* out, int width, int height, bool roi, int frames, bool first)
+	{
+		FFmpegEncoder encoder;
+		encoder.set_thread_count(1);
+		encoder.set_roi_encoding(roi);
+		encoder.set_bit_rate(roi ? ENCODER_BIT_RATE * 6 / 10 : ENCODER_BIT_RATE);
+		if (!encoder.init(width, height, AV_PIX_FMT_YUV420P))
+		{
+			return false;
+		}
+
+		std::vector<uint8_t> buffer;
+		uint8_t* data[4];
+		int linesize[4];
+		if (!alloc_image(buffer, data, linesize, AV_PIX_FMT_YUV420P, width, height))
+		{
+			return false;
+		}
+
+		EncoderRegion region = { width / 4, height / 4, width * 3 / 4, height * 3 / 4, -6 };
+		int mbWidth = (width + ENCODER_MB_SIZE - 1) / ENCODER_MB_SIZE;
+		int mbHeight = (height + ENCODER_MB_SIZE - 1) / ENCODER_MB_SIZE;
+		std::vector<int8_t> importanceMap((size_t)mbWidth * mbHeight, 4);
+
+		size_t bytes = 0;
+		double start = GetSeconds();
+		for (int i = 0; i <= frames; i++)
+		{
+			if (i < frames)
+			{
+				fill_frame(data, linesize, width, height, i);
+				if (roi && !encoder.set_regions_of_interest(&region, 1, importanceMap.data()))
+				{
+					return false;
+				}
+				if (!encoder.send_video_data(width, height, data, linesize))
+				{
+					return false;
+				}
+			}
+			else if (!encoder.send_end_of_stream())
+			{
+				return false;
+			}
+
+			AVPacket* packet;
+			while ((packet = encoder.receive_packet()) != NULL)
+			{
+				bytes += packet->size;
+				encoder.end_receive_packet();
+			}
+		}
+		double elapsed = GetSeconds() - start;
+
+		fprintf(out, "%s\n    {\"resolution\": \"%dx%d\", \"mode\": \"%s\", \"frames\": %d, \"fps\": %.1f, \"bytes\": %zu}",
+			first ? "" : ",", width, height, roi ? "roi" : "uniform", frames, elapsed > 0 ? frames / elapsed : 0.0, bytes);
+		return true;
+	}
+
+	bool bench_encoder(FILE* out, int width, int height, const char* preset, int frames, bool first)
+	{
+		FFmpegEncoder encoder;
+		encoder.set_preset(preset);
+		if (!encoder.init(width, height, AV_PIX_FMT_YUV420P))
+		{
+			return false;
+		}
+
+		// the frames are prepared before timing
+		std::vector<std::vector<uint8_t> > buffers(25);
+		for (size_t i = 0; i < buffers.size(); i++)
+		{
+			uint8_t* data[4];
+			int linesize[4];
+			if (!alloc_image(buffers[i], data, linesize, AV_PIX_FMT_YUV420P, width, height))
+			{
+				return false;
+			}
+			fill_frame(data, linesize, width, height, (int)i);
+		}
+
+		size_t bytes = 0;
+		double start = GetSeconds();
+		for (int i = 0; i <= frames; i++)
+		{
+			if (i < frames)
+			{
+				uint8_t* data[4];
+				int linesize[4];
+				av_image_fill_arrays(data, linesize, buffers[i % buffers.size()].data(), AV_PIX_FMT_YUV420P, width, height, 1);
+				if (!encoder.send_video_data(width, height, data, linesize))
+				{
+					return false;
+				}
+			}
+			else if (!encoder.send_end_of_stream())
+			{
+				return false;
+			}
+
+			AVPacket* packet;
+			while ((packet = encoder.receive_packet()) != NULL)
+			{
+				bytes += packet->size;
+				encoder.end_receive_packet();
+			}
+		}
+		double elapsed = GetSeconds() - start;
+
+		fprintf(out, "%s\n    {\"resolution\": \"%dx%d\", \"preset\": \"%s\", \"frames\": %d, \"fps\": %.1f, \"bytes\": %zu}",
+			first ? "" : ",", width, height, preset, frames, elapsed > 0 ? frames / elapsed : 0.0, bytes);
+		return true;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	const char* outputPath = NULL;
+	bool quick = false;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--quick") == 0)
+		{
+			quick = true;
+		}
+		else
+		{
+			outputPath = argv[i];
+		}
+	}
+
+	FILE* out = stdout;
+	if (outputPath)
+	{
+		out = fopen(outputPath, "w");
+		if (!out)
+		{
+			fprintf(stderr, "can't open %s\n", outputPath);
+			return 1;
+		}
+	}
+
+	const int resolutionCount = sizeof(g_resolutions) / sizeof(g_resolutions[0]);
+	const int scanIterations = quick ? 10 : 100;
+	const int scaleFrames = quick ? 20 : 200;
+	const int encodeFrames = quick ? 25 : 100;
+	// a few gops, so the IDR frames show up
+	const int spreadFrames = quick ? 75 : 250;
+
+	std::vector<TestStream> streams(resolutionCount);
+	for (int i = 0; i < resolutionCount; i++)
+	{
+		if (!generate_stream(g_resolutions[i].width, g_resolutions[i].height, STREAM_FRAMES, streams[i]))
+		{
+			fprintf(stderr, "can't generate the %dx%d test stream\n", g_resolutions[i].width, g_resolutions[i].height);
+			return 1;
+		}
+	}
+
+	int ret = 0;
+	unsigned version = avcodec_version();
+	fprintf(out, "{\n  \"version\": 1,\n  \"libavcodec\": \"%u.%u.%u\",\n  \"stream_frames\": %d,",
+		version >> 16, (version >> 8) & 0xFF, version & 0xFF, STREAM_FRAMES);
+
+	fprintf(out, "\n  \"start_code_scan\": [");
+	for (int i = 0; i < resolutionCount; i++)
+	{
+		bench_start_codes(out, streams[i], scanIterations, i == 0);
+	}
+
+	// a failed entry prints nothing, so the separator goes by the entries printed
+	fprintf(out, "\n  ],\n  \"bitstream_analyzer\": [");
+	bool first = true;
+	for (int i = 0; i < resolutionCount; i++)
+	{
+		if (!bench_analyzer(out, streams[i], scanIterations, first))
+		{
+			fprintf(stderr, "analyzer benchmark failed at %dx%d\n", streams[i].width, streams[i].height);
+			ret = 1;
+			continue;
+		}
+		first = false;
+	}
+
+	fprintf(out, "\n  ],\n  \"decoder\": [");
+	first = true;
+	for (int i = 0; i < resolutionCount; i++)
+	{
+		if (!bench_decoder(out, streams[i], first))
+		{
+			fprintf(stderr, "decoder benchmark failed at %dx%d\n", streams[i].width, streams[i].height);
+			ret = 1;
+			continue;
+		}
+		first = false;
+	}
+
+	fprintf(out, "\n  ],\n  \"scale_yuv\": [");
+	first = true;
+	for (int i = 0; i < resolutionCount; i++)
+	{
+		for (size_t j = 0; j < sizeof(g_scale_formats) / sizeof(g_scale_formats[0]); j++)
+		{
+			if (!bench_scale(out, g_resolutions[i].width, g_resolutions[i].height, g_scale_formats[j], scaleFrames, first))
+			{
+				fprintf(stderr, "scale_yuv benchmark failed for %s\n", g_scale_formats[j].name);
+				ret = 1;
+				continue;
+			}
+			first = false;
+		}
+	}
+
+	fprintf(out, "\n  ],\n  \"quality_metrics\": [");
+	first = true;
+	for (int i = 0; i < resolutionCount; i++)
+	{
+		if (!bench_quality(out, g_resolutions[i].width, g_resolutions[i].height, scaleFrames, first))
+		{
+			fprintf(stderr, "quality benchmark failed at %dx%d\n", g_resolutions[i].width, g_resolutions[i].height);
+			ret = 1;
+			continue;
+		}
+		first = false;
+	}
+
+	fprintf(out, "\n  ],\n  \"encoder\": [");
+	first = true;
+	for (int i = 0; i < resolutionCount; i++)
+	{
+		for (size_t j = 0; j < sizeof(g_presets) / sizeof(g_presets[0]); j++)
+		{
+			if (!bench_encoder(out, g_resolutions[i].width, g_resolutions[i].height, g_presets[j], encodeFrames, first))
+			{
+				fprintf(stderr, "encoder benchmark failed for %s\n", g_presets[j]);
+				ret = 1;
+				continue;
+			}
+			first = false;
+		}
+	}
+
+	fprintf(out, "\n  ],\n  \"frame_size_spread\": [");
+	first = true;
+	for (int i = 0; i < resolutionCount; i++)
+	{
+		for (int mode = 0; mode < 2; mode++)
+		{
+			if (!bench_frame_sizes(out, g_resolutions[i].width, g_resolutions[i].height, mode == 1, spreadFrames, first))
+			{
+				fprintf(stderr, "frame size benchmark failed at %dx%d\n", g_resolutions[i].width, g_resolutions[i].height);
+				ret = 1;
+				continue;
+			}
+			first = false;
+		}
+	}
+
+	fprintf(out, "\n  ],\n  \"roi_encoding\": [");
+	first = true;
+	for (int i = 0; i < resolutionCount; i++)
+	{
+		for (int mode = 0; mode < 2; mode++)
+		{
+			if (!bench_roi(out, g_resolutions[i].width, g_resolutions[i].height, mode == 1, encodeFrames, first))
+			{
+				fprintf(stderr, "roi benchmark failed at %dx%d\n", g_resolutions[i].width, g_resolutions[i].height);
+				ret = 1;
+				continue;
+			}
+			first = false;
+		}
+	}
+
+	fprintf(out, "\n  ]\n}\n");
+
+	if (out != stdout)
+	{
+		fclose(out);
+	}
+
+	return ret;
+}
\ No newline at end of file
@@ -0,0 +1,201 @@
+#include "codec_async.h"
+
+#ifdef CODEC_ASYNC_AVAILABLE
+
+CodecThreadPool::CodecThreadPool()
+{
+	m_stop = false;
+}
+
+CodecThreadPool::~CodecThreadPool()
+{
+	stop();
+}
+
+bool CodecThreadPool::init(int threads)
+{
+	stop();
+
+	if (threads <= 0)
+	{
+		threads = (int)std::thread::hardware_concurrency();
+		if (threads <= 0)
+		{
+			threads = 1;
+		}
+	}
+
+	for (int i = 0; i < threads; i++)
+	{
+		m_threads.push_back(std::thread(&CodecThreadPool::worker_loop, this));
+	}
+
+	return true;
+}
+
+void CodecThreadPool::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_cond.notify_all();
+
+	for (size_t i = 0; i < m_threads.size(); i++)
+	{
+		m_threads[i].join();
+	}
+	m_threads.clear();
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_queue.clear();
+	m_stop = false;
+}
+
+void CodecThreadPool::post(std::coroutine_handle<> handle)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_queue.push_back(handle);
+	}
+	m_cond.notify_one();
+}
+
+void CodecThreadPool::worker_loop()
+{
+	while (true)
+	{
+		std::coroutine_handle<> handle;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cond.wait(lock, [&] { return m_stop || !m_queue.empty(); });
+			if (m_queue.empty())
+			{
+				return;
+			}
+			handle = m_queue.front();
+			m_queue.pop_front();
+		}
+
+		handle.resume();
+	}
+}
+
+CodecGenerator<AVFrame*> AsyncDecoder::decode(uint8_t* data, size_t size, int64_t pts)
+{
+	co_await m_executor.schedule();
+
+	AVFrame* frame;
+	while (true)
+	{
+		CodecStatus status = m_decoder.send_packet(data, size, pts);
+		if (status != CODEC_AGAIN)
+		{
+			if (status != CODEC_OK)
+			{
+				co_return status;
+			}
+			break;
+		}
+
+		// the decoder is full, hand out its frames before sending the packet again
+		bool received = false;
+		while ((frame = m_decoder.receive_frame()) != NULL)
+		{
+			received = true;
+			co_yield frame;
+		}
+
+		if (!received)
+		{
+			co_return CODEC_AGAIN;
+		}
+	}
+
+	while ((frame = m_decoder.receive_frame()) != NULL)
+	{
+		co_yield frame;
+	}
+
+	co_return m_decoder.is_end_of_stream() ? CODEC_EOF : CODEC_OK;
+}
+
+CodecGenerator<AVFrame*> AsyncDecoder::drain()
+{
+	co_await m_executor.schedule();
+
+	if (!m_decoder.send_end_of_stream())
+	{
+		co_return CODEC_ERROR;
+	}
+
+	AVFrame* frame;
+	while ((frame = m_decoder.receive_frame()) != NULL)
+	{
+		co_yield frame;
+	}
+
+	co_return m_decoder.is_end_of_stream() ? CODEC_EOF : CODEC_ERROR;
+}
+
+CodecGenerator<AVPacket*> AsyncEncoder::encode(int width, int height, uint8_t* data[], int linesize[])
+{
+	co_await m_executor.schedule();
+
+	AVPacket* packet;
+	while (true)
+	{
+		CodecStatus status = m_encoder.send_frame(width, height, data, linesize);
+		if (status != CODEC_AGAIN)
+		{
+			if (status != CODEC_OK)
+			{
+				co_return status;
+			}
+			break;
+		}
+
+		// the encoder is full, hand out its packets before sending the frame again
+		bool received = false;
+		while ((packet = m_encoder.receive_packet()) != NULL)
+		{
+			received = true;
+			co_yield packet;
+			m_encoder.end_receive_packet();
+		}
+
+		if (!received)
+		{
+			co_return CODEC_AGAIN;
+		}
+	}
+
+	while ((packet = m_encoder.receive_packet()) != NULL)
+	{
+		co_yield packet;
+		m_encoder.end_receive_packet();
+	}
+
+	co_return m_encoder.is_end_of_stream() ? CODEC_EOF : CODEC_OK;
+}
+
+CodecGenerator<AVPacket*> AsyncEncoder::drain()
+{
+	co_await m_executor.schedule();
+
+	if (!m_encoder.send_end_of_stream())
+	{
+		co_return CODEC_ERROR;
+	}
+
+	AVPacket* packet;
+	while ((packet = m_encoder.receive_packet()) != NULL)
+	{
+		co_yield packet;
+		m_encoder.end_receive_packet();
+	}
+
+	co_return m_encoder.is_end_of_stream() ? CODEC_EOF : CODEC_ERROR;
+}
+
+#endif
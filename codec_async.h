@@ -0,0 +1,360 @@
+#ifndef _H_CODEC_ASYNC_H_
+#define _H_CODEC_ASYNC_H_
+
+/**
+* the C++20 coroutine interface of FFmpegDecoder and FFmpegEncoder, for serving many
+* streams from a few threads without a thread or a polling loop per stream.
+*
+* a stream is a coroutine(e.g. a CodecTask), it awaits AsyncDecoder::decode for the
+* frames of each packet and AsyncEncoder::encode for the packets of each frame. the
+* codec work runs on a CodecExecutor, the library CodecThreadPool or the caller's own
+* event loop. the backpressure(EAGAIN) is handled by handing out the output before
+* sending the input again, and the final CodecStatus of each call is reported.
+*
+*   CodecTask run_stream(CodecThreadPool& pool, FFmpegDecoder& decoder, Source& source)
+*   {
+*       AsyncDecoder async(decoder, pool);
+*       while (source.read(data, size, pts))
+*       {
+*           CodecGenerator<AVFrame*> frames = async.decode(data, size, pts);
+*           while (co_await frames.next())
+*           {
+*               use(frames.value());
+*           }
+*           if (frames.status() == CODEC_ERROR) ...
+*       }
+*   }
+*
+* the whole file is empty without C++20 coroutines, the rest of the library is C++11.
+*/
+
+#if (defined(_MSVC_LANG) ? _MSVC_LANG : __cplusplus) >= 202002L && defined(__has_include)
+#if __has_include(<coroutine>)
+#define CODEC_ASYNC_AVAILABLE 1
+#endif
+#endif
+
+#ifdef CODEC_ASYNC_AVAILABLE
+
+#include <coroutine>
+#include <exception>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <vector>
+
+#include "ffmpeg_decoder.h"
+#include "ffmpeg_encoder.h"
+
+/**
+* where the codec coroutines run. an event loop(e.g. io_uring) implements post by
+* queueing the handle and resuming it from the loop thread.
+*/
+class CodecExecutor
+{
+public:
+	virtual ~CodecExecutor()
+	{
+	}
+
+	/**
+	 * @brief resume the coroutine later on a thread of the executor, it's thread safe
+	 */
+	virtual void post(std::coroutine_handle<> handle) = 0;
+
+	/**
+	 * @brief co_await executor.schedule() moves the coroutine to the executor
+	 */
+	auto schedule()
+	{
+		struct Awaiter
+		{
+			CodecExecutor* executor;
+
+			bool await_ready() const noexcept
+			{
+				return false;
+			}
+
+			void await_suspend(std::coroutine_handle<> handle)
+			{
+				executor->post(handle);
+			}
+
+			void await_resume() const noexcept
+			{
+			}
+		};
+
+		return Awaiter{ this };
+	}
+};
+
+/**
+* the library executor, a fixed pool of threads resuming the posted coroutines in order
+*/
+class CodecThreadPool : public CodecExecutor
+{
+public:
+	CodecThreadPool();
+	virtual ~CodecThreadPool();
+
+	/**
+	 * @brief start the threads
+	 *
+	 * @param threads -- the thread count, 0 means one per hardware thread
+	 *
+	 * @return true -- successful
+	 *         false -- failed
+	 */
+	bool init(int threads);
+
+	/**
+	 * @brief stop the threads after the posted coroutines, the later ones are never resumed
+	 */
+	void stop();
+
+	void post(std::coroutine_handle<> handle) override;
+
+private:
+	void worker_loop();
+
+private:
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::deque<std::coroutine_handle<> > m_queue;
+	std::vector<std::thread> m_threads;
+	bool m_stop;
+};
+
+/**
+* a fire and forget coroutine, e.g. the loop of one stream. it starts at once on the
+* calling thread and frees itself at the end.
+*/
+struct CodecTask
+{
+	struct promise_type
+	{
+		CodecTask get_return_object() noexcept
+		{
+			return CodecTask();
+		}
+
+		std::suspend_never initial_suspend() noexcept
+		{
+			return {};
+		}
+
+		std::suspend_never final_suspend() noexcept
+		{
+			return {};
+		}
+
+		void return_void() noexcept
+		{
+		}
+
+		void unhandled_exception() noexcept
+		{
+			std::terminate();
+		}
+	};
+};
+
+/**
+* an asynchronous sequence of the codec output. the producer starts at the first next(),
+* each co_await next() resumes it until it yields the next value or ends.
+*/
+template <typename T>
+class CodecGenerator
+{
+public:
+	struct promise_type
+	{
+		T value;
+		CodecStatus status = CODEC_OK;
+		std::coroutine_handle<> consumer;
+
+		// back to the consumer waiting in next()
+		struct TransferAwaiter
+		{
+			bool await_ready() const noexcept
+			{
+				return false;
+			}
+
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+			{
+				return handle.promise().consumer;
+			}
+
+			void await_resume() const noexcept
+			{
+			}
+		};
+
+		CodecGenerator get_return_object() noexcept
+		{
+			return CodecGenerator(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		std::suspend_always initial_suspend() noexcept
+		{
+			return {};
+		}
+
+		TransferAwaiter final_suspend() noexcept
+		{
+			return {};
+		}
+
+		TransferAwaiter yield_value(T v) noexcept
+		{
+			value = v;
+			return {};
+		}
+
+		void return_value(CodecStatus s) noexcept
+		{
+			status = s;
+		}
+
+		void unhandled_exception() noexcept
+		{
+			std::terminate();
+		}
+	};
+
+	explicit CodecGenerator(std::coroutine_handle<promise_type> handle)
+		: m_handle(handle)
+	{
+	}
+
+	CodecGenerator(CodecGenerator&& other) noexcept
+		: m_handle(other.m_handle)
+	{
+		other.m_handle = nullptr;
+	}
+
+	CodecGenerator(const CodecGenerator&) = delete;
+	CodecGenerator& operator=(const CodecGenerator&) = delete;
+
+	~CodecGenerator()
+	{
+		if (m_handle)
+		{
+			m_handle.destroy();
+		}
+	}
+
+	/**
+	 * @brief co_await next() is true when there is a new value, false at the end
+	 */
+	auto next()
+	{
+		struct Awaiter
+		{
+			std::coroutine_handle<promise_type> handle;
+
+			bool await_ready() const noexcept
+			{
+				return handle.done();
+			}
+
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> consumer) noexcept
+			{
+				handle.promise().consumer = consumer;
+				return handle;
+			}
+
+			bool await_resume() const noexcept
+			{
+				return !handle.done();
+			}
+		};
+
+		return Awaiter{ m_handle };
+	}
+
+	/**
+	 * @brief the value of the last next(), it's valid until the next one
+	 */
+	T value() const
+	{
+		return m_handle.promise().value;
+	}
+
+	/**
+	 * @brief the final status after next() returned false
+	 */
+	CodecStatus status() const
+	{
+		return m_handle.promise().status;
+	}
+
+private:
+	std::coroutine_handle<promise_type> m_handle;
+};
+
+/**
+* the coroutine interface of one FFmpegDecoder, one decode or drain at a time
+*/
+class AsyncDecoder
+{
+public:
+	AsyncDecoder(FFmpegDecoder& decoder, CodecExecutor& executor)
+		: m_decoder(decoder), m_executor(executor)
+	{
+	}
+
+	/**
+	 * @brief decode one packet on the executor and yield its frames, the frames left by the
+	 * previous packets come first. the data must be valid until the generator ends.
+	 *
+	 * the final status is CODEC_OK, CODEC_EOF, CODEC_ERROR, or CODEC_AGAIN if the decoder
+	 * was full and had no frame to hand out, the packet wasn't taken then.
+	 */
+	CodecGenerator<AVFrame*> decode(uint8_t* data, size_t size, int64_t pts);
+
+	/**
+	 * @brief signal the end of stream and yield all the buffered frames, the final status
+	 * is CODEC_EOF when all of them were received
+	 */
+	CodecGenerator<AVFrame*> drain();
+
+private:
+	FFmpegDecoder& m_decoder;
+	CodecExecutor& m_executor;
+};
+
+/**
+* the coroutine interface of one FFmpegEncoder, one encode or drain at a time
+*/
+class AsyncEncoder
+{
+public:
+	AsyncEncoder(FFmpegEncoder& encoder, CodecExecutor& executor)
+		: m_encoder(encoder), m_executor(executor)
+	{
+	}
+
+	/**
+	 * @brief encode one frame on the executor and yield the packets, see AsyncDecoder::decode.
+	 * the planes must be valid until the generator ends.
+	 */
+	CodecGenerator<AVPacket*> encode(int width, int height, uint8_t* data[], int linesize[]);
+
+	/**
+	 * @brief signal the end of stream and yield all the delayed packets
+	 */
+	CodecGenerator<AVPacket*> drain();
+
+private:
+	FFmpegEncoder& m_encoder;
+	CodecExecutor& m_executor;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,121 @@
+#include "codec_memory.h"
+
+extern "C"
+{
+#include <libavutil/mem.h>
+}
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace
+{
+	const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+	CodecDefaultAllocator g_default_allocator;
+	std::atomic<CodecAllocator*> g_allocator(&g_default_allocator);
+}
+
+void* CodecDefaultAllocator::allocate(size_t size)
+{
+	return av_malloc(size);
+}
+
+void CodecDefaultAllocator::deallocate(void* ptr, size_t /*size*/)
+{
+	av_free(ptr);
+}
+
+void* CodecHugePageAllocator::allocate(size_t size)
+{
+#ifdef __linux__
+	if (size >= HUGE_PAGE_SIZE)
+	{
+		size_t mapSize = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+		void* ptr = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ptr == MAP_FAILED)
+		{
+			return NULL;
+		}
+#ifdef MADV_HUGEPAGE
+		// only a hint, the buffer is fine with the normal pages
+		madvise(ptr, mapSize, MADV_HUGEPAGE);
+#endif
+		return ptr;
+	}
+#endif
+
+	return av_malloc(size);
+}
+
+void CodecHugePageAllocator::deallocate(void* ptr, size_t size)
+{
+#ifdef __linux__
+	if (size >= HUGE_PAGE_SIZE)
+	{
+		munmap(ptr, (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+		return;
+	}
+#endif
+
+	av_free(ptr);
+}
+
+CodecMemory::CodecMemory(CodecMetrics& metrics)
+	: m_metrics(metrics), m_limit(0)
+{
+	m_allocator = get_default_allocator();
+}
+
+CodecMemory::~CodecMemory()
+{
+}
+
+void CodecMemory::set_default_allocator(CodecAllocator* allocator)
+{
+	g_allocator.store(allocator ? allocator : &g_default_allocator);
+}
+
+CodecAllocator* CodecMemory::get_default_allocator()
+{
+	return g_allocator.load();
+}
+
+bool CodecMemory::set_allocator(CodecAllocator* allocator)
+{
+	if (m_metrics.get_memory_bytes() > 0)
+	{
+		return false;
+	}
+
+	m_allocator = allocator ? allocator : get_default_allocator();
+	return true;
+}
+
+void* CodecMemory::allocate(size_t size)
+{
+	if (!m_metrics.add_memory(size, m_limit.load(std::memory_order_relaxed)))
+	{
+		return NULL;
+	}
+
+	void* ptr = m_allocator->allocate(size);
+	if (!ptr)
+	{
+		m_metrics.remove_memory(size);
+	}
+
+	return ptr;
+}
+
+void CodecMemory::deallocate(void* ptr, size_t size)
+{
+	if (!ptr)
+	{
+		return;
+	}
+
+	m_allocator->deallocate(ptr, size);
+	m_metrics.remove_memory(size);
+}
@@ -0,0 +1,130 @@
+#ifndef _H_CODEC_MEMORY_H_
+#define _H_CODEC_MEMORY_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+#include "codec_metrics.h"
+
+/**
+* the allocator of the library buffers, e.g. an arena or a hugepage pool.
+* it must be thread safe if it's shared by sessions on different threads.
+*/
+class CodecAllocator
+{
+public:
+	virtual ~CodecAllocator()
+	{
+	}
+
+	/**
+	 * @brief allocate a buffer aligned like av_malloc(at least 64 bytes)
+	 * @return the buffer, NULL if failed
+	 */
+	virtual void* allocate(size_t size) = 0;
+
+	/**
+	 * @brief free a buffer of allocate, size is the allocated size
+	 */
+	virtual void deallocate(void* ptr, size_t size) = 0;
+};
+
+/**
+* av_malloc and av_free, the default allocator
+*/
+class CodecDefaultAllocator : public CodecAllocator
+{
+public:
+	void* allocate(size_t size) override;
+	void deallocate(void* ptr, size_t size) override;
+};
+
+/**
+* the large buffers(at least 2MB, e.g. the frame and tensor buffers) are mapped with
+* transparent huge pages to cut the TLB misses, the smaller ones use av_malloc.
+* on other systems than linux it's the same as CodecDefaultAllocator.
+*/
+class CodecHugePageAllocator : public CodecAllocator
+{
+public:
+	void* allocate(size_t size) override;
+	void deallocate(void* ptr, size_t size) override;
+};
+
+/**
+* the memory accounting of one decoder, encoder or transcoder.
+*
+* the buffers the library allocates itself(the conversion, output and tensor buffers)
+* go through the allocator of the session and are counted in the memory gauges of its
+* CodecMetrics, which are exported with the other metrics. the buffers allocated inside
+* libavcodec aren't counted. an allocation over the limit of the session fails like an
+* out of memory, so the session call returns false or NULL instead of the process dying.
+*/
+class CodecMemory
+{
+public:
+	explicit CodecMemory(CodecMetrics& metrics);
+	virtual ~CodecMemory();
+
+	/**
+	 * @brief the allocator of the sessions created later, NULL is CodecDefaultAllocator.
+	 * it must outlive those sessions.
+	 */
+	static void set_default_allocator(CodecAllocator* allocator);
+	static CodecAllocator* get_default_allocator();
+
+	/**
+	 * @brief the allocator of this session, NULL is the default one
+	 *
+	 * @return true -- successful
+	 *         false -- the session has buffers from the current allocator, free them first
+	 */
+	bool set_allocator(CodecAllocator* allocator);
+
+	/**
+	 * @brief the max bytes of the session, 0 is no limit(the default)
+	 */
+	void set_limit(size_t bytes)
+	{
+		m_limit.store(bytes, std::memory_order_relaxed);
+	}
+
+	size_t get_limit() const
+	{
+		return m_limit.load(std::memory_order_relaxed);
+	}
+
+	CodecAllocator* get_allocator() const
+	{
+		return m_allocator;
+	}
+
+	/**
+	 * @brief allocate a buffer of the session
+	 * @return the buffer, NULL if it's over the limit or failed
+	 */
+	void* allocate(size_t size);
+
+	/**
+	 * @brief free a buffer of allocate, NULL is ignored
+	 */
+	void deallocate(void* ptr, size_t size);
+
+	uint64_t get_bytes() const
+	{
+		return m_metrics.get_memory_bytes();
+	}
+
+	uint64_t get_peak() const
+	{
+		return m_metrics.get_memory_peak();
+	}
+
+private:
+	CodecMetrics& m_metrics;
+	CodecAllocator* m_allocator;
+	std::atomic<size_t> m_limit;
+};
+
+#endif
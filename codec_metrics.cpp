@@ -0,0 +1,483 @@
+#include "codec_metrics.h"
+#include <stdio.h>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+
+namespace
+{
+	const char* g_stage_names[STAGE_COUNT] = {
+		"send_packet",
+		"receive_frame",
+		"hwframe_transfer",
+		"sws_scale",
+		"send_frame",
+		"receive_packet"
+	};
+
+	// the sessions for the exporter, it's only locked on create, destroy and export
+	std::mutex g_registry_mutex;
+	std::vector<CodecMetrics*> g_registry;
+
+	const int SUB_BUCKET_BITS = 3;
+	const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+	const int MAX_EXPONENT = 34;
+
+	int bucket_index(uint64_t value)
+	{
+		if (value < SUB_BUCKETS)
+		{
+			return (int)value;
+		}
+
+		int exponent = 63;
+		while (!(value >> exponent))
+		{
+			exponent--;
+		}
+
+		if (exponent > MAX_EXPONENT)
+		{
+			return CodecMetrics::HISTOGRAM_BUCKETS - 1;
+		}
+
+		int shift = exponent - SUB_BUCKET_BITS;
+		int sub = (int)((value >> shift) & (SUB_BUCKETS - 1));
+		return SUB_BUCKETS + shift * SUB_BUCKETS + sub;
+	}
+
+	// the middle value of the bucket
+	uint64_t bucket_value(int index)
+	{
+		if (index < SUB_BUCKETS)
+		{
+			return (uint64_t)index;
+		}
+
+		int shift = (index - SUB_BUCKETS) / SUB_BUCKETS;
+		int sub = (index - SUB_BUCKETS) % SUB_BUCKETS;
+		uint64_t low = (uint64_t)(SUB_BUCKETS + sub) << shift;
+		return low + (((uint64_t)1 << shift) >> 1);
+	}
+
+	void update_max(std::atomic<uint64_t>& target, uint64_t value)
+	{
+		uint64_t current = target.load(std::memory_order_relaxed);
+		while (value > current && !target.compare_exchange_weak(current, value, std::memory_order_relaxed))
+			;
+	}
+
+	struct MetricFamily
+	{
+		const char* name;
+		uint64_t CodecMetricsSnapshot::*value;
+	};
+
+	const MetricFamily g_counter_families[] = {
+		{ "ffmpegutils_packets_in_total", &CodecMetricsSnapshot::packets_in },
+		{ "ffmpegutils_packets_out_total", &CodecMetricsSnapshot::packets_out },
+		{ "ffmpegutils_frames_in_total", &CodecMetricsSnapshot::frames_in },
+		{ "ffmpegutils_frames_out_total", &CodecMetricsSnapshot::frames_out },
+		{ "ffmpegutils_bytes_in_total", &CodecMetricsSnapshot::bytes_in },
+		{ "ffmpegutils_bytes_out_total", &CodecMetricsSnapshot::bytes_out },
+		{ "ffmpegutils_errors_total", &CodecMetricsSnapshot::errors },
+		{ "ffmpegutils_memory_rejected_total", &CodecMetricsSnapshot::memory_rejected }
+	};
+
+	const MetricFamily g_gauge_families[] = {
+		{ "ffmpegutils_memory_bytes", &CodecMetricsSnapshot::memory_bytes },
+		{ "ffmpegutils_memory_peak_bytes", &CodecMetricsSnapshot::memory_peak_bytes }
+	};
+
+	// the label value escaped as the Prometheus text format requires
+	void append_label_value(std::string& out, const std::string& value)
+	{
+		for (size_t i = 0; i < value.size(); i++)
+		{
+			if (value[i] == '\\')
+			{
+				out += "\\\\";
+			}
+			else if (value[i] == '"')
+			{
+				out += "\\\"";
+			}
+			else if (value[i] == '\n')
+			{
+				out += "\\n";
+			}
+			else
+			{
+				out += value[i];
+			}
+		}
+	}
+
+	// the extra labels are made by the exporter, they aren't escaped
+	void append_line(std::string& out, const char* name, const CodecMetricsSnapshot& s, const char* extra, double value)
+	{
+		char number[32];
+		snprintf(number, sizeof(number), "%.9g", value);
+
+		out += name;
+		out += "{kind=\"";
+		append_label_value(out, s.kind);
+		out += "\",session=\"";
+		append_label_value(out, s.label);
+		out += "\"";
+		out += extra;
+		out += "} ";
+		out += number;
+		out += "\n";
+	}
+
+	// all the lines of a metric family must be in one group
+	void append_families(std::string& out, const std::vector<CodecMetricsSnapshot>& snapshots)
+	{
+		char extra[128];
+
+		for (size_t f = 0; f < sizeof(g_counter_families) / sizeof(g_counter_families[0]); f++)
+		{
+			out += "# TYPE ";
+			out += g_counter_families[f].name;
+			out += " counter\n";
+			for (size_t i = 0; i < snapshots.size(); i++)
+			{
+				append_line(out, g_counter_families[f].name, snapshots[i], "",
+					(double)(snapshots[i].*g_counter_families[f].value));
+			}
+		}
+
+		for (size_t f = 0; f < sizeof(g_gauge_families) / sizeof(g_gauge_families[0]); f++)
+		{
+			out += "# TYPE ";
+			out += g_gauge_families[f].name;
+			out += " gauge\n";
+			for (size_t i = 0; i < snapshots.size(); i++)
+			{
+				append_line(out, g_gauge_families[f].name, snapshots[i], "",
+					(double)(snapshots[i].*g_gauge_families[f].value));
+			}
+		}
+
+		out += "# TYPE ffmpegutils_errors_by_code_total counter\n";
+		for (size_t i = 0; i < snapshots.size(); i++)
+		{
+			const CodecMetricsSnapshot& s = snapshots[i];
+			for (size_t j = 0; j < s.error_codes.size(); j++)
+			{
+				if (s.error_codes[j].first)
+				{
+					snprintf(extra, sizeof(extra), ",code=\"%d\"", s.error_codes[j].first);
+				}
+				else
+				{
+					snprintf(extra, sizeof(extra), ",code=\"other\"");
+				}
+				append_line(out, "ffmpegutils_errors_by_code_total", s, extra, (double)s.error_codes[j].second);
+			}
+		}
+
+		out += "# TYPE ffmpegutils_stage_latency_seconds summary\n";
+		for (size_t i = 0; i < snapshots.size(); i++)
+		{
+			const CodecMetricsSnapshot& s = snapshots[i];
+			for (int j = 0; j < STAGE_COUNT; j++)
+			{
+				const CodecStageSnapshot& stage = s.stages[j];
+				if (stage.count == 0)
+				{
+					continue;
+				}
+
+				snprintf(extra, sizeof(extra), ",stage=\"%s\",quantile=\"0.5\"", g_stage_names[j]);
+				append_line(out, "ffmpegutils_stage_latency_seconds", s, extra, stage.p50_ns / 1e9);
+				snprintf(extra, sizeof(extra), ",stage=\"%s\",quantile=\"0.9\"", g_stage_names[j]);
+				append_line(out, "ffmpegutils_stage_latency_seconds", s, extra, stage.p90_ns / 1e9);
+				snprintf(extra, sizeof(extra), ",stage=\"%s\",quantile=\"0.99\"", g_stage_names[j]);
+				append_line(out, "ffmpegutils_stage_latency_seconds", s, extra, stage.p99_ns / 1e9);
+				snprintf(extra, sizeof(extra), ",stage=\"%s\",quantile=\"1\"", g_stage_names[j]);
+				append_line(out, "ffmpegutils_stage_latency_seconds", s, extra, stage.max_ns / 1e9);
+				snprintf(extra, sizeof(extra), ",stage=\"%s\"", g_stage_names[j]);
+				append_line(out, "ffmpegutils_stage_latency_seconds_sum", s, extra, stage.sum_ns / 1e9);
+				append_line(out, "ffmpegutils_stage_latency_seconds_count", s, extra, (double)stage.count);
+			}
+		}
+	}
+}
+
+std::atomic<bool> CodecMetrics::s_enabled(false);
+
+CodecMetrics::CodecMetrics(const char* kind)
+	: CodecMetrics(kind, true)
+{
+}
+
+CodecMetrics::CodecMetrics(const char* kind, bool registered)
+{
+	m_registered = registered;
+	m_kind = kind;
+	m_memory_bytes.store(0);
+	reset();
+
+	if (m_registered)
+	{
+		std::lock_guard<std::mutex> lock(g_registry_mutex);
+		g_registry.push_back(this);
+	}
+}
+
+CodecMetrics::~CodecMetrics()
+{
+	if (m_registered)
+	{
+		std::lock_guard<std::mutex> lock(g_registry_mutex);
+		g_registry.erase(std::remove(g_registry.begin(), g_registry.end(), this), g_registry.end());
+	}
+}
+
+void CodecMetrics::set_enabled(bool enabled)
+{
+	s_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+CodecMetrics& CodecMetrics::global()
+{
+	static CodecMetrics metrics("process", false);
+	return metrics;
+}
+
+void CodecMetrics::set_label(const char* label)
+{
+	std::lock_guard<std::mutex> lock(g_registry_mutex);
+	m_label = label ? label : "";
+}
+
+int64_t CodecMetrics::now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void CodecMetrics::record_latency(CodecStage stage, uint64_t ns)
+{
+	int index = bucket_index(ns);
+	CodecMetrics& process = global();
+
+	m_histograms[stage][index].fetch_add(1, std::memory_order_relaxed);
+	m_latency_sum[stage].fetch_add(ns, std::memory_order_relaxed);
+	update_max(m_latency_max[stage], ns);
+
+	process.m_histograms[stage][index].fetch_add(1, std::memory_order_relaxed);
+	process.m_latency_sum[stage].fetch_add(ns, std::memory_order_relaxed);
+	update_max(process.m_latency_max[stage], ns);
+}
+
+void CodecMetrics::count_packet_in(size_t bytes)
+{
+	m_packets_in.fetch_add(1, std::memory_order_relaxed);
+	m_bytes_in.fetch_add(bytes, std::memory_order_relaxed);
+	global().m_packets_in.fetch_add(1, std::memory_order_relaxed);
+	global().m_bytes_in.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void CodecMetrics::count_packet_out(size_t bytes)
+{
+	m_packets_out.fetch_add(1, std::memory_order_relaxed);
+	m_bytes_out.fetch_add(bytes, std::memory_order_relaxed);
+	global().m_packets_out.fetch_add(1, std::memory_order_relaxed);
+	global().m_bytes_out.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void CodecMetrics::count_frame_in()
+{
+	m_frames_in.fetch_add(1, std::memory_order_relaxed);
+	global().m_frames_in.fetch_add(1, std::memory_order_relaxed);
+}
+
+void CodecMetrics::count_frame_out()
+{
+	m_frames_out.fetch_add(1, std::memory_order_relaxed);
+	global().m_frames_out.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool CodecMetrics::add_memory(size_t bytes, size_t limit)
+{
+	uint64_t current = m_memory_bytes.load(std::memory_order_relaxed);
+	do
+	{
+		if (limit && current + bytes > limit)
+		{
+			m_memory_rejected.fetch_add(1, std::memory_order_relaxed);
+			global().m_memory_rejected.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+	} while (!m_memory_bytes.compare_exchange_weak(current, current + bytes, std::memory_order_relaxed));
+	update_max(m_memory_peak, current + bytes);
+
+	CodecMetrics& process = global();
+	update_max(process.m_memory_peak, process.m_memory_bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+	return true;
+}
+
+void CodecMetrics::remove_memory(size_t bytes)
+{
+	m_memory_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+	global().m_memory_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+void CodecMetrics::count_error(int code)
+{
+	record_error(code);
+	global().record_error(code);
+}
+
+void CodecMetrics::record_error(int code)
+{
+	m_errors.fetch_add(1, std::memory_order_relaxed);
+
+	if (code == 0)
+	{
+		m_error_counts[ERROR_SLOTS - 1].fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	for (int i = 0; i < ERROR_SLOTS - 1; i++)
+	{
+		int current = m_error_codes[i].load(std::memory_order_acquire);
+		if (current == 0)
+		{
+			int expected = 0;
+			if (m_error_codes[i].compare_exchange_strong(expected, code, std::memory_order_acq_rel) || expected == code)
+			{
+				m_error_counts[i].fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+		}
+		else if (current == code)
+		{
+			m_error_counts[i].fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+	}
+
+	m_error_counts[ERROR_SLOTS - 1].fetch_add(1, std::memory_order_relaxed);
+}
+
+void CodecMetrics::snapshot(CodecMetricsSnapshot& snapshot) const
+{
+	snapshot.kind = m_kind;
+	snapshot.label = m_label;
+	snapshot.packets_in = m_packets_in.load(std::memory_order_relaxed);
+	snapshot.packets_out = m_packets_out.load(std::memory_order_relaxed);
+	snapshot.frames_in = m_frames_in.load(std::memory_order_relaxed);
+	snapshot.frames_out = m_frames_out.load(std::memory_order_relaxed);
+	snapshot.bytes_in = m_bytes_in.load(std::memory_order_relaxed);
+	snapshot.bytes_out = m_bytes_out.load(std::memory_order_relaxed);
+	snapshot.errors = m_errors.load(std::memory_order_relaxed);
+	snapshot.memory_bytes = m_memory_bytes.load(std::memory_order_relaxed);
+	snapshot.memory_peak_bytes = m_memory_peak.load(std::memory_order_relaxed);
+	snapshot.memory_rejected = m_memory_rejected.load(std::memory_order_relaxed);
+
+	snapshot.error_codes.clear();
+	for (int i = 0; i < ERROR_SLOTS; i++)
+	{
+		uint64_t count = m_error_counts[i].load(std::memory_order_relaxed);
+		if (count)
+		{
+			int code = i < ERROR_SLOTS - 1 ? m_error_codes[i].load(std::memory_order_relaxed) : 0;
+			snapshot.error_codes.push_back(std::make_pair(code, count));
+		}
+	}
+
+	for (int stage = 0; stage < STAGE_COUNT; stage++)
+	{
+		uint64_t buckets[HISTOGRAM_BUCKETS];
+		uint64_t total = 0;
+		for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		{
+			buckets[i] = m_histograms[stage][i].load(std::memory_order_relaxed);
+			total += buckets[i];
+		}
+
+		CodecStageSnapshot& s = snapshot.stages[stage];
+		s.count = total;
+		s.sum_ns = m_latency_sum[stage].load(std::memory_order_relaxed);
+		s.max_ns = m_latency_max[stage].load(std::memory_order_relaxed);
+		s.p50_ns = 0;
+		s.p90_ns = 0;
+		s.p99_ns = 0;
+
+		const double quantiles[3] = { 0.50, 0.90, 0.99 };
+		uint64_t* values[3] = { &s.p50_ns, &s.p90_ns, &s.p99_ns };
+		uint64_t seen = 0;
+		int q = 0;
+		for (int i = 0; i < HISTOGRAM_BUCKETS && q < 3 && total; i++)
+		{
+			seen += buckets[i];
+			while (q < 3 && seen >= (uint64_t)(quantiles[q] * total + 0.5) && seen > 0)
+			{
+				*values[q] = std::min(bucket_value(i), s.max_ns);
+				q++;
+			}
+		}
+	}
+}
+
+void CodecMetrics::reset()
+{
+	m_packets_in.store(0);
+	m_packets_out.store(0);
+	m_frames_in.store(0);
+	m_frames_out.store(0);
+	m_bytes_in.store(0);
+	m_bytes_out.store(0);
+	m_errors.store(0);
+	m_memory_peak.store(m_memory_bytes.load());
+	m_memory_rejected.store(0);
+
+	for (int i = 0; i < ERROR_SLOTS; i++)
+	{
+		m_error_codes[i].store(0);
+		m_error_counts[i].store(0);
+	}
+
+	for (int stage = 0; stage < STAGE_COUNT; stage++)
+	{
+		for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		{
+			m_histograms[stage][i].store(0);
+		}
+		m_latency_sum[stage].store(0);
+		m_latency_max[stage].store(0);
+	}
+}
+
+void CodecMetrics::snapshot_all(std::vector<CodecMetricsSnapshot>& snapshots)
+{
+	std::lock_guard<std::mutex> lock(g_registry_mutex);
+
+	snapshots.resize(g_registry.size());
+	for (size_t i = 0; i < g_registry.size(); i++)
+	{
+		g_registry[i]->snapshot(snapshots[i]);
+	}
+}
+
+std::string CodecMetrics::export_prometheus()
+{
+	std::vector<CodecMetricsSnapshot> snapshots;
+	{
+		std::lock_guard<std::mutex> lock(g_registry_mutex);
+		snapshots.resize(g_registry.size() + 1);
+		global().snapshot(snapshots[0]);
+		for (size_t i = 0; i < g_registry.size(); i++)
+		{
+			g_registry[i]->snapshot(snapshots[i + 1]);
+		}
+	}
+
+	std::string out;
+	append_families(out, snapshots);
+	return out;
+}
\ No newline at end of file
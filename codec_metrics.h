@@ -0,0 +1,262 @@
+#ifndef _H_CODEC_METRICS_H_
+#define _H_CODEC_METRICS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+//#define CODEC_METRICS_DISABLED
+
+/**
+* the stages timed by CodecMetrics
+*/
+enum CodecStage
+{
+	STAGE_SEND_PACKET = 0,   // avcodec_send_packet
+	STAGE_RECEIVE_FRAME,     // avcodec_receive_frame
+	STAGE_HW_TRANSFER,       // av_hwframe_transfer_data
+	STAGE_SWS_SCALE,         // sws_scale
+	STAGE_SEND_FRAME,        // avcodec_send_frame
+	STAGE_RECEIVE_PACKET,    // avcodec_receive_packet
+	STAGE_COUNT
+};
+
+/**
+* the latency summary of one stage
+*/
+struct CodecStageSnapshot
+{
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t p50_ns;
+	uint64_t p90_ns;
+	uint64_t p99_ns;
+	uint64_t max_ns;
+};
+
+/**
+* a copy of the metrics of one session, or of the whole process
+*/
+struct CodecMetricsSnapshot
+{
+	std::string kind;
+	std::string label;
+
+	uint64_t packets_in;
+	uint64_t packets_out;
+	uint64_t frames_in;
+	uint64_t frames_out;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t errors;
+
+	// the buffers of CodecMemory
+	uint64_t memory_bytes;
+	uint64_t memory_peak_bytes;
+	uint64_t memory_rejected;
+
+	// the AVERROR code and its count
+	std::vector<std::pair<int, uint64_t> > error_codes;
+	CodecStageSnapshot stages[STAGE_COUNT];
+};
+
+/**
+* lock free counters and latency histograms of one decoder, encoder or transcoder.
+*
+* every record also goes into the process wide metrics. the recording is off
+* by default, it is turned on by set_enabled(true), or compiled out entirely by
+* CODEC_METRICS_DISABLED. when it is off, the cost is one relaxed atomic load.
+*
+* the histograms are log-linear like HdrHistogram, 8 sub buckets per power of 2,
+* so the quantiles are within 12.5% of the real values.
+*/
+class CodecMetrics
+{
+public:
+	/**
+	 * @param kind -- the session kind, e.g. "decoder"
+	 */
+	explicit CodecMetrics(const char* kind);
+	virtual ~CodecMetrics();
+
+	/**
+	 * @brief turn the recording on or off for the whole process
+	 */
+	static void set_enabled(bool enabled);
+
+	static bool is_enabled()
+	{
+#ifdef CODEC_METRICS_DISABLED
+		return false;
+#else
+		return s_enabled.load(std::memory_order_relaxed);
+#endif
+	}
+
+	/**
+	 * @brief the process wide metrics
+	 */
+	static CodecMetrics& global();
+
+	/**
+	 * @brief the label of the session in the exported metrics, e.g. the stream id
+	 */
+	void set_label(const char* label);
+
+	/**
+	 * @brief start timing a stage
+	 * @return the start time, 0 if the recording is off
+	 */
+	int64_t begin() const
+	{
+		return is_enabled() ? now_ns() : 0;
+	}
+
+	/**
+	 * @brief finish timing a stage
+	 * @param stage -- the stage
+	 *        start -- the value returned by begin()
+	 */
+	void end(CodecStage stage, int64_t start)
+	{
+		if (start)
+		{
+			record_latency(stage, (uint64_t)(now_ns() - start));
+		}
+	}
+
+	void add_packet_in(size_t bytes)
+	{
+		if (is_enabled())
+		{
+			count_packet_in(bytes);
+		}
+	}
+
+	void add_packet_out(size_t bytes)
+	{
+		if (is_enabled())
+		{
+			count_packet_out(bytes);
+		}
+	}
+
+	void add_frame_in()
+	{
+		if (is_enabled())
+		{
+			count_frame_in();
+		}
+	}
+
+	void add_frame_out()
+	{
+		if (is_enabled())
+		{
+			count_frame_out();
+		}
+	}
+
+	/**
+	 * @brief count an error
+	 * @param code -- the AVERROR code
+	 */
+	void add_error(int code)
+	{
+		if (is_enabled())
+		{
+			count_error(code);
+		}
+	}
+
+	/**
+	 * @brief count the allocated buffer bytes, see CodecMemory. it's always on, unlike the
+	 * other metrics, because the limit depends on it
+	 *
+	 * @param bytes -- the allocated size
+	 *        limit -- the max bytes of the session, 0 is no limit
+	 *
+	 * @return true -- counted
+	 *         false -- it would go over the limit, it's counted as rejected instead
+	 */
+	bool add_memory(size_t bytes, size_t limit);
+	void remove_memory(size_t bytes);
+
+	uint64_t get_memory_bytes() const
+	{
+		return m_memory_bytes.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_memory_peak() const
+	{
+		return m_memory_peak.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * @brief copy the current values
+	 */
+	void snapshot(CodecMetricsSnapshot& snapshot) const;
+
+	/**
+	 * @brief clear all the values, the memory peak restarts from the current bytes
+	 */
+	void reset();
+
+	/**
+	 * @brief export the process wide metrics and all the live sessions in
+	 * the Prometheus text format
+	 */
+	static std::string export_prometheus();
+
+	/**
+	 * @brief snapshots of all the live sessions
+	 */
+	static void snapshot_all(std::vector<CodecMetricsSnapshot>& snapshots);
+
+public:
+	static const int HISTOGRAM_BUCKETS = 8 + 32 * 8;
+	static const int ERROR_SLOTS = 16;
+
+private:
+	CodecMetrics(const char* kind, bool registered);
+
+	static int64_t now_ns();
+	void record_latency(CodecStage stage, uint64_t ns);
+	void count_packet_in(size_t bytes);
+	void count_packet_out(size_t bytes);
+	void count_frame_in();
+	void count_frame_out();
+	void count_error(int code);
+	void record_error(int code);
+
+private:
+	static std::atomic<bool> s_enabled;
+
+	bool m_registered;
+	std::string m_kind;
+	std::string m_label;
+
+	std::atomic<uint64_t> m_packets_in;
+	std::atomic<uint64_t> m_packets_out;
+	std::atomic<uint64_t> m_frames_in;
+	std::atomic<uint64_t> m_frames_out;
+	std::atomic<uint64_t> m_bytes_in;
+	std::atomic<uint64_t> m_bytes_out;
+	std::atomic<uint64_t> m_errors;
+
+	std::atomic<uint64_t> m_memory_bytes;
+	std::atomic<uint64_t> m_memory_peak;
+	std::atomic<uint64_t> m_memory_rejected;
+
+	// the slot is claimed by CAS on the code, the last slot counts the others
+	std::atomic<int> m_error_codes[ERROR_SLOTS];
+	std::atomic<uint64_t> m_error_counts[ERROR_SLOTS];
+
+	std::atomic<uint64_t> m_histograms[STAGE_COUNT][HISTOGRAM_BUCKETS];
+	std::atomic<uint64_t> m_latency_sum[STAGE_COUNT];
+	std::atomic<uint64_t> m_latency_max[STAGE_COUNT];
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,336 @@
+#include "codec_placement.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+
+extern "C"
+{
+#include <libavutil/mem.h>
+}
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+namespace
+{
+	const size_t NUMA_MIN_SIZE = 64 * 1024;
+	const int MAX_NODES = 1024;
+	// linux/mempolicy.h
+	const int NUMA_MPOL_PREFERRED = 1;
+
+	bool read_line(const char* path, char* line, size_t size)
+	{
+		FILE* file = fopen(path, "r");
+		if (!file)
+		{
+			return false;
+		}
+
+		bool ok = fgets(line, (int)size, file) != NULL;
+		fclose(file);
+		return ok;
+	}
+
+	size_t page_align(size_t size)
+	{
+#ifdef __linux__
+		size_t page = (size_t)sysconf(_SC_PAGESIZE);
+		return (size + page - 1) & ~(page - 1);
+#else
+		return size;
+#endif
+	}
+
+	std::mutex g_numa_allocators_mutex;
+	std::vector<CodecNumaAllocator*> g_numa_allocators;
+}
+
+bool CodecTopology::parse_cpu_list(const char* list, std::vector<int>& cpus)
+{
+	cpus.clear();
+
+	const char* p = list;
+	while (*p && *p != '\n')
+	{
+		char* end;
+		long first = strtol(p, &end, 10);
+		if (end == p || first < 0)
+		{
+			return false;
+		}
+
+		long last = first;
+		p = end;
+		if (*p == '-')
+		{
+			p++;
+			last = strtol(p, &end, 10);
+			if (end == p || last < first)
+			{
+				return false;
+			}
+			p = end;
+		}
+
+		for (long cpu = first; cpu <= last; cpu++)
+		{
+			cpus.push_back((int)cpu);
+		}
+
+		if (*p == ',')
+		{
+			p++;
+		}
+	}
+
+	return !cpus.empty();
+}
+
+bool CodecTopology::get_nodes(std::vector<int>& nodes, std::vector<std::vector<int> >& cpus)
+{
+	nodes.clear();
+	cpus.clear();
+
+	char line[4096];
+	std::vector<int> online;
+	if (read_line("/sys/devices/system/node/online", line, sizeof(line)) && parse_cpu_list(line, online))
+	{
+		for (size_t i = 0; i < online.size(); i++)
+		{
+			char path[128];
+			std::vector<int> nodeCpus;
+			snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", online[i]);
+			// a node with memory only has no CPUs
+			if (read_line(path, line, sizeof(line)) && parse_cpu_list(line, nodeCpus))
+			{
+				nodes.push_back(online[i]);
+				cpus.push_back(nodeCpus);
+			}
+		}
+	}
+
+	if (nodes.empty())
+	{
+		std::vector<int> allCpus;
+		if (!get_thread_affinity(allCpus))
+		{
+			return false;
+		}
+		nodes.push_back(0);
+		cpus.push_back(allCpus);
+	}
+
+	return true;
+}
+
+bool CodecTopology::set_thread_affinity(const std::vector<int>& cpus)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (size_t i = 0; i < cpus.size(); i++)
+	{
+		if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE)
+		{
+			CPU_SET(cpus[i], &set);
+		}
+	}
+
+	return CPU_COUNT(&set) > 0 && sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+	return false;
+#endif
+}
+
+bool CodecTopology::get_thread_affinity(std::vector<int>& cpus)
+{
+	cpus.clear();
+
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) != 0)
+	{
+		return false;
+	}
+
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if (CPU_ISSET(cpu, &set))
+		{
+			cpus.push_back(cpu);
+		}
+	}
+#endif
+
+	return !cpus.empty();
+}
+
+CodecAffinityScope::CodecAffinityScope(const std::vector<int>& cpus)
+{
+	m_bound = !cpus.empty() && CodecTopology::get_thread_affinity(m_previous) &&
+		CodecTopology::set_thread_affinity(cpus);
+}
+
+CodecAffinityScope::~CodecAffinityScope()
+{
+	if (m_bound)
+	{
+		CodecTopology::set_thread_affinity(m_previous);
+	}
+}
+
+CodecNumaAllocator::CodecNumaAllocator(int node)
+{
+	m_node = node;
+}
+
+CodecNumaAllocator* CodecNumaAllocator::get(int node)
+{
+	if (node < 0 || node >= MAX_NODES)
+	{
+		return NULL;
+	}
+
+	std::lock_guard<std::mutex> lock(g_numa_allocators_mutex);
+	if (g_numa_allocators.size() <= (size_t)node)
+	{
+		g_numa_allocators.resize(node + 1, NULL);
+	}
+
+	if (!g_numa_allocators[node])
+	{
+		g_numa_allocators[node] = new (std::nothrow) CodecNumaAllocator(node);
+	}
+
+	return g_numa_allocators[node];
+}
+
+void* CodecNumaAllocator::allocate(size_t size)
+{
+#ifdef __linux__
+	if (size >= NUMA_MIN_SIZE && m_node >= 0)
+	{
+		size_t mapSize = page_align(size);
+		void* ptr = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ptr == MAP_FAILED)
+		{
+			return NULL;
+		}
+
+		// before the first touch, so the pages come from the node
+		unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+		mask[m_node / (8 * sizeof(unsigned long))] = 1UL << (m_node % (8 * sizeof(unsigned long)));
+		syscall(SYS_mbind, ptr, mapSize, NUMA_MPOL_PREFERRED, mask, (unsigned long)MAX_NODES, 0);
+		return ptr;
+	}
+#endif
+
+	return av_malloc(size);
+}
+
+void CodecNumaAllocator::deallocate(void* ptr, size_t size)
+{
+#ifdef __linux__
+	if (size >= NUMA_MIN_SIZE && m_node >= 0)
+	{
+		munmap(ptr, page_align(size));
+		return;
+	}
+#endif
+
+	av_free(ptr);
+}
+
+CodecPlacementScheduler::CodecPlacementScheduler()
+{
+}
+
+CodecPlacementScheduler::~CodecPlacementScheduler()
+{
+}
+
+bool CodecPlacementScheduler::init()
+{
+	std::vector<int> nodes;
+	std::vector<std::vector<int> > cpus;
+	if (!CodecTopology::get_nodes(nodes, cpus))
+	{
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_nodes.resize(nodes.size());
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		m_nodes[i].id = nodes[i];
+		m_nodes[i].cpus = cpus[i];
+		m_nodes[i].load = 0;
+	}
+
+	return true;
+}
+
+bool CodecPlacementScheduler::acquire(CodecPlacement& placement, int weight)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_nodes.empty())
+	{
+		return false;
+	}
+
+	// the load per CPU, the nodes may have different sizes
+	size_t best = 0;
+	for (size_t i = 1; i < m_nodes.size(); i++)
+	{
+		if ((int64_t)m_nodes[i].load * (int64_t)m_nodes[best].cpus.size() <
+			(int64_t)m_nodes[best].load * (int64_t)m_nodes[i].cpus.size())
+		{
+			best = i;
+		}
+	}
+
+	m_nodes[best].load += weight;
+	placement.node = m_nodes[best].id;
+	placement.cpus = m_nodes[best].cpus;
+	return true;
+}
+
+void CodecPlacementScheduler::release(const CodecPlacement& placement, int weight)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (size_t i = 0; i < m_nodes.size(); i++)
+	{
+		if (m_nodes[i].id == placement.node)
+		{
+			m_nodes[i].load -= weight;
+			if (m_nodes[i].load < 0)
+			{
+				m_nodes[i].load = 0;
+			}
+			return;
+		}
+	}
+}
+
+int CodecPlacementScheduler::get_node_count()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return (int)m_nodes.size();
+}
+
+int CodecPlacementScheduler::get_load(int index)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (index < 0 || index >= (int)m_nodes.size())
+	{
+		return -1;
+	}
+
+	return m_nodes[index].load;
+}
@@ -0,0 +1,159 @@
+#ifndef _H_CODEC_PLACEMENT_H_
+#define _H_CODEC_PLACEMENT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <mutex>
+
+#include "codec_memory.h"
+
+/**
+* where a session runs, see FFmpegDecoder::set_placement and FFmpegEncoder::set_placement.
+*
+* the codec threads of libavcodec and x264 are created by avcodec_open2 and inherit the
+* affinity of the thread calling it, so the calling thread is bound to the CPUs while the
+* codec is opened. the library buffers of the session are allocated on the NUMA node by
+* CodecNumaAllocator. the thread feeding the session should be bound too, e.g. by
+* CodecAffinityScope, so the frames it touches first are on the same node.
+*
+* the affinity and the NUMA binding are linux only, they are ignored on other systems.
+*/
+struct CodecPlacement
+{
+	// the NUMA node of the buffers, -1 is any
+	int node;
+	// the CPUs of the codec threads, empty is any
+	std::vector<int> cpus;
+
+	CodecPlacement()
+	{
+		node = -1;
+	}
+};
+
+/**
+* the NUMA nodes and the CPU affinity of the host
+*/
+class CodecTopology
+{
+public:
+	/**
+	 * @brief parse a linux CPU list like "0-7,16-23"
+	 */
+	static bool parse_cpu_list(const char* list, std::vector<int>& cpus);
+
+	/**
+	 * @brief the online NUMA nodes, a host without NUMA has node 0 with all the CPUs
+	 *
+	 * @param nodes -- [output] the node ids
+	 *        cpus -- [output] the CPUs of each node
+	 */
+	static bool get_nodes(std::vector<int>& nodes, std::vector<std::vector<int> >& cpus);
+
+	/**
+	 * @brief bind the calling thread to the CPUs
+	 */
+	static bool set_thread_affinity(const std::vector<int>& cpus);
+	static bool get_thread_affinity(std::vector<int>& cpus);
+};
+
+/**
+* binds the calling thread to the CPUs for its lifetime, the previous affinity is restored
+* at the end. nothing is done if the CPUs are empty.
+*/
+class CodecAffinityScope
+{
+public:
+	explicit CodecAffinityScope(const std::vector<int>& cpus);
+	~CodecAffinityScope();
+
+private:
+	CodecAffinityScope(const CodecAffinityScope&);
+	CodecAffinityScope& operator=(const CodecAffinityScope&);
+
+	bool m_bound;
+	std::vector<int> m_previous;
+};
+
+/**
+* the buffers of at least 64KB are mapped and bound to a NUMA node(MPOL_PREFERRED, so
+* they still come from another node when it's full), the smaller ones use av_malloc and
+* are placed by the first touch.
+*/
+class CodecNumaAllocator : public CodecAllocator
+{
+public:
+	explicit CodecNumaAllocator(int node);
+
+	/**
+	 * @brief the shared allocator of a node, it lives until the process exits
+	 */
+	static CodecNumaAllocator* get(int node);
+
+	void* allocate(size_t size) override;
+	void deallocate(void* ptr, size_t size) override;
+
+	int get_node() const
+	{
+		return m_node;
+	}
+
+private:
+	int m_node;
+};
+
+/**
+* spreads the sessions evenly across the NUMA nodes, each session goes to the node with
+* the least load
+*/
+class CodecPlacementScheduler
+{
+public:
+	CodecPlacementScheduler();
+	virtual ~CodecPlacementScheduler();
+
+	/**
+	 * @brief find the nodes of the host
+	 *
+	 * @return true -- successful
+	 *         false -- the topology is unknown
+	 */
+	bool init();
+
+	/**
+	 * @brief place a session on the least loaded node
+	 *
+	 * @param placement -- [output] the node and its CPUs
+	 *        weight -- the load of the session, e.g. its codec thread count
+	 *
+	 * @return true -- successful
+	 *         false -- not initialized
+	 */
+	bool acquire(CodecPlacement& placement, int weight = 1);
+
+	/**
+	 * @brief the session ended, the same weight as acquire
+	 */
+	void release(const CodecPlacement& placement, int weight = 1);
+
+	int get_node_count();
+
+	/**
+	 * @brief the load of a node by its index, -1 if there's no such node
+	 */
+	int get_load(int index);
+
+private:
+	struct Node
+	{
+		int id;
+		std::vector<int> cpus;
+		int load;
+	};
+
+	std::mutex m_mutex;
+	std::vector<Node> m_nodes;
+};
+
+#endif
@@ -0,0 +1,220 @@
+#include "codec_trace.h"
+#include <stdio.h>
+#include <mutex>
+#include <chrono>
+#include <vector>
+
+namespace
+{
+	struct TraceEvent
+	{
+		const char* name;
+		uint32_t stream_id;
+		int64_t start_ns;
+		int64_t duration_ns;
+	};
+
+	// written by its thread only, the exporter reads the events behind the head
+	struct TraceBuffer
+	{
+		std::atomic<uint64_t> head;
+		// the events before it were dropped by clear(), only the exporter touches it
+		uint64_t cleared;
+		std::atomic<bool> in_use;
+		int tid;
+		std::string thread_name;
+		TraceEvent events[CodecTrace::BUFFER_EVENTS];
+	};
+
+	// it's only locked when a thread records its first event, and on export
+	std::mutex g_buffers_mutex;
+	std::vector<TraceBuffer*> g_buffers;
+
+	TraceBuffer* acquire_buffer()
+	{
+		std::lock_guard<std::mutex> lock(g_buffers_mutex);
+
+		// the buffer of an exited thread is reused, its events are kept
+		for (size_t i = 0; i < g_buffers.size(); i++)
+		{
+			if (!g_buffers[i]->in_use.load(std::memory_order_relaxed))
+			{
+				g_buffers[i]->in_use.store(true, std::memory_order_relaxed);
+				g_buffers[i]->thread_name.clear();
+				return g_buffers[i];
+			}
+		}
+
+		TraceBuffer* buffer = new TraceBuffer;
+		buffer->head.store(0, std::memory_order_relaxed);
+		buffer->cleared = 0;
+		buffer->in_use.store(true, std::memory_order_relaxed);
+		buffer->tid = (int)g_buffers.size() + 1;
+		g_buffers.push_back(buffer);
+		return buffer;
+	}
+
+	struct ThreadBuffer
+	{
+		TraceBuffer* buffer;
+
+		ThreadBuffer() : buffer(NULL)
+		{
+		}
+
+		~ThreadBuffer()
+		{
+			if (buffer)
+			{
+				buffer->in_use.store(false, std::memory_order_relaxed);
+			}
+		}
+
+		TraceBuffer* get()
+		{
+			if (!buffer)
+			{
+				buffer = acquire_buffer();
+			}
+			return buffer;
+		}
+	};
+
+	thread_local ThreadBuffer t_buffer;
+
+	void append_escaped(std::string& out, const std::string& value)
+	{
+		for (size_t i = 0; i < value.size(); i++)
+		{
+			char c = value[i];
+			if (c == '"' || c == '\\')
+			{
+				out += '\\';
+			}
+			out += (unsigned char)c < 0x20 ? ' ' : c;
+		}
+	}
+}
+
+std::atomic<bool> CodecTrace::s_enabled(false);
+
+void CodecTrace::set_enabled(bool enabled)
+{
+	s_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+int64_t CodecTrace::now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void CodecTrace::record(const char* name, uint32_t stream_id, int64_t start_ns, int64_t end_ns)
+{
+	TraceBuffer* buffer = t_buffer.get();
+	uint64_t head = buffer->head.load(std::memory_order_relaxed);
+
+	TraceEvent& event = buffer->events[head % BUFFER_EVENTS];
+	event.name = name;
+	event.stream_id = stream_id;
+	event.start_ns = start_ns;
+	event.duration_ns = end_ns - start_ns;
+
+	buffer->head.store(head + 1, std::memory_order_release);
+}
+
+void CodecTrace::set_thread_name(const char* name)
+{
+	TraceBuffer* buffer = t_buffer.get();
+
+	std::lock_guard<std::mutex> lock(g_buffers_mutex);
+	buffer->thread_name = name ? name : "";
+}
+
+std::string CodecTrace::export_chrome_trace()
+{
+	std::string out = "{\"traceEvents\":[";
+	bool first = true;
+	char line[512];
+	std::vector<TraceEvent> events;
+
+	std::lock_guard<std::mutex> lock(g_buffers_mutex);
+	for (size_t i = 0; i < g_buffers.size(); i++)
+	{
+		TraceBuffer* buffer = g_buffers[i];
+
+		uint64_t head = buffer->head.load(std::memory_order_acquire);
+		uint64_t begin = head > (uint64_t)BUFFER_EVENTS ? head - BUFFER_EVENTS : 0;
+		if (begin < buffer->cleared)
+		{
+			begin = buffer->cleared;
+		}
+		events.clear();
+		for (uint64_t j = begin; j < head; j++)
+		{
+			events.push_back(buffer->events[j % BUFFER_EVENTS]);
+		}
+
+		// the thread may have overwritten the oldest events while they were copied
+		uint64_t newHead = buffer->head.load(std::memory_order_acquire);
+		size_t skip = 0;
+		if (newHead > (uint64_t)BUFFER_EVENTS && newHead - BUFFER_EVENTS > begin)
+		{
+			skip = (size_t)(newHead - BUFFER_EVENTS - begin);
+			// the slot being written now
+			skip++;
+		}
+
+		if (!buffer->thread_name.empty())
+		{
+			out += first ? "" : ",";
+			first = false;
+			snprintf(line, sizeof(line), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"", buffer->tid);
+			out += line;
+			append_escaped(out, buffer->thread_name);
+			out += "\"}}";
+		}
+
+		for (size_t j = skip; j < events.size(); j++)
+		{
+			const TraceEvent& event = events[j];
+			snprintf(line, sizeof(line),
+				"%s{\"name\":\"%s\",\"cat\":\"codec\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{\"stream\":%u}}",
+				first ? "" : ",", event.name, event.start_ns / 1000.0, event.duration_ns / 1000.0, buffer->tid, event.stream_id);
+			out += line;
+			first = false;
+		}
+	}
+
+	out += "],\"displayTimeUnit\":\"ms\"}\n";
+	return out;
+}
+
+bool CodecTrace::dump_chrome_trace(const char* path)
+{
+	std::string trace = export_chrome_trace();
+
+	FILE* file = fopen(path, "wb");
+	if (!file)
+	{
+		return false;
+	}
+
+	bool ret = fwrite(trace.data(), 1, trace.size(), file) == trace.size();
+	if (fclose(file) != 0)
+	{
+		ret = false;
+	}
+
+	return ret;
+}
+
+void CodecTrace::clear()
+{
+	std::lock_guard<std::mutex> lock(g_buffers_mutex);
+	for (size_t i = 0; i < g_buffers.size(); i++)
+	{
+		// only the owner thread writes the head, so it isn't reset
+		g_buffers[i]->cleared = g_buffers[i]->head.load(std::memory_order_acquire);
+	}
+}
@@ -0,0 +1,108 @@
+#ifndef _H_CODEC_TRACE_H_
+#define _H_CODEC_TRACE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <string>
+
+//#define CODEC_TRACE_DISABLED
+
+/**
+* timeline recording of the decoder, transcoder and encoder calls, exported as
+* Chrome trace JSON(chrome://tracing, https://ui.perfetto.dev).
+*
+* each thread writes its events into its own ring buffer without locking, the
+* oldest events are overwritten. the recording is off by default, then the cost
+* of a traced call is one relaxed atomic load and a branch. CODEC_TRACE_DISABLED
+* compiles it out entirely.
+*/
+class CodecTrace
+{
+public:
+	// the events kept per thread
+	static const int BUFFER_EVENTS = 8192;
+
+	/**
+	 * @brief turn the recording on or off for the whole process
+	 */
+	static void set_enabled(bool enabled);
+
+	static bool is_enabled()
+	{
+#ifdef CODEC_TRACE_DISABLED
+		return false;
+#else
+		return s_enabled.load(std::memory_order_relaxed);
+#endif
+	}
+
+	static int64_t now_ns();
+
+	/**
+	 * @brief record a finished call
+	 *
+	 * @param name -- the event name, it must be a string literal
+	 *        stream_id -- the stream id, see set_trace_id of the codec classes
+	 *        start_ns, end_ns -- the time of the call, from now_ns()
+	 */
+	static void record(const char* name, uint32_t stream_id, int64_t start_ns, int64_t end_ns);
+
+	/**
+	 * @brief name the calling thread in the trace
+	 */
+	static void set_thread_name(const char* name);
+
+	/**
+	 * @brief the recorded events of all the threads in the Chrome trace JSON format
+	 */
+	static std::string export_chrome_trace();
+
+	/**
+	 * @brief write export_chrome_trace() to the file
+	 *
+	 * @return true -- successful
+	 *         false -- failed to write the file
+	 */
+	static bool dump_chrome_trace(const char* path);
+
+	/**
+	 * @brief drop all the recorded events
+	 */
+	static void clear();
+
+private:
+	static std::atomic<bool> s_enabled;
+};
+
+/**
+* records the enclosing scope as one event
+*/
+class CodecTraceScope
+{
+public:
+	CodecTraceScope(const char* name, uint32_t stream_id)
+		: m_name(name), m_stream_id(stream_id)
+	{
+		m_start = CodecTrace::is_enabled() ? CodecTrace::now_ns() : 0;
+	}
+
+	~CodecTraceScope()
+	{
+		if (m_start)
+		{
+			CodecTrace::record(m_name, m_stream_id, m_start, CodecTrace::now_ns());
+		}
+	}
+
+private:
+	CodecTraceScope(const CodecTraceScope&);
+	CodecTraceScope& operator=(const CodecTraceScope&);
+
+private:
+	const char* m_name;
+	uint32_t m_stream_id;
+	int64_t m_start;
+};
+
+#endif
@@ -1,4 +1,139 @@
 #include "codec_utils.h"
+#include <string.h>
+
+namespace
+{
+	const uint8_t TIMESTAMP_SEI_UUID[16] = {
+		0x6c, 0x61, 0x74, 0x65, 0x6e, 0x63, 0x79, 0x2d,
+		0x9a, 0x3e, 0x41, 0x5b, 0xb2, 0x07, 0xc4, 0x1d
+	};
+	const int TIMESTAMP_SEI_PAYLOAD_SIZE = 16 + 8 + 4;
+
+	// reads the RBSP bytes of a NAL unit, skips the emulation prevention bytes
+	struct RbspReader
+	{
+		const uint8_t *pos;
+		const uint8_t *end;
+		int zeros;
+
+		bool read(uint8_t &value)
+		{
+			if (pos < end && zeros >= 2 && *pos == 3)
+			{
+				pos++;
+				zeros = 0;
+			}
+
+			if (pos >= end)
+			{
+				return false;
+			}
+
+			value = *pos++;
+			zeros = value ? 0 : zeros + 1;
+			return true;
+		}
+
+		// the ff_byte coded payload type or payload size
+		bool read_sei_value(uint32_t &value)
+		{
+			uint8_t byte;
+			value = 0;
+			do
+			{
+				if (!read(byte))
+				{
+					return false;
+				}
+				value += byte;
+			} while (byte == 0xFF);
+
+			return true;
+		}
+	};
+
+	bool parse_timestamp_sei(const uint8_t *nal, const uint8_t *end, int64_t &timestamp_us, uint32_t &sequence)
+	{
+		RbspReader reader = { nal + 1, end, 0 };
+
+		while (reader.pos < end && *reader.pos != 0x80)
+		{
+			uint32_t type;
+			uint32_t size;
+			if (!reader.read_sei_value(type) || !reader.read_sei_value(size))
+			{
+				return false;
+			}
+
+			uint8_t payload[TIMESTAMP_SEI_PAYLOAD_SIZE];
+			uint32_t i = 0;
+			bool matched = (type == 5 && size == TIMESTAMP_SEI_PAYLOAD_SIZE);
+			for (; i < size; i++)
+			{
+				uint8_t byte;
+				if (!reader.read(byte))
+				{
+					return false;
+				}
+
+				if (matched)
+				{
+					payload[i] = byte;
+					if (i < 16 && byte != TIMESTAMP_SEI_UUID[i])
+					{
+						matched = false;
+					}
+				}
+			}
+
+			if (matched)
+			{
+				uint64_t value = 0;
+				for (i = 16; i < 24; i++)
+				{
+					value = (value << 8) | payload[i];
+				}
+				timestamp_us = (int64_t)value;
+				sequence = ((uint32_t)payload[24] << 24) | ((uint32_t)payload[25] << 16) |
+					((uint32_t)payload[26] << 8) | payload[27];
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	bool has_sei_payload(const uint8_t *nal, const uint8_t *end, uint32_t payload_type)
+	{
+		RbspReader reader = { nal + 1, end, 0 };
+
+		while (reader.pos < end && *reader.pos != 0x80)
+		{
+			uint32_t type;
+			uint32_t size;
+			if (!reader.read_sei_value(type) || !reader.read_sei_value(size))
+			{
+				return false;
+			}
+
+			if (type == payload_type)
+			{
+				return true;
+			}
+
+			for (uint32_t i = 0; i < size; i++)
+			{
+				uint8_t byte;
+				if (!reader.read(byte))
+				{
+					return false;
+				}
+			}
+		}
+
+		return false;
+	}
+}
 
 static const uint8_t *AVCFindStartCodeInternal(const uint8_t *start, const uint8_t *end)
 {
@@ -155,4 +290,203 @@ int count_frames(const uint8_t *data, size_t size)
 	}
 
 	return count;
-}
\ No newline at end of file
+}
+
+bool avc_find_parameter_sets(const uint8_t *data, size_t size,
+	const uint8_t *&sps, size_t &sps_size, const uint8_t *&pps, size_t &pps_size)
+{
+	const uint8_t *nalStart;
+	const uint8_t *nalEnd;
+	const uint8_t *end = data + size;
+	int type;
+
+	sps = NULL;
+	pps = NULL;
+	sps_size = 0;
+	pps_size = 0;
+
+	nalStart = avc_find_start_code(data, end);
+	while (true)
+	{
+		while (nalStart < end && !*(nalStart++))
+			;
+
+		if (nalStart == end)
+		{
+			break;
+		}
+
+		type = nalStart[0] & 0x1F;
+		nalEnd = avc_find_start_code(nalStart, end);
+
+		if (type == 7 && !sps)
+		{
+			sps = nalStart;
+			sps_size = nalEnd - nalStart;
+		}
+		else if (type == 8 && !pps)
+		{
+			pps = nalStart;
+			pps_size = nalEnd - nalStart;
+		}
+
+		if (sps && pps)
+		{
+			return true;
+		}
+
+		nalStart = nalEnd;
+	}
+
+	return false;
+}
+
+const uint8_t* avc_find_first_slice(const uint8_t *data, size_t size)
+{
+	const uint8_t *nalStart;
+	const uint8_t *startCode;
+	const uint8_t *end = data + size;
+	int type;
+
+	startCode = avc_find_start_code(data, end);
+	while (startCode < end)
+	{
+		nalStart = startCode;
+		while (nalStart < end && !*(nalStart++))
+			;
+
+		if (nalStart == end)
+		{
+			break;
+		}
+
+		type = nalStart[0] & 0x1F;
+		if (type >= 1 && type <= 5)
+		{
+			return startCode;
+		}
+
+		startCode = avc_find_start_code(nalStart, end);
+	}
+
+	return end;
+}
+
+size_t avc_write_timestamp_sei(uint8_t *buf, int64_t timestamp_us, uint32_t sequence)
+{
+	uint8_t rbsp[3 + TIMESTAMP_SEI_PAYLOAD_SIZE + 1];
+	uint8_t *p = rbsp;
+	uint64_t value = (uint64_t)timestamp_us;
+	int i;
+
+	*p++ = 5;
+	*p++ = TIMESTAMP_SEI_PAYLOAD_SIZE;
+	memcpy(p, TIMESTAMP_SEI_UUID, sizeof(TIMESTAMP_SEI_UUID));
+	p += sizeof(TIMESTAMP_SEI_UUID);
+	for (i = 7; i >= 0; i--)
+	{
+		*p++ = (uint8_t)(value >> (i * 8));
+	}
+	for (i = 3; i >= 0; i--)
+	{
+		*p++ = (uint8_t)(sequence >> (i * 8));
+	}
+	// rbsp_trailing_bits
+	*p++ = 0x80;
+
+	size_t pos = 0;
+	buf[pos++] = 0;
+	buf[pos++] = 0;
+	buf[pos++] = 0;
+	buf[pos++] = 1;
+	buf[pos++] = 0x06;
+
+	// emulation prevention, 0x000000 ~ 0x000003 becomes 0x00000300 ~ 0x00000303
+	int zeros = 0;
+	for (const uint8_t *q = rbsp; q < p; q++)
+	{
+		if (zeros >= 2 && *q <= 3)
+		{
+			buf[pos++] = 3;
+			zeros = 0;
+		}
+		buf[pos++] = *q;
+		zeros = *q ? 0 : zeros + 1;
+	}
+
+	return pos;
+}
+
+bool avc_find_timestamp_sei(const uint8_t *data, size_t size, int64_t &timestamp_us, uint32_t &sequence)
+{
+	const uint8_t *nalStart;
+	const uint8_t *nalEnd;
+	const uint8_t *end = data + size;
+	int type;
+
+	nalStart = avc_find_start_code(data, end);
+	while (true)
+	{
+		while (nalStart < end && !*(nalStart++))
+			;
+
+		if (nalStart == end)
+		{
+			break;
+		}
+
+		type = nalStart[0] & 0x1F;
+		// the SEI comes before the slices
+		if (type >= 1 && type <= 5)
+		{
+			break;
+		}
+
+		nalEnd = avc_find_start_code(nalStart, end);
+		if (type == 6 && parse_timestamp_sei(nalStart, nalEnd, timestamp_us, sequence))
+		{
+			return true;
+		}
+
+		nalStart = nalEnd;
+	}
+
+	return false;
+}
+
+bool avc_find_recovery_point(const uint8_t *data, size_t size)
+{
+	const uint8_t *nalStart;
+	const uint8_t *nalEnd;
+	const uint8_t *end = data + size;
+	int type;
+
+	nalStart = avc_find_start_code(data, end);
+	while (true)
+	{
+		while (nalStart < end && !*(nalStart++))
+			;
+
+		if (nalStart == end)
+		{
+			break;
+		}
+
+		type = nalStart[0] & 0x1F;
+		// the SEI comes before the slices
+		if (type >= 1 && type <= 5)
+		{
+			break;
+		}
+
+		nalEnd = avc_find_start_code(nalStart, end);
+		if (type == 6 && has_sei_payload(nalStart, nalEnd, 6))
+		{
+			return true;
+		}
+
+		nalStart = nalEnd;
+	}
+
+	return false;
+}
@@ -44,9 +44,91 @@ extern "C"
  30-31             reserved
 */
 
+/**
+* the result of sending data to a codec
+*/
+enum CodecStatus
+{
+	CODEC_OK = 0,
+	// the codec is full(EAGAIN), receive its output first, then send the same data again
+	CODEC_AGAIN,
+	// the end of stream was sent, reset the codec first
+	CODEC_EOF,
+	CODEC_ERROR
+};
+
 const uint8_t* avc_find_start_code(const uint8_t *start, const uint8_t *end);
 bool avc_find_key_frame(const uint8_t *data, size_t size);
 int count_avc_key_frames(const uint8_t *data, size_t size);
+// the count of the NAL units, H264StreamAnalyzer groups them into pictures
 int count_frames(const uint8_t *data, size_t size);
 
+/**
+ * @brief find the first SPS and PPS NAL units in an Annex-B buffer
+ *
+ * @param data -- [input] the Annex-B data
+ *        size -- [input] the data size
+ *        sps, sps_size -- [output] the SPS NAL unit(without start code) and its size
+ *        pps, pps_size -- [output] the PPS NAL unit(without start code) and its size
+ *
+ * @return true -- both SPS and PPS were found
+ *         false -- at least one of them is missing
+ */
+bool avc_find_parameter_sets(const uint8_t *data, size_t size,
+	const uint8_t *&sps, size_t &sps_size, const uint8_t *&pps, size_t &pps_size);
+
+/**
+ * @brief find the first slice(VCL) NAL unit of an access unit
+ *
+ * @return the start code of the slice, or data + size if there is no slice
+ */
+const uint8_t* avc_find_first_slice(const uint8_t *data, size_t size);
+
+/**
+ latency tracing SEI, a user_data_unregistered(payload type 5) SEI NAL unit:
+
+ | 16 bytes UUID | 8 bytes capture time, microseconds | 4 bytes sequence number |
+
+ the integers are big endian, the NAL unit is written with emulation prevention.
+*/
+
+//the max size of the timestamp SEI NAL unit, with the start code
+constexpr size_t AVC_TIMESTAMP_SEI_MAX_SIZE = 64;
+
+/**
+ * @brief write the timestamp SEI NAL unit with a 4 bytes start code
+ *
+ * @param buf -- [output] the buffer, at least AVC_TIMESTAMP_SEI_MAX_SIZE bytes
+ *        timestamp_us -- the wallclock capture time, microseconds
+ *        sequence -- the frame sequence number
+ *
+ * @return the written size
+ */
+size_t avc_write_timestamp_sei(uint8_t *buf, int64_t timestamp_us, uint32_t sequence);
+
+/**
+ * @brief find the timestamp SEI in an Annex-B buffer, the data is parsed in place
+ *
+ * @param data -- [input] the Annex-B data
+ *        size -- [input] the data size
+ *        timestamp_us -- [output] the capture time, microseconds
+ *        sequence -- [output] the frame sequence number
+ *
+ * @return true -- found
+ *         false -- not found
+ */
+bool avc_find_timestamp_sei(const uint8_t *data, size_t size, int64_t &timestamp_us, uint32_t &sequence);
+
+/**
+ * @brief if the access unit has a recovery point SEI(payload type 6), the decoding can
+ * start from it without an IDR frame, e.g. a stream with the intra refresh
+ *
+ * @param data -- [input] the Annex-B data
+ *        size -- [input] the data size
+ *
+ * @return true -- found
+ *         false -- not found
+ */
+bool avc_find_recovery_point(const uint8_t *data, size_t size);
+
 #endif
@@ -0,0 +1,182 @@
+#include "decoder_pool.h"
+#include <new>
+
+DecoderPool::DecoderPool()
+{
+	m_max_idle = 64;
+}
+
+DecoderPool::~DecoderPool()
+{
+	clear();
+
+	for (size_t i = 0; i < m_groups.size(); i++)
+	{
+		delete m_groups[i];
+	}
+	m_groups.clear();
+}
+
+DecoderPool::Group* DecoderPool::find_group(enum AVCodecID id, int reduce, int thread_count, bool create)
+{
+	for (size_t i = 0; i < m_groups.size(); i++)
+	{
+		Group* group = m_groups[i];
+		if (group->id == id && group->reduce == reduce && group->thread_count == thread_count)
+		{
+			return group;
+		}
+	}
+
+	if (!create)
+	{
+		return NULL;
+	}
+
+	Group* group = new (std::nothrow) Group;
+	if (!group)
+	{
+		return NULL;
+	}
+
+	group->id = id;
+	group->reduce = reduce;
+	group->thread_count = thread_count;
+	m_groups.push_back(group);
+	return group;
+}
+
+FFmpegDecoder* DecoderPool::open_decoder(enum AVCodecID id, int reduce, int thread_count)
+{
+	FFmpegDecoder* decoder = new (std::nothrow) FFmpegDecoder();
+	if (!decoder)
+	{
+		return NULL;
+	}
+
+	decoder->set_thread_count(thread_count);
+	if (!decoder->init(id, reduce))
+	{
+		delete decoder;
+		return NULL;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_decoder_groups[decoder] = find_group(id, reduce, thread_count, true);
+	return decoder;
+}
+
+bool DecoderPool::prepare(enum AVCodecID id, int count, int reduce, int thread_count)
+{
+	int missing;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		Group* group = find_group(id, reduce, thread_count, true);
+		if (!group)
+		{
+			return false;
+		}
+		missing = count - (int)group->idle.size();
+	}
+
+	// opened without the lock, so acquire() isn't blocked meanwhile
+	for (int i = 0; i < missing; i++)
+	{
+		FFmpegDecoder* decoder = open_decoder(id, reduce, thread_count);
+		if (!decoder)
+		{
+			return false;
+		}
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		find_group(id, reduce, thread_count, false)->idle.push_back(decoder);
+	}
+
+	return true;
+}
+
+FFmpegDecoder* DecoderPool::acquire(enum AVCodecID id, int reduce, int thread_count)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		Group* group = find_group(id, reduce, thread_count, false);
+		if (group && !group->idle.empty())
+		{
+			FFmpegDecoder* decoder = group->idle.back();
+			group->idle.pop_back();
+			return decoder;
+		}
+	}
+
+	return open_decoder(id, reduce, thread_count);
+}
+
+void DecoderPool::release(FFmpegDecoder* decoder)
+{
+	if (!decoder)
+	{
+		return;
+	}
+
+	// the codec threads of a placed decoder keep their affinity and its buffers can't move
+	// to the default allocator, so it can't be handed to another session
+	const CodecPlacement& placement = decoder->get_placement();
+	bool pooled = placement.node < 0 && placement.cpus.empty() &&
+		decoder->get_memory().get_allocator() == CodecMemory::get_default_allocator();
+
+	if (pooled && decoder->is_initialized() && decoder->reset())
+	{
+		// the per stream settings, so the series and the gauges of the next stream start clean
+		decoder->set_timestamp_sei(false);
+		decoder->set_trace_id(0);
+		decoder->get_metrics().set_label(NULL);
+		decoder->get_metrics().reset();
+		decoder->get_memory().set_limit(0);
+
+		// not the settings of the decoder, the session may have changed its thread count
+		std::lock_guard<std::mutex> lock(m_mutex);
+		std::map<FFmpegDecoder*, Group*>::iterator it = m_decoder_groups.find(decoder);
+		Group* group = it != m_decoder_groups.end() ? it->second : NULL;
+		if (group && (int)group->idle.size() < m_max_idle)
+		{
+			group->idle.push_back(decoder);
+			return;
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_decoder_groups.erase(decoder);
+	}
+	delete decoder;
+}
+
+int DecoderPool::get_idle_count(enum AVCodecID id, int reduce, int thread_count)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	Group* group = find_group(id, reduce, thread_count, false);
+	return group ? (int)group->idle.size() : 0;
+}
+
+void DecoderPool::clear()
+{
+	std::vector<FFmpegDecoder*> decoders;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (size_t i = 0; i < m_groups.size(); i++)
+		{
+			decoders.insert(decoders.end(), m_groups[i]->idle.begin(), m_groups[i]->idle.end());
+			m_groups[i]->idle.clear();
+		}
+
+		for (size_t i = 0; i < decoders.size(); i++)
+		{
+			m_decoder_groups.erase(decoders[i]);
+		}
+	}
+
+	for (size_t i = 0; i < decoders.size(); i++)
+	{
+		delete decoders[i];
+	}
+}
@@ -0,0 +1,98 @@
+#ifndef _H_DECODER_POOL_H_
+#define _H_DECODER_POOL_H_
+
+#include <stdint.h>
+#include <vector>
+#include <map>
+#include <mutex>
+
+#include "ffmpeg_decoder.h"
+
+/**
+* a pool of opened FFmpegDecoder sessions for fast stream startup.
+*
+* the decoders are opened ahead by prepare(), a new stream takes one by acquire()
+* without avcodec_open2, and gives it back by release() when the stream ends, where
+* it's recycled by avcodec_flush_buffers instead of being freed. the decoders are
+* grouped by the codec, the reduce factor and the thread count. the hardware device
+* is probed once per process and shared, see FFmpegDecoder::init.
+*/
+class DecoderPool
+{
+public:
+	DecoderPool();
+	virtual ~DecoderPool();
+
+	/**
+	 * @brief open decoders until count of them are idle
+	 *
+	 * @param id -- the codec id
+	 *        count -- the idle decoders to keep
+	 *        reduce -- see FFmpegDecoder::init
+	 *        thread_count -- see FFmpegDecoder::set_thread_count
+	 *
+	 * @return true -- successful
+	 *         false -- a decoder failed to open
+	 */
+	bool prepare(enum AVCodecID id, int count, int reduce = 0, int thread_count = 4);
+
+	/**
+	 * @brief take an idle decoder, a new one is opened if there is none
+	 *
+	 * @return the decoder, NULL if it failed to open
+	 */
+	FFmpegDecoder* acquire(enum AVCodecID id, int reduce = 0, int thread_count = 4);
+
+	/**
+	 * @brief give back a decoder from acquire(), it's reset for the next stream.
+	 * it's freed if there are already max_idle idle decoders of its group. the group is
+	 * the one it was opened for, even if the session changed its thread count.
+	 *
+	 * the settings of the session are cleared: the resync mode and the key frame callback
+	 * (see FFmpegDecoder::reset), the timestamp SEI, the trace id, the metrics label and
+	 * counters and the memory limit. only the codec, the reduce factor, the thread count
+	 * and the hardware device survive. a decoder with a placement or a memory allocator of
+	 * its own is freed instead, its codec threads and buffers stay where they were opened.
+	 */
+	void release(FFmpegDecoder* decoder);
+
+	/**
+	 * @brief the max idle decoders kept per group, the default is 64
+	 */
+	void set_max_idle(int count)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_max_idle = count;
+	}
+
+	/**
+	 * @brief the idle decoders of a group
+	 */
+	int get_idle_count(enum AVCodecID id, int reduce = 0, int thread_count = 4);
+
+	/**
+	 * @brief free all the idle decoders
+	 */
+	void clear();
+
+private:
+	struct Group
+	{
+		enum AVCodecID id;
+		int reduce;
+		int thread_count;
+		std::vector<FFmpegDecoder*> idle;
+	};
+
+	Group* find_group(enum AVCodecID id, int reduce, int thread_count, bool create);
+	FFmpegDecoder* open_decoder(enum AVCodecID id, int reduce, int thread_count);
+
+private:
+	std::mutex m_mutex;
+	std::vector<Group*> m_groups;
+	// the group of each decoder opened by the pool, recorded by open_decoder
+	std::map<FFmpegDecoder*, Group*> m_decoder_groups;
+	int m_max_idle;
+};
+
+#endif
@@ -0,0 +1,267 @@
+#include "encoder_registry.h"
+#include <stdlib.h>
+#include <string.h>
+#include <mutex>
+#include <algorithm>
+
+namespace
+{
+	// the known encoders, the table order breaks the ties of the policies
+	const EncoderBackend g_known_backends[] = {
+		{ "h264_nvenc", true, AV_HWDEVICE_TYPE_CUDA, AV_PIX_FMT_NONE, AV_PIX_FMT_NONE, 0, 0.05f, 2, 0, false, 0 },
+		{ "h264_qsv", true, AV_HWDEVICE_TYPE_QSV, AV_PIX_FMT_QSV, AV_PIX_FMT_NV12, 0, 0.1f, 2, 0, false, 0 },
+		{ "h264_vaapi", true, AV_HWDEVICE_TYPE_VAAPI, AV_PIX_FMT_VAAPI, AV_PIX_FMT_NV12, ENCODER_CAP_ROI, 0.1f, 1, 0, false, 0 },
+		{ "h264_videotoolbox", true, AV_HWDEVICE_TYPE_VIDEOTOOLBOX, AV_PIX_FMT_NONE, AV_PIX_FMT_NONE, 0, 0.1f, 1, 0, false, 0 },
+		{ "libx264", false, AV_HWDEVICE_TYPE_NONE, AV_PIX_FMT_NONE, AV_PIX_FMT_NONE,
+			ENCODER_CAP_INTRA_REFRESH | ENCODER_CAP_X264_OPTIONS | ENCODER_CAP_ROI, 1.0f, 3, 0, false, 0 },
+		{ "libopenh264", false, AV_HWDEVICE_TYPE_NONE, AV_PIX_FMT_NONE, AV_PIX_FMT_NONE, 0, 0.7f, 1, 0, false, 0 }
+	};
+	const int KNOWN_BACKEND_COUNT = sizeof(g_known_backends) / sizeof(g_known_backends[0]);
+
+	std::mutex g_mutex;
+	bool g_probed = false;
+	EncoderPolicy g_default_policy = ENCODER_POLICY_SOFTWARE;
+	// the known backends and the default H264 encoder if it's none of them, never resized
+	// after probing, so the pointers stay valid
+	std::vector<EncoderBackend> g_backends;
+	std::vector<AVBufferRef*> g_devices;
+
+	bool is_backend(const EncoderBackend* backend)
+	{
+		return !g_backends.empty() && backend >= &g_backends[0] && backend <= &g_backends.back();
+	}
+
+	// called with g_mutex locked
+	bool open_device(size_t index)
+	{
+		EncoderBackend& backend = g_backends[index];
+		if (backend.device_type == AV_HWDEVICE_TYPE_NONE || g_devices[index])
+		{
+			return true;
+		}
+
+		// the encoder may be built in without the GPU or the driver on this host,
+		// then the backend isn't selected again
+		if (av_hwdevice_ctx_create(&g_devices[index], backend.device_type, NULL, NULL, 0) < 0)
+		{
+			g_devices[index] = NULL;
+			backend.available = false;
+			return false;
+		}
+
+		return true;
+	}
+
+	// called with g_mutex locked
+	void probe()
+	{
+		if (g_probed)
+		{
+			return;
+		}
+		g_probed = true;
+
+		const char* policy = getenv("FFMPEGUTILS_ENCODER_POLICY");
+		if (policy)
+		{
+			if (strcmp(policy, "software") == 0)
+			{
+				g_default_policy = ENCODER_POLICY_SOFTWARE;
+			}
+			else if (strcmp(policy, "lowest_cost") == 0)
+			{
+				g_default_policy = ENCODER_POLICY_LOWEST_COST;
+			}
+			else if (strcmp(policy, "best_quality") == 0)
+			{
+				g_default_policy = ENCODER_POLICY_BEST_QUALITY;
+			}
+		}
+
+		g_backends.reserve(KNOWN_BACKEND_COUNT + 1);
+		g_devices.reserve(KNOWN_BACKEND_COUNT + 1);
+
+		bool hasSoftware = false;
+		for (int i = 0; i < KNOWN_BACKEND_COUNT; i++)
+		{
+			// the devices are created by the first acquire(), not for the unused backends
+			EncoderBackend backend = g_known_backends[i];
+			backend.available = avcodec_find_encoder_by_name(backend.name) != NULL;
+
+			hasSoftware = hasSoftware || (backend.available && !backend.hardware);
+			g_backends.push_back(backend);
+			g_devices.push_back(NULL);
+		}
+
+		// the default H264 encoder of the build, e.g. a libavcodec without libx264
+		const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+		if (!hasSoftware && codec)
+		{
+			bool known = false;
+			for (int i = 0; i < KNOWN_BACKEND_COUNT; i++)
+			{
+				known = known || strcmp(codec->name, g_known_backends[i].name) == 0;
+			}
+
+			if (!known)
+			{
+				EncoderBackend backend = { codec->name, false, AV_HWDEVICE_TYPE_NONE, AV_PIX_FMT_NONE, AV_PIX_FMT_NONE,
+					0, 1.0f, 1, 0, true, 0 };
+				g_backends.push_back(backend);
+				g_devices.push_back(NULL);
+			}
+		}
+	}
+
+	struct LowestCost
+	{
+		bool operator()(const EncoderBackend* a, const EncoderBackend* b) const
+		{
+			return a->cpu_cost < b->cpu_cost || (a->cpu_cost == b->cpu_cost && a->quality > b->quality);
+		}
+	};
+
+	struct BestQuality
+	{
+		bool operator()(const EncoderBackend* a, const EncoderBackend* b) const
+		{
+			return a->quality > b->quality || (a->quality == b->quality && a->cpu_cost < b->cpu_cost);
+		}
+	};
+}
+
+void EncoderRegistry::set_default_policy(EncoderPolicy policy)
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+	probe();
+	g_default_policy = (policy == ENCODER_POLICY_DEFAULT) ? ENCODER_POLICY_SOFTWARE : policy;
+}
+
+EncoderPolicy EncoderRegistry::get_default_policy()
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+	probe();
+	return g_default_policy;
+}
+
+bool EncoderRegistry::set_max_sessions(const char* name, int count)
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+	probe();
+
+	for (size_t i = 0; i < g_backends.size(); i++)
+	{
+		if (strcmp(g_backends[i].name, name) == 0)
+		{
+			g_backends[i].max_sessions = count > 0 ? count : 0;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void EncoderRegistry::get_backends(std::vector<EncoderBackend>& backends)
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+	probe();
+	backends = g_backends;
+}
+
+void EncoderRegistry::select(EncoderPolicy policy, const char* name, int capabilities,
+	std::vector<const EncoderBackend*>& candidates)
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+	probe();
+
+	if (policy == ENCODER_POLICY_DEFAULT)
+	{
+		policy = g_default_policy;
+	}
+
+	candidates.clear();
+	const EncoderBackend* preferred = NULL;
+	for (size_t i = 0; i < g_backends.size(); i++)
+	{
+		const EncoderBackend& backend = g_backends[i];
+		if (!backend.available || (backend.capabilities & capabilities) != capabilities ||
+			(policy == ENCODER_POLICY_SOFTWARE && backend.hardware))
+		{
+			continue;
+		}
+
+		if (name && strcmp(backend.name, name) == 0)
+		{
+			preferred = &backend;
+		}
+		else
+		{
+			candidates.push_back(&backend);
+		}
+	}
+
+	if (policy == ENCODER_POLICY_LOWEST_COST)
+	{
+		std::stable_sort(candidates.begin(), candidates.end(), LowestCost());
+	}
+	else
+	{
+		std::stable_sort(candidates.begin(), candidates.end(), BestQuality());
+	}
+
+	if (preferred)
+	{
+		candidates.insert(candidates.begin(), preferred);
+	}
+}
+
+bool EncoderRegistry::acquire(const EncoderBackend* backend)
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+	if (!is_backend(backend))
+	{
+		return false;
+	}
+
+	size_t index = backend - &g_backends[0];
+	EncoderBackend& entry = g_backends[index];
+	if (!entry.available || (entry.max_sessions > 0 && entry.sessions >= entry.max_sessions))
+	{
+		return false;
+	}
+
+	if (!open_device(index))
+	{
+		return false;
+	}
+
+	entry.sessions++;
+	return true;
+}
+
+void EncoderRegistry::release(const EncoderBackend* backend)
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+	if (!is_backend(backend))
+	{
+		return;
+	}
+
+	EncoderBackend& entry = g_backends[backend - &g_backends[0]];
+	if (entry.sessions > 0)
+	{
+		entry.sessions--;
+	}
+}
+
+AVBufferRef* EncoderRegistry::get_device(const EncoderBackend* backend)
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+	if (!is_backend(backend))
+	{
+		return NULL;
+	}
+
+	AVBufferRef* device = g_devices[backend - &g_backends[0]];
+	return device ? av_buffer_ref(device) : NULL;
+}
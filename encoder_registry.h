@@ -0,0 +1,133 @@
+#ifndef _H_ENCODER_REGISTRY_H_
+#define _H_ENCODER_REGISTRY_H_
+
+#include <stdint.h>
+#include <vector>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavutil/hwcontext.h>
+}
+
+/**
+* how FFmpegEncoder chooses its backend
+*/
+enum EncoderPolicy
+{
+	// the process default, see EncoderRegistry::set_default_policy
+	ENCODER_POLICY_DEFAULT = 0,
+	// the software encoders only, the best quality first. it's the default, like the builds
+	// without the hardware encoder before
+	ENCODER_POLICY_SOFTWARE,
+	// the least CPU per session first, so the hardware encoders with a free session, then software
+	ENCODER_POLICY_LOWEST_COST,
+	// the best quality at the same bitrate first
+	ENCODER_POLICY_BEST_QUALITY
+};
+
+/**
+* the features a session may need, the backends without them are skipped
+*/
+enum EncoderCapability
+{
+	// the x264 intra-refresh, see FFmpegEncoder::set_intra_refresh
+	ENCODER_CAP_INTRA_REFRESH = 1,
+	// the x264 preset, tune, profile and forced-idr options
+	ENCODER_CAP_X264_OPTIONS = 2,
+	// the AV_FRAME_DATA_REGIONS_OF_INTEREST side data, see FFmpegEncoder::set_regions_of_interest
+	ENCODER_CAP_ROI = 4
+};
+
+struct EncoderBackend
+{
+	// the libavcodec encoder name
+	const char* name;
+	bool hardware;
+	// the device of a hardware encoder, AV_HWDEVICE_TYPE_NONE for software
+	enum AVHWDeviceType device_type;
+	// the frames are uploaded to the device in this format, AV_PIX_FMT_NONE if the encoder
+	// takes the frames in the system memory
+	enum AVPixelFormat hw_pixel_format;
+	// the system memory format of the uploaded frames(e.g. NV12 for QSV and VAAPI), the
+	// frames are converted to it before the upload, AV_PIX_FMT_NONE without the upload
+	enum AVPixelFormat upload_pixel_format;
+	// EncoderCapability
+	int capabilities;
+	// the CPU cores taken by a 1080p25 session, a relative cost for the policy
+	float cpu_cost;
+	// the relative quality at the same bitrate, higher is better
+	int quality;
+	// the max concurrent sessions(e.g. a consumer NVENC), 0 means no limit
+	int max_sessions;
+
+	// the encoder is in libavcodec, and its device was created or isn't tried yet
+	bool available;
+	// the sessions open now
+	int sessions;
+};
+
+/**
+* the H264 encoders of the process, for one binary across hosts with different hardware.
+*
+* the known encoders(NVENC, QSV, VAAPI, VideoToolbox, libx264, OpenH264) are probed
+* once per process: the encoder must be built into libavcodec. the device of a
+* hardware encoder is created by its first session, so the software policy never opens
+* a GPU, it's kept and shared by the sessions. a backend whose device can't be created
+* is unavailable from then on.
+* FFmpegEncoder::init takes the candidates of its policy in order and falls back to the
+* next one(at last a software encoder) when a device is missing, full or fails to open.
+*
+* the policy can be forced by the environment variable FFMPEGUTILS_ENCODER_POLICY
+* (software, lowest_cost or best_quality), e.g. to test the software path on a host
+* with a GPU.
+*/
+class EncoderRegistry
+{
+public:
+	/**
+	 * @brief the policy of the sessions with ENCODER_POLICY_DEFAULT
+	 */
+	static void set_default_policy(EncoderPolicy policy);
+	static EncoderPolicy get_default_policy();
+
+	/**
+	 * @brief the session limit of a backend, e.g. the licensed NVENC sessions
+	 *
+	 * @return true -- successful
+	 *         false -- no such backend
+	 */
+	static bool set_max_sessions(const char* name, int count);
+
+	/**
+	 * @brief a snapshot of all the known backends, the unavailable ones too
+	 */
+	static void get_backends(std::vector<EncoderBackend>& backends);
+
+	/**
+	 * @brief the available backends to try in order
+	 *
+	 * @param policy -- the policy
+	 *        name -- the preferred backend, it goes first if it's usable, NULL for none
+	 *        capabilities -- the required EncoderCapability flags
+	 *        candidates -- [output] the backends
+	 */
+	static void select(EncoderPolicy policy, const char* name, int capabilities,
+		std::vector<const EncoderBackend*>& candidates);
+
+	/**
+	 * @brief take a session of the backend
+	 *
+	 * @return true -- successful, the device of a hardware backend is created
+	 *         false -- the backend is full or its device can't be created
+	 */
+	static bool acquire(const EncoderBackend* backend);
+	static void release(const EncoderBackend* backend);
+
+	/**
+	 * @brief a new reference of the shared device of a hardware backend, NULL if it has none
+	 */
+	static AVBufferRef* get_device(const EncoderBackend* backend);
+};
+
+#endif
@@ -1,10 +1,9 @@
 #include "ffmpeg_decoder.h"
-#include "codec_utils.h"
+#include <mutex>
+#include <vector>
 
 namespace
 {
-	static enum AVPixelFormat hw_pix_fmt;
-
 	enum AVHWDeviceType hw_priorities[] = {
 		AV_HWDEVICE_TYPE_D3D11VA,
 		AV_HWDEVICE_TYPE_CUDA,
@@ -20,9 +19,22 @@ namespace
 		AV_HWDEVICE_TYPE_NONE
 	};
 
+	// the hardware probing result of a codec, the device is shared by all its decoders
+	struct HwDeviceCache
+	{
+		enum AVCodecID codec_id;
+		AVBufferRef* device;
+		enum AVPixelFormat pix_fmt;
+	};
+
+	std::mutex g_hw_cache_mutex;
+	std::vector<HwDeviceCache> g_hw_cache;
+
 	enum AVPixelFormat get_hw_format(AVCodecContext *ctx, const enum AVPixelFormat *pix_fmts)
 	{
 		const enum AVPixelFormat *p;
+		// the opaque points to the hardware pixel format of the decoder
+		enum AVPixelFormat hw_pix_fmt = *(const enum AVPixelFormat *)ctx->opaque;
 
 		for (p = pix_fmts; *p != -1; p++) 
 		{
@@ -37,6 +49,7 @@ namespace
 }
 
 FFmpegDecoder::FFmpegDecoder()
+	: m_metrics("decoder"), m_memory(m_metrics)
 {
 	m_decoder_context = NULL;
 	m_decoder_codec = NULL;
@@ -45,10 +58,35 @@ FFmpegDecoder::FFmpegDecoder()
 	m_sws_frame = NULL;
 	m_sws_context = NULL;
 	m_sws_frame_buffer = NULL;
+	m_sws_frame_buffer_size = 0;
 	m_hw_ctx = NULL;
 
+	m_reduce = 0;
+	m_scale_reduce = false;
+	m_thread_count = 4;
+
+	m_hw_pix_fmt = AV_PIX_FMT_NONE;
 	m_hw_available = false;
 	m_initialized = false;
+	m_trace_id = 0;
+
+	m_eof = false;
+	m_resync = false;
+	m_waiting_key_frame = true;
+	m_dropped_frames = 0;
+	m_key_frame_request_time = 0;
+	m_key_frame_callback = NULL;
+	m_key_frame_opaque = NULL;
+
+	m_timestamp_sei = false;
+	for (int i = 0; i < DECODER_SEI_QUEUE_SIZE; i++)
+	{
+		m_sei_entries[i].valid = false;
+	}
+	m_sei_index = 0;
+	m_frame_has_sei = false;
+	m_frame_latency = 0;
+	m_frame_sequence = 0;
 }
 
 FFmpegDecoder::~FFmpegDecoder()
@@ -56,12 +94,23 @@ FFmpegDecoder::~FFmpegDecoder()
 	free_context();
 }
 
-bool FFmpegDecoder::init(enum AVCodecID id)
+bool FFmpegDecoder::init(enum AVCodecID id, int reduce)
 {
+	CodecTraceScope trace("decoder.init", m_trace_id);
 	int ret;
 
 	free_context();
 
+	if (reduce < 0 || reduce > 3)
+	{
+		return false;
+	}
+
+	if (m_placement.node >= 0)
+	{
+		m_memory.set_allocator(CodecNumaAllocator::get(m_placement.node));
+	}
+
 	m_decoder_codec = avcodec_find_decoder(id);
 	if (!m_decoder_codec)
 	{
@@ -74,7 +123,7 @@ bool FFmpegDecoder::init(enum AVCodecID id)
 		return false;
 	}
 
-	m_decoder_context->thread_count = 4;
+	m_decoder_context->thread_count = m_thread_count;
 	m_decoder_context->thread_type = FF_THREAD_SLICE;
 	
 	m_decoder_context->hw_device_ctx = NULL;
@@ -82,16 +131,55 @@ bool FFmpegDecoder::init(enum AVCodecID id)
 	m_hw_available = init_hw_decoder();
 	if (m_hw_available)
 	{
+		m_decoder_context->opaque = &m_hw_pix_fmt;
 		m_decoder_context->get_format = get_hw_format;
 	}
 
-	ret = avcodec_open2(m_decoder_context, m_decoder_codec, NULL);
+	// the decoder skips the high frequency coefficients, it's much cheaper than scaling afterwards
+	m_reduce = reduce;
+	m_scale_reduce = false;
+	if (reduce > 0)
+	{
+		if (!m_hw_available && reduce <= m_decoder_codec->max_lowres)
+		{
+			m_decoder_context->lowres = reduce;
+		}
+		else
+		{
+			m_scale_reduce = true;
+		}
+	}
+
+	{
+		// the codec threads are created here and inherit the affinity
+		CodecAffinityScope affinity(m_placement.cpus);
+		ret = avcodec_open2(m_decoder_context, m_decoder_codec, NULL);
+	}
 	if (ret < 0)
 	{
 		free_context();
 		return false;
 	}
 
+	// allocated here, the frames can be received before any packet is decoded(e.g. the
+	// packets dropped by the resync or the end of stream of an empty stream)
+	m_frame = av_frame_alloc();
+	if (!m_frame)
+	{
+		free_context();
+		return false;
+	}
+
+	if (m_hw_available)
+	{
+		m_hw_frame = av_frame_alloc();
+		if (!m_hw_frame)
+		{
+			free_context();
+			return false;
+		}
+	}
+
 #if LIBAVCODEC_VERSION_MAJOR >= 58
 	if (m_decoder_codec->capabilities & AV_CODEC_CAP_TRUNCATED)
 	{
@@ -111,33 +199,62 @@ bool FFmpegDecoder::init(enum AVCodecID id)
 
 bool FFmpegDecoder::init_hw_decoder()
 {
-	enum AVHWDeviceType *priority = hw_priorities;
-	AVBufferRef *hwCtx = NULL;
+	std::lock_guard<std::mutex> lock(g_hw_cache_mutex);
 
-	while (*priority != AV_HWDEVICE_TYPE_NONE)
+	// the probing and the device creation take milliseconds, they are done once per codec
+	size_t index = 0;
+	for (; index < g_hw_cache.size(); index++)
 	{
-		if (has_hw_type(*priority))
+		if (g_hw_cache[index].codec_id == m_decoder_codec->id)
 		{
-			int ret = av_hwdevice_ctx_create(&hwCtx, *priority, NULL, NULL, 0);
-			if (ret == 0)
+			break;
+		}
+	}
+
+	if (index == g_hw_cache.size())
+	{
+		HwDeviceCache cache;
+		cache.codec_id = m_decoder_codec->id;
+		cache.device = NULL;
+		cache.pix_fmt = AV_PIX_FMT_NONE;
+
+		enum AVHWDeviceType *priority = hw_priorities;
+		while (*priority != AV_HWDEVICE_TYPE_NONE)
+		{
+			enum AVPixelFormat pixFmt;
+			if (has_hw_type(*priority, pixFmt))
 			{
-				break;
+				int ret = av_hwdevice_ctx_create(&cache.device, *priority, NULL, NULL, 0);
+				if (ret == 0)
+				{
+					cache.pix_fmt = pixFmt;
+					break;
+				}
 			}
+			priority++;
 		}
-		priority++;
+
+		g_hw_cache.push_back(cache);
 	}
 
-	if (hwCtx)
+	const HwDeviceCache& cache = g_hw_cache[index];
+	if (!cache.device)
 	{
-		m_hw_ctx = hwCtx;
-		m_decoder_context->hw_device_ctx = av_buffer_ref(hwCtx);
-		return true;
+		return false;
 	}
 
-	return false;
+	m_hw_ctx = av_buffer_ref(cache.device);
+	if (!m_hw_ctx)
+	{
+		return false;
+	}
+
+	m_hw_pix_fmt = cache.pix_fmt;
+	m_decoder_context->hw_device_ctx = av_buffer_ref(cache.device);
+	return m_decoder_context->hw_device_ctx != NULL;
 }
 
-bool FFmpegDecoder::has_hw_type(enum AVHWDeviceType type)
+bool FFmpegDecoder::has_hw_type(enum AVHWDeviceType type, enum AVPixelFormat& pix_fmt)
 {
 	for (int i = 0;; i++)
 	{
@@ -150,7 +267,7 @@ bool FFmpegDecoder::has_hw_type(enum AVHWDeviceType type)
 		if (config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX &&
 			config->device_type == type)
 		{
-			hw_pix_fmt = config->pix_fmt;
+			pix_fmt = config->pix_fmt;
 			return true;
 		}
 	}
@@ -158,6 +275,52 @@ bool FFmpegDecoder::has_hw_type(enum AVHWDeviceType type)
 	return false;
 }
 
+bool FFmpegDecoder::reset()
+{
+	if (!m_initialized)
+	{
+		return false;
+	}
+
+	avcodec_flush_buffers(m_decoder_context);
+	m_eof = false;
+	m_waiting_key_frame = true;
+	m_key_frame_request_time = 0;
+	// the callback belongs to the previous stream, its opaque may be freed already
+	m_resync = false;
+	m_dropped_frames = 0;
+	m_key_frame_callback = NULL;
+	m_key_frame_opaque = NULL;
+
+	for (int i = 0; i < DECODER_SEI_QUEUE_SIZE; i++)
+	{
+		m_sei_entries[i].valid = false;
+	}
+	m_frame_has_sei = false;
+
+	return true;
+}
+
+void FFmpegDecoder::start_resync()
+{
+	if (!m_resync || m_waiting_key_frame)
+	{
+		return;
+	}
+
+	m_waiting_key_frame = true;
+	request_key_frame();
+}
+
+void FFmpegDecoder::request_key_frame()
+{
+	m_key_frame_request_time = av_gettime_relative();
+	if (m_key_frame_callback)
+	{
+		m_key_frame_callback(m_key_frame_opaque);
+	}
+}
+
 bool FFmpegDecoder::validate(enum AVCodecID id)
 {
 	if (!m_initialized)
@@ -207,9 +370,10 @@ bool FFmpegDecoder::free_context()
 
 	if (m_sws_frame_buffer)
 	{
-		av_free(m_sws_frame_buffer);
+		m_memory.deallocate(m_sws_frame_buffer, m_sws_frame_buffer_size);
 		m_sws_frame_buffer = NULL;
 	}
+	m_sws_frame_buffer_size = 0;
 
 	if (m_sws_context)
 	{
@@ -217,6 +381,15 @@ bool FFmpegDecoder::free_context()
 		m_sws_context = NULL;
 	}
 
+	for (int i = 0; i < DECODER_SEI_QUEUE_SIZE; i++)
+	{
+		m_sei_entries[i].valid = false;
+	}
+	m_frame_has_sei = false;
+
+	m_eof = false;
+	m_waiting_key_frame = true;
+	m_key_frame_request_time = 0;
 	m_initialized = false;
 
 	return true;
@@ -224,6 +397,13 @@ bool FFmpegDecoder::free_context()
 
 bool FFmpegDecoder::send_video_data(uint8_t* data, size_t size, long long timestamp)
 {
+	CodecStatus status = send_packet(data, size, timestamp);
+	return status == CODEC_OK || status == CODEC_AGAIN;
+}
+
+CodecStatus FFmpegDecoder::send_packet(uint8_t* data, size_t size, long long timestamp)
+{
+	CodecTraceScope trace("decoder.send_packet", m_trace_id);
 	AVPacket packet = { 0 };
 	int ret;
 
@@ -237,66 +417,157 @@ bool FFmpegDecoder::send_video_data(uint8_t* data, size_t size, long long timest
 	packet.size = (int)size;
 	packet.pts = timestamp;
 
-	if (m_decoder_codec->id == AV_CODEC_ID_H264 && avc_find_key_frame(data, size))
+	bool keyFrame = m_decoder_codec->id == AV_CODEC_ID_H264 && avc_find_key_frame(data, size);
+	if (keyFrame)
 	{
 		packet.flags |= AV_PKT_FLAG_KEY;
 	}
 
-	if (!m_frame)
+	if (m_resync && m_waiting_key_frame && m_decoder_codec->id == AV_CODEC_ID_H264)
 	{
-		m_frame = av_frame_alloc();
-		if (!m_frame)
+		if (!keyFrame && !avc_find_recovery_point(data, size))
 		{
-			return false;
+			// it would only be decoded into a concealed or corrupted frame
+			m_dropped_frames++;
+			if (av_gettime_relative() - m_key_frame_request_time >= DECODER_KEY_FRAME_REQUEST_INTERVAL_US)
+			{
+				request_key_frame();
+			}
+			return CODEC_OK;
 		}
+		m_waiting_key_frame = false;
 	}
 
-	if (m_hw_available && !m_hw_frame)
+	int64_t captureTime;
+	uint32_t sequence;
+	if (m_timestamp_sei && m_decoder_codec->id == AV_CODEC_ID_H264 &&
+		avc_find_timestamp_sei(data, size, captureTime, sequence))
 	{
-		m_hw_frame = av_frame_alloc();
-		if (!m_hw_frame)
-		{
-			return false;
-		}
+		SeiEntry& entry = m_sei_entries[m_sei_index];
+		entry.timestamp = timestamp;
+		entry.capture_time = captureTime;
+		entry.sequence = sequence;
+		entry.valid = true;
+		m_sei_index = (m_sei_index + 1) % DECODER_SEI_QUEUE_SIZE;
 	}
 
+	int64_t start = m_metrics.begin();
 	ret = avcodec_send_packet(m_decoder_context, &packet);
-	if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+	m_metrics.end(STAGE_SEND_PACKET, start);
+	if (ret == AVERROR(EAGAIN))
+	{
+		return CODEC_AGAIN;
+	}
+	else if (ret == AVERROR_EOF)
 	{
-		return true;
+		// the end of stream was sent, the decoder must be reset first
+		return CODEC_EOF;
 	}
 	else if (ret < 0)
+	{
+		m_metrics.add_error(ret);
+		start_resync();
+		return CODEC_ERROR;
+	}
+
+	m_metrics.add_packet_in(size);
+	return CODEC_OK;
+}
+
+bool FFmpegDecoder::send_end_of_stream()
+{
+	if (!m_initialized)
 	{
 		return false;
 	}
 
+	int ret = avcodec_send_packet(m_decoder_context, NULL);
+	if (ret < 0 && ret != AVERROR_EOF)
+	{
+		m_metrics.add_error(ret);
+		return false;
+	}
+
 	return true;
 }
 
-AVFrame* FFmpegDecoder::receive_frame()
+bool FFmpegDecoder::decode_frame()
 {
+	if (!m_initialized)
+	{
+		return false;
+	}
+
 	AVFrame* retFrame = m_hw_available ? m_hw_frame : m_frame;
-	int ret = avcodec_receive_frame(m_decoder_context, retFrame);
-	if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN))
+	int64_t start;
+	int ret;
+	while (true)
 	{
-		return NULL;
+		start = m_metrics.begin();
+		ret = avcodec_receive_frame(m_decoder_context, retFrame);
+		m_metrics.end(STAGE_RECEIVE_FRAME, start);
+		if (ret == AVERROR_EOF)
+		{
+			m_eof = true;
+			return false;
+		}
+		else if (ret == AVERROR(EAGAIN))
+		{
+			return false;
+		}
+		else if (ret < 0)
+		{
+			m_metrics.add_error(ret);
+			start_resync();
+			return false;
+		}
+
+		m_metrics.add_frame_out();
+
+		if (m_resync && ((retFrame->flags & AV_FRAME_FLAG_CORRUPT) || retFrame->decode_error_flags))
+		{
+			// don't pass the concealed frame downstream, wait for the next key frame
+			m_dropped_frames++;
+			start_resync();
+			av_frame_unref(retFrame);
+			continue;
+		}
+		break;
 	}
-	else if (ret < 0)
+
+	m_frame_has_sei = false;
+	if (m_timestamp_sei)
 	{
-		return NULL;
+		update_frame_latency(retFrame->pts);
 	}
 
 	if (m_hw_available)
 	{
 		// retrieve data from GPU to CPU
+		CodecTraceScope transferTrace("decoder.hwframe_transfer", m_trace_id);
+		start = m_metrics.begin();
 		ret = av_hwframe_transfer_data(m_frame, m_hw_frame, 0);
+		m_metrics.end(STAGE_HW_TRANSFER, start);
 		if (ret < 0)
 		{
-			return NULL;
+			m_metrics.add_error(ret);
+			return false;
 		}
+		m_frame->pts = m_hw_frame->pts;
 	}
 
-	if (m_frame->format != AV_PIX_FMT_YUV420P)
+	return true;
+}
+
+AVFrame* FFmpegDecoder::receive_frame()
+{
+	CodecTraceScope trace("decoder.receive_frame", m_trace_id);
+	if (!decode_frame())
+	{
+		return NULL;
+	}
+
+	if (m_frame->format != AV_PIX_FMT_YUV420P || m_scale_reduce)
 	{
 		if (scale_frame())
 		{
@@ -311,14 +582,97 @@ AVFrame* FFmpegDecoder::receive_frame()
 	return NULL;
 }
 
+bool FFmpegDecoder::receive_frame(uint8_t* const data[], const int linesize[], int max_width, int max_height,
+	int& width, int& height, int64_t& pts, bool& dropped)
+{
+	CodecTraceScope trace("decoder.receive_frame", m_trace_id);
+	dropped = false;
+	if (!decode_frame())
+	{
+		return false;
+	}
+
+	dropped = true;
+	get_output_size(width, height);
+	if (width > max_width || height > max_height)
+	{
+		return false;
+	}
+
+	if (m_frame->format == AV_PIX_FMT_YUV420P && !m_scale_reduce)
+	{
+		uint8_t* dst[4] = { data[0], data[1], data[2], NULL };
+		int dstLinesize[4] = { linesize[0], linesize[1], linesize[2], 0 };
+		av_image_copy(dst, dstLinesize, (const uint8_t **)m_frame->data, m_frame->linesize,
+			AV_PIX_FMT_YUV420P, width, height);
+	}
+	else if (!convert_frame(data, linesize, width, height))
+	{
+		return false;
+	}
+
+	pts = m_frame->pts;
+	dropped = false;
+	return true;
+}
+
+void FFmpegDecoder::update_frame_latency(int64_t pts)
+{
+	for (int i = 0; i < DECODER_SEI_QUEUE_SIZE; i++)
+	{
+		SeiEntry& entry = m_sei_entries[i];
+		if (entry.valid && entry.timestamp == pts)
+		{
+			m_frame_has_sei = true;
+			m_frame_latency = av_gettime() - entry.capture_time;
+			m_frame_sequence = entry.sequence;
+			entry.valid = false;
+			return;
+		}
+	}
+}
+
+void FFmpegDecoder::get_output_size(int& width, int& height) const
+{
+	width = m_frame->width;
+	height = m_frame->height;
+	if (m_scale_reduce)
+	{
+		width = (width + (1 << m_reduce) - 1) >> m_reduce;
+		height = (height + (1 << m_reduce) - 1) >> m_reduce;
+	}
+}
+
+bool FFmpegDecoder::convert_frame(uint8_t* const data[], const int linesize[], int width, int height)
+{
+	// averages the source pixels when scaling down, the bilinear filter only samples a few of them
+	int flags = (width != m_frame->width || height != m_frame->height) ? SWS_AREA : SWS_FAST_BILINEAR;
+	m_sws_context = sws_getCachedContext(m_sws_context,
+		m_frame->width, m_frame->height, (AVPixelFormat)m_frame->format, width, height,
+		AV_PIX_FMT_YUV420P, flags, NULL, NULL, NULL);
+	if (!m_sws_context)
+	{
+		return false;
+	}
+
+	CodecTraceScope scaleTrace("decoder.sws_scale", m_trace_id);
+	int64_t start = m_metrics.begin();
+	sws_scale(m_sws_context, (const uint8_t * const *)m_frame->data, m_frame->linesize,
+		0, m_frame->height, data, linesize);
+	m_metrics.end(STAGE_SWS_SCALE, start);
+	return true;
+}
+
 bool FFmpegDecoder::scale_frame()
 {
 	int ret;
-	m_sws_context = sws_getCachedContext(m_sws_context,
-		m_frame->width, m_frame->height, (AVPixelFormat)m_frame->format, m_frame->width, m_frame->height,
-		AV_PIX_FMT_YUV420P, SWS_FAST_BILINEAR, NULL, NULL, NULL);
-	if (m_sws_context)
+	int width;
+	int height;
+	get_output_size(width, height);
+
+	if (!m_sws_frame || m_sws_frame->width != width || m_sws_frame->height != height)
 	{
+		CodecTraceScope allocTrace("decoder.sws_alloc", m_trace_id);
 		if (!m_sws_frame)
 		{
 			m_sws_frame = av_frame_alloc();
@@ -326,33 +680,46 @@ bool FFmpegDecoder::scale_frame()
 			{
 				return false;
 			}
-			ret = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, m_frame->width, m_frame->height, 1);
-			if (ret < 0)
-			{
-				return false;
-			}
-			m_sws_frame_buffer = (uint8_t *)av_malloc(ret);
+		}
+		ret = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, width, height, 1);
+		if (ret < 0)
+		{
+			return false;
+		}
+		// the buffer is kept when the size goes down
+		if (ret > m_sws_frame_buffer_size)
+		{
+			// the old buffer is freed first to stay under the memory limit, the frame must not
+			// point at it if the new one fails, the next frame allocates again
+			memset(m_sws_frame->data, 0, sizeof(m_sws_frame->data));
+			m_sws_frame->width = 0;
+			m_sws_frame->height = 0;
+			m_memory.deallocate(m_sws_frame_buffer, m_sws_frame_buffer_size);
+			m_sws_frame_buffer = NULL;
+			m_sws_frame_buffer_size = 0;
+			m_sws_frame_buffer = (uint8_t *)m_memory.allocate(ret);
 			if (!m_sws_frame_buffer)
 			{
 				return false;
 			}
-			ret = av_image_fill_arrays(m_sws_frame->data, m_sws_frame->linesize, m_sws_frame_buffer,
-				AV_PIX_FMT_YUV420P, m_frame->width, m_frame->height, 1);
-			if (ret < 0)
-			{
-				return false;
-			}
+			m_sws_frame_buffer_size = ret;
 		}
-
-		sws_scale(m_sws_context, (const uint8_t * const *)m_frame->data, m_frame->linesize,
-			0, m_frame->height, m_sws_frame->data, m_sws_frame->linesize);
-		m_sws_frame->width = m_frame->width;
-		m_sws_frame->height = m_frame->height;
+		ret = av_image_fill_arrays(m_sws_frame->data, m_sws_frame->linesize, m_sws_frame_buffer,
+			AV_PIX_FMT_YUV420P, width, height, 1);
+		if (ret < 0)
+		{
+			return false;
+		}
+		m_sws_frame->width = width;
+		m_sws_frame->height = height;
 		m_sws_frame->format = AV_PIX_FMT_YUV420P;
-		return true;
 	}
-	else
+
+	if (!convert_frame(m_sws_frame->data, m_sws_frame->linesize, width, height))
 	{
 		return false;
 	}
+
+	m_sws_frame->pts = m_frame->pts;
+	return true;
 }
\ No newline at end of file
@@ -6,14 +6,29 @@ extern "C"
 #include <libavcodec/avcodec.h>
 #include <libswscale/swscale.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/time.h>
 }
 
+#include "codec_utils.h"
+#include "codec_metrics.h"
+#include "codec_memory.h"
+#include "codec_placement.h"
+#include "codec_trace.h"
+
+//the packets waiting in the decoder with their timestamp SEI
+constexpr int DECODER_SEI_QUEUE_SIZE = 32;
+
+//the key frame request is repeated at this interval while waiting for it
+constexpr int64_t DECODER_KEY_FRAME_REQUEST_INTERVAL_US = 500000;
+
 /**
 * ffmpeg decoder
 */
 class FFmpegDecoder
 {
 public:
+	typedef void (*KeyFrameRequestCallback)(void* opaque);
+
 	FFmpegDecoder();
 	virtual ~FFmpegDecoder();
 
@@ -30,11 +45,64 @@ public:
 
 	/**
 	 * @brief initialize from the code id
+	 *
+	 * @param id -- the codec id
+	 *        reduce -- the output is 1/2^reduce of the coded size in each dimension, 0 ~ 3.
+	 *                  the codec lowres option is used if the codec supports it(e.g. mjpeg),
+	 *                  otherwise(e.g. h264) the decoded frame is scaled down by sws_scale
+	 *                  straight into a reused YUV420P buffer
 	 * 
 	 * @return true -- initialize successful
 	 *         false -- initialize failed
 	 */
-	bool init(enum AVCodecID id);
+	bool init(enum AVCodecID id, int reduce = 0);
+
+	/**
+	 * @brief set the codec thread count used by the next init(), the default is 4
+	 */
+	void set_thread_count(int count)
+	{
+		m_thread_count = count;
+	}
+
+	int get_thread_count() const
+	{
+		return m_thread_count;
+	}
+
+	/**
+	 * @brief bind the codec threads to the CPUs and the buffers to the NUMA node of the
+	 * placement, it's used by the next init(). see CodecPlacement
+	 */
+	void set_placement(const CodecPlacement& placement)
+	{
+		m_placement = placement;
+	}
+
+	const CodecPlacement& get_placement() const
+	{
+		return m_placement;
+	}
+
+	enum AVCodecID get_codec_id() const
+	{
+		return m_decoder_codec ? m_decoder_codec->id : AV_CODEC_ID_NONE;
+	}
+
+	int get_reduce() const
+	{
+		return m_reduce;
+	}
+
+	/**
+	 * @brief drop the buffered data and frames by avcodec_flush_buffers, the decoder is
+	 * ready for a new stream of the same codec without init(). the resync settings of the
+	 * stream(set_resync, set_key_frame_callback, get_dropped_frames) are cleared
+	 *
+	 * @return true -- successful
+	 *         false -- not initialized
+	 */
+	bool reset();
 
 	/**
 	* @brief if the decoder supports codecid
@@ -50,9 +118,40 @@ public:
 	* @param data -- the video data
 	*        size -- the data size
 	*        timestamp -- the timestamp
+	*
+	* @return true -- successful, also when the decoder is full and the data wasn't taken
+	*         false -- failed
 	*/
 	bool send_video_data(uint8_t* data, size_t size, long long timestamp);
 
+	/**
+	* @brief send video data, like send_video_data but the backpressure is reported
+	*
+	* @return CODEC_OK -- taken
+	*         CODEC_AGAIN -- the decoder is full, call receive_frame until NULL and send it again
+	*         CODEC_EOF -- send_end_of_stream was called, reset() first
+	*         CODEC_ERROR -- failed
+	*/
+	CodecStatus send_packet(uint8_t* data, size_t size, long long timestamp);
+
+	/**
+	* @brief signal the end of stream, so the decoder outputs all the buffered frames.
+	* after that, call receive_frame until it returns NULL and is_end_of_stream() is true,
+	* then reset() for the next stream.
+	*
+	* @return true -- successful
+	*         false -- failed
+	*/
+	bool send_end_of_stream();
+
+	/**
+	* @brief all the frames were received after send_end_of_stream
+	*/
+	bool is_end_of_stream() const
+	{
+		return m_eof;
+	}
+
 	/**
 	* @brief receive the decoded frame
 	* @return the AVFrame pointer, if failed, returns NULL.
@@ -62,24 +161,189 @@ public:
 	*/
 	AVFrame* receive_frame();
 
+	/**
+	* @brief receive the decoded frame as YUV420P straight into the caller's planes, e.g. the
+	* slot of a ShmFrameWriter. the frame is converted or copied once, without the internal frame.
+	*
+	* @param data -- the target planes
+	*        linesize -- the target line sizes
+	*        max_width, max_height -- the capacity of the target
+	*        width, height -- [output] the frame size, see the reduce of init
+	*        pts -- [output] the timestamp sent with the frame
+	*        dropped -- [output] false is no frame(like receive_frame() returning NULL), true is
+	*                   a frame was decoded but doesn't fit or failed to convert. the planes
+	*                   aren't written in both cases, e.g. ShmFrameWriter::abort_frame
+	*
+	* @return true -- a frame was written
+	*         false -- no frame was written, see dropped
+	*/
+	bool receive_frame(uint8_t* const data[], const int linesize[], int max_width, int max_height,
+		int& width, int& height, int64_t& pts, bool& dropped);
+
+	/**
+	* @brief extract the latency tracing SEI(see avc_find_timestamp_sei) from the H264 packets
+	*
+	* @param enabled -- on or off, the default is off
+	*/
+	void set_timestamp_sei(bool enabled)
+	{
+		m_timestamp_sei = enabled;
+	}
+
+	/**
+	* @brief the latency of the last frame returned by receive_frame, from the
+	* capture time in its SEI to the time it was decoded
+	*
+	* @param latency_us -- [output] the latency, microseconds
+	*        sequence -- [output] the sequence number in the SEI
+	*
+	* @return true -- the frame has the timestamp SEI
+	*         false -- no SEI
+	*/
+	bool get_frame_latency(int64_t& latency_us, uint32_t& sequence) const
+	{
+		if (!m_frame_has_sei)
+		{
+			return false;
+		}
+
+		latency_us = m_frame_latency;
+		sequence = m_frame_sequence;
+		return true;
+	}
+
+	/**
+	* @brief the loss resync mode(H264 only), the default is off.
+	* after a gap signalled by notify_packet_loss, a decode error or a corrupted frame, the
+	* packets are dropped without decoding until an IDR frame or a recovery point SEI, and
+	* the corrupted frames aren't output. a new stream also waits for its first key frame.
+	*
+	* @param enabled -- on or off
+	*/
+	void set_resync(bool enabled)
+	{
+		m_resync = enabled;
+	}
+
+	/**
+	* @brief the callback to request a key frame from the sender(e.g. RTCP PLI) when the
+	* resync starts, it's repeated every DECODER_KEY_FRAME_REQUEST_INTERVAL_US while waiting.
+	* it's called from send_video_data or receive_frame.
+	*/
+	void set_key_frame_callback(KeyFrameRequestCallback callback, void* opaque)
+	{
+		m_key_frame_callback = callback;
+		m_key_frame_opaque = opaque;
+	}
+
+	/**
+	* @brief the caller lost packets, e.g. RtpFrame::discontinuity, so the next packets are
+	* dropped until a key frame in the resync mode
+	*/
+	void notify_packet_loss()
+	{
+		start_resync();
+	}
+
+	/**
+	* @brief if the packets are being dropped for the resync
+	*/
+	bool is_waiting_key_frame() const
+	{
+		return m_resync && m_waiting_key_frame;
+	}
+
+	/**
+	* @brief the count of the packets and the corrupted frames dropped by the resync
+	*/
+	uint64_t get_dropped_frames() const
+	{
+		return m_dropped_frames;
+	}
+
+	/**
+	* @brief set the stream id of the trace events of this decoder, see CodecTrace
+	*/
+	void set_trace_id(uint32_t id)
+	{
+		m_trace_id = id;
+	}
+
+	/**
+	* @brief the metrics of this decoder
+	*/
+	CodecMetrics& get_metrics()
+	{
+		return m_metrics;
+	}
+
+	/**
+	* @brief the memory accounting of this decoder, e.g. a memory limit
+	*/
+	CodecMemory& get_memory()
+	{
+		return m_memory;
+	}
+
 private:
 	bool free_context();
+	bool decode_frame();
+	void get_output_size(int& width, int& height) const;
+	bool convert_frame(uint8_t* const data[], const int linesize[], int width, int height);
 	bool scale_frame();
 
 	bool init_hw_decoder();
-	bool has_hw_type(enum AVHWDeviceType type);
+	bool has_hw_type(enum AVHWDeviceType type, enum AVPixelFormat& pix_fmt);
+	void update_frame_latency(int64_t pts);
+	void start_resync();
+	void request_key_frame();
 private:
 	bool m_initialized;
+	bool m_eof;
 	bool m_hw_available;
 	AVCodecContext* m_decoder_context;
 	AVCodec* m_decoder_codec;
 
 	AVBufferRef* m_hw_ctx;
+	enum AVPixelFormat m_hw_pix_fmt;
 	AVFrame* m_hw_frame;
 	AVFrame* m_frame;
 	AVFrame* m_sws_frame;
 	uint8_t* m_sws_frame_buffer;
+	int m_sws_frame_buffer_size;
 	SwsContext* m_sws_context;
+
+	// the reduced output, see init
+	int m_reduce;
+	bool m_scale_reduce;
+	int m_thread_count;
+	CodecPlacement m_placement;
+
+	CodecMetrics m_metrics;
+	CodecMemory m_memory;
+	uint32_t m_trace_id;
+
+	bool m_resync;
+	bool m_waiting_key_frame;
+	uint64_t m_dropped_frames;
+	int64_t m_key_frame_request_time;
+	KeyFrameRequestCallback m_key_frame_callback;
+	void* m_key_frame_opaque;
+
+	struct SeiEntry
+	{
+		long long timestamp;
+		int64_t capture_time;
+		uint32_t sequence;
+		bool valid;
+	};
+
+	bool m_timestamp_sei;
+	SeiEntry m_sei_entries[DECODER_SEI_QUEUE_SIZE];
+	int m_sei_index;
+	bool m_frame_has_sei;
+	int64_t m_frame_latency;
+	uint32_t m_frame_sequence;
 };
 
 #endif
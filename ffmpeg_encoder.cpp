@@ -1,39 +1,128 @@
 #include "ffmpeg_encoder.h"
-#include <new>
+#include <algorithm>
 
 namespace
 {
-#ifdef USE_HARDWARE_ENCODER
-	//hardware encoder name
-	const char *g_enc_name = "h264_vaapi";  //h264_qsv, h264_nvenc, h264_vaapi, h264_dxva2
-	enum AVHWDeviceType g_hw_device_type = AV_HWDEVICE_TYPE_VAAPI; //AV_HWDEVICE_TYPE_DXVA2, AV_HWDEVICE_TYPE_QSV, AV_HWDEVICE_TYPE_VAAPI, AV_HWDEVICE_TYPE_CUDA
-	AVPixelFormat g_hw_pixel_format = AV_PIX_FMT_VAAPI; //AV_PIX_FMT_DXVA2_VLD,  AV_PIX_FMT_VAAPI, AV_PIX_FMT_CUDA, AV_PIX_FMT_QSV
-#endif
-
 	//get the milliseconds
 	static int64_t GetTime()
 	{
 		return av_gettime_relative() / 1000;
 	}
 
+	AVRegionOfInterest make_region(int left, int top, int right, int bottom, int qpOffset)
+	{
+		AVRegionOfInterest region;
+		region.self_size = sizeof(AVRegionOfInterest);
+		region.left = left;
+		region.top = top;
+		region.right = right;
+		region.bottom = bottom;
+		// libx264 scales the offset by its QP range(51 for 8 bit), so it's the QP offset there
+		region.qoffset.num = std::max(-51, std::min(51, qpOffset));
+		region.qoffset.den = 51;
+		return region;
+	}
+
+	// merge the blocks of the importance map into rectangles: the runs of the same offset in
+	// a row, extended down while the next row has the same run
+	void append_map_regions(const int8_t* map, int width, int height, std::vector<AVRegionOfInterest>& regions)
+	{
+		int mbWidth = (width + ENCODER_MB_SIZE - 1) / ENCODER_MB_SIZE;
+		int mbHeight = (height + ENCODER_MB_SIZE - 1) / ENCODER_MB_SIZE;
+
+		// the regions ending at the current row
+		std::vector<size_t> previous;
+		std::vector<size_t> current;
+		for (int y = 0; y < mbHeight; y++)
+		{
+			const int8_t* row = map + (size_t)y * mbWidth;
+			int top = y * ENCODER_MB_SIZE;
+			int bottom = std::min(top + ENCODER_MB_SIZE, height);
+
+			current.clear();
+			for (int x = 0; x < mbWidth;)
+			{
+				int start = x;
+				int8_t offset = row[x];
+				while (x < mbWidth && row[x] == offset)
+				{
+					x++;
+				}
+
+				if (offset == 0)
+				{
+					continue;
+				}
+
+				AVRegionOfInterest run = make_region(start * ENCODER_MB_SIZE, top,
+					std::min(x * ENCODER_MB_SIZE, width), bottom, offset);
+				size_t index = regions.size();
+				for (size_t i = 0; i < previous.size(); i++)
+				{
+					const AVRegionOfInterest& region = regions[previous[i]];
+					if (region.left == run.left && region.right == run.right && region.qoffset.num == run.qoffset.num)
+					{
+						index = previous[i];
+						break;
+					}
+				}
+
+				if (index < regions.size())
+				{
+					regions[index].bottom = bottom;
+				}
+				else
+				{
+					regions.push_back(run);
+				}
+				current.push_back(index);
+			}
+
+			previous.swap(current);
+		}
+	}
+
 }
 FFmpegEncoder::FFmpegEncoder()
+	: m_metrics("encoder"), m_memory(m_metrics)
 {
 	m_encoder_context = NULL;
 	m_encoder_codec = NULL;
 	m_frame = NULL;
+	m_ref_frame = NULL;
 	m_packet = NULL;
 
 	m_buffer = NULL;
 	m_buffer_used_len = 0;
 
-#ifdef USE_HARDWARE_ENCODER
+	m_policy = ENCODER_POLICY_DEFAULT;
+	m_backend = NULL;
+
 	m_hw_ctx = NULL;
 	m_hw_frame = NULL;
+	m_upload_frame = NULL;
+	m_upload_sws = NULL;
 	m_hw_available = false;
-#endif
 
 	m_pts = 0;
+	m_thread_count = 0;
+	m_preset = "ultrafast";
+	m_force_key_frame = false;
+	m_intra_refresh = false;
+	m_refresh_period = ENCODER_GOP_SIZE;
+	m_bit_rate = ENCODER_BIT_RATE;
+	m_roi_encoding = false;
+
+	m_timestamp_sei = false;
+	m_capture_time = 0;
+	m_sei_sequence = 0;
+	m_sei_packet = NULL;
+	m_trace_id = 0;
+
+	m_width = 0;
+	m_height = 0;
+	m_pixel_format = AV_PIX_FMT_NONE;
+	m_eof = false;
 	
 	m_initialized = false;
 }
@@ -45,7 +134,7 @@ FFmpegEncoder::~FFmpegEncoder()
 
 bool FFmpegEncoder::init(int width, int height, AVPixelFormat pixelFormat)
 {
-	int ret;
+	CodecTraceScope trace("encoder.init", m_trace_id);
 
 	free_context();
 
@@ -54,54 +143,109 @@ bool FFmpegEncoder::init(int width, int height, AVPixelFormat pixelFormat)
 		return false;
 	}
 
-	m_buffer = new (std::nothrow) uint8_t[ENCODER_BUFFER_SIZE];
+	if (m_placement.node >= 0)
+	{
+		m_memory.set_allocator(CodecNumaAllocator::get(m_placement.node));
+	}
+
+	m_buffer = (uint8_t *)m_memory.allocate(ENCODER_BUFFER_SIZE);
 	if (!m_buffer)
 	{
 		return false;
 	}
 
-#ifdef USE_HARDWARE_ENCODER
-	ret = av_hwdevice_ctx_create(&m_hw_ctx, g_hw_device_type, NULL, NULL, 0);
-	if (ret == 0)
+	// alloc packet and frame
+	m_packet = av_packet_alloc();
+	if (!m_packet)
+	{
+		return false;
+	}
+
+	m_sei_packet = av_packet_alloc();
+	if (!m_sei_packet)
 	{
-		m_hw_available = true;
+		return false;
+	}
 
-		m_encoder_codec = avcodec_find_encoder_by_name(g_enc_name);
-		if (!m_encoder_codec)
+	// the x264 intra refresh and the regions of interest aren't supported by all the encoders
+	int capabilities = (m_intra_refresh ? ENCODER_CAP_INTRA_REFRESH : 0) | (m_roi_encoding ? ENCODER_CAP_ROI : 0);
+	std::vector<const EncoderBackend*> candidates;
+	EncoderRegistry::select(m_policy, m_backend_name.empty() ? NULL : m_backend_name.c_str(),
+		capabilities, candidates);
+	for (size_t i = 0; i < candidates.size(); i++)
+	{
+		if (open_backend(candidates[i], width, height, pixelFormat))
 		{
-			m_hw_available = false;
-			// find encoder
-			m_encoder_codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+			break;
 		}
+
+		// the next candidate, e.g. software when the GPU sessions are full
+		close_backend();
 	}
-	else
+
+	if (!m_backend)
 	{
-		char errStr[512] = { 0 };
-		av_strerror(ret, errStr, sizeof(errStr));
+		return false;
+	}
 
-		m_hw_available = false;
-		m_encoder_codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+	m_frame = av_frame_alloc();
+	if (!m_frame)
+	{
+		return false;
 	}
+	// Allocate new buffer(s) for audio or video data.
+	m_frame->format = pixelFormat;
+	m_frame->width = m_encoder_context->width;
+	m_frame->height = m_encoder_context->height;
 
-#else
-	m_encoder_codec = avcodec_find_encoder(AV_CODEC_ID_H264);
-#endif
+	// the reference of a refcounted frame from the caller, see send_frame(const AVFrame*)
+	m_ref_frame = av_frame_alloc();
+	if (!m_ref_frame)
+	{
+		return false;
+	}
 
-	if (!m_encoder_codec)
+	/**
+	ret = av_frame_get_buffer(frame, 0);
+	if (ret < 0)
 	{
+		LOG_ERROR("could not allocate the video frame data");
 		return false;
 	}
+	*/
 
-	// get the encoder context
-	m_encoder_context = avcodec_alloc_context3(m_encoder_codec);
-	if (!m_encoder_context)
+	for (int i = 0; i < ENCODER_SEI_QUEUE_SIZE; i++)
+	{
+		m_sei_entries[i].pts = -1;
+	}
+
+	m_pts = 0;
+	m_width = width;
+	m_height = height;
+	m_pixel_format = pixelFormat;
+	m_initialized = true;
+	return true;
+}
+
+bool FFmpegEncoder::open_backend(const EncoderBackend* backend, int width, int height, AVPixelFormat pixelFormat)
+{
+	int ret;
+
+	if (!EncoderRegistry::acquire(backend))
 	{
 		return false;
 	}
+	m_backend = backend;
 
-	// alloc packet and frame
-	m_packet = av_packet_alloc();
-	if (!m_packet)
+	m_encoder_codec = avcodec_find_encoder_by_name(backend->name);
+	if (!m_encoder_codec)
+	{
+		return false;
+	}
+
+	// get the encoder context
+	m_encoder_context = avcodec_alloc_context3(m_encoder_codec);
+	if (!m_encoder_context)
 	{
 		return false;
 	}
@@ -121,43 +265,60 @@ bool FFmpegEncoder::init(int width, int height, AVPixelFormat pixelFormat)
 	// if frame->pict_type is AV_PICTURE_TYPE_I, then gop_size is ignored and
 	// the output of encoder will always be I frame irrespective to gop_size.
 	// I frame interval
-	m_encoder_context->gop_size = 25;
+	m_encoder_context->gop_size = m_intra_refresh ? m_refresh_period : ENCODER_GOP_SIZE;
 	// if you don't need b frame, then set to 0
 	m_encoder_context->max_b_frames = 0;
 	m_encoder_context->pix_fmt = pixelFormat;
 	// put sample parameters
-	m_encoder_context->bit_rate = 400000;
+	m_encoder_context->bit_rate = m_bit_rate;
+	m_encoder_context->thread_count = m_thread_count;
 
-	ret = av_opt_set(m_encoder_context->priv_data, "preset", "ultrafast", 0);  //default value is slow. ultrafastsuperfastveryfastfasterfastmediumslowslowerveryslowplacebo
-	if (ret != 0)
-	{
-	}
-	ret = av_opt_set(m_encoder_context->priv_data, "profile", "baseline", 0); // baselinemainhighhigh10high422high444
-	if (ret != 0)
+	if (backend->capabilities & ENCODER_CAP_X264_OPTIONS)
 	{
+		ret = av_opt_set(m_encoder_context->priv_data, "preset", m_preset.c_str(), 0);  //default value is slow. ultrafastsuperfastveryfastfasterfastmediumslowslowerveryslowplacebo
+		if (ret != 0)
+		{
+		}
+		ret = av_opt_set(m_encoder_context->priv_data, "profile", "baseline", 0); // baselinemainhighhigh10high422high444
+		if (ret != 0)
+		{
+		}
+		ret = av_opt_set(m_encoder_context->priv_data, "tune", "zerolatency", 0);
+		// the requested key frames are IDR frames
+		ret = av_opt_set(m_encoder_context->priv_data, "forced-idr", "1", 0);
+		if (m_intra_refresh)
+		{
+			// gop_size is the sweep length, only the first frame is an IDR frame
+			ret = av_opt_set(m_encoder_context->priv_data, "intra-refresh", "1", 0);
+			// one frame of VBV buffer, each frame gets about bit_rate / fps
+			m_encoder_context->rc_max_rate = m_encoder_context->bit_rate;
+			m_encoder_context->rc_buffer_size = (int)(m_encoder_context->bit_rate *
+				m_encoder_context->framerate.den / m_encoder_context->framerate.num);
+		}
+		if (m_roi_encoding)
+		{
+			// libx264 applies the regions through the adaptive quantization
+			ret = av_opt_set(m_encoder_context->priv_data, "aq-mode", "variance", 0);
+		}
 	}
-	ret = av_opt_set(m_encoder_context->priv_data, "tune", "zerolatency", 0);
 	//ret = av_opt_set(m_encoder_context->priv_data, "tune", "film", 0); //  film, animation, grain, stillimage, psnr, ssim, fastdecode, zerolatency
 	//if (ret != 0)
 	//{
 	//	LOG_ERROR("av_opt_set tune failed");
 	//}
 
-#ifdef USE_HARDWARE_ENCODER
-	if (m_hw_available)
+	if (backend->hw_pixel_format != AV_PIX_FMT_NONE)
 	{
-		ret = set_hwframe_ctx(width, height);
-		if (ret < 0)
+		// the frames are uploaded to the shared device of the backend
+		m_hw_ctx = EncoderRegistry::get_device(backend);
+		if (!m_hw_ctx || set_hwframe_ctx(width, height) < 0)
 		{
-			m_hw_available = false;
+			return false;
 		}
 
-		if (m_hw_available)
-		{
-		//	m_encoder_context->pix_fmt = g_hw_pixel_format;
-		}
+		m_encoder_context->pix_fmt = backend->hw_pixel_format;
+		m_hw_available = true;
 	}
-#endif
 
 	// if H264 AV_CODEC_FLAG_GLOBAL_HEADER was set,
 	// the sps, pps, sei is in encoderContext->extradata.
@@ -166,7 +327,11 @@ bool FFmpegEncoder::init(int width, int height, AVPixelFormat pixelFormat)
 	//encoderContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
 	// open
-	ret = avcodec_open2(m_encoder_context, m_encoder_codec, NULL);
+	{
+		// the codec threads are created here and inherit the affinity
+		CodecAffinityScope affinity(m_placement.cpus);
+		ret = avcodec_open2(m_encoder_context, m_encoder_codec, NULL);
+	}
 	if (ret < 0)
 	{
 		char errStr[512] = { 0 };
@@ -175,52 +340,92 @@ bool FFmpegEncoder::init(int width, int height, AVPixelFormat pixelFormat)
 		return false;
 	}
 
-	m_frame = av_frame_alloc();
-	if (!m_frame)
-	{
-		return false;
-	}
-	// Allocate new buffer(s) for audio or video data.
-	m_frame->format = pixelFormat;
-	m_frame->width = m_encoder_context->width;
-	m_frame->height = m_encoder_context->height;
-
-	/**
-	ret = av_frame_get_buffer(frame, 0);
-	if (ret < 0)
-	{
-		LOG_ERROR("could not allocate the video frame data");
-		return false;
-	}
-	*/
-
-#ifdef USE_HARDWARE_ENCODER
 	if (m_hw_available)
 	{
-		if (!(m_hw_frame = av_frame_alloc())) 
+		if (!(m_hw_frame = av_frame_alloc()))
 		{
 			return false;
 		}
 
-		if ((ret = av_hwframe_get_buffer(m_encoder_context->hw_frames_ctx, m_hw_frame, 0)) < 0) 
+		if ((ret = av_hwframe_get_buffer(m_encoder_context->hw_frames_ctx, m_hw_frame, 0)) < 0)
 		{
 			return false;
 		}
 
-		if (!m_hw_frame->hw_frames_ctx) 
+		if (!m_hw_frame->hw_frames_ctx)
 		{
 			return false;
 		}
-	}
 
-#endif
+		// e.g. the YUV420P input of a NV12 surface
+		if (backend->upload_pixel_format != pixelFormat)
+		{
+			if (!(m_upload_frame = av_frame_alloc()))
+			{
+				return false;
+			}
+			m_upload_frame->format = backend->upload_pixel_format;
+			m_upload_frame->width = width;
+			m_upload_frame->height = height;
+			if (av_frame_get_buffer(m_upload_frame, 0) < 0)
+			{
+				return false;
+			}
+
+			m_upload_sws = sws_getCachedContext(NULL, width, height, pixelFormat, width, height,
+				backend->upload_pixel_format, SWS_POINT, NULL, NULL, NULL);
+			if (!m_upload_sws)
+			{
+				return false;
+			}
+		}
+	}
 
-	m_pts = 0;
-	m_initialized = true;
 	return true;
 }
 
-#ifdef USE_HARDWARE_ENCODER
+void FFmpegEncoder::close_backend()
+{
+	if (m_encoder_context)
+	{
+		avcodec_free_context(&m_encoder_context);
+		m_encoder_context = NULL;
+	}
+
+	if (m_hw_frame)
+	{
+		av_frame_free(&m_hw_frame);
+		m_hw_frame = NULL;
+	}
+
+	if (m_upload_frame)
+	{
+		av_frame_free(&m_upload_frame);
+		m_upload_frame = NULL;
+	}
+
+	if (m_upload_sws)
+	{
+		sws_freeContext(m_upload_sws);
+		m_upload_sws = NULL;
+	}
+
+	if (m_hw_ctx)
+	{
+		av_buffer_unref(&m_hw_ctx);
+		m_hw_ctx = NULL;
+	}
+
+	m_hw_available = false;
+
+	if (m_backend)
+	{
+		EncoderRegistry::release(m_backend);
+		m_backend = NULL;
+	}
+	m_encoder_codec = NULL;
+}
+
 int FFmpegEncoder::set_hwframe_ctx(int width, int height)
 {
 	AVBufferRef *hw_frames_ref;
@@ -233,8 +438,8 @@ int FFmpegEncoder::set_hwframe_ctx(int width, int height)
 	}
 
 	frames_ctx = (AVHWFramesContext *)(hw_frames_ref->data);
-	frames_ctx->format = g_hw_pixel_format;
-	frames_ctx->sw_format = AV_PIX_FMT_YUV420P;
+	frames_ctx->format = m_backend->hw_pixel_format;
+	frames_ctx->sw_format = m_backend->upload_pixel_format;
 	frames_ctx->width = width;
 	frames_ctx->height = height;
 	frames_ctx->initial_pool_size = 20;
@@ -254,71 +459,288 @@ int FFmpegEncoder::set_hwframe_ctx(int width, int height)
 	av_buffer_unref(&hw_frames_ref);
 	return err;
 }
-#endif
 
 bool FFmpegEncoder::send_video_data(int width, int height, uint8_t* data_p[], int linesize_p[])
 {
+	return send_frame(width, height, data_p, linesize_p) == CODEC_OK;
+}
+
+CodecStatus FFmpegEncoder::send_frame(int width, int height, uint8_t* data_p[], int linesize_p[])
+{
+	CodecTraceScope trace("encoder.send_frame", m_trace_id);
 	if (!m_initialized)
 	{
-		return false;
+		return CODEC_ERROR;
 	}
 
-	m_frame->pts = m_pts++;
 	for (int i = 0; i < 3; i++)
 	{
 		m_frame->data[i] = data_p[i];
 		m_frame->linesize[i] = linesize_p[i];
 	}
 
+	return send_source_frame(m_frame);
+}
+
+CodecStatus FFmpegEncoder::send_frame(const AVFrame* source)
+{
+	CodecTraceScope trace("encoder.send_frame", m_trace_id);
+	if (!m_initialized || !source->buf[0] || source->format != m_pixel_format ||
+		source->width != m_width || source->height != m_height)
+	{
+		return CODEC_ERROR;
+	}
+
+	// a new reference, avcodec_send_frame references it again instead of copying the planes
+	int err = av_frame_ref(m_ref_frame, source);
+	if (err < 0)
+	{
+		m_metrics.add_error(err);
+		return CODEC_ERROR;
+	}
+
+	CodecStatus status = send_source_frame(m_ref_frame);
+	av_frame_unref(m_ref_frame);
+	return status;
+}
+
+CodecStatus FFmpegEncoder::send_source_frame(AVFrame* source)
+{
+	source->pts = m_pts;
+	source->pict_type = m_force_key_frame ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+
+	if (m_timestamp_sei && source->pts >= 0)
+	{
+		SeiEntry& entry = m_sei_entries[source->pts % ENCODER_SEI_QUEUE_SIZE];
+		entry.pts = source->pts;
+		entry.capture_time = m_capture_time ? m_capture_time : av_gettime();
+		entry.sequence = m_sei_sequence;
+	}
+
 	int err;
-#ifdef USE_HARDWARE_ENCODER
+	int64_t start;
+	AVFrame* frame = source;
 	if (m_hw_available)
 	{
-		if ((err = av_hwframe_transfer_data(m_hw_frame, m_frame, 0)) < 0) 
+		CodecTraceScope transferTrace("encoder.hwframe_transfer", m_trace_id);
+		int64_t transferStart = m_metrics.begin();
+		AVFrame* upload = source;
+		if (m_upload_sws)
 		{
-			return false;
+			sws_scale(m_upload_sws, source->data, source->linesize, 0, source->height,
+				m_upload_frame->data, m_upload_frame->linesize);
+			upload = m_upload_frame;
 		}
-
-		err = avcodec_send_frame(m_encoder_context, m_hw_frame);
+		err = av_hwframe_transfer_data(m_hw_frame, upload, 0);
+		m_metrics.end(STAGE_HW_TRANSFER, transferStart);
 		if (err < 0)
 		{
-			return false;
+			m_metrics.add_error(err);
+			return CODEC_ERROR;
 		}
+		m_hw_frame->pts = source->pts;
+		m_hw_frame->pict_type = source->pict_type;
+		frame = m_hw_frame;
+	}
+
+	if (!m_regions.empty() && !attach_regions_of_interest(frame))
+	{
+		return CODEC_ERROR;
 	}
-	else
+
+	start = m_metrics.begin();
+	err = avcodec_send_frame(m_encoder_context, frame);
+	m_metrics.end(STAGE_SEND_FRAME, start);
+	// the encoder took its own reference, the frame is reused by the next call
+	av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+	if (err == AVERROR(EAGAIN))
 	{
-		err = avcodec_send_frame(m_encoder_context, m_frame);
-		if (err < 0)
+		// not taken, the pts and the key frame request stay for sending it again
+		return CODEC_AGAIN;
+	}
+	else if (err == AVERROR_EOF)
+	{
+		return CODEC_EOF;
+	}
+	else if (err < 0)
+	{
+		m_metrics.add_error(err);
+		return CODEC_ERROR;
+	}
+
+	m_pts++;
+	m_force_key_frame = false;
+	m_capture_time = 0;
+	m_regions.clear();
+	if (m_timestamp_sei)
+	{
+		m_sei_sequence++;
+	}
+
+	m_metrics.add_frame_in();
+	return CODEC_OK;
+}
+
+bool FFmpegEncoder::set_regions_of_interest(const EncoderRegion* regions, int count, const int8_t* importanceMap)
+{
+	m_regions.clear();
+	if (!m_initialized || !(m_backend->capabilities & ENCODER_CAP_ROI))
+	{
+		return false;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		// clip to the frame, the empty ones are dropped
+		int left = std::max(regions[i].left, 0);
+		int top = std::max(regions[i].top, 0);
+		int right = std::min(regions[i].right, m_width);
+		int bottom = std::min(regions[i].bottom, m_height);
+		if (left < right && top < bottom && regions[i].qp_offset != 0)
 		{
-			return false;
+			m_regions.push_back(make_region(left, top, right, bottom, regions[i].qp_offset));
 		}
 	}
-#else
-	err = avcodec_send_frame(m_encoder_context, m_frame);
-	if (err < 0)
+
+	if (importanceMap)
+	{
+		append_map_regions(importanceMap, m_width, m_height, m_regions);
+	}
+
+	return true;
+}
+
+bool FFmpegEncoder::attach_regions_of_interest(AVFrame* frame)
+{
+	size_t size = m_regions.size() * sizeof(AVRegionOfInterest);
+	AVFrameSideData* sideData = av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST, size);
+	if (!sideData)
 	{
+		m_metrics.add_error(AVERROR(ENOMEM));
 		return false;
 	}
-#endif
 
+	memcpy(sideData->data, m_regions.data(), size);
 	return true;
 }
 
+bool FFmpegEncoder::send_end_of_stream()
+{
+	CodecTraceScope trace("encoder.send_end_of_stream", m_trace_id);
+	if (!m_initialized)
+	{
+		return false;
+	}
+
+	int err = avcodec_send_frame(m_encoder_context, NULL);
+	if (err < 0 && err != AVERROR_EOF)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+bool FFmpegEncoder::reset()
+{
+	CodecTraceScope trace("encoder.reset", m_trace_id);
+	if (!m_initialized)
+	{
+		return false;
+	}
+
+#ifdef AV_CODEC_CAP_ENCODER_FLUSH
+	if (m_encoder_codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH)
+	{
+		avcodec_flush_buffers(m_encoder_context);
+		av_packet_unref(m_packet);
+
+		for (int i = 0; i < ENCODER_SEI_QUEUE_SIZE; i++)
+		{
+			m_sei_entries[i].pts = -1;
+		}
+		m_sei_sequence = 0;
+		m_capture_time = 0;
+
+		// the next stream starts with an IDR frame
+		m_force_key_frame = true;
+		m_pts = 0;
+		m_eof = false;
+		return true;
+	}
+#endif
+
+	// the encoder can't be flushed(e.g. libx264), it's opened again with the same settings
+	return init(m_width, m_height, m_pixel_format);
+}
+
 AVPacket* FFmpegEncoder::receive_packet()
 {
+	CodecTraceScope trace("encoder.receive_packet", m_trace_id);
+	int64_t start = m_metrics.begin();
 	int ret = avcodec_receive_packet(m_encoder_context, m_packet);
-	if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+	m_metrics.end(STAGE_RECEIVE_PACKET, start);
+	if (ret == AVERROR_EOF)
+	{
+		m_eof = true;
+		return NULL;
+	}
+	else if (ret == AVERROR(EAGAIN))
 	{
 		return NULL;
 	}
 	else if (ret < 0)
 	{
+		m_metrics.add_error(ret);
 		return NULL;
 	}
 
+	if (m_timestamp_sei)
+	{
+		// the packet is still usable without the SEI
+		insert_timestamp_sei();
+	}
+
+	m_metrics.add_packet_out(m_packet->size);
 	return m_packet;
 }
 
+bool FFmpegEncoder::insert_timestamp_sei()
+{
+	// a negative pts(see set_next_pts) has no entry
+	if (m_packet->pts < 0)
+	{
+		return false;
+	}
+
+	const SeiEntry& entry = m_sei_entries[m_packet->pts % ENCODER_SEI_QUEUE_SIZE];
+	if (entry.pts != m_packet->pts)
+	{
+		return false;
+	}
+
+	uint8_t sei[AVC_TIMESTAMP_SEI_MAX_SIZE];
+	size_t seiSize = avc_write_timestamp_sei(sei, entry.capture_time, entry.sequence);
+
+	// the SEI goes after the AUD, SPS and PPS, before the first slice
+	const uint8_t* slice = avc_find_first_slice(m_packet->data, m_packet->size);
+	size_t headerSize = slice - m_packet->data;
+
+	if (av_new_packet(m_sei_packet, m_packet->size + (int)seiSize) < 0)
+	{
+		return false;
+	}
+
+	memcpy(m_sei_packet->data, m_packet->data, headerSize);
+	memcpy(m_sei_packet->data + headerSize, sei, seiSize);
+	memcpy(m_sei_packet->data + headerSize + seiSize, slice, m_packet->size - headerSize);
+	av_packet_copy_props(m_sei_packet, m_packet);
+
+	av_packet_unref(m_packet);
+	av_packet_move_ref(m_packet, m_sei_packet);
+	return true;
+}
+
 void FFmpegEncoder::end_receive_packet()
 {
 	av_packet_unref(m_packet);
@@ -356,41 +778,39 @@ bool FFmpegEncoder::free_context()
 		m_frame = NULL;
 	}
 
-	if (m_packet)
+	if (m_ref_frame)
 	{
-		av_packet_free(&m_packet);
-		m_packet = NULL;
+		av_frame_free(&m_ref_frame);
+		m_ref_frame = NULL;
 	}
 
-	if (m_encoder_context)
-	{
-		avcodec_free_context(&m_encoder_context);
-		m_encoder_context = NULL;
-	}
-
-#ifdef USE_HARDWARE_ENCODER
-	if (m_hw_ctx)
+	if (m_packet)
 	{
-		av_buffer_unref(&m_hw_ctx);
-		m_hw_ctx = NULL;
+		av_packet_free(&m_packet);
+		m_packet = NULL;
 	}
 
-	if (m_hw_frame)
+	if (m_sei_packet)
 	{
-		av_frame_free(&m_hw_frame);
-		m_hw_frame = NULL;
+		av_packet_free(&m_sei_packet);
+		m_sei_packet = NULL;
 	}
 
-	m_hw_available = false;
-#endif
+	// the codec context, the hardware frames and the backend session
+	close_backend();
 
 	if (m_buffer)
 	{
-		delete[] m_buffer;
+		m_memory.deallocate(m_buffer, ENCODER_BUFFER_SIZE);
 		m_buffer = NULL;
 	}
 
 	m_pts = 0;
+	m_force_key_frame = false;
+	m_capture_time = 0;
+	m_sei_sequence = 0;
+	m_regions.clear();
+	m_eof = false;
 	m_initialized = false;
 
 	return true;
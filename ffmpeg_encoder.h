@@ -1,6 +1,9 @@
 #ifndef _H_FFMPEG_ENCODER_H_
 #define _H_FFMPEG_ENCODER_H_
 
+#include <string>
+#include <vector>
+
 extern "C"
 {
 #include <libavcodec/avcodec.h>
@@ -10,10 +13,36 @@ extern "C"
 #include <libavutil/hwcontext.h>
 }
 
-//#define USE_HARDWARE_ENCODER
+#include "codec_utils.h"
+#include "codec_metrics.h"
+#include "codec_memory.h"
+#include "codec_placement.h"
+#include "codec_trace.h"
+#include "encoder_registry.h"
 
 //the encoder buffer size
 constexpr int ENCODER_BUFFER_SIZE = 1024 * 256;
+//the I frame interval
+constexpr int ENCODER_GOP_SIZE = 25;
+//the frames waiting in the encoder for their timestamp SEI
+constexpr int ENCODER_SEI_QUEUE_SIZE = 64;
+//the default bitrate
+constexpr int64_t ENCODER_BIT_RATE = 400000;
+//the block size of the importance map of set_regions_of_interest
+constexpr int ENCODER_MB_SIZE = 16;
+
+/**
+* a region of interest of a frame, in pixels, right and bottom are exclusive
+*/
+struct EncoderRegion
+{
+	int left;
+	int top;
+	int right;
+	int bottom;
+	// the QP offset, negative is better quality(e.g. -6 for the faces), positive saves bits
+	int qp_offset;
+};
 
 /**
 * ffmpeg encoder
@@ -37,6 +66,78 @@ public:
 	 */
 	bool init(int width, int height, AVPixelFormat pixelFormat);
 
+	/**
+	 * set the codec thread count used by the next init(), 0 means auto
+	 * @param count -- the thread count
+	 */
+	void set_thread_count(int count)
+	{
+		m_thread_count = count;
+	}
+
+	/**
+	 * bind the codec(e.g. x264) threads to the CPUs and the buffers to the NUMA node of
+	 * the placement, it's used by the next init(). see CodecPlacement
+	 */
+	void set_placement(const CodecPlacement& placement)
+	{
+		m_placement = placement;
+	}
+
+	/**
+	 * set the backend policy used by the next init(), the default is ENCODER_POLICY_DEFAULT,
+	 * see EncoderRegistry. init() falls back to the next backend of the policy when one
+	 * fails, e.g. the GPU is missing or its sessions are full
+	 * @param policy -- the policy
+	 */
+	void set_policy(EncoderPolicy policy)
+	{
+		m_policy = policy;
+	}
+
+	/**
+	 * prefer a backend in the next init(), it's tried first if the policy allows it
+	 * @param name -- the libavcodec encoder name(e.g. h264_nvenc), NULL for none
+	 */
+	void set_backend(const char* name)
+	{
+		m_backend_name = name ? name : "";
+	}
+
+	/**
+	 * the backend opened by init(), NULL if not initialized
+	 */
+	const EncoderBackend* get_backend() const
+	{
+		return m_backend;
+	}
+
+	/**
+	 * set the x264 preset used by the next init(), the default is ultrafast
+	 * @param preset -- ultrafast, superfast, veryfast, faster, fast, medium, slow, slower, veryslow, placebo
+	 */
+	void set_preset(const char* preset)
+	{
+		m_preset = preset;
+	}
+
+	/**
+	 * set the pts of the next frame sent by send_video_data, call it after init()
+	 * @param pts -- the pts, in 1/25 second units
+	 */
+	void set_next_pts(int64_t pts)
+	{
+		m_pts = pts;
+	}
+
+	/**
+	 * get the pts of the next frame sent by send_video_data
+	 */
+	int64_t get_next_pts() const
+	{
+		return m_pts;
+	}
+
 	/**
 	* encode the data to h264
 	* @param width -- [input]the image width
@@ -46,6 +147,139 @@ public:
 	*/
 	bool send_video_data(int width, int height, uint8_t* data[], int linesize[]);
 
+	/**
+	 * send video data, like send_video_data but the backpressure is reported
+	 * @return CODEC_OK - taken, CODEC_AGAIN - the encoder is full, call receive_packet
+	 *         until NULL and send the same frame again, CODEC_EOF - send_end_of_stream
+	 *         was called, reset() first, CODEC_ERROR - failed
+	 */
+	CodecStatus send_frame(int width, int height, uint8_t* data[], int linesize[]);
+
+	/**
+	 * send a refcounted frame(frame->buf set, e.g. MosaicCompositor::get_canvas_frame) of
+	 * the init() size and format. the encoder keeps a reference instead of copying the
+	 * planes, the caller must not write them while the buffer isn't writable
+	 * (av_buffer_is_writable). the pts is set like send_video_data, the frame isn't changed
+	 * @return like send_frame(width, height, data, linesize)
+	 */
+	CodecStatus send_frame(const AVFrame* frame);
+
+	/**
+	 * signal the end of stream, so the encoder outputs all the delayed packets.
+	 * after that, call receive_packet until it returns NULL and is_end_of_stream() is true.
+	 * the encoder must be reset before sending new frames.
+	 * @return true - successful, false - failed
+	 */
+	bool send_end_of_stream();
+
+	/**
+	 * all the packets were received after send_end_of_stream
+	 */
+	bool is_end_of_stream() const
+	{
+		return m_eof;
+	}
+
+	/**
+	 * get ready for a new stream with the same settings, the buffered frames are dropped
+	 * and the next frame is an IDR frame with pts 0. the codec context is flushed if the
+	 * encoder supports it, otherwise it's opened again.
+	 * @return true - successful, false - failed
+	 */
+	bool reset();
+
+	/**
+	 * insert a latency tracing SEI(see avc_write_timestamp_sei) carrying the capture time
+	 * and the sequence number before the slices of each packet
+	 * @param enabled -- on or off, the default is off
+	 */
+	void set_timestamp_sei(bool enabled)
+	{
+		m_timestamp_sei = enabled;
+	}
+
+	/**
+	 * set the wallclock capture time of the next frame sent by send_video_data,
+	 * if it is not set, the time when send_video_data is called is used
+	 * @param timestamp_us -- the time, microseconds since the epoch like av_gettime()
+	 */
+	void set_capture_time(int64_t timestamp_us)
+	{
+		m_capture_time = timestamp_us;
+	}
+
+	/**
+	 * the low latency mode used by the next init(), the default is off.
+	 * instead of an IDR frame every gop, a column of intra blocks sweeps across the frames
+	 * (x264 intra-refresh) and the VBV buffer holds one frame at the bitrate, so the frame
+	 * sizes stay close to constant. the start of each sweep has a recovery point SEI, the
+	 * decoding can start from it(see FFmpegDecoder::set_resync).
+	 * @param enabled -- on or off
+	 *        period -- the frames of one sweep, the longest wait for a recovery point
+	 */
+	void set_intra_refresh(bool enabled, int period = ENCODER_GOP_SIZE)
+	{
+		m_intra_refresh = enabled;
+		m_refresh_period = period > 0 ? period : ENCODER_GOP_SIZE;
+	}
+
+	/**
+	 * set the bitrate used by the next init(), the default is ENCODER_BIT_RATE
+	 * @param bitRate -- the bitrate, bits per second
+	 */
+	void set_bit_rate(int64_t bitRate)
+	{
+		m_bit_rate = bitRate > 0 ? bitRate : ENCODER_BIT_RATE;
+	}
+
+	/**
+	 * the region of interest encoding used by the next init(), the default is off.
+	 * only the backends with ENCODER_CAP_ROI are selected, and the x264 adaptive
+	 * quantization is enabled(the ultrafast preset turns it off), libx264 ignores the
+	 * regions without it.
+	 * @param enabled -- on or off
+	 */
+	void set_roi_encoding(bool enabled)
+	{
+		m_roi_encoding = enabled;
+	}
+
+	/**
+	 * set the regions of interest of the next frame sent by send_video_data, they're sent
+	 * as AV_FRAME_DATA_REGIONS_OF_INTEREST side data. the rate control still keeps the
+	 * bitrate, so the bits move from the rest of the frame to the regions; lower the
+	 * bitrate(set_bit_rate) to save the bits instead.
+	 * @param regions -- the regions, the first one wins where they overlap, NULL if count is 0
+	 *        count -- the region count
+	 *        importanceMap -- NULL or the QP offsets of the ENCODER_MB_SIZE blocks in the raster
+	 *                         order, (width + 15) / 16 per row, 0 means no offset. it's
+	 *                         merged into rectangles after the regions
+	 * @return true - successful, false - not initialized with set_roi_encoding(true)
+	 */
+	bool set_regions_of_interest(const EncoderRegion* regions, int count, const int8_t* importanceMap = NULL);
+
+	/**
+	 * encode the next frame sent by send_video_data as an IDR frame, e.g. on a scene change.
+	 * in the intra refresh mode no IDR frame is forced, the next sweep of the refresh is the
+	 * recovery point, so a receiver recovers within the refresh period without a size spike.
+	 */
+	void request_key_frame()
+	{
+		if (!m_intra_refresh)
+		{
+			m_force_key_frame = true;
+		}
+	}
+
+	/**
+	 * skip one frame without encoding it, e.g. an unchanged frame of a static scene.
+	 * the timestamps of the following frames keep their place.
+	 */
+	void skip_video_frame()
+	{
+		m_pts++;
+	}
+
 	/**
 	 * receive the encoded packet
 	 * @return the AVPakcet pointer, if failed, returns NULL.
@@ -62,31 +296,96 @@ public:
 	 * @return true - successful, false - failed
 	 */
 	bool receive_packets(uint8_t*& data, size_t& len);
+
+	/**
+	 * set the stream id of the trace events of this encoder, see CodecTrace
+	 */
+	void set_trace_id(uint32_t id)
+	{
+		m_trace_id = id;
+	}
+
+	/**
+	 * the metrics of this encoder
+	 */
+	CodecMetrics& get_metrics()
+	{
+		return m_metrics;
+	}
+
+	/**
+	 * the memory accounting of this encoder, e.g. a memory limit
+	 */
+	CodecMemory& get_memory()
+	{
+		return m_memory;
+	}
 private:
 	bool free_context();
-
-#ifdef USE_HARDWARE_ENCODER
+	bool insert_timestamp_sei();
+	CodecStatus send_source_frame(AVFrame* source);
+	bool open_backend(const EncoderBackend* backend, int width, int height, AVPixelFormat pixelFormat);
+	void close_backend();
 	int set_hwframe_ctx(int width, int height);
-#endif
+	bool attach_regions_of_interest(AVFrame* frame);
 
 private:
 	bool m_initialized;
 
-#ifdef USE_HARDWARE_ENCODER
+	EncoderPolicy m_policy;
+	std::string m_backend_name;
+	const EncoderBackend* m_backend;
+
 	bool m_hw_available;
 	AVBufferRef* m_hw_ctx;
 	AVFrame* m_hw_frame;
-#endif
+	// the frame in the upload format of the backend and its converter, NULL if the
+	// input format is uploaded as it is
+	AVFrame* m_upload_frame;
+	SwsContext* m_upload_sws;
 
 	AVCodecContext* m_encoder_context;
 	AVCodec* m_encoder_codec;
 
 	AVPacket* m_packet;
 	AVFrame* m_frame;
+	AVFrame* m_ref_frame;
 	int64_t m_pts;
+	int m_width;
+	int m_height;
+	AVPixelFormat m_pixel_format;
+	bool m_eof;
+	int m_thread_count;
+	CodecPlacement m_placement;
+	std::string m_preset;
+	bool m_force_key_frame;
+	bool m_intra_refresh;
+	int m_refresh_period;
+	int64_t m_bit_rate;
+	bool m_roi_encoding;
+	// the regions of the next frame
+	std::vector<AVRegionOfInterest> m_regions;
 
 	uint8_t* m_buffer;
 	size_t m_buffer_used_len;
+
+	struct SeiEntry
+	{
+		int64_t pts;
+		int64_t capture_time;
+		uint32_t sequence;
+	};
+
+	bool m_timestamp_sei;
+	int64_t m_capture_time;
+	uint32_t m_sei_sequence;
+	// indexed by pts
+	SeiEntry m_sei_entries[ENCODER_SEI_QUEUE_SIZE];
+	AVPacket* m_sei_packet;
+
+	CodecMetrics m_metrics;
+	CodecMemory m_memory;
+	uint32_t m_trace_id;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,416 @@
+#include "ffmpeg_segment_encoder.h"
+#include "codec_utils.h"
+#include <string.h>
+#include <new>
+
+namespace
+{
+	const uint8_t g_start_code[4] = { 0, 0, 0, 1 };
+}
+
+FFmpegSegmentEncoder::FFmpegSegmentEncoder()
+{
+	m_width = 0;
+	m_height = 0;
+	m_pixel_format = AV_PIX_FMT_NONE;
+	m_frame_size = 0;
+	m_chunk_frames = 0;
+	m_max_pending = 0;
+	m_pts = 0;
+	m_current = NULL;
+
+	m_eos = false;
+	m_stop = false;
+	m_error = false;
+	m_initialized = false;
+}
+
+FFmpegSegmentEncoder::~FFmpegSegmentEncoder()
+{
+	free_context();
+}
+
+bool FFmpegSegmentEncoder::init(int width, int height, AVPixelFormat pixelFormat, int workers, int gops_per_chunk)
+{
+	free_context();
+
+	if (width <= 0 || height <= 0 || gops_per_chunk <= 0)
+	{
+		return false;
+	}
+
+	if (workers <= 0)
+	{
+		workers = (int)std::thread::hardware_concurrency();
+		if (workers <= 0)
+		{
+			workers = 1;
+		}
+	}
+
+	m_frame_size = av_image_get_buffer_size(pixelFormat, width, height, 1);
+	if (m_frame_size < 0)
+	{
+		return false;
+	}
+
+	m_width = width;
+	m_height = height;
+	m_pixel_format = pixelFormat;
+	m_chunk_frames = gops_per_chunk * ENCODER_GOP_SIZE;
+	m_max_pending = (size_t)workers;
+	m_pts = 0;
+
+	// the workers share the cores, so each x264 context gets its own slice of them
+	int hwThreads = (int)std::thread::hardware_concurrency();
+	int threadsPerWorker = hwThreads > workers ? hwThreads / workers : 1;
+
+	m_stop = false;
+	for (int i = 0; i < workers; i++)
+	{
+		FFmpegEncoder* encoder = new (std::nothrow) FFmpegEncoder();
+		if (!encoder)
+		{
+			free_context();
+			return false;
+		}
+		encoder->set_thread_count(threadsPerWorker);
+		m_encoders.push_back(encoder);
+		m_threads.push_back(std::thread(&FFmpegSegmentEncoder::worker_loop, this, encoder));
+	}
+
+	m_initialized = true;
+	return true;
+}
+
+void FFmpegSegmentEncoder::free_context()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_work_cond.notify_all();
+
+	for (size_t i = 0; i < m_threads.size(); i++)
+	{
+		m_threads[i].join();
+	}
+	m_threads.clear();
+
+	for (size_t i = 0; i < m_encoders.size(); i++)
+	{
+		delete m_encoders[i];
+	}
+	m_encoders.clear();
+
+	if (m_current)
+	{
+		m_free_buffers.insert(m_free_buffers.end(), m_current->frames.begin(), m_current->frames.end());
+		delete m_current;
+		m_current = NULL;
+	}
+
+	// the pending chunks are also in m_chunks
+	m_pending.clear();
+	for (size_t i = 0; i < m_chunks.size(); i++)
+	{
+		m_free_buffers.insert(m_free_buffers.end(), m_chunks[i]->frames.begin(), m_chunks[i]->frames.end());
+		delete m_chunks[i];
+	}
+	m_chunks.clear();
+
+	for (size_t i = 0; i < m_free_buffers.size(); i++)
+	{
+		av_free(m_free_buffers[i]);
+	}
+	m_free_buffers.clear();
+
+	m_sps.clear();
+	m_pps.clear();
+	m_output.clear();
+
+	m_eos = false;
+	m_error = false;
+	m_initialized = false;
+}
+
+uint8_t* FFmpegSegmentEncoder::get_frame_buffer()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_free_buffers.empty())
+		{
+			uint8_t* buffer = m_free_buffers.back();
+			m_free_buffers.pop_back();
+			return buffer;
+		}
+	}
+
+	return (uint8_t *)av_malloc(m_frame_size);
+}
+
+bool FFmpegSegmentEncoder::send_video_data(int width, int height, uint8_t* data[], int linesize[])
+{
+	if (!m_initialized || m_eos)
+	{
+		return false;
+	}
+
+	if (width != m_width || height != m_height)
+	{
+		return false;
+	}
+
+	if (!m_current)
+	{
+		m_current = new (std::nothrow) Chunk();
+		if (!m_current)
+		{
+			return false;
+		}
+		m_current->start_pts = m_pts;
+		m_current->done = false;
+		m_current->ok = false;
+	}
+
+	uint8_t* buffer = get_frame_buffer();
+	if (!buffer)
+	{
+		return false;
+	}
+
+	uint8_t* dstData[4];
+	int dstLinesize[4];
+	if (av_image_fill_arrays(dstData, dstLinesize, buffer, m_pixel_format, m_width, m_height, 1) < 0)
+	{
+		av_free(buffer);
+		return false;
+	}
+
+	av_image_copy(dstData, dstLinesize, (const uint8_t **)data, linesize, m_pixel_format, m_width, m_height);
+	m_current->frames.push_back(buffer);
+	m_pts++;
+
+	if ((int)m_current->frames.size() >= m_chunk_frames)
+	{
+		return dispatch_chunk();
+	}
+
+	return true;
+}
+
+bool FFmpegSegmentEncoder::send_end_of_stream()
+{
+	if (!m_initialized || m_eos)
+	{
+		return false;
+	}
+
+	m_eos = true;
+	if (m_current)
+	{
+		return dispatch_chunk();
+	}
+
+	return true;
+}
+
+bool FFmpegSegmentEncoder::dispatch_chunk()
+{
+	Chunk* chunk = m_current;
+	m_current = NULL;
+
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		// backpressure, keep at most one waiting chunk per worker
+		while (m_pending.size() >= m_max_pending && !m_stop)
+		{
+			m_done_cond.wait(lock);
+		}
+
+		m_chunks.push_back(chunk);
+		m_pending.push_back(chunk);
+	}
+	m_work_cond.notify_one();
+
+	return true;
+}
+
+void FFmpegSegmentEncoder::worker_loop(FFmpegEncoder* encoder)
+{
+	while (true)
+	{
+		Chunk* chunk;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (!m_stop && m_pending.empty())
+			{
+				m_work_cond.wait(lock);
+			}
+
+			if (m_stop)
+			{
+				return;
+			}
+
+			chunk = m_pending.front();
+			m_pending.pop_front();
+		}
+		m_done_cond.notify_all();
+
+		bool ok = encode_chunk(encoder, chunk);
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_free_buffers.insert(m_free_buffers.end(), chunk->frames.begin(), chunk->frames.end());
+			chunk->frames.clear();
+			chunk->ok = ok;
+			chunk->done = true;
+		}
+		m_done_cond.notify_all();
+	}
+}
+
+bool FFmpegSegmentEncoder::encode_chunk(FFmpegEncoder* encoder, Chunk* chunk)
+{
+	// the encoder is reset per chunk, so every chunk starts with an IDR frame
+	if (!encoder->is_initialized())
+	{
+		if (!encoder->init(m_width, m_height, m_pixel_format))
+		{
+			return false;
+		}
+	}
+	else if (!encoder->reset())
+	{
+		return false;
+	}
+	encoder->set_next_pts(chunk->start_pts);
+
+	AVPacket* packet;
+	for (size_t i = 0; i < chunk->frames.size(); i++)
+	{
+		uint8_t* data[4];
+		int linesize[4];
+		if (av_image_fill_arrays(data, linesize, chunk->frames[i], m_pixel_format, m_width, m_height, 1) < 0)
+		{
+			return false;
+		}
+
+		if (!encoder->send_video_data(m_width, m_height, data, linesize))
+		{
+			return false;
+		}
+
+		while ((packet = encoder->receive_packet()) != NULL)
+		{
+			chunk->output.insert(chunk->output.end(), packet->data, packet->data + packet->size);
+			encoder->end_receive_packet();
+		}
+	}
+
+	if (!encoder->send_end_of_stream())
+	{
+		return false;
+	}
+
+	while ((packet = encoder->receive_packet()) != NULL)
+	{
+		chunk->output.insert(chunk->output.end(), packet->data, packet->data + packet->size);
+		encoder->end_receive_packet();
+	}
+
+	return true;
+}
+
+bool FFmpegSegmentEncoder::stitch_chunk(Chunk* chunk)
+{
+	const uint8_t* sps;
+	const uint8_t* pps;
+	size_t spsSize;
+	size_t ppsSize;
+
+	bool found = avc_find_parameter_sets(chunk->output.data(), chunk->output.size(), sps, spsSize, pps, ppsSize);
+	if (m_sps.empty())
+	{
+		if (!found)
+		{
+			return false;
+		}
+
+		m_sps.assign(sps, sps + spsSize);
+		m_pps.assign(pps, pps + ppsSize);
+	}
+	else if (found)
+	{
+		// every chunk comes from a separate context, the decoder expects the same parameter sets
+		if (spsSize != m_sps.size() || memcmp(sps, m_sps.data(), spsSize) != 0 ||
+			ppsSize != m_pps.size() || memcmp(pps, m_pps.data(), ppsSize) != 0)
+		{
+			return false;
+		}
+	}
+
+	m_output.clear();
+	if (!found)
+	{
+		m_output.insert(m_output.end(), g_start_code, g_start_code + 4);
+		m_output.insert(m_output.end(), m_sps.begin(), m_sps.end());
+		m_output.insert(m_output.end(), g_start_code, g_start_code + 4);
+		m_output.insert(m_output.end(), m_pps.begin(), m_pps.end());
+	}
+	m_output.insert(m_output.end(), chunk->output.begin(), chunk->output.end());
+
+	return true;
+}
+
+bool FFmpegSegmentEncoder::receive_packets(uint8_t*& data, size_t& len, bool wait)
+{
+	Chunk* chunk;
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (m_error || m_chunks.empty())
+		{
+			return false;
+		}
+
+		chunk = m_chunks.front();
+		while (wait && !chunk->done)
+		{
+			m_done_cond.wait(lock);
+		}
+
+		if (!chunk->done)
+		{
+			return false;
+		}
+
+		m_chunks.pop_front();
+	}
+
+	bool ok = chunk->ok && stitch_chunk(chunk);
+	delete chunk;
+
+	if (!ok)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_error = true;
+		return false;
+	}
+
+	data = m_output.data();
+	len = m_output.size();
+	return true;
+}
+
+bool FFmpegSegmentEncoder::is_finished()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_eos && m_chunks.empty();
+}
+
+bool FFmpegSegmentEncoder::has_error()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_error;
+}
\ No newline at end of file
@@ -0,0 +1,132 @@
+#ifndef _H_FFMPEG_SEGMENT_ENCODER_H_
+#define _H_FFMPEG_SEGMENT_ENCODER_H_
+
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavutil/imgutils.h>
+}
+
+#include "ffmpeg_encoder.h"
+
+/**
+* segmented ffmpeg encoder for offline jobs.
+*
+* the input frames are cut into GOP aligned chunks, the chunks are encoded
+* concurrently by several FFmpegEncoder instances with identical parameters,
+* and the outputs are stitched back into one Annex-B stream in input order.
+* every chunk starts with an IDR frame, the pts continue from one chunk to the next.
+*/
+class FFmpegSegmentEncoder
+{
+public:
+	FFmpegSegmentEncoder();
+	virtual ~FFmpegSegmentEncoder();
+
+	bool is_initialized() const
+	{
+		return m_initialized;
+	}
+
+	/**
+	 * initialize
+	 * @param width -- the source yuv image width
+	 *        height -- the source yuv image height
+	 *        pixelFormat -- the source data pixel format, now it must be AV_PIX_FMT_YUV420P
+	 *        workers -- the encoder instance count, 0 means one per hardware thread
+	 *        gops_per_chunk -- the chunk length, in ENCODER_GOP_SIZE frames
+	 */
+	bool init(int width, int height, AVPixelFormat pixelFormat, int workers, int gops_per_chunk);
+
+	/**
+	* copy the frame into the current chunk, the full chunk is dispatched to the workers.
+	* it blocks while all the workers are busy and enough chunks are waiting.
+	* @param width -- [input]the image width
+	*        height -- [input]the image height
+	*        data -- [input]the data
+	*        linesize -- [input]the line size
+	*/
+	bool send_video_data(int width, int height, uint8_t* data[], int linesize[]);
+
+	/**
+	 * dispatch the last partial chunk, no frames can be sent after that
+	 * @return true - successful, false - failed
+	 */
+	bool send_end_of_stream();
+
+	/**
+	 * receive the next encoded chunk, in input order
+	 * @param data -- output parameter, the data pointer reference,
+	 *                it's valid until the next call
+	 *        len -- output parameter, the data length
+	 *        wait -- wait until the next chunk was encoded
+	 * @return true - a chunk was received, false - no chunk is ready or encoding failed
+	 */
+	bool receive_packets(uint8_t*& data, size_t& len, bool wait);
+
+	/**
+	 * @return true - the end of stream was sent and all the chunks were received
+	 */
+	bool is_finished();
+
+	/**
+	 * @return true - a chunk failed to encode or its SPS/PPS differs from the first chunk
+	 */
+	bool has_error();
+
+private:
+	struct Chunk
+	{
+		int64_t start_pts;
+		std::vector<uint8_t*> frames;
+		std::vector<uint8_t> output;
+		bool done;
+		bool ok;
+	};
+
+	void free_context();
+	bool dispatch_chunk();
+	void worker_loop(FFmpegEncoder* encoder);
+	bool encode_chunk(FFmpegEncoder* encoder, Chunk* chunk);
+	bool stitch_chunk(Chunk* chunk);
+
+	uint8_t* get_frame_buffer();
+
+private:
+	bool m_initialized;
+	bool m_eos;
+	bool m_stop;
+	bool m_error;
+
+	int m_width;
+	int m_height;
+	AVPixelFormat m_pixel_format;
+	int m_frame_size;
+	int m_chunk_frames;
+	size_t m_max_pending;
+	int64_t m_pts;
+
+	Chunk* m_current;
+	std::deque<Chunk*> m_chunks;
+	std::deque<Chunk*> m_pending;
+	std::vector<uint8_t*> m_free_buffers;
+
+	std::vector<FFmpegEncoder*> m_encoders;
+	std::vector<std::thread> m_threads;
+	std::mutex m_mutex;
+	std::condition_variable m_work_cond;
+	std::condition_variable m_done_cond;
+
+	std::vector<uint8_t> m_sps;
+	std::vector<uint8_t> m_pps;
+	std::vector<uint8_t> m_output;
+};
+
+#endif
\ No newline at end of file
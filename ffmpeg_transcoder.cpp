@@ -1,13 +1,156 @@
 #include "ffmpeg_transcoder.h"
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+#define TRANSCODER_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+	// dst = (a * (256 - weight) + b * weight) / 256, weight is in [0, 256]
+	void blend_rows(const uint8_t* a, const uint8_t* b, int weight, uint8_t* dst, int count)
+	{
+		if (weight == 0 || a == b)
+		{
+			memcpy(dst, a, count);
+			return;
+		}
+
+		int i = 0;
+#ifdef TRANSCODER_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i wa = _mm_set1_epi16((short)(256 - weight));
+		const __m128i wb = _mm_set1_epi16((short)weight);
+		const __m128i round = _mm_set1_epi16(128);
+		for (; i + 16 <= count; i += 16)
+		{
+			__m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+			__m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+			// at most 255 * 256 + 128, it fits in unsigned 16 bits
+			__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa),
+				_mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb));
+			__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa),
+				_mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb));
+			lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+			hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+		}
+#endif
+		for (; i < count; i++)
+		{
+			dst[i] = (uint8_t)((a[i] * (256 - weight) + b[i] * weight + 128) >> 8);
+		}
+	}
+
+	// the source position of the output sample i, with the pixel centers aligned
+	void sample_position(double start, double scale, int i, int size, int& p0, int& p1, int& weight)
+	{
+		double pos = start + (i + 0.5) * scale - 0.5;
+		if (pos < 0)
+		{
+			pos = 0;
+		}
+		else if (pos > size - 1)
+		{
+			pos = size - 1;
+		}
+
+		p0 = (int)pos;
+		p1 = p0 + 1 < size ? p0 + 1 : p0;
+		weight = (int)((pos - p0) * 256 + 0.5);
+	}
+
+	void interpolate_row(const uint8_t* src, const int* x0, const int* x1, const uint16_t* weights, uint8_t* dst, int count)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			int w = weights[i];
+			dst[i] = (uint8_t)((src[x0[i]] * (256 - w) + src[x1[i]] * w + 128) >> 8);
+		}
+	}
+
+	inline uint8_t clamp_pixel(int value)
+	{
+		return (uint8_t)(value < 0 ? 0 : (value > 255 ? 255 : value));
+	}
+
+	inline void store_value(uint8_t& dst, uint8_t value, const float*)
+	{
+		dst = value;
+	}
+
+	inline void store_value(float& dst, uint8_t value, const float* lut)
+	{
+		dst = lut[value];
+	}
+
+	template <typename T>
+	void store_channel_row(T* dst, int step, const uint8_t* src, int count, const float* lut)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			store_value(dst[i * step], src[i], lut);
+		}
+	}
+
+	template <typename T>
+	void fill_channel_row(T* dst, int step, T value, int count)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			dst[i * step] = value;
+		}
+	}
+
+	template <typename T>
+	void store_tensor_row(T* image, const TensorOptions& options, int y, int left, int count,
+		const std::vector<uint8_t>* rgb, const float (*lut)[256], const T* pad)
+	{
+		bool planar = options.layout == TENSOR_NCHW;
+		int step = planar ? 1 : 3;
+		int right = options.width - left - count;
+
+		for (int c = 0; c < 3; c++)
+		{
+			int src = options.bgr ? 2 - c : c;
+			T* row = planar ? image + ((size_t)c * options.height + y) * options.width
+				: image + (size_t)y * options.width * 3 + c;
+
+			fill_channel_row(row, step, pad[c], left);
+			row += left * step;
+			if (count > 0)
+			{
+				store_channel_row(row, step, rgb[src].data(), count, lut[c]);
+				row += count * step;
+			}
+			fill_channel_row(row, step, pad[c], right);
+		}
+	}
+}
+
 
 FFmpegTranscoder::FFmpegTranscoder()
+	: m_metrics("transcoder"), m_memory(m_metrics)
 {
 	m_sws_context = NULL;
 	m_sws_frame_buffer = NULL;
+	m_sws_frame_buffer_size = 0;
 	m_sws_frame = NULL;
 	m_src_width = -1;
 	m_src_height = -1;
 	m_src_pixel_format = AVPixelFormat::AV_PIX_FMT_NONE;
+	m_trace_id = 0;
+
+	m_tensor = NULL;
+	m_tensor_buffer_size = 0;
+	m_tensor_frame_size = 0;
+	m_tensor_frames = 0;
+	m_tensor_scale_x = 1.0f;
+	m_tensor_scale_y = 1.0f;
+	m_tensor_offset_x = 0.0f;
+	m_tensor_offset_y = 0.0f;
 }
 
 FFmpegTranscoder::~FFmpegTranscoder()
@@ -20,15 +163,18 @@ FFmpegTranscoder::~FFmpegTranscoder()
 
 	if (m_sws_frame_buffer)
 	{
-		av_free(m_sws_frame_buffer);
+		m_memory.deallocate(m_sws_frame_buffer, m_sws_frame_buffer_size);
 		m_sws_frame_buffer = NULL;
 	}
+	m_sws_frame_buffer_size = 0;
 
 	if (m_sws_context)
 	{
 		sws_freeContext(m_sws_context);
 		m_sws_context = NULL;
 	}
+
+	free_tensor();
 }
 
 void FFmpegTranscoder::free_context()
@@ -41,9 +187,10 @@ void FFmpegTranscoder::free_context()
 
 	if (m_sws_frame_buffer)
 	{
-		av_free(m_sws_frame_buffer);
+		m_memory.deallocate(m_sws_frame_buffer, m_sws_frame_buffer_size);
 		m_sws_frame_buffer = NULL;
 	}
+	m_sws_frame_buffer_size = 0;
 
 	if (m_sws_context)
 	{
@@ -54,6 +201,7 @@ void FFmpegTranscoder::free_context()
 
 bool FFmpegTranscoder::scale_yuv(uint8_t *data, int* linesize, int width, int height, AVPixelFormat format, AVFrame** frame)
 {
+	CodecTraceScope trace("transcoder.scale_yuv", m_trace_id);
 	int ret;
 	if (width != m_src_width || height != m_src_height || format != m_src_pixel_format)
 	{
@@ -65,31 +213,38 @@ bool FFmpegTranscoder::scale_yuv(uint8_t *data, int* linesize, int width, int he
 	{
 		if (!m_sws_frame)
 		{
-			m_sws_frame = av_frame_alloc();
-			if (!m_sws_frame)
-			{
-				return false;
-			}
+			CodecTraceScope allocTrace("transcoder.sws_alloc", m_trace_id);
+			// the buffer first, the frame is only kept with its planes, so a buffer rejected
+			// by the memory limit is allocated again by the next call
 			ret = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, width, height, 1);
 			if (ret < 0)
 			{
 				return false;
 			}
-			m_sws_frame_buffer = (uint8_t *)av_malloc(ret);
-			if (!m_sws_frame_buffer)
+			uint8_t* buffer = (uint8_t *)m_memory.allocate(ret);
+			if (!buffer)
 			{
 				return false;
 			}
-			ret = av_image_fill_arrays(m_sws_frame->data, m_sws_frame->linesize, m_sws_frame_buffer,
-				AV_PIX_FMT_YUV420P, width, height, 1);
-			if (ret < 0)
+			AVFrame* swsFrame = av_frame_alloc();
+			if (!swsFrame || av_image_fill_arrays(swsFrame->data, swsFrame->linesize, buffer,
+				AV_PIX_FMT_YUV420P, width, height, 1) < 0)
 			{
+				av_frame_free(&swsFrame);
+				m_memory.deallocate(buffer, ret);
 				return false;
 			}
+			m_sws_frame = swsFrame;
+			m_sws_frame_buffer = buffer;
+			m_sws_frame_buffer_size = ret;
 		}
 
+		int64_t start = m_metrics.begin();
 		sws_scale(m_sws_context, (const uint8_t * const *)data, linesize,
 			0, height, m_sws_frame->data, m_sws_frame->linesize);
+		m_metrics.end(STAGE_SWS_SCALE, start);
+		m_metrics.add_frame_in();
+		m_metrics.add_frame_out();
 
 		*frame = m_sws_frame;
 		return true;
@@ -98,4 +253,229 @@ bool FFmpegTranscoder::scale_yuv(uint8_t *data, int* linesize, int width, int he
 	{
 		return false;
 	}
-}
\ No newline at end of file
+}
+
+void FFmpegTranscoder::free_tensor()
+{
+	if (m_tensor)
+	{
+		m_memory.deallocate(m_tensor, m_tensor_buffer_size);
+		m_tensor = NULL;
+	}
+	m_tensor_buffer_size = 0;
+
+	m_tensor_frame_size = 0;
+	m_tensor_frames = 0;
+}
+
+bool FFmpegTranscoder::init_tensor(const TensorOptions& options)
+{
+	free_tensor();
+
+	if (options.width <= 0 || options.height <= 0 || options.batch <= 0)
+	{
+		return false;
+	}
+
+	for (int c = 0; c < 3; c++)
+	{
+		if (options.type == TENSOR_FLOAT32 && options.std[c] == 0.0f)
+		{
+			return false;
+		}
+	}
+
+	size_t elementSize = options.type == TENSOR_FLOAT32 ? sizeof(float) : sizeof(uint8_t);
+	m_tensor_frame_size = (size_t)options.width * options.height * 3 * elementSize;
+	m_tensor = (uint8_t *)m_memory.allocate(m_tensor_frame_size * options.batch);
+	if (!m_tensor)
+	{
+		m_tensor_frame_size = 0;
+		return false;
+	}
+	m_tensor_buffer_size = m_tensor_frame_size * options.batch;
+
+	m_tensor_options = options;
+	m_tensor_frames = 0;
+
+	// the normalization is a table lookup
+	for (int c = 0; c < 3; c++)
+	{
+		float scale = options.type == TENSOR_FLOAT32 ? 1.0f / options.std[c] : 1.0f;
+		float mean = options.type == TENSOR_FLOAT32 ? options.mean[c] : 0.0f;
+		for (int v = 0; v < 256; v++)
+		{
+			m_tensor_lut[c][v] = (v - mean) * scale;
+		}
+
+		float padValue = m_tensor_lut[c][options.pad_value];
+		if (options.type == TENSOR_FLOAT32)
+		{
+			memcpy(m_tensor_pad[c], &padValue, sizeof(float));
+		}
+		else
+		{
+			m_tensor_pad[c][0] = options.pad_value;
+		}
+	}
+
+	return true;
+}
+
+void FFmpegTranscoder::write_tensor_row(uint8_t* dst, int y, int left, int count)
+{
+	if (m_tensor_options.type == TENSOR_FLOAT32)
+	{
+		float pad[3];
+		for (int c = 0; c < 3; c++)
+		{
+			memcpy(&pad[c], m_tensor_pad[c], sizeof(float));
+		}
+		store_tensor_row((float*)dst, m_tensor_options, y, left, count, m_tensor_rgb, m_tensor_lut, pad);
+	}
+	else
+	{
+		uint8_t pad[3] = { m_tensor_pad[0][0], m_tensor_pad[1][0], m_tensor_pad[2][0] };
+		store_tensor_row(dst, m_tensor_options, y, left, count, m_tensor_rgb, m_tensor_lut, pad);
+	}
+}
+
+bool FFmpegTranscoder::add_tensor_frame(uint8_t* const data[], const int linesize[], int width, int height, AVPixelFormat format)
+{
+	CodecTraceScope trace("transcoder.add_tensor_frame", m_trace_id);
+
+	if (!m_tensor || is_tensor_full() || width < 2 || height < 2)
+	{
+		return false;
+	}
+
+	uint8_t* const* planes = data;
+	const int* strides = linesize;
+	bool fullRange = format == AV_PIX_FMT_YUVJ420P;
+	if (format != AV_PIX_FMT_YUV420P && format != AV_PIX_FMT_YUVJ420P)
+	{
+		AVFrame* frame;
+		if (!scale_yuv((uint8_t*)data, (int*)linesize, width, height, format, &frame))
+		{
+			return false;
+		}
+		planes = frame->data;
+		strides = frame->linesize;
+	}
+
+	int64_t start = m_metrics.begin();
+
+	const TensorOptions& options = m_tensor_options;
+	double srcX = 0, srcY = 0, srcW = width, srcH = height;
+	int dstX = 0, dstY = 0, dstW = options.width, dstH = options.height;
+	if (options.resize == TENSOR_RESIZE_LETTERBOX)
+	{
+		double scale = fmin((double)options.width / width, (double)options.height / height);
+		dstW = (int)fmax(1.0, floor(width * scale + 0.5));
+		dstH = (int)fmax(1.0, floor(height * scale + 0.5));
+		dstX = (options.width - dstW) / 2;
+		dstY = (options.height - dstH) / 2;
+	}
+	else if (options.resize == TENSOR_RESIZE_CROP)
+	{
+		double scale = fmax((double)options.width / width, (double)options.height / height);
+		srcW = options.width / scale;
+		srcH = options.height / scale;
+		srcX = (width - srcW) / 2;
+		srcY = (height - srcH) / 2;
+	}
+
+	double stepX = srcW / dstW;
+	double stepY = srcH / dstH;
+	m_tensor_scale_x = (float)(dstW / srcW);
+	m_tensor_scale_y = (float)(dstH / srcH);
+	m_tensor_offset_x = (float)(dstX - srcX * m_tensor_scale_x);
+	m_tensor_offset_y = (float)(dstY - srcY * m_tensor_scale_y);
+
+	int chromaWidth = (width + 1) / 2;
+	int chromaHeight = (height + 1) / 2;
+
+	m_tensor_x0.resize(dstW);
+	m_tensor_x1.resize(dstW);
+	m_tensor_xw.resize(dstW);
+	m_tensor_cx0.resize(dstW);
+	m_tensor_cx1.resize(dstW);
+	m_tensor_cxw.resize(dstW);
+	for (int x = 0; x < dstW; x++)
+	{
+		int weight;
+		sample_position(srcX, stepX, x, width, m_tensor_x0[x], m_tensor_x1[x], weight);
+		m_tensor_xw[x] = (uint16_t)weight;
+		sample_position(srcX / 2, stepX / 2, x, chromaWidth, m_tensor_cx0[x], m_tensor_cx1[x], weight);
+		m_tensor_cxw[x] = (uint16_t)weight;
+	}
+
+	m_tensor_rows[0].resize(width);
+	m_tensor_rows[1].resize(chromaWidth);
+	m_tensor_rows[2].resize(chromaWidth);
+	for (int c = 0; c < 3; c++)
+	{
+		m_tensor_yuv[c].resize(dstW);
+		m_tensor_rgb[c].resize(dstW);
+	}
+
+	// BT.601, 8 bits fixed point
+	int yScale = fullRange ? 256 : 298;
+	int yOffset = fullRange ? 0 : 16;
+	int rv = fullRange ? 359 : 409;
+	int gu = fullRange ? 88 : 100;
+	int gv = fullRange ? 183 : 208;
+	int bu = fullRange ? 454 : 516;
+
+	uint8_t* image = m_tensor + m_tensor_frames * m_tensor_frame_size;
+	for (int y = 0; y < options.height; y++)
+	{
+		if (y < dstY || y >= dstY + dstH)
+		{
+			write_tensor_row(image, y, options.width, 0);
+			continue;
+		}
+
+		// the vertical pass, the source rows are interpolated once for the whole output row
+		int y0, y1, weight;
+		sample_position(srcY, stepY, y - dstY, height, y0, y1, weight);
+		blend_rows(planes[0] + (size_t)y0 * strides[0], planes[0] + (size_t)y1 * strides[0], weight,
+			m_tensor_rows[0].data(), width);
+		sample_position(srcY / 2, stepY / 2, y - dstY, chromaHeight, y0, y1, weight);
+		for (int p = 1; p < 3; p++)
+		{
+			blend_rows(planes[p] + (size_t)y0 * strides[p], planes[p] + (size_t)y1 * strides[p], weight,
+				m_tensor_rows[p].data(), chromaWidth);
+		}
+
+		// the horizontal pass
+		uint8_t* lum = m_tensor_yuv[0].data();
+		uint8_t* cb = m_tensor_yuv[1].data();
+		uint8_t* cr = m_tensor_yuv[2].data();
+		interpolate_row(m_tensor_rows[0].data(), m_tensor_x0.data(), m_tensor_x1.data(), m_tensor_xw.data(), lum, dstW);
+		interpolate_row(m_tensor_rows[1].data(), m_tensor_cx0.data(), m_tensor_cx1.data(), m_tensor_cxw.data(), cb, dstW);
+		interpolate_row(m_tensor_rows[2].data(), m_tensor_cx0.data(), m_tensor_cx1.data(), m_tensor_cxw.data(), cr, dstW);
+
+		// the color conversion, the loop is vectorized by the compiler
+		uint8_t* r = m_tensor_rgb[0].data();
+		uint8_t* g = m_tensor_rgb[1].data();
+		uint8_t* b = m_tensor_rgb[2].data();
+		for (int x = 0; x < dstW; x++)
+		{
+			int c = (lum[x] - yOffset) * yScale + 128;
+			int u = cb[x] - 128;
+			int v = cr[x] - 128;
+
+			r[x] = clamp_pixel((c + rv * v) >> 8);
+			g[x] = clamp_pixel((c - gu * u - gv * v) >> 8);
+			b[x] = clamp_pixel((c + bu * u) >> 8);
+		}
+
+		write_tensor_row(image, y, dstX, dstW);
+	}
+
+	m_tensor_frames++;
+	m_metrics.end(STAGE_SWS_SCALE, start);
+	m_metrics.add_frame_in();
+	return true;
+}
@@ -10,6 +10,72 @@ extern "C"
 #include <libavutil/imgutils.h>
 }
 
+#include "codec_metrics.h"
+#include "codec_memory.h"
+#include "codec_trace.h"
+#include <vector>
+
+/**
+* the tensor layout of the inference output
+*/
+enum TensorLayout
+{
+	TENSOR_NCHW = 0,
+	TENSOR_NHWC
+};
+
+enum TensorDataType
+{
+	TENSOR_UINT8 = 0,
+	TENSOR_FLOAT32
+};
+
+/**
+* how the image is fitted into the model input size
+*/
+enum TensorResizeMode
+{
+	TENSOR_RESIZE_STRETCH = 0,  // ignore the aspect ratio
+	TENSOR_RESIZE_LETTERBOX,    // keep the aspect ratio, pad the borders
+	TENSOR_RESIZE_CROP          // keep the aspect ratio, cut the center
+};
+
+/**
+* the inference output options of FFmpegTranscoder
+*/
+struct TensorOptions
+{
+	int width;                  // the model input width
+	int height;                 // the model input height
+	int batch;                  // the max frames in one tensor
+	TensorLayout layout;
+	TensorDataType type;
+	TensorResizeMode resize;
+	bool bgr;                   // the channel order is BGR instead of RGB
+	// float32 only, the output is (value - mean) / std, the value is in [0, 255]
+	float mean[3];
+	float std[3];
+	// the letterbox padding value, in [0, 255]
+	uint8_t pad_value;
+
+	TensorOptions()
+	{
+		width = 0;
+		height = 0;
+		batch = 1;
+		layout = TENSOR_NCHW;
+		type = TENSOR_FLOAT32;
+		resize = TENSOR_RESIZE_STRETCH;
+		bgr = false;
+		for (int i = 0; i < 3; i++)
+		{
+			mean[i] = 0.0f;
+			std[i] = 255.0f;
+		}
+		pad_value = 114;
+	}
+};
+
 /**
 * the ffmpeg transcoder
 */
@@ -34,17 +100,149 @@ public:
 	*/
 	bool scale_yuv(uint8_t *data, int* linesize, int width, int height, AVPixelFormat format, AVFrame** frame);
 
+	/**
+	* @brief initialize the inference output, the tensor buffer is allocated here
+	*
+	* @return true -- successful
+	*         false -- invalid options or out of memory
+	*/
+	bool init_tensor(const TensorOptions& options);
+
+	/**
+	* @brief resize, convert to RGB/BGR and normalize the image into the next slot of the tensor,
+	* in one pass over the source. YUV420P and YUVJ420P are read directly, the other formats
+	* are converted by scale_yuv first.
+	*
+	* @param data -- [input] the planes
+	*        linesize -- [input] the plane line sizes
+	*        width -- [input] the image width
+	*        height -- [input] the image height
+	*        format -- [input] the ffmpeg format of image
+	*
+	* @return true -- successful
+	*         false -- the tensor is full or not initialized, or the conversion failed
+	*/
+	bool add_tensor_frame(uint8_t* const data[], const int linesize[], int width, int height, AVPixelFormat format);
+
+	bool add_tensor_frame(const AVFrame* frame)
+	{
+		return add_tensor_frame(frame->data, frame->linesize, frame->width, frame->height, (AVPixelFormat)frame->format);
+	}
+
+	/**
+	* @brief the tensor data, the frames are contiguous in the order they were added
+	*/
+	const uint8_t* get_tensor() const
+	{
+		return m_tensor;
+	}
+
+	/**
+	* @brief the size of the added frames in bytes
+	*/
+	size_t get_tensor_size() const
+	{
+		return m_tensor_frames * m_tensor_frame_size;
+	}
+
+	int get_tensor_frames() const
+	{
+		return m_tensor_frames;
+	}
+
+	bool is_tensor_full() const
+	{
+		return m_tensor_frames >= m_tensor_options.batch;
+	}
+
+	/**
+	* @brief start a new batch, the buffer is reused
+	*/
+	void clear_tensor()
+	{
+		m_tensor_frames = 0;
+	}
+
+	/**
+	* @brief the mapping from the last added image to the tensor, e.g. for the detection boxes.
+	* tensor_x = x * scale_x + offset_x, tensor_y = y * scale_y + offset_y
+	*/
+	void get_tensor_mapping(float& scale_x, float& scale_y, float& offset_x, float& offset_y) const
+	{
+		scale_x = m_tensor_scale_x;
+		scale_y = m_tensor_scale_y;
+		offset_x = m_tensor_offset_x;
+		offset_y = m_tensor_offset_y;
+	}
+
+	/**
+	* @brief set the stream id of the trace events of this transcoder, see CodecTrace
+	*/
+	void set_trace_id(uint32_t id)
+	{
+		m_trace_id = id;
+	}
+
+	/**
+	* @brief the metrics of this transcoder
+	*/
+	CodecMetrics& get_metrics()
+	{
+		return m_metrics;
+	}
+
+	/**
+	* @brief the memory accounting of this transcoder, e.g. a memory limit
+	*/
+	CodecMemory& get_memory()
+	{
+		return m_memory;
+	}
+
 private:
 	void free_context();
+	void free_tensor();
+	void write_tensor_row(uint8_t* dst, int y, int left, int count);
 
 private:
 	SwsContext* m_sws_context;
 	uint8_t* m_sws_frame_buffer;
+	int m_sws_frame_buffer_size;
 	AVFrame *m_sws_frame;
 
 	AVPixelFormat m_src_pixel_format;
 	int m_src_width;
 	int m_src_height;
+
+	CodecMetrics m_metrics;
+	CodecMemory m_memory;
+	uint32_t m_trace_id;
+
+	TensorOptions m_tensor_options;
+	uint8_t* m_tensor;
+	size_t m_tensor_buffer_size;
+	size_t m_tensor_frame_size;
+	int m_tensor_frames;
+	// the value of each channel and pixel value, in the output type
+	float m_tensor_lut[3][256];
+	uint8_t m_tensor_pad[3][4];
+	float m_tensor_scale_x;
+	float m_tensor_scale_y;
+	float m_tensor_offset_x;
+	float m_tensor_offset_y;
+
+	// the horizontal sample positions and weights, luma and chroma
+	std::vector<int> m_tensor_x0;
+	std::vector<int> m_tensor_x1;
+	std::vector<uint16_t> m_tensor_xw;
+	std::vector<int> m_tensor_cx0;
+	std::vector<int> m_tensor_cx1;
+	std::vector<uint16_t> m_tensor_cxw;
+	// the vertically interpolated source rows
+	std::vector<uint8_t> m_tensor_rows[3];
+	// the resized row and the converted output row, per channel
+	std::vector<uint8_t> m_tensor_yuv[3];
+	std::vector<uint8_t> m_tensor_rgb[3];
 };
 
 #endif
\ No newline at end of file
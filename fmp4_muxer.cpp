@@ -0,0 +1,423 @@
+#include "fmp4_muxer.h"
+#include <string.h>
+
+namespace
+{
+	// the media timescale, same as the MPEG-TS clock
+	const int MP4_TIMESCALE = 90000;
+
+	const uint32_t SAMPLE_FLAGS_KEY = 0x02000000;     // sample_depends_on = 2
+	const uint32_t SAMPLE_FLAGS_NON_KEY = 0x01010000; // sample_depends_on = 1, sample_is_non_sync_sample
+
+	void put_u16(std::vector<uint8_t>& buf, uint16_t v)
+	{
+		buf.push_back((uint8_t)(v >> 8));
+		buf.push_back((uint8_t)v);
+	}
+
+	void put_u32(std::vector<uint8_t>& buf, uint32_t v)
+	{
+		buf.push_back((uint8_t)(v >> 24));
+		buf.push_back((uint8_t)(v >> 16));
+		buf.push_back((uint8_t)(v >> 8));
+		buf.push_back((uint8_t)v);
+	}
+
+	void put_u64(std::vector<uint8_t>& buf, uint64_t v)
+	{
+		put_u32(buf, (uint32_t)(v >> 32));
+		put_u32(buf, (uint32_t)v);
+	}
+
+	void put_zeros(std::vector<uint8_t>& buf, size_t count)
+	{
+		buf.insert(buf.end(), count, 0);
+	}
+
+	void put_tag(std::vector<uint8_t>& buf, const char* tag)
+	{
+		buf.insert(buf.end(), tag, tag + 4);
+	}
+
+	size_t begin_box(std::vector<uint8_t>& buf, const char* type)
+	{
+		size_t start = buf.size();
+		put_u32(buf, 0);
+		put_tag(buf, type);
+		return start;
+	}
+
+	size_t begin_full_box(std::vector<uint8_t>& buf, const char* type, uint8_t version, uint32_t flags)
+	{
+		size_t start = begin_box(buf, type);
+		put_u32(buf, ((uint32_t)version << 24) | (flags & 0xFFFFFF));
+		return start;
+	}
+
+	void end_box(std::vector<uint8_t>& buf, size_t start)
+	{
+		uint32_t size = (uint32_t)(buf.size() - start);
+		buf[start] = (uint8_t)(size >> 24);
+		buf[start + 1] = (uint8_t)(size >> 16);
+		buf[start + 2] = (uint8_t)(size >> 8);
+		buf[start + 3] = (uint8_t)size;
+	}
+
+	void put_matrix(std::vector<uint8_t>& buf)
+	{
+		// the unity matrix
+		put_u32(buf, 0x00010000);
+		put_u32(buf, 0);
+		put_u32(buf, 0);
+		put_u32(buf, 0);
+		put_u32(buf, 0x00010000);
+		put_u32(buf, 0);
+		put_u32(buf, 0);
+		put_u32(buf, 0);
+		put_u32(buf, 0x40000000);
+	}
+}
+
+FMP4Muxer::FMP4Muxer()
+{
+	m_sink = NULL;
+	m_width = 0;
+	m_height = 0;
+	m_time_base.num = 1;
+	m_time_base.den = 25;
+	m_fragment_duration = 0;
+
+	m_header_written = false;
+	m_sequence = 0;
+	m_last_duration = 0;
+}
+
+FMP4Muxer::~FMP4Muxer()
+{
+}
+
+bool FMP4Muxer::init(MuxerSink* sink, int width, int height, AVRational time_base, int fragment_duration_ms)
+{
+	if (!sink || width <= 0 || height <= 0 || time_base.num <= 0 || time_base.den <= 0 || fragment_duration_ms <= 0)
+	{
+		return false;
+	}
+
+	m_sink = sink;
+	m_width = width;
+	m_height = height;
+	m_time_base = time_base;
+	m_fragment_duration = (int64_t)fragment_duration_ms * MP4_TIMESCALE / 1000;
+
+	m_header_written = false;
+	m_sequence = 0;
+	// the duration of the last sample is unknown, assume one time base tick until a real one is seen
+	AVRational timescale = { 1, MP4_TIMESCALE };
+	m_last_duration = av_rescale_q(1, time_base, timescale);
+	m_samples.clear();
+	m_mdat.clear();
+
+	return m_remuxer.init(H264Remuxer::FORMAT_ANNEXB, H264Remuxer::FORMAT_AVCC,
+		H264Remuxer::FLAG_STRIP_AUD | H264Remuxer::FLAG_STRIP_PARAMETER_SETS);
+}
+
+bool FMP4Muxer::write_packet(const AVPacket* packet)
+{
+	// a missing timestamp is taken from the other one, a packet without both can't be placed
+	if (!packet || (packet->pts == AV_NOPTS_VALUE && packet->dts == AV_NOPTS_VALUE))
+	{
+		return false;
+	}
+
+	int64_t pts = packet->pts == AV_NOPTS_VALUE ? packet->dts : packet->pts;
+	int64_t dts = packet->dts == AV_NOPTS_VALUE ? packet->pts : packet->dts;
+	return write_packet(packet->data, packet->size, pts, dts);
+}
+
+bool FMP4Muxer::write_packet(const uint8_t* data, size_t size, int64_t pts, int64_t dts)
+{
+	if (!m_sink)
+	{
+		return false;
+	}
+
+	if (!m_remuxer.process(data, size))
+	{
+		return false;
+	}
+
+	bool key = m_remuxer.is_key_frame();
+	if (!m_header_written)
+	{
+		// the decoder can't start before the first key frame
+		if (!key)
+		{
+			return true;
+		}
+
+		if (!write_init_segment())
+		{
+			return false;
+		}
+		m_header_written = true;
+	}
+
+	AVRational timescale = { 1, MP4_TIMESCALE };
+	int64_t dts90k = av_rescale_q(dts, m_time_base, timescale);
+	int64_t pts90k = av_rescale_q(pts, m_time_base, timescale);
+
+	if (!m_samples.empty())
+	{
+		int64_t elapsed = dts90k - m_samples[0].dts;
+		if ((key && elapsed >= m_fragment_duration) || elapsed >= 2 * m_fragment_duration)
+		{
+			if (!write_fragment(dts90k))
+			{
+				return false;
+			}
+		}
+	}
+
+	Sample sample;
+	sample.dts = dts90k;
+	sample.composition_offset = (int32_t)(pts90k - dts90k);
+	sample.size = (uint32_t)m_remuxer.get_output_size();
+	sample.key = key;
+	m_samples.push_back(sample);
+
+	const std::vector<H264Segment>& segments = m_remuxer.get_segments();
+	for (size_t i = 0; i < segments.size(); i++)
+	{
+		m_mdat.insert(m_mdat.end(), segments[i].data, segments[i].data + segments[i].size);
+	}
+
+	return true;
+}
+
+bool FMP4Muxer::finish()
+{
+	if (!m_sink)
+	{
+		return false;
+	}
+
+	if (!m_samples.empty())
+	{
+		int64_t nextDts = m_samples.back().dts + m_last_duration;
+		if (!write_fragment(nextDts))
+		{
+			return false;
+		}
+	}
+
+	return m_sink->flush();
+}
+
+bool FMP4Muxer::write_init_segment()
+{
+	std::vector<uint8_t> avcc;
+	if (!m_remuxer.get_extradata(H264Remuxer::FORMAT_AVCC, avcc))
+	{
+		return false;
+	}
+
+	std::vector<uint8_t>& buf = m_box;
+	buf.clear();
+
+	size_t ftyp = begin_box(buf, "ftyp");
+	put_tag(buf, "iso6");
+	put_u32(buf, 0);
+	put_tag(buf, "iso6");
+	put_tag(buf, "cmfc");
+	put_tag(buf, "mp41");
+	end_box(buf, ftyp);
+
+	size_t moov = begin_box(buf, "moov");
+	{
+		size_t mvhd = begin_full_box(buf, "mvhd", 0, 0);
+		put_u32(buf, 0);            // creation_time
+		put_u32(buf, 0);            // modification_time
+		put_u32(buf, 1000);         // timescale
+		put_u32(buf, 0);            // duration
+		put_u32(buf, 0x00010000);   // rate
+		put_u16(buf, 0x0100);       // volume
+		put_zeros(buf, 10);
+		put_matrix(buf);
+		put_zeros(buf, 24);
+		put_u32(buf, 2);            // next_track_ID
+		end_box(buf, mvhd);
+
+		size_t trak = begin_box(buf, "trak");
+		{
+			size_t tkhd = begin_full_box(buf, "tkhd", 0, 3);
+			put_u32(buf, 0);        // creation_time
+			put_u32(buf, 0);        // modification_time
+			put_u32(buf, 1);        // track_ID
+			put_u32(buf, 0);
+			put_u32(buf, 0);        // duration
+			put_zeros(buf, 8);
+			put_u16(buf, 0);        // layer
+			put_u16(buf, 0);        // alternate_group
+			put_u16(buf, 0);        // volume
+			put_u16(buf, 0);
+			put_matrix(buf);
+			put_u32(buf, (uint32_t)m_width << 16);
+			put_u32(buf, (uint32_t)m_height << 16);
+			end_box(buf, tkhd);
+
+			size_t mdia = begin_box(buf, "mdia");
+			{
+				size_t mdhd = begin_full_box(buf, "mdhd", 0, 0);
+				put_u32(buf, 0);
+				put_u32(buf, 0);
+				put_u32(buf, MP4_TIMESCALE);
+				put_u32(buf, 0);
+				put_u16(buf, 0x55C4); // und
+				put_u16(buf, 0);
+				end_box(buf, mdhd);
+
+				size_t hdlr = begin_full_box(buf, "hdlr", 0, 0);
+				put_u32(buf, 0);
+				put_tag(buf, "vide");
+				put_zeros(buf, 12);
+				const char name[] = "VideoHandler";
+				buf.insert(buf.end(), name, name + sizeof(name));
+				end_box(buf, hdlr);
+
+				size_t minf = begin_box(buf, "minf");
+				{
+					size_t vmhd = begin_full_box(buf, "vmhd", 0, 1);
+					put_zeros(buf, 8);
+					end_box(buf, vmhd);
+
+					size_t dinf = begin_box(buf, "dinf");
+					size_t dref = begin_full_box(buf, "dref", 0, 0);
+					put_u32(buf, 1);
+					size_t url = begin_full_box(buf, "url ", 0, 1);
+					end_box(buf, url);
+					end_box(buf, dref);
+					end_box(buf, dinf);
+
+					size_t stbl = begin_box(buf, "stbl");
+					{
+						size_t stsd = begin_full_box(buf, "stsd", 0, 0);
+						put_u32(buf, 1);
+						size_t avc1 = begin_box(buf, "avc1");
+						put_zeros(buf, 6);
+						put_u16(buf, 1);            // data_reference_index
+						put_zeros(buf, 16);
+						put_u16(buf, (uint16_t)m_width);
+						put_u16(buf, (uint16_t)m_height);
+						put_u32(buf, 0x00480000);   // 72 dpi
+						put_u32(buf, 0x00480000);
+						put_u32(buf, 0);
+						put_u16(buf, 1);            // frame_count
+						put_zeros(buf, 32);         // compressorname
+						put_u16(buf, 0x0018);       // depth
+						put_u16(buf, 0xFFFF);
+						size_t avcC = begin_box(buf, "avcC");
+						buf.insert(buf.end(), avcc.begin(), avcc.end());
+						end_box(buf, avcC);
+						end_box(buf, avc1);
+						end_box(buf, stsd);
+
+						// the samples are in the fragments, the tables are empty
+						size_t stts = begin_full_box(buf, "stts", 0, 0);
+						put_u32(buf, 0);
+						end_box(buf, stts);
+						size_t stsc = begin_full_box(buf, "stsc", 0, 0);
+						put_u32(buf, 0);
+						end_box(buf, stsc);
+						size_t stsz = begin_full_box(buf, "stsz", 0, 0);
+						put_u32(buf, 0);
+						put_u32(buf, 0);
+						end_box(buf, stsz);
+						size_t stco = begin_full_box(buf, "stco", 0, 0);
+						put_u32(buf, 0);
+						end_box(buf, stco);
+					}
+					end_box(buf, stbl);
+				}
+				end_box(buf, minf);
+			}
+			end_box(buf, mdia);
+		}
+		end_box(buf, trak);
+
+		size_t mvex = begin_box(buf, "mvex");
+		size_t trex = begin_full_box(buf, "trex", 0, 0);
+		put_u32(buf, 1);    // track_ID
+		put_u32(buf, 1);    // default_sample_description_index
+		put_u32(buf, 0);
+		put_u32(buf, 0);
+		put_u32(buf, 0);
+		end_box(buf, trex);
+		end_box(buf, mvex);
+	}
+	end_box(buf, moov);
+
+	return m_sink->write(buf.data(), buf.size());
+}
+
+bool FMP4Muxer::write_fragment(int64_t next_dts)
+{
+	std::vector<uint8_t>& buf = m_box;
+	buf.clear();
+
+	m_sink->begin_fragment(m_samples[0].dts, m_samples[0].key);
+
+	size_t moof = begin_box(buf, "moof");
+	size_t mfhd = begin_full_box(buf, "mfhd", 0, 0);
+	put_u32(buf, ++m_sequence);
+	end_box(buf, mfhd);
+
+	size_t traf = begin_box(buf, "traf");
+	size_t tfhd = begin_full_box(buf, "tfhd", 0, 0x020000); // default-base-is-moof
+	put_u32(buf, 1);
+	end_box(buf, tfhd);
+
+	size_t tfdt = begin_full_box(buf, "tfdt", 1, 0);
+	put_u64(buf, (uint64_t)m_samples[0].dts);
+	end_box(buf, tfdt);
+
+	// data offset, sample duration, size, flags and composition time offset
+	size_t trun = begin_full_box(buf, "trun", 1, 0x000F01);
+	put_u32(buf, (uint32_t)m_samples.size());
+	size_t dataOffset = buf.size();
+	put_u32(buf, 0);
+	for (size_t i = 0; i < m_samples.size(); i++)
+	{
+		const Sample& sample = m_samples[i];
+		int64_t nextSampleDts = i + 1 < m_samples.size() ? m_samples[i + 1].dts : next_dts;
+		int64_t duration = nextSampleDts - sample.dts;
+		if (duration <= 0)
+		{
+			duration = m_last_duration;
+		}
+		m_last_duration = duration;
+
+		put_u32(buf, (uint32_t)duration);
+		put_u32(buf, sample.size);
+		put_u32(buf, sample.key ? SAMPLE_FLAGS_KEY : SAMPLE_FLAGS_NON_KEY);
+		put_u32(buf, (uint32_t)sample.composition_offset);
+	}
+	end_box(buf, trun);
+	end_box(buf, traf);
+	end_box(buf, moof);
+
+	// the data starts after the moof and the mdat header
+	uint32_t offset = (uint32_t)(buf.size() + 8);
+	buf[dataOffset] = (uint8_t)(offset >> 24);
+	buf[dataOffset + 1] = (uint8_t)(offset >> 16);
+	buf[dataOffset + 2] = (uint8_t)(offset >> 8);
+	buf[dataOffset + 3] = (uint8_t)offset;
+
+	put_u32(buf, (uint32_t)(m_mdat.size() + 8));
+	put_tag(buf, "mdat");
+
+	bool ret = m_sink->write(buf.data(), buf.size()) && m_sink->write(m_mdat.data(), m_mdat.size());
+
+	m_samples.clear();
+	m_mdat.clear();
+	return ret;
+}
\ No newline at end of file
@@ -0,0 +1,100 @@
+#ifndef _H_FMP4_MUXER_H_
+#define _H_FMP4_MUXER_H_
+
+#include <stdint.h>
+#include <vector>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+#include "h264_remuxer.h"
+#include "muxer_sink.h"
+
+/**
+* streaming fragmented MP4(CMAF) muxer for the H264 Annex-B packets of FFmpegEncoder.
+*
+* the init segment(ftyp + moov) is written on the first key frame, then every
+* fragment(moof + mdat) is written as soon as it is complete. only the samples
+* of the current fragment are kept in memory.
+*/
+class FMP4Muxer
+{
+public:
+	FMP4Muxer();
+	virtual ~FMP4Muxer();
+
+	/**
+	 * @brief initialize
+	 *
+	 * @param sink -- the output, it must be valid until finish()
+	 *        width -- the video width
+	 *        height -- the video height
+	 *        time_base -- the time base of the packet timestamps
+	 *        fragment_duration_ms -- the target fragment duration, a fragment is cut
+	 *                                before the next key frame once it is reached
+	 *
+	 * @return true -- successful
+	 *         false -- failed
+	 */
+	bool init(MuxerSink* sink, int width, int height, AVRational time_base, int fragment_duration_ms);
+
+	/**
+	 * @brief write an encoded packet
+	 *
+	 * @param packet -- the Annex-B packet, a missing pts or dts is taken from the other one
+	 *
+	 * @return true -- successful
+	 *         false -- failed, or the packet has neither pts nor dts
+	 */
+	bool write_packet(const AVPacket* packet);
+
+	/**
+	 * @brief write an encoded access unit
+	 *
+	 * @param data -- the Annex-B data
+	 *        size -- the data size
+	 *        pts -- the presentation timestamp, in time_base
+	 *        dts -- the decode timestamp, in time_base
+	 *
+	 * @return true -- successful
+	 *         false -- failed
+	 */
+	bool write_packet(const uint8_t* data, size_t size, int64_t pts, int64_t dts);
+
+	/**
+	 * @brief write the last fragment and flush the sink
+	 */
+	bool finish();
+
+private:
+	struct Sample
+	{
+		int64_t dts;
+		int32_t composition_offset;
+		uint32_t size;
+		bool key;
+	};
+
+	bool write_init_segment();
+	bool write_fragment(int64_t next_dts);
+
+private:
+	MuxerSink* m_sink;
+	int m_width;
+	int m_height;
+	AVRational m_time_base;
+	int64_t m_fragment_duration;
+
+	H264Remuxer m_remuxer;
+	bool m_header_written;
+	uint32_t m_sequence;
+	int64_t m_last_duration;
+
+	std::vector<Sample> m_samples;
+	std::vector<uint8_t> m_mdat;
+	std::vector<uint8_t> m_box;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,302 @@
+#include "gop_cache.h"
+#include <new>
+#include <chrono>
+
+GopSubscriber::GopSubscriber(size_t queue_size, DropPolicy policy)
+{
+	m_policy = policy;
+	m_waiting_key_frame = true;
+	m_closed = false;
+	m_dropped = 0;
+
+	m_queue.resize(queue_size, NULL);
+	m_head = 0;
+	m_count = 0;
+
+	m_packet = NULL;
+}
+
+GopSubscriber::~GopSubscriber()
+{
+	for (size_t i = 0; i < m_queue.size(); i++)
+	{
+		if (m_queue[i])
+		{
+			av_packet_free(&m_queue[i]);
+		}
+	}
+	m_queue.clear();
+
+	if (m_packet)
+	{
+		av_packet_free(&m_packet);
+		m_packet = NULL;
+	}
+}
+
+bool GopSubscriber::alloc_queue()
+{
+	for (size_t i = 0; i < m_queue.size(); i++)
+	{
+		m_queue[i] = av_packet_alloc();
+		if (!m_queue[i])
+		{
+			return false;
+		}
+	}
+
+	m_packet = av_packet_alloc();
+	if (!m_packet)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+void GopSubscriber::clear_queue()
+{
+	while (m_count > 0)
+	{
+		av_packet_unref(m_queue[m_head]);
+		m_head = (m_head + 1) % m_queue.size();
+		m_count--;
+		m_dropped++;
+	}
+}
+
+bool GopSubscriber::enqueue(const AVPacket* packet)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_closed)
+		{
+			return false;
+		}
+
+		bool key = (packet->flags & AV_PKT_FLAG_KEY) != 0;
+		if (m_waiting_key_frame)
+		{
+			if (!key)
+			{
+				m_dropped++;
+				return true;
+			}
+			m_waiting_key_frame = false;
+		}
+
+		if (m_count == m_queue.size())
+		{
+			// the slow consumer
+			clear_queue();
+			if (m_policy == DROP_DISCONNECT)
+			{
+				m_closed = true;
+				m_cond.notify_all();
+				return false;
+			}
+
+			if (!key)
+			{
+				m_dropped++;
+				m_waiting_key_frame = true;
+				return true;
+			}
+		}
+
+		AVPacket* slot = m_queue[(m_head + m_count) % m_queue.size()];
+		if (av_packet_ref(slot, packet) < 0)
+		{
+			m_dropped++;
+			m_waiting_key_frame = true;
+			return true;
+		}
+		m_count++;
+	}
+	m_cond.notify_one();
+
+	return true;
+}
+
+AVPacket* GopSubscriber::receive_packet(int timeout_ms)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	av_packet_unref(m_packet);
+	if (m_count == 0 && timeout_ms > 0 && !m_closed)
+	{
+		m_cond.wait_for(lock, std::chrono::milliseconds(timeout_ms));
+	}
+
+	if (m_count == 0)
+	{
+		return NULL;
+	}
+
+	av_packet_move_ref(m_packet, m_queue[m_head]);
+	m_head = (m_head + 1) % m_queue.size();
+	m_count--;
+
+	return m_packet;
+}
+
+void GopSubscriber::end_receive_packet()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	av_packet_unref(m_packet);
+}
+
+bool GopSubscriber::is_closed()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_closed;
+}
+
+int64_t GopSubscriber::get_dropped_count()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_dropped;
+}
+
+GopCache::GopCache()
+{
+	m_max_gop_packets = 0;
+	m_gop_valid = false;
+}
+
+GopCache::~GopCache()
+{
+	clear_gop();
+
+	for (size_t i = 0; i < m_subscribers.size(); i++)
+	{
+		delete m_subscribers[i];
+	}
+	m_subscribers.clear();
+}
+
+bool GopCache::init(size_t max_gop_packets)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (max_gop_packets == 0)
+	{
+		return false;
+	}
+
+	clear_gop();
+	m_max_gop_packets = max_gop_packets;
+	m_gop.reserve(max_gop_packets);
+
+	return true;
+}
+
+void GopCache::clear_gop()
+{
+	for (size_t i = 0; i < m_gop.size(); i++)
+	{
+		av_packet_free(&m_gop[i]);
+	}
+	m_gop.clear();
+	m_gop_valid = false;
+}
+
+bool GopCache::push_packet(const AVPacket* packet)
+{
+	if (!packet)
+	{
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (packet->flags & AV_PKT_FLAG_KEY)
+	{
+		clear_gop();
+		m_gop_valid = true;
+	}
+
+	if (m_gop_valid)
+	{
+		if (m_gop.size() < m_max_gop_packets)
+		{
+			// a reference, the data buffer is shared
+			AVPacket* cached = av_packet_clone(packet);
+			if (!cached)
+			{
+				clear_gop();
+				return false;
+			}
+			m_gop.push_back(cached);
+		}
+		else
+		{
+			// an incomplete GOP is useless for the late joiners
+			clear_gop();
+		}
+	}
+
+	for (size_t i = 0; i < m_subscribers.size(); i++)
+	{
+		m_subscribers[i]->enqueue(packet);
+	}
+
+	return true;
+}
+
+GopSubscriber* GopCache::subscribe(size_t queue_size, GopSubscriber::DropPolicy policy)
+{
+	if (queue_size == 0)
+	{
+		return NULL;
+	}
+
+	GopSubscriber* subscriber = new (std::nothrow) GopSubscriber(queue_size, policy);
+	if (!subscriber)
+	{
+		return NULL;
+	}
+
+	if (!subscriber->alloc_queue())
+	{
+		delete subscriber;
+		return NULL;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// the cached GOP first, the live packets follow without gap
+	if (m_gop_valid && m_gop.size() <= queue_size)
+	{
+		for (size_t i = 0; i < m_gop.size(); i++)
+		{
+			subscriber->enqueue(m_gop[i]);
+		}
+	}
+
+	m_subscribers.push_back(subscriber);
+	return subscriber;
+}
+
+void GopCache::unsubscribe(GopSubscriber* subscriber)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (size_t i = 0; i < m_subscribers.size(); i++)
+		{
+			if (m_subscribers[i] == subscriber)
+			{
+				m_subscribers.erase(m_subscribers.begin() + i);
+				break;
+			}
+		}
+	}
+
+	delete subscriber;
+}
+
+size_t GopCache::get_subscriber_count()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_subscribers.size();
+}
\ No newline at end of file
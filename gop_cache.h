@@ -0,0 +1,143 @@
+#ifndef _H_GOP_CACHE_H_
+#define _H_GOP_CACHE_H_
+
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+class GopCache;
+
+/**
+* one subscriber of a GopCache, it has its own bounded packet queue.
+* the queued packets share the data buffers with the cache, nothing is copied.
+*/
+class GopSubscriber
+{
+public:
+	enum DropPolicy
+	{
+		// when the queue is full, drop the queued packets and wait for the next key frame
+		DROP_TO_KEY_FRAME = 0,
+		// when the queue is full, close the subscriber
+		DROP_DISCONNECT
+	};
+
+	/**
+	 * @brief receive the next packet
+	 *
+	 * @param timeout_ms -- the wait time when the queue is empty, 0 returns immediately
+	 *
+	 * @return the AVPacket pointer, NULL if there is no packet or the subscriber was closed.
+	 * Make sure that you MUST not delete the returned pointer,
+	 * it's lifetime was managed by the GopSubscriber.
+	 */
+	AVPacket* receive_packet(int timeout_ms);
+	void end_receive_packet();
+
+	/**
+	 * @brief if the subscriber was closed by the DROP_DISCONNECT policy
+	 */
+	bool is_closed();
+
+	/**
+	 * @brief the count of the packets dropped for this subscriber
+	 */
+	int64_t get_dropped_count();
+
+private:
+	friend class GopCache;
+
+	GopSubscriber(size_t queue_size, DropPolicy policy);
+	virtual ~GopSubscriber();
+
+	bool alloc_queue();
+	bool enqueue(const AVPacket* packet);
+	void clear_queue();
+
+private:
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+
+	DropPolicy m_policy;
+	bool m_waiting_key_frame;
+	bool m_closed;
+	int64_t m_dropped;
+
+	// the ring of preallocated packets
+	std::vector<AVPacket*> m_queue;
+	size_t m_head;
+	size_t m_count;
+
+	AVPacket* m_packet;
+};
+
+/**
+* the GOP cache for fanning out one encoded stream to many subscribers.
+*
+* it keeps the latest IDR frame and its dependent packets as refcounted AVPackets,
+* a new subscriber receives the cached GOP immediately and then the live packets,
+* so it doesn't wait for the next IDR and the encoder needn't force one.
+*/
+class GopCache
+{
+public:
+	GopCache();
+	virtual ~GopCache();
+
+	/**
+	 * @brief initialize
+	 *
+	 * @param max_gop_packets -- the max packets of the cached GOP, a longer GOP isn't
+	 *                           cached until the next key frame
+	 *
+	 * @return true -- successful
+	 *         false -- failed
+	 */
+	bool init(size_t max_gop_packets);
+
+	/**
+	 * @brief cache the packet and fan it out to all the subscribers
+	 *
+	 * @param packet -- the encoded packet, the key frame must have AV_PKT_FLAG_KEY
+	 *
+	 * @return true -- successful
+	 *         false -- failed
+	 */
+	bool push_packet(const AVPacket* packet);
+
+	/**
+	 * @brief add a subscriber, the cached GOP is queued to it at once
+	 *
+	 * @param queue_size -- the max queued packets, it should hold a whole GOP
+	 *        policy -- what to do when the queue is full
+	 *
+	 * @return the subscriber, NULL if failed.
+	 * it's lifetime was managed by the GopCache, release it by unsubscribe()
+	 */
+	GopSubscriber* subscribe(size_t queue_size, GopSubscriber::DropPolicy policy);
+	void unsubscribe(GopSubscriber* subscriber);
+
+	/**
+	 * @brief the count of the subscribers
+	 */
+	size_t get_subscriber_count();
+
+private:
+	void clear_gop();
+
+private:
+	std::mutex m_mutex;
+
+	size_t m_max_gop_packets;
+	bool m_gop_valid;
+	std::vector<AVPacket*> m_gop;
+	std::vector<GopSubscriber*> m_subscribers;
+};
+
+#endif
\ No newline at end of file
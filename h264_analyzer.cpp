@@ -0,0 +1,631 @@
+#include "h264_analyzer.h"
+#include "codec_utils.h"
+#include <string.h>
+
+namespace
+{
+	// the slice header fields used fit in it, the slice data is never read
+	const size_t SLICE_HEADER_SIZE = 32;
+	// an SPS with the scaling lists
+	const size_t PARAMETER_SET_SIZE = 512;
+
+	// copies the RBSP bytes of a NAL unit payload, without the emulation prevention bytes
+	size_t unescape_rbsp(const uint8_t *src, const uint8_t *end, uint8_t *dst, size_t max_size)
+	{
+		size_t size = 0;
+		int zeros = 0;
+		while (src < end && size < max_size)
+		{
+			if (zeros >= 2 && *src == 3)
+			{
+				src++;
+				zeros = 0;
+				continue;
+			}
+
+			uint8_t value = *src++;
+			dst[size++] = value;
+			zeros = value ? 0 : zeros + 1;
+		}
+
+		return size;
+	}
+
+	// reads the bits and the exp-Golomb codes, a read past the end returns 0 and sets failed
+	struct BitReader
+	{
+		const uint8_t *data;
+		size_t bits;
+		size_t pos;
+
+		uint32_t read_bit()
+		{
+			if (pos >= bits)
+			{
+				pos = bits + 1;
+				return 0;
+			}
+
+			uint32_t value = (data[pos >> 3] >> (7 - (pos & 7))) & 1;
+			pos++;
+			return value;
+		}
+
+		uint32_t read_bits(int count)
+		{
+			uint32_t value = 0;
+			while (count-- > 0)
+			{
+				value = (value << 1) | read_bit();
+			}
+			return value;
+		}
+
+		uint32_t read_ue()
+		{
+			int zeros = 0;
+			while (!read_bit())
+			{
+				if (++zeros > 31 || failed())
+				{
+					pos = bits + 1;
+					return 0;
+				}
+			}
+
+			return ((1u << zeros) - 1) + read_bits(zeros);
+		}
+
+		int32_t read_se()
+		{
+			uint32_t value = read_ue();
+			return (value & 1) ? (int32_t)((value + 1) >> 1) : -(int32_t)(value >> 1);
+		}
+
+		bool failed() const
+		{
+			return pos > bits;
+		}
+	};
+
+	bool has_chroma_format(int profile)
+	{
+		switch (profile)
+		{
+		case 100: case 110: case 122: case 244: case 44: case 83:
+		case 86: case 118: case 128: case 138: case 139: case 134: case 135:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	void skip_scaling_list(BitReader &reader, int size)
+	{
+		int last = 8;
+		int next = 8;
+		for (int i = 0; i < size && next != 0; i++)
+		{
+			next = (last + reader.read_se() + 256) % 256;
+			last = next ? next : last;
+		}
+	}
+
+	char get_slice_type(uint32_t slice_type)
+	{
+		switch (slice_type % 5)
+		{
+		case 0:
+		case 3:
+			return 'P';
+		case 1:
+			return 'B';
+		default:
+			return 'I';
+		}
+	}
+}
+
+H264StreamAnalyzer::H264StreamAnalyzer()
+{
+	m_history_pos = 0;
+	m_history_count = 0;
+	reset();
+}
+
+H264StreamAnalyzer::~H264StreamAnalyzer()
+{
+}
+
+bool H264StreamAnalyzer::init(int history)
+{
+	if (history <= 0)
+	{
+		return false;
+	}
+
+	m_history.assign(history, H264FrameInfo());
+	reset();
+	return true;
+}
+
+void H264StreamAnalyzer::reset()
+{
+	memset(m_sps, 0, sizeof(m_sps));
+	memset(m_pps, 0, sizeof(m_pps));
+	memset(&m_current, 0, sizeof(m_current));
+	memset(&m_stats, 0, sizeof(m_stats));
+
+	m_has_data = false;
+	m_has_slice = false;
+	m_current_gaps_allowed = false;
+	m_current_max_frame_num = 0;
+	m_current_pps_id = -1;
+	m_current_idr_pic_id = -1;
+	m_current_field = 0;
+	m_timestamp = 0;
+
+	m_prev_ref_frame_num = -1;
+	m_gop_length = 0;
+	m_gops = 0;
+	m_gop_frames = 0;
+
+	m_history_pos = 0;
+	m_history_count = 0;
+}
+
+int H264StreamAnalyzer::push(const uint8_t* data, size_t size, int64_t timestamp_us)
+{
+	int completed = 0;
+	const uint8_t *nalStart;
+	const uint8_t *nalEnd;
+	const uint8_t *nal;
+	const uint8_t *end = data + size;
+
+	m_timestamp = timestamp_us;
+
+	nalStart = avc_find_start_code(data, end);
+	while (nalStart < end)
+	{
+		nal = nalStart;
+		while (nal < end && !*(nal++))
+			;
+
+		if (nal == end)
+		{
+			break;
+		}
+
+		nalEnd = avc_find_start_code(nal, end);
+		if (parse_nal(nal, nalEnd, nalEnd - nalStart))
+		{
+			completed++;
+		}
+		nalStart = nalEnd;
+	}
+
+	return completed;
+}
+
+int H264StreamAnalyzer::flush()
+{
+	bool completed = end_picture();
+	m_has_data = false;
+	return completed ? 1 : 0;
+}
+
+bool H264StreamAnalyzer::parse_nal(const uint8_t* nal, const uint8_t* end, size_t nal_size)
+{
+	int type = nal[0] & 0x1F;
+	bool completed = false;
+
+	if (type == 1 || type == 5)
+	{
+		completed = parse_slice(nal, end);
+	}
+	else
+	{
+		// SEI, SPS, PPS, AUD and 14-18 start the next access unit(7.4.1.2.3)
+		if (m_has_slice && (type == 6 || type == 7 || type == 8 || type == 9 || (type >= 14 && type <= 18)))
+		{
+			completed = end_picture();
+		}
+
+		if (!m_has_data)
+		{
+			begin_picture();
+		}
+
+		if (type == 7)
+		{
+			parse_sps(nal, end);
+		}
+		else if (type == 8)
+		{
+			parse_pps(nal, end);
+		}
+		else if (type == 6 && avc_find_recovery_point(nal - 3, end - nal + 3))
+		{
+			// the start code is at least 00 00 01
+			m_current.recovery_point = true;
+		}
+	}
+
+	m_current.size += (uint32_t)nal_size;
+	return completed;
+}
+
+bool H264StreamAnalyzer::parse_sps(const uint8_t* nal, const uint8_t* end)
+{
+	uint8_t rbsp[PARAMETER_SET_SIZE];
+	size_t size = unescape_rbsp(nal + 1, end, rbsp, sizeof(rbsp));
+	BitReader reader = { rbsp, size * 8, 0 };
+
+	int profile = (int)reader.read_bits(8);
+	// constraint flags and level_idc
+	reader.read_bits(16);
+	uint32_t id = reader.read_ue();
+	if (id >= sizeof(m_sps) / sizeof(m_sps[0]))
+	{
+		return false;
+	}
+
+	SequenceParameterSet sps;
+	memset(&sps, 0, sizeof(sps));
+
+	uint32_t chromaFormat = 1;
+	if (has_chroma_format(profile))
+	{
+		chromaFormat = reader.read_ue();
+		if (chromaFormat == 3)
+		{
+			sps.separate_colour_plane = reader.read_bit() != 0;
+		}
+		// bit depths and qpprime_y_zero_transform_bypass_flag
+		reader.read_ue();
+		reader.read_ue();
+		reader.read_bit();
+		if (reader.read_bit())
+		{
+			for (int i = 0; i < (chromaFormat != 3 ? 8 : 12); i++)
+			{
+				if (reader.read_bit())
+				{
+					skip_scaling_list(reader, i < 6 ? 16 : 64);
+				}
+			}
+		}
+	}
+
+	sps.log2_max_frame_num = (int)reader.read_ue() + 4;
+	sps.poc_type = (int)reader.read_ue();
+	if (sps.poc_type == 0)
+	{
+		sps.log2_max_poc_lsb = (int)reader.read_ue() + 4;
+		if (sps.log2_max_poc_lsb > 16)
+		{
+			return false;
+		}
+	}
+	else if (sps.poc_type == 1)
+	{
+		reader.read_bit();
+		reader.read_se();
+		reader.read_se();
+		uint32_t cycle = reader.read_ue();
+		if (cycle > 255)
+		{
+			return false;
+		}
+		for (uint32_t i = 0; i < cycle; i++)
+		{
+			reader.read_se();
+		}
+	}
+	else if (sps.poc_type != 2)
+	{
+		return false;
+	}
+
+	// max_num_ref_frames
+	reader.read_ue();
+	sps.gaps_in_frame_num_allowed = reader.read_bit() != 0;
+	int widthMbs = (int)reader.read_ue() + 1;
+	int heightMapUnits = (int)reader.read_ue() + 1;
+	sps.frame_mbs_only = reader.read_bit() != 0;
+	if (!sps.frame_mbs_only)
+	{
+		// mb_adaptive_frame_field_flag
+		reader.read_bit();
+	}
+	// direct_8x8_inference_flag
+	reader.read_bit();
+
+	int cropLeft = 0;
+	int cropRight = 0;
+	int cropTop = 0;
+	int cropBottom = 0;
+	if (reader.read_bit())
+	{
+		cropLeft = (int)reader.read_ue();
+		cropRight = (int)reader.read_ue();
+		cropTop = (int)reader.read_ue();
+		cropBottom = (int)reader.read_ue();
+	}
+
+	if (reader.failed() || sps.log2_max_frame_num > 16 || chromaFormat > 3)
+	{
+		return false;
+	}
+
+	int frameHeightFactor = sps.frame_mbs_only ? 1 : 2;
+	int cropUnitX = 1;
+	int cropUnitY = frameHeightFactor;
+	if (chromaFormat != 0 && !sps.separate_colour_plane)
+	{
+		cropUnitX = (chromaFormat == 3) ? 1 : 2;
+		cropUnitY = ((chromaFormat == 1) ? 2 : 1) * frameHeightFactor;
+	}
+
+	sps.width = widthMbs * 16 - cropUnitX * (cropLeft + cropRight);
+	sps.height = heightMapUnits * 16 * frameHeightFactor - cropUnitY * (cropTop + cropBottom);
+	if (sps.width <= 0 || sps.height <= 0)
+	{
+		return false;
+	}
+
+	sps.valid = true;
+	m_sps[id] = sps;
+	m_stats.width = sps.width;
+	m_stats.height = sps.height;
+	return true;
+}
+
+bool H264StreamAnalyzer::parse_pps(const uint8_t* nal, const uint8_t* end)
+{
+	uint8_t rbsp[SLICE_HEADER_SIZE];
+	size_t size = unescape_rbsp(nal + 1, end, rbsp, sizeof(rbsp));
+	BitReader reader = { rbsp, size * 8, 0 };
+
+	uint32_t id = reader.read_ue();
+	uint32_t spsId = reader.read_ue();
+	if (reader.failed() || id >= sizeof(m_pps) / sizeof(m_pps[0]) || spsId >= sizeof(m_sps) / sizeof(m_sps[0]))
+	{
+		return false;
+	}
+
+	m_pps[id].valid = true;
+	m_pps[id].sps_id = (int)spsId;
+	return true;
+}
+
+bool H264StreamAnalyzer::parse_slice(const uint8_t* nal, const uint8_t* end)
+{
+	uint8_t rbsp[SLICE_HEADER_SIZE];
+	size_t size = unescape_rbsp(nal + 1, end, rbsp, sizeof(rbsp));
+	BitReader reader = { rbsp, size * 8, 0 };
+
+	bool idr = (nal[0] & 0x1F) == 5;
+	bool reference = (nal[0] & 0x60) != 0;
+	uint32_t firstMb = reader.read_ue();
+	uint32_t sliceType = reader.read_ue();
+	uint32_t ppsId = reader.read_ue();
+	bool valid = !reader.failed() && sliceType <= 9;
+
+	int frameNum = -1;
+	int pocLsb = -1;
+	int field = 0;
+	int idrPicId = -1;
+	const SequenceParameterSet *sps = NULL;
+	if (valid && ppsId < sizeof(m_pps) / sizeof(m_pps[0]) && m_pps[ppsId].valid && m_sps[m_pps[ppsId].sps_id].valid)
+	{
+		sps = &m_sps[m_pps[ppsId].sps_id];
+		if (sps->separate_colour_plane)
+		{
+			// colour_plane_id
+			reader.read_bits(2);
+		}
+
+		frameNum = (int)reader.read_bits(sps->log2_max_frame_num);
+		if (!sps->frame_mbs_only && reader.read_bit())
+		{
+			field = reader.read_bit() ? 2 : 1;
+		}
+
+		if (idr)
+		{
+			idrPicId = (int)reader.read_ue();
+		}
+
+		if (sps->poc_type == 0)
+		{
+			pocLsb = (int)reader.read_bits(sps->log2_max_poc_lsb);
+		}
+
+		if (reader.failed())
+		{
+			sps = NULL;
+			frameNum = -1;
+			pocLsb = -1;
+		}
+	}
+
+	// the first slice of the next picture(7.4.1.2.4), the slices are assumed in order
+	bool completed = false;
+	if (m_has_slice && valid &&
+		(firstMb == 0 || (int)ppsId != m_current_pps_id || idr != m_current.idr || reference != m_current.reference ||
+		(frameNum >= 0 && m_current.frame_num >= 0 &&
+		(frameNum != m_current.frame_num || field != m_current_field || idrPicId != m_current_idr_pic_id))))
+	{
+		completed = end_picture();
+	}
+
+	if (!m_has_data)
+	{
+		begin_picture();
+	}
+
+	if (!m_has_slice)
+	{
+		m_has_slice = true;
+		m_current.type = valid ? get_slice_type(sliceType) : 'P';
+		m_current.idr = idr;
+		m_current.reference = reference;
+		m_current.frame_num = frameNum;
+		m_current.poc_lsb = pocLsb;
+		m_current_pps_id = valid ? (int)ppsId : -1;
+		m_current_idr_pic_id = idrPicId;
+		m_current_field = field;
+		m_current_gaps_allowed = sps ? sps->gaps_in_frame_num_allowed : false;
+		m_current_max_frame_num = sps ? (1 << sps->log2_max_frame_num) : 0;
+	}
+	else if (valid)
+	{
+		char type = get_slice_type(sliceType);
+		if (type == 'B' || (type == 'P' && m_current.type == 'I'))
+		{
+			m_current.type = type;
+		}
+	}
+
+	m_current.slices++;
+	return completed;
+}
+
+void H264StreamAnalyzer::begin_picture()
+{
+	memset(&m_current, 0, sizeof(m_current));
+	m_current.timestamp_us = m_timestamp;
+	m_current.frame_num = -1;
+	m_current.poc_lsb = -1;
+	m_has_data = true;
+	m_has_slice = false;
+}
+
+bool H264StreamAnalyzer::end_picture()
+{
+	if (!m_has_slice)
+	{
+		return false;
+	}
+
+	m_has_data = false;
+	m_has_slice = false;
+
+	// 8.2.5.2, a frame_num other than PrevRefFrameNum and PrevRefFrameNum + 1
+	if (m_current.idr)
+	{
+		m_prev_ref_frame_num = m_current.frame_num;
+	}
+	else if (m_current.frame_num >= 0 && m_prev_ref_frame_num >= 0 && m_current_max_frame_num > 0)
+	{
+		int expected = (m_prev_ref_frame_num + 1) % m_current_max_frame_num;
+		if (m_current.frame_num != m_prev_ref_frame_num && m_current.frame_num != expected && !m_current_gaps_allowed)
+		{
+			m_current.frame_num_gap = true;
+			m_stats.frame_num_gaps++;
+			m_stats.missing_frames += (m_current.frame_num - expected + m_current_max_frame_num) % m_current_max_frame_num;
+		}
+
+		if (m_current.reference)
+		{
+			m_prev_ref_frame_num = m_current.frame_num;
+		}
+	}
+
+	m_stats.frames++;
+	m_stats.bytes += m_current.size;
+	if (m_current.type == 'I')
+	{
+		m_stats.i_frames++;
+	}
+	else if (m_current.type == 'P')
+	{
+		m_stats.p_frames++;
+	}
+	else
+	{
+		m_stats.b_frames++;
+	}
+
+	if (m_current.idr)
+	{
+		m_stats.idr_frames++;
+	}
+
+	// the pictures before the first key frame aren't a GOP
+	if (m_current.idr || m_current.recovery_point)
+	{
+		if (m_gop_length > 0)
+		{
+			m_gops++;
+			m_gop_frames += m_gop_length;
+			m_stats.last_gop_length = m_gop_length;
+			m_stats.average_gop_length = (double)m_gop_frames / m_gops;
+		}
+		m_gop_length = 1;
+	}
+	else if (m_gop_length > 0)
+	{
+		m_gop_length++;
+	}
+
+	if (!m_history.empty())
+	{
+		m_history[m_history_pos] = m_current;
+		m_history_pos = (m_history_pos + 1) % m_history.size();
+		if (m_history_count < m_history.size())
+		{
+			m_history_count++;
+		}
+	}
+
+	return true;
+}
+
+void H264StreamAnalyzer::get_history(std::vector<H264FrameInfo>& frames, int count) const
+{
+	size_t n = (count <= 0 || (size_t)count > m_history_count) ? m_history_count : (size_t)count;
+
+	frames.resize(n);
+	for (size_t i = 0; i < n; i++)
+	{
+		frames[i] = m_history[(m_history_pos + m_history.size() - n + i) % m_history.size()];
+	}
+}
+
+std::string H264StreamAnalyzer::get_type_sequence(int count) const
+{
+	size_t n = (count <= 0 || (size_t)count > m_history_count) ? m_history_count : (size_t)count;
+
+	std::string types(n, ' ');
+	for (size_t i = 0; i < n; i++)
+	{
+		types[i] = m_history[(m_history_pos + m_history.size() - n + i) % m_history.size()].type;
+	}
+
+	return types;
+}
+
+int64_t H264StreamAnalyzer::get_bitrate(int64_t window_us) const
+{
+	if (window_us <= 0 || m_history_count == 0)
+	{
+		return 0;
+	}
+
+	size_t last = (m_history_pos + m_history.size() - 1) % m_history.size();
+	int64_t start = m_history[last].timestamp_us - window_us;
+	uint64_t bytes = 0;
+	for (size_t i = 0; i < m_history_count; i++)
+	{
+		const H264FrameInfo& frame = m_history[(last + m_history.size() - i) % m_history.size()];
+		if (frame.timestamp_us <= start)
+		{
+			break;
+		}
+		bytes += frame.size;
+	}
+
+	return (int64_t)(bytes * 8 * 1000000 / (uint64_t)window_us);
+}
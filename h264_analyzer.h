@@ -0,0 +1,188 @@
+#ifndef _H_H264_ANALYZER_H_
+#define _H_H264_ANALYZER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <string>
+
+/**
+* one coded picture(a frame, or a field of an interlaced stream) found by H264StreamAnalyzer
+*/
+struct H264FrameInfo
+{
+	// the timestamp passed with the data of its first NAL unit
+	int64_t timestamp_us;
+	// the access unit size with the start codes and the SPS/PPS/SEI before the slices
+	uint32_t size;
+	// 'I', 'P' or 'B', a picture with a B slice is 'B', else with a P slice is 'P'
+	char type;
+	bool idr;
+	// it has a recovery point SEI, the decoding can start from it(e.g. intra refresh)
+	bool recovery_point;
+	// nal_ref_idc isn't 0
+	bool reference;
+	// -1 if its PPS or SPS wasn't received yet
+	int frame_num;
+	// pic_order_cnt_lsb, -1 if the SPS uses pic_order_cnt_type 1 or 2
+	int poc_lsb;
+	int slices;
+	// frame_num skipped some reference pictures, e.g. lost packets
+	bool frame_num_gap;
+};
+
+struct H264StreamStats
+{
+	uint64_t frames;
+	uint64_t i_frames;
+	uint64_t p_frames;
+	uint64_t b_frames;
+	uint64_t idr_frames;
+	uint64_t bytes;
+	// the pictures from a key frame(IDR or recovery point) to the next one
+	int last_gop_length;
+	double average_gop_length;
+	// the gaps and the reference pictures missing in them
+	uint64_t frame_num_gaps;
+	uint64_t missing_frames;
+	// from the last SPS, 0 before it
+	int width;
+	int height;
+};
+
+/**
+* H264 Annex-B stream analysis without decoding, for monitoring the ingest streams.
+*
+* only the NAL headers, the parameter sets and the first bytes of each slice header are
+* read(first_mb_in_slice, slice_type, frame_num, pic_order_cnt_lsb), so the cost is the
+* start code scan of codec_utils. the slices of one picture are grouped into an access
+* unit like a decoder does, which count_frames doesn't do(it counts the NAL units).
+*
+* it's not thread safe, use one analyzer per stream.
+*/
+class H264StreamAnalyzer
+{
+public:
+	H264StreamAnalyzer();
+	virtual ~H264StreamAnalyzer();
+
+	/**
+	 * @brief initialize
+	 *
+	 * @param history -- the count of the last pictures kept for get_history, get_type_sequence
+	 *        and get_bitrate
+	 *
+	 * @return true -- successful
+	 *         false -- invalid parameter
+	 */
+	bool init(int history = 1024);
+
+	/**
+	 * @brief forget the stream, the parameter sets and the statistics
+	 */
+	void reset();
+
+	/**
+	 * @brief analyze the Annex-B data, it must have whole NAL units(e.g. a packet of a
+	 * demuxer, an encoder or RtpH264Depacketizer). a picture is complete when the first
+	 * NAL unit of the next one is found, so the last one is held until the next call.
+	 *
+	 * @param data -- the Annex-B data
+	 *        size -- the data size
+	 *        timestamp_us -- the arrival or decoding time of the data, microseconds
+	 *
+	 * @return the count of the completed pictures
+	 */
+	int push(const uint8_t* data, size_t size, int64_t timestamp_us);
+
+	/**
+	 * @brief complete the held picture, e.g. at the end of stream
+	 *
+	 * @return the count of the completed pictures, 0 or 1
+	 */
+	int flush();
+
+	/**
+	 * @brief the statistics of the completed pictures
+	 */
+	const H264StreamStats& get_stats() const
+	{
+		return m_stats;
+	}
+
+	/**
+	 * @brief the last completed pictures in decoding order, the oldest first
+	 *
+	 * @param frames -- [output] the pictures
+	 *        count -- the max count, 0 means the whole history
+	 */
+	void get_history(std::vector<H264FrameInfo>& frames, int count = 0) const;
+
+	/**
+	 * @brief the types of the last pictures in decoding order, e.g. "IPBBPBBP"
+	 */
+	std::string get_type_sequence(int count) const;
+
+	/**
+	 * @brief the bits per second of the pictures in the window ending at the last one,
+	 * the window is limited by the history
+	 */
+	int64_t get_bitrate(int64_t window_us) const;
+
+private:
+	struct SequenceParameterSet
+	{
+		bool valid;
+		bool separate_colour_plane;
+		bool frame_mbs_only;
+		bool gaps_in_frame_num_allowed;
+		int log2_max_frame_num;
+		int poc_type;
+		int log2_max_poc_lsb;
+		int width;
+		int height;
+	};
+
+	struct PictureParameterSet
+	{
+		bool valid;
+		int sps_id;
+	};
+
+	bool parse_nal(const uint8_t* nal, const uint8_t* end, size_t nal_size);
+	bool parse_sps(const uint8_t* nal, const uint8_t* end);
+	bool parse_pps(const uint8_t* nal, const uint8_t* end);
+	bool parse_slice(const uint8_t* nal, const uint8_t* end);
+	void begin_picture();
+	bool end_picture();
+
+private:
+	SequenceParameterSet m_sps[32];
+	PictureParameterSet m_pps[256];
+
+	// the picture in progress
+	H264FrameInfo m_current;
+	bool m_has_data;
+	bool m_has_slice;
+	bool m_current_gaps_allowed;
+	int m_current_max_frame_num;
+	int m_current_pps_id;
+	int m_current_idr_pic_id;
+	// 0 is a frame, 1 the top field, 2 the bottom field
+	int m_current_field;
+	int64_t m_timestamp;
+
+	// PrevRefFrameNum of the frame_num gap detection, -1 before the first picture
+	int m_prev_ref_frame_num;
+	int m_gop_length;
+	uint64_t m_gops;
+	uint64_t m_gop_frames;
+
+	std::vector<H264FrameInfo> m_history;
+	size_t m_history_pos;
+	size_t m_history_count;
+
+	H264StreamStats m_stats;
+};
+
+#endif
@@ -0,0 +1,496 @@
+#include "h264_remuxer.h"
+#include "codec_utils.h"
+#include <string.h>
+
+namespace
+{
+	const size_t INPUT_SEGMENT = (size_t)-1;
+
+	const uint8_t g_start_code[4] = { 0, 0, 0, 1 };
+
+	enum NalType
+	{
+		NAL_IDR = 5,
+		NAL_SEI = 6,
+		NAL_SPS = 7,
+		NAL_PPS = 8,
+		NAL_AUD = 9
+	};
+
+	// the exp-Golomb codes at the start of an SPS, the emulation prevention bytes are skipped
+	struct SpsReader
+	{
+		const uint8_t* data;
+		size_t size;
+		size_t byte;
+		int bit;
+		int zeros;
+		bool failed;
+
+		uint32_t read_bit()
+		{
+			if (bit == 0)
+			{
+				if (zeros >= 2 && byte < size && data[byte] == 3)
+				{
+					byte++;
+					zeros = 0;
+				}
+				if (byte >= size)
+				{
+					failed = true;
+					return 0;
+				}
+				zeros = data[byte] ? 0 : zeros + 1;
+			}
+
+			uint32_t value = (data[byte] >> (7 - bit)) & 1;
+			if (++bit == 8)
+			{
+				bit = 0;
+				byte++;
+			}
+			return value;
+		}
+
+		uint32_t read_ue()
+		{
+			int leading = 0;
+			while (!read_bit())
+			{
+				if (++leading > 31 || failed)
+				{
+					failed = true;
+					return 0;
+				}
+			}
+
+			uint32_t value = 0;
+			for (int i = 0; i < leading; i++)
+			{
+				value = (value << 1) | read_bit();
+			}
+			return ((1u << leading) - 1) + value;
+		}
+	};
+
+	// chroma_format_idc and the bit depths of the profiles above main and extended, 7.3.2.1.1
+	bool parse_sps_format(const std::vector<uint8_t>& sps, uint32_t& chromaFormat,
+		uint32_t& lumaDepthMinus8, uint32_t& chromaDepthMinus8)
+	{
+		// after the NAL header, profile_idc, the constraint flags and level_idc
+		SpsReader reader = { sps.data(), sps.size(), 4, 0, 0, false };
+		reader.read_ue(); // seq_parameter_set_id
+		chromaFormat = reader.read_ue();
+		if (chromaFormat == 3)
+		{
+			reader.read_bit(); // separate_colour_plane_flag
+		}
+		lumaDepthMinus8 = reader.read_ue();
+		chromaDepthMinus8 = reader.read_ue();
+		return !reader.failed && chromaFormat <= 3 && lumaDepthMinus8 <= 6 && chromaDepthMinus8 <= 6;
+	}
+}
+
+H264Remuxer::H264Remuxer()
+{
+	m_input_format = FORMAT_ANNEXB;
+	m_output_format = FORMAT_ANNEXB;
+	m_flags = 0;
+	m_nal_length_size = 4;
+
+	m_has_sps = false;
+	m_has_pps = false;
+	m_key_frame = false;
+	m_output_size = 0;
+}
+
+H264Remuxer::~H264Remuxer()
+{
+}
+
+bool H264Remuxer::init(StreamFormat input_format, StreamFormat output_format, int flags)
+{
+	m_input_format = input_format;
+	m_output_format = output_format;
+	m_flags = flags;
+	m_nal_length_size = 4;
+
+	m_sps.clear();
+	m_pps.clear();
+	m_headers.clear();
+	m_header_offsets.clear();
+	m_segments.clear();
+	m_output_size = 0;
+	m_key_frame = false;
+
+	return true;
+}
+
+bool H264Remuxer::set_extradata(const uint8_t* data, size_t size)
+{
+	if (!data || size < 4)
+	{
+		return false;
+	}
+
+	// the avcC starts with configurationVersion 1, Annex-B starts with a start code
+	if (data[0] == 1)
+	{
+		return parse_avcc_extradata(data, size);
+	}
+
+	const uint8_t* sps;
+	const uint8_t* pps;
+	size_t spsSize;
+	size_t ppsSize;
+	if (!avc_find_parameter_sets(data, size, sps, spsSize, pps, ppsSize))
+	{
+		return false;
+	}
+
+	save_parameter_set(m_sps, sps, spsSize);
+	save_parameter_set(m_pps, pps, ppsSize);
+	return true;
+}
+
+bool H264Remuxer::parse_avcc_extradata(const uint8_t* data, size_t size)
+{
+	// the 5 bytes header, then at least the SPS count and the PPS count
+	if (size < 7)
+	{
+		return false;
+	}
+
+	const uint8_t* end = data + size;
+	const uint8_t* p = data + 5;
+
+	int nalLengthSize = (data[4] & 0x03) + 1;
+	if (nalLengthSize == 3)
+	{
+		return false;
+	}
+
+	// the SPS array, then the PPS array, the first of each is kept
+	const uint8_t* nals[2] = { NULL, NULL };
+	size_t nalSizes[2] = { 0, 0 };
+	for (int i = 0; i < 2; i++)
+	{
+		if (p >= end)
+		{
+			return false;
+		}
+
+		int count = i == 0 ? (*p & 0x1F) : *p;
+		p++;
+
+		for (int j = 0; j < count; j++)
+		{
+			if (end - p < 2)
+			{
+				return false;
+			}
+
+			size_t len = (p[0] << 8) | p[1];
+			p += 2;
+			if ((size_t)(end - p) < len)
+			{
+				return false;
+			}
+
+			if (j == 0)
+			{
+				nals[i] = p;
+				nalSizes[i] = len;
+			}
+			p += len;
+		}
+	}
+
+	// nothing is changed by a truncated record
+	m_nal_length_size = nalLengthSize;
+	if (nals[0])
+	{
+		save_parameter_set(m_sps, nals[0], nalSizes[0]);
+	}
+	if (nals[1])
+	{
+		save_parameter_set(m_pps, nals[1], nalSizes[1]);
+	}
+	return true;
+}
+
+void H264Remuxer::save_parameter_set(std::vector<uint8_t>& dst, const uint8_t* nal, size_t size)
+{
+	if (dst.size() != size || memcmp(dst.data(), nal, size) != 0)
+	{
+		dst.assign(nal, nal + size);
+	}
+}
+
+void H264Remuxer::add_header(size_t size)
+{
+	size_t offset = m_headers.size();
+
+	if (m_output_format == FORMAT_ANNEXB)
+	{
+		m_headers.insert(m_headers.end(), g_start_code, g_start_code + 4);
+	}
+	else
+	{
+		m_headers.push_back((uint8_t)(size >> 24));
+		m_headers.push_back((uint8_t)(size >> 16));
+		m_headers.push_back((uint8_t)(size >> 8));
+		m_headers.push_back((uint8_t)size);
+	}
+
+	H264Segment segment = { NULL, 4 };
+	m_segments.push_back(segment);
+	m_header_offsets.push_back(offset);
+	m_output_size += 4;
+}
+
+void H264Remuxer::add_nal(const uint8_t* nal, size_t size)
+{
+	add_header(size);
+
+	H264Segment segment = { nal, size };
+	m_segments.push_back(segment);
+	m_header_offsets.push_back(INPUT_SEGMENT);
+	m_output_size += size;
+}
+
+bool H264Remuxer::handle_nal(const uint8_t* nal, size_t size)
+{
+	if (size == 0)
+	{
+		return true;
+	}
+
+	int type = nal[0] & 0x1F;
+	switch (type)
+	{
+	case NAL_AUD:
+		if (m_flags & FLAG_STRIP_AUD)
+		{
+			return true;
+		}
+		break;
+	case NAL_SEI:
+		if (m_flags & FLAG_STRIP_SEI)
+		{
+			return true;
+		}
+		break;
+	case NAL_SPS:
+		save_parameter_set(m_sps, nal, size);
+		m_has_sps = true;
+		if (m_flags & FLAG_STRIP_PARAMETER_SETS)
+		{
+			return true;
+		}
+		break;
+	case NAL_PPS:
+		save_parameter_set(m_pps, nal, size);
+		m_has_pps = true;
+		if (m_flags & FLAG_STRIP_PARAMETER_SETS)
+		{
+			return true;
+		}
+		break;
+	case NAL_IDR:
+		m_key_frame = true;
+		if ((m_flags & FLAG_INSERT_PARAMETER_SETS) && !(m_flags & FLAG_STRIP_PARAMETER_SETS) &&
+			!(m_has_sps && m_has_pps) &&
+			!m_sps.empty() && !m_pps.empty())
+		{
+			// the cached parameter sets are not modified until the next access unit
+			add_nal(m_sps.data(), m_sps.size());
+			add_nal(m_pps.data(), m_pps.size());
+			m_has_sps = true;
+			m_has_pps = true;
+		}
+		break;
+	default:
+		break;
+	}
+
+	add_nal(nal, size);
+	return true;
+}
+
+bool H264Remuxer::parse_annexb(const uint8_t* data, size_t size)
+{
+	const uint8_t *nalStart;
+	const uint8_t *nalEnd;
+	const uint8_t *end = data + size;
+
+	nalStart = avc_find_start_code(data, end);
+	while (true)
+	{
+		while (nalStart < end && !*(nalStart++))
+			;
+
+		if (nalStart == end)
+		{
+			break;
+		}
+
+		nalEnd = avc_find_start_code(nalStart, end);
+
+		// a NAL unit never ends with a zero byte, drop the trailing_zero_8bits
+		const uint8_t* payloadEnd = nalEnd;
+		while (payloadEnd > nalStart && !payloadEnd[-1])
+		{
+			payloadEnd--;
+		}
+
+		if (!handle_nal(nalStart, payloadEnd - nalStart))
+		{
+			return false;
+		}
+
+		nalStart = nalEnd;
+	}
+
+	return true;
+}
+
+bool H264Remuxer::parse_avcc(const uint8_t* data, size_t size)
+{
+	const uint8_t* end = data + size;
+	const uint8_t* p = data;
+
+	while (p < end)
+	{
+		if (end - p < m_nal_length_size)
+		{
+			return false;
+		}
+
+		size_t len = 0;
+		for (int i = 0; i < m_nal_length_size; i++)
+		{
+			len = (len << 8) | p[i];
+		}
+		p += m_nal_length_size;
+
+		if ((size_t)(end - p) < len)
+		{
+			return false;
+		}
+
+		if (!handle_nal(p, len))
+		{
+			return false;
+		}
+		p += len;
+	}
+
+	return true;
+}
+
+bool H264Remuxer::process(const uint8_t* data, size_t size)
+{
+	m_headers.clear();
+	m_header_offsets.clear();
+	m_segments.clear();
+	m_output_size = 0;
+	m_has_sps = false;
+	m_has_pps = false;
+	m_key_frame = false;
+
+	if (!data)
+	{
+		return false;
+	}
+
+	bool ret = m_input_format == FORMAT_ANNEXB ? parse_annexb(data, size) : parse_avcc(data, size);
+	if (!ret)
+	{
+		return false;
+	}
+
+	// the header buffer doesn't grow any more, resolve the header segments
+	for (size_t i = 0; i < m_segments.size(); i++)
+	{
+		if (m_header_offsets[i] != INPUT_SEGMENT)
+		{
+			m_segments[i].data = m_headers.data() + m_header_offsets[i];
+		}
+	}
+
+	return true;
+}
+
+size_t H264Remuxer::copy_output(uint8_t* dst, size_t capacity) const
+{
+	if (capacity < m_output_size)
+	{
+		return 0;
+	}
+
+	size_t used = 0;
+	for (size_t i = 0; i < m_segments.size(); i++)
+	{
+		memcpy(dst + used, m_segments[i].data, m_segments[i].size);
+		used += m_segments[i].size;
+	}
+
+	return used;
+}
+
+bool H264Remuxer::get_extradata(StreamFormat format, std::vector<uint8_t>& extradata) const
+{
+	extradata.clear();
+	if (m_sps.size() < 4 || m_pps.empty())
+	{
+		return false;
+	}
+
+	if (format == FORMAT_ANNEXB)
+	{
+		extradata.insert(extradata.end(), g_start_code, g_start_code + 4);
+		extradata.insert(extradata.end(), m_sps.begin(), m_sps.end());
+		extradata.insert(extradata.end(), g_start_code, g_start_code + 4);
+		extradata.insert(extradata.end(), m_pps.begin(), m_pps.end());
+		return true;
+	}
+
+	// AVCDecoderConfigurationRecord, ISO/IEC 14496-15
+	extradata.push_back(1);
+	extradata.push_back(m_sps[1]); // profile_idc
+	extradata.push_back(m_sps[2]); // constraint flags
+	extradata.push_back(m_sps[3]); // level_idc
+	extradata.push_back(0xFC | 3); // 4 bytes NAL length
+	extradata.push_back(0xE0 | 1); // one SPS
+	extradata.push_back((uint8_t)(m_sps.size() >> 8));
+	extradata.push_back((uint8_t)m_sps.size());
+	extradata.insert(extradata.end(), m_sps.begin(), m_sps.end());
+	extradata.push_back(1); // one PPS
+	extradata.push_back((uint8_t)(m_pps.size() >> 8));
+	extradata.push_back((uint8_t)m_pps.size());
+	extradata.insert(extradata.end(), m_pps.begin(), m_pps.end());
+
+	int profile = m_sps[1];
+	if (profile != 66 && profile != 77 && profile != 88)
+	{
+		// the high profile extension, from the SPS(10 bit, 4:2:2 and 4:4:4 in the high 10,
+		// high 4:2:2 and high 4:4:4 profiles)
+		uint32_t chromaFormat;
+		uint32_t lumaDepthMinus8;
+		uint32_t chromaDepthMinus8;
+		if (!parse_sps_format(m_sps, chromaFormat, lumaDepthMinus8, chromaDepthMinus8))
+		{
+			extradata.clear();
+			return false;
+		}
+
+		extradata.push_back(0xFC | (uint8_t)chromaFormat);      // chroma_format_idc
+		extradata.push_back(0xF8 | (uint8_t)lumaDepthMinus8);   // bit_depth_luma_minus8
+		extradata.push_back(0xF8 | (uint8_t)chromaDepthMinus8); // bit_depth_chroma_minus8
+		extradata.push_back(0);                                 // numOfSequenceParameterSetExt
+	}
+
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,164 @@
+#ifndef _H_H264_REMUXER_H_
+#define _H_H264_REMUXER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/**
+* the output piece of a remuxed access unit.
+* it points either into the input buffer or into the remuxer's own header buffer.
+*/
+struct H264Segment
+{
+	const uint8_t* data;
+	size_t size;
+};
+
+/**
+* H264 bitstream passthrough, it works directly on the NAL units without re-encoding.
+*
+* for every access unit, it can
+* 1. strip the SEI and AUD NAL units
+* 2. insert the latest SPS/PPS before an IDR frame when they are missing
+* 3. rewrite between Annex-B(start code) and AVCC(length prefixed)
+* 4. strip the SPS/PPS NAL units which are carried out of band in the extradata
+*
+* the NAL payloads are never copied, the output is a list of segments which
+* reference the input buffer, only the start codes, length prefixes and the
+* inserted parameter sets are generated by the remuxer.
+*/
+class H264Remuxer
+{
+public:
+	enum StreamFormat
+	{
+		FORMAT_ANNEXB = 0,
+		FORMAT_AVCC
+	};
+
+	enum Flags
+	{
+		FLAG_STRIP_SEI = 1,
+		FLAG_STRIP_AUD = 2,
+		FLAG_INSERT_PARAMETER_SETS = 4,
+		FLAG_STRIP_PARAMETER_SETS = 8
+	};
+
+	H264Remuxer();
+	virtual ~H264Remuxer();
+
+	/**
+	 * @brief initialize
+	 *
+	 * @param input_format -- the format of the data passed to process()
+	 *        output_format -- the format of the output segments
+	 *        flags -- the combination of Flags
+	 *
+	 * @return true -- successful
+	 *         false -- failed
+	 */
+	bool init(StreamFormat input_format, StreamFormat output_format, int flags);
+
+	/**
+	 * @brief set the codec extradata, the SPS/PPS in it are used for insertion,
+	 * and for the AVCC input, it gives the NAL length size
+	 *
+	 * @param data -- the extradata, Annex-B or avcC(AVCDecoderConfigurationRecord)
+	 *        size -- the extradata size
+	 *
+	 * @return true -- successful
+	 *         false -- the extradata is invalid
+	 */
+	bool set_extradata(const uint8_t* data, size_t size);
+
+	/**
+	 * @brief remux one access unit
+	 *
+	 * @param data -- [input] the access unit, it must be valid until the segments are consumed
+	 *        size -- [input] the data size
+	 *
+	 * @return true -- successful, the result is in get_segments()
+	 *         false -- the data is malformed
+	 */
+	bool process(const uint8_t* data, size_t size);
+
+	/**
+	 * @brief the output segments of the last process(), they are valid until the next process()
+	 */
+	const std::vector<H264Segment>& get_segments() const
+	{
+		return m_segments;
+	}
+
+	/**
+	 * @brief the total size of the output segments
+	 */
+	size_t get_output_size() const
+	{
+		return m_output_size;
+	}
+
+	/**
+	 * @brief copy the output segments into a contiguous buffer
+	 *
+	 * @param dst -- the destination buffer
+	 *        capacity -- the destination buffer size
+	 *
+	 * @return the copied size, 0 if the buffer is too small
+	 */
+	size_t copy_output(uint8_t* dst, size_t capacity) const;
+
+	/**
+	 * @brief if the last processed access unit is an IDR frame
+	 */
+	bool is_key_frame() const
+	{
+		return m_key_frame;
+	}
+
+	/**
+	 * @brief build the extradata from the latest SPS/PPS
+	 *
+	 * @param format -- FORMAT_AVCC for avcC(AVCDecoderConfigurationRecord),
+	 *                  FORMAT_ANNEXB for start code prefixed SPS and PPS
+	 *        extradata -- [output] the extradata
+	 *
+	 * @return true -- successful
+	 *         false -- no SPS/PPS was seen yet
+	 */
+	bool get_extradata(StreamFormat format, std::vector<uint8_t>& extradata) const;
+
+private:
+	void add_nal(const uint8_t* nal, size_t size);
+	void add_header(size_t size);
+	void save_parameter_set(std::vector<uint8_t>& dst, const uint8_t* nal, size_t size);
+
+	bool parse_annexb(const uint8_t* data, size_t size);
+	bool parse_avcc(const uint8_t* data, size_t size);
+	bool parse_avcc_extradata(const uint8_t* data, size_t size);
+	bool handle_nal(const uint8_t* nal, size_t size);
+
+private:
+	StreamFormat m_input_format;
+	StreamFormat m_output_format;
+	int m_flags;
+	int m_nal_length_size;
+
+	std::vector<uint8_t> m_sps;
+	std::vector<uint8_t> m_pps;
+
+	// per access unit state
+	bool m_has_sps;
+	bool m_has_pps;
+	bool m_key_frame;
+	size_t m_output_size;
+
+	// the generated start codes and length prefixes,
+	// the segments keep their offsets until the access unit is complete
+	std::vector<uint8_t> m_headers;
+	std::vector<size_t> m_header_offsets;
+	std::vector<H264Segment> m_segments;
+};
+
+#endif
\ No newline at end of file
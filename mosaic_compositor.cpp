@@ -0,0 +1,426 @@
+#include "mosaic_compositor.h"
+#include <string.h>
+
+namespace
+{
+	const int CANVAS_ALIGN = 32;
+	const int CANVAS_COUNT = 2;
+
+	int align_size(int size)
+	{
+		return (size + CANVAS_ALIGN - 1) & ~(CANVAS_ALIGN - 1);
+	}
+}
+
+MosaicCompositor::MosaicCompositor()
+{
+	m_initialized = false;
+	m_stop = false;
+
+	m_width = 0;
+	m_height = 0;
+	for (int i = 0; i < CANVAS_COUNT; i++)
+	{
+		m_canvas_buffers[i] = NULL;
+	}
+	m_current = 0;
+	m_canvas_size = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		m_canvas[i] = NULL;
+		m_linesize[i] = 0;
+	}
+
+	m_next = 0;
+	m_failed = 0;
+	m_running = 0;
+	m_generation = 0;
+
+	m_trace_id = 0;
+}
+
+MosaicCompositor::~MosaicCompositor()
+{
+	free_context();
+}
+
+void MosaicCompositor::free_tiles()
+{
+	for (size_t i = 0; i < m_tiles.size(); i++)
+	{
+		if (m_tiles[i]->sws_context)
+		{
+			sws_freeContext(m_tiles[i]->sws_context);
+		}
+		delete m_tiles[i];
+	}
+	m_tiles.clear();
+}
+
+void MosaicCompositor::free_context()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_work_cond.notify_all();
+
+	for (size_t i = 0; i < m_threads.size(); i++)
+	{
+		m_threads[i].join();
+	}
+	m_threads.clear();
+	m_stop = false;
+
+	free_tiles();
+	m_jobs.clear();
+
+	// the encoder may still hold references, the buffers are freed with the last one
+	for (int i = 0; i < CANVAS_COUNT; i++)
+	{
+		av_buffer_unref(&m_canvas_buffers[i]);
+	}
+	m_current = 0;
+	m_canvas_size = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		m_canvas[i] = NULL;
+		m_linesize[i] = 0;
+	}
+
+	m_initialized = false;
+}
+
+bool MosaicCompositor::init(int width, int height, int threads)
+{
+	free_context();
+
+	if (width <= 0 || height <= 0 || (width & 1) || (height & 1))
+	{
+		return false;
+	}
+
+	if (threads <= 0)
+	{
+		threads = (int)std::thread::hardware_concurrency();
+		if (threads <= 0)
+		{
+			threads = 1;
+		}
+	}
+
+	m_width = width;
+	m_height = height;
+	m_linesize[0] = align_size(width);
+	m_linesize[1] = align_size(width / 2);
+	m_linesize[2] = m_linesize[1];
+
+	m_canvas_size = (size_t)m_linesize[0] * height + (size_t)m_linesize[1] * (height / 2) * 2;
+	for (int i = 0; i < CANVAS_COUNT; i++)
+	{
+		m_canvas_buffers[i] = av_buffer_alloc((int)m_canvas_size);
+		if (!m_canvas_buffers[i])
+		{
+			free_context();
+			return false;
+		}
+	}
+	set_canvas(0);
+	fill_black(0, 0, width, height);
+
+	// the caller of compose() is one of the threads
+	for (int i = 1; i < threads; i++)
+	{
+		m_threads.push_back(std::thread(&MosaicCompositor::worker_loop, this));
+	}
+
+	m_initialized = true;
+	return true;
+}
+
+int MosaicCompositor::add_tile(int x, int y, int width, int height)
+{
+	x &= ~1;
+	y &= ~1;
+	width &= ~1;
+	height &= ~1;
+	if (!m_initialized || x < 0 || y < 0 || width <= 0 || height <= 0 ||
+		x + width > m_width || y + height > m_height)
+	{
+		return -1;
+	}
+
+	Tile* tile = new Tile;
+	memset(tile, 0, sizeof(Tile));
+	tile->x = x;
+	tile->y = y;
+	tile->width = width;
+	tile->height = height;
+	tile->src_format = AV_PIX_FMT_NONE;
+
+	m_tiles.push_back(tile);
+	return (int)m_tiles.size() - 1;
+}
+
+bool MosaicCompositor::set_grid(int columns, int rows)
+{
+	if (!m_initialized || columns <= 0 || rows <= 0 || !prepare_canvas())
+	{
+		return false;
+	}
+
+	free_tiles();
+	fill_black(0, 0, m_width, m_height);
+
+	for (int row = 0; row < rows; row++)
+	{
+		// the edges are computed from the positions, so the grid covers the canvas without gaps
+		int top = (m_height * row / rows) & ~1;
+		int bottom = row + 1 == rows ? m_height : (m_height * (row + 1) / rows) & ~1;
+		for (int column = 0; column < columns; column++)
+		{
+			int left = (m_width * column / columns) & ~1;
+			int right = column + 1 == columns ? m_width : (m_width * (column + 1) / columns) & ~1;
+			if (add_tile(left, top, right - left, bottom - top) < 0)
+			{
+				free_tiles();
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+bool MosaicCompositor::set_tile_frame(int index, uint8_t* const data[], const int linesize[], int width, int height, AVPixelFormat format)
+{
+	if (index < 0 || index >= (int)m_tiles.size() || width <= 0 || height <= 0)
+	{
+		return false;
+	}
+
+	Tile* tile = m_tiles[index];
+	for (int i = 0; i < 4; i++)
+	{
+		tile->data[i] = data[i];
+		tile->linesize[i] = linesize[i];
+	}
+	tile->src_width = width;
+	tile->src_height = height;
+	tile->src_format = format;
+	tile->clear = false;
+	tile->dirty = true;
+	return true;
+}
+
+bool MosaicCompositor::clear_tile(int index)
+{
+	if (index < 0 || index >= (int)m_tiles.size())
+	{
+		return false;
+	}
+
+	m_tiles[index]->clear = true;
+	m_tiles[index]->dirty = true;
+	return true;
+}
+
+void MosaicCompositor::set_canvas(int index)
+{
+	uint8_t* buffer = m_canvas_buffers[index]->data;
+	m_current = index;
+	m_canvas[0] = buffer;
+	m_canvas[1] = buffer + (size_t)m_linesize[0] * m_height;
+	m_canvas[2] = m_canvas[1] + (size_t)m_linesize[1] * (m_height / 2);
+}
+
+bool MosaicCompositor::prepare_canvas()
+{
+	if (av_buffer_is_writable(m_canvas_buffers[m_current]))
+	{
+		return true;
+	}
+
+	// the encoder still holds the current canvas, the other one continues from its content
+	int other = (m_current + 1) % CANVAS_COUNT;
+	if (av_buffer_is_writable(m_canvas_buffers[other]))
+	{
+		memcpy(m_canvas_buffers[other]->data, m_canvas_buffers[m_current]->data, m_canvas_size);
+		set_canvas(other);
+		return true;
+	}
+
+	// both are held, the current one is replaced by a copy
+	if (av_buffer_make_writable(&m_canvas_buffers[m_current]) < 0)
+	{
+		return false;
+	}
+	set_canvas(m_current);
+	return true;
+}
+
+bool MosaicCompositor::get_canvas_frame(AVFrame* frame) const
+{
+	av_frame_unref(frame);
+	if (!m_initialized)
+	{
+		return false;
+	}
+
+	frame->buf[0] = av_buffer_ref(m_canvas_buffers[m_current]);
+	if (!frame->buf[0])
+	{
+		return false;
+	}
+
+	for (int i = 0; i < 3; i++)
+	{
+		frame->data[i] = m_canvas[i];
+		frame->linesize[i] = m_linesize[i];
+	}
+	frame->width = m_width;
+	frame->height = m_height;
+	frame->format = AV_PIX_FMT_YUV420P;
+	return true;
+}
+
+void MosaicCompositor::fill_black(int x, int y, int width, int height)
+{
+	for (int i = 0; i < height; i++)
+	{
+		memset(m_canvas[0] + (size_t)(y + i) * m_linesize[0] + x, 16, width);
+	}
+
+	for (int i = 0; i < height / 2; i++)
+	{
+		memset(m_canvas[1] + (size_t)(y / 2 + i) * m_linesize[1] + x / 2, 128, width / 2);
+		memset(m_canvas[2] + (size_t)(y / 2 + i) * m_linesize[2] + x / 2, 128, width / 2);
+	}
+}
+
+bool MosaicCompositor::scale_tile(Tile* tile)
+{
+	CodecTraceScope trace("mosaic.scale_tile", m_trace_id);
+
+	tile->dirty = false;
+	if (tile->clear)
+	{
+		fill_black(tile->x, tile->y, tile->width, tile->height);
+		return true;
+	}
+
+	tile->sws_context = sws_getCachedContext(tile->sws_context,
+		tile->src_width, tile->src_height, tile->src_format, tile->width, tile->height,
+		AV_PIX_FMT_YUV420P, SWS_FAST_BILINEAR, NULL, NULL, NULL);
+	if (!tile->sws_context)
+	{
+		return false;
+	}
+
+	// the tile region of the canvas is the destination, there is no intermediate frame
+	uint8_t* dst[4] = {
+		m_canvas[0] + (size_t)tile->y * m_linesize[0] + tile->x,
+		m_canvas[1] + (size_t)(tile->y / 2) * m_linesize[1] + tile->x / 2,
+		m_canvas[2] + (size_t)(tile->y / 2) * m_linesize[2] + tile->x / 2,
+		NULL
+	};
+	int dstLinesize[4] = { m_linesize[0], m_linesize[1], m_linesize[2], 0 };
+
+	sws_scale(tile->sws_context, tile->data, tile->linesize, 0, tile->src_height, dst, dstLinesize);
+	return true;
+}
+
+void MosaicCompositor::run_tiles()
+{
+	int count = (int)m_jobs.size();
+	int index;
+	while ((index = m_next.fetch_add(1)) < count)
+	{
+		if (!scale_tile(m_jobs[index]))
+		{
+			m_failed++;
+		}
+	}
+}
+
+void MosaicCompositor::worker_loop()
+{
+	uint64_t generation = 0;
+
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_work_cond.wait(lock, [&] { return m_stop || m_generation != generation; });
+			if (m_stop)
+			{
+				return;
+			}
+			generation = m_generation;
+		}
+
+		run_tiles();
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (--m_running == 0)
+			{
+				m_done_cond.notify_all();
+			}
+		}
+	}
+}
+
+int MosaicCompositor::compose()
+{
+	CodecTraceScope trace("mosaic.compose", m_trace_id);
+
+	if (!m_initialized)
+	{
+		return -1;
+	}
+
+	m_jobs.clear();
+	for (size_t i = 0; i < m_tiles.size(); i++)
+	{
+		if (m_tiles[i]->dirty)
+		{
+			m_jobs.push_back(m_tiles[i]);
+		}
+	}
+
+	if (m_jobs.empty())
+	{
+		return 0;
+	}
+
+	// the canvas referenced by the encoder isn't written
+	if (!prepare_canvas())
+	{
+		return -1;
+	}
+
+	m_next = 0;
+	m_failed = 0;
+	if (m_threads.empty() || m_jobs.size() == 1)
+	{
+		run_tiles();
+	}
+	else
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_running = (int)m_threads.size();
+			m_generation++;
+		}
+		m_work_cond.notify_all();
+
+		run_tiles();
+
+		// every worker checks in, so none of them is still reading m_jobs
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_done_cond.wait(lock, [&] { return m_running == 0; });
+	}
+
+	return m_failed > 0 ? -1 : (int)m_jobs.size();
+}
@@ -0,0 +1,209 @@
+#ifndef _H_MOSAIC_COMPOSITOR_H_
+#define _H_MOSAIC_COMPOSITOR_H_
+
+#include <stdint.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+#include <libavutil/imgutils.h>
+}
+
+#include "codec_trace.h"
+
+/**
+* video wall compositor.
+*
+* the source frames are scaled by sws_scale straight into their tile regions of
+* one YUV420P canvas, the tiles are scaled in parallel by a thread pool. only
+* the tiles with a new frame since the last compose() are scaled, the others keep
+* their content.
+*
+* the canvas is a refcounted buffer, get_canvas_frame references it and
+* FFmpegEncoder::send_frame(const AVFrame*) passes the reference on, so the encoder
+* takes the canvas without copying it. there are two canvases: if the encoder still
+* holds the current one when compose() starts, the other one takes over(with a copy
+* of the current content) and the referenced one isn't written.
+*/
+class MosaicCompositor
+{
+public:
+	MosaicCompositor();
+	virtual ~MosaicCompositor();
+
+	bool is_initialized() const
+	{
+		return m_initialized;
+	}
+
+	/**
+	 * @brief initialize, the canvas is filled with black
+	 *
+	 * @param width -- the canvas width, it must be even
+	 *        height -- the canvas height, it must be even
+	 *        threads -- the thread count including the caller of compose(), 0 means one per hardware thread
+	 *
+	 * @return true -- successful
+	 *         false -- failed
+	 */
+	bool init(int width, int height, int threads);
+
+	/**
+	 * @brief add a tile, the position and size are rounded down to even numbers
+	 *
+	 * @return the tile index, -1 if the region is outside the canvas
+	 */
+	int add_tile(int x, int y, int width, int height);
+
+	/**
+	 * @brief replace the tiles by a columns x rows grid covering the canvas, the tile
+	 * index is row * columns + column
+	 */
+	bool set_grid(int columns, int rows);
+
+	int get_tile_count() const
+	{
+		return (int)m_tiles.size();
+	}
+
+	/**
+	 * @brief set the new frame of a tile. the planes are not copied, they must stay
+	 * valid until compose() returns, e.g. the frame returned by FFmpegDecoder::receive_frame
+	 * before the next receive_frame call.
+	 *
+	 * @param index -- the tile index
+	 *        data -- the planes
+	 *        linesize -- the plane line sizes
+	 *        width -- the image width
+	 *        height -- the image height
+	 *        format -- the ffmpeg format of image
+	 *
+	 * @return true -- successful
+	 *         false -- invalid tile index or image
+	 */
+	bool set_tile_frame(int index, uint8_t* const data[], const int linesize[], int width, int height, AVPixelFormat format);
+
+	bool set_tile_frame(int index, const AVFrame* frame)
+	{
+		return set_tile_frame(index, frame->data, frame->linesize, frame->width, frame->height, (AVPixelFormat)frame->format);
+	}
+
+	/**
+	 * @brief fill a tile with black, e.g. when its stream is lost
+	 */
+	bool clear_tile(int index);
+
+	/**
+	 * @brief scale the new frames into the canvas, it blocks until all the tiles are done
+	 *
+	 * @return the count of the updated tiles, -1 if some tiles failed
+	 */
+	int compose();
+
+	/**
+	 * @brief the canvas planes, valid until the next compose() or init()
+	 */
+	void get_canvas(uint8_t* data[3], int linesize[3]) const
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			data[i] = m_canvas[i];
+			linesize[i] = m_linesize[i];
+		}
+	}
+
+	/**
+	 * @brief a new reference of the canvas as a YUV420P frame, e.g. for
+	 * FFmpegEncoder::send_frame(const AVFrame*), the caller unreferences it
+	 *
+	 * @param frame -- [output] the frame, it's unreferenced first
+	 *
+	 * @return true -- successful
+	 *         false -- not initialized or out of memory
+	 */
+	bool get_canvas_frame(AVFrame* frame) const;
+
+	int get_width() const
+	{
+		return m_width;
+	}
+
+	int get_height() const
+	{
+		return m_height;
+	}
+
+	/**
+	 * @brief set the stream id of the trace events of this compositor, see CodecTrace
+	 */
+	void set_trace_id(uint32_t id)
+	{
+		m_trace_id = id;
+	}
+
+private:
+	struct Tile
+	{
+		int x;
+		int y;
+		int width;
+		int height;
+
+		SwsContext* sws_context;
+
+		// the pending frame, set by set_tile_frame
+		bool dirty;
+		bool clear;
+		const uint8_t* data[4];
+		int linesize[4];
+		int src_width;
+		int src_height;
+		AVPixelFormat src_format;
+	};
+
+	void free_context();
+	void free_tiles();
+	void worker_loop();
+	void run_tiles();
+	bool scale_tile(Tile* tile);
+	void fill_black(int x, int y, int width, int height);
+	bool prepare_canvas();
+	void set_canvas(int index);
+
+private:
+	bool m_initialized;
+	bool m_stop;
+
+	int m_width;
+	int m_height;
+	// the two canvases, the encoder may hold a reference of one while the other is composed
+	AVBufferRef* m_canvas_buffers[2];
+	int m_current;
+	size_t m_canvas_size;
+	uint8_t* m_canvas[3];
+	int m_linesize[3];
+
+	std::vector<Tile*> m_tiles;
+
+	// the tiles of the current compose(), taken by the workers and the caller by m_next
+	std::vector<Tile*> m_jobs;
+	std::atomic<int> m_next;
+	std::atomic<int> m_failed;
+	int m_running;
+	uint64_t m_generation;
+
+	std::vector<std::thread> m_threads;
+	std::mutex m_mutex;
+	std::condition_variable m_work_cond;
+	std::condition_variable m_done_cond;
+
+	uint32_t m_trace_id;
+};
+
+#endif
@@ -0,0 +1,109 @@
+#include "muxer_sink.h"
+#include <string.h>
+#include <new>
+
+FileMuxerSink::FileMuxerSink()
+{
+	m_file = NULL;
+	m_buffer = NULL;
+	m_buffer_size = 0;
+	m_buffer_used_len = 0;
+}
+
+FileMuxerSink::~FileMuxerSink()
+{
+	close();
+}
+
+bool FileMuxerSink::open(const char* path, size_t buffer_size)
+{
+	close();
+
+	if (buffer_size == 0)
+	{
+		return false;
+	}
+
+	m_buffer = new (std::nothrow) uint8_t[buffer_size];
+	if (!m_buffer)
+	{
+		return false;
+	}
+	m_buffer_size = buffer_size;
+
+	m_file = fopen(path, "wb");
+	if (!m_file)
+	{
+		close();
+		return false;
+	}
+
+	// the data is buffered here, not in stdio
+	setvbuf(m_file, NULL, _IONBF, 0);
+	return true;
+}
+
+void FileMuxerSink::close()
+{
+	if (m_file)
+	{
+		flush();
+		fclose(m_file);
+		m_file = NULL;
+	}
+
+	if (m_buffer)
+	{
+		delete[] m_buffer;
+		m_buffer = NULL;
+	}
+
+	m_buffer_size = 0;
+	m_buffer_used_len = 0;
+}
+
+bool FileMuxerSink::write(const uint8_t* data, size_t size)
+{
+	if (!m_file)
+	{
+		return false;
+	}
+
+	if (m_buffer_used_len + size > m_buffer_size)
+	{
+		if (!flush())
+		{
+			return false;
+		}
+
+		// a large block goes to the file directly
+		if (size >= m_buffer_size)
+		{
+			return fwrite(data, 1, size, m_file) == size;
+		}
+	}
+
+	memcpy(m_buffer + m_buffer_used_len, data, size);
+	m_buffer_used_len += size;
+	return true;
+}
+
+bool FileMuxerSink::flush()
+{
+	if (!m_file)
+	{
+		return false;
+	}
+
+	if (m_buffer_used_len > 0)
+	{
+		size_t len = m_buffer_used_len;
+		m_buffer_used_len = 0;
+		if (fwrite(m_buffer, 1, len, m_file) != len)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,103 @@
+#ifndef _H_MUXER_SINK_H_
+#define _H_MUXER_SINK_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/**
+* the output of the streaming muxers
+*/
+class MuxerSink
+{
+public:
+	virtual ~MuxerSink()
+	{
+	}
+
+	/**
+	 * @brief write the muxed data
+	 *
+	 * @param data -- the data
+	 *        size -- the data size
+	 *
+	 * @return true -- successful
+	 *         false -- failed, the muxer stops
+	 */
+	virtual bool write(const uint8_t* data, size_t size) = 0;
+
+	/**
+	 * @brief a new fragment(fMP4) or segment(TS) starts with the next written data
+	 *
+	 * @param start_time -- the decode time of the first frame, in 1/90000 second
+	 *        key_frame -- the fragment starts with a key frame
+	 */
+	virtual void begin_fragment(int64_t /*start_time*/, bool /*key_frame*/)
+	{
+	}
+
+	/**
+	 * @brief flush the buffered data
+	 */
+	virtual bool flush()
+	{
+		return true;
+	}
+};
+
+/**
+* the sink calls a caller supplied function for each written block
+*/
+class CallbackMuxerSink : public MuxerSink
+{
+public:
+	typedef bool (*WriteCallback)(const uint8_t* data, size_t size, void* opaque);
+
+	CallbackMuxerSink(WriteCallback callback, void* opaque)
+	{
+		m_callback = callback;
+		m_opaque = opaque;
+	}
+
+	virtual bool write(const uint8_t* data, size_t size)
+	{
+		return m_callback(data, size, m_opaque);
+	}
+
+private:
+	WriteCallback m_callback;
+	void* m_opaque;
+};
+
+/**
+* the sink writes to a local file through a fixed size buffer
+*/
+class FileMuxerSink : public MuxerSink
+{
+public:
+	FileMuxerSink();
+	virtual ~FileMuxerSink();
+
+	/**
+	 * @brief open the file for writing
+	 *
+	 * @param path -- the file path
+	 *        buffer_size -- the write buffer size
+	 *
+	 * @return true -- successful
+	 *         false -- failed
+	 */
+	bool open(const char* path, size_t buffer_size = 1024 * 256);
+	void close();
+
+	virtual bool write(const uint8_t* data, size_t size);
+	virtual bool flush();
+
+private:
+	FILE* m_file;
+	uint8_t* m_buffer;
+	size_t m_buffer_size;
+	size_t m_buffer_used_len;
+};
+
+#endif
\ No newline at end of file
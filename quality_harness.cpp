@@ -0,0 +1,250 @@
+#include "quality_harness.h"
+#include <string.h>
+
+namespace
+{
+	// the oldest scores are dropped when the caller doesn't receive them
+	const size_t MAX_SCORES = 1024;
+
+	// the planes of a packed YUV420P buffer
+	void get_planes(uint8_t* buffer, int width, int height, uint8_t* planes[3], int linesize[3])
+	{
+		linesize[0] = width;
+		linesize[1] = width / 2;
+		linesize[2] = width / 2;
+		planes[0] = buffer;
+		planes[1] = buffer + (size_t)width * height;
+		planes[2] = planes[1] + (size_t)(width / 2) * (height / 2);
+	}
+}
+
+QualityHarness::QualityHarness()
+{
+	m_encoder = NULL;
+	m_width = 0;
+	m_height = 0;
+	m_flags = 0;
+	m_interval = 1;
+	m_frames = 0;
+	memset(&m_sum, 0, sizeof(m_sum));
+	m_scored = 0;
+	m_packet_callback = NULL;
+	m_packet_opaque = NULL;
+}
+
+QualityHarness::~QualityHarness()
+{
+}
+
+bool QualityHarness::init(FFmpegEncoder& encoder, int width, int height, int threads, int flags)
+{
+	m_encoder = NULL;
+	m_sources.clear();
+	m_scores.clear();
+	memset(&m_sum, 0, sizeof(m_sum));
+	m_scored = 0;
+	m_frames = 0;
+
+	if (!encoder.is_initialized() || !m_metrics.init(width, height, threads) || !m_decoder.init(AV_CODEC_ID_H264))
+	{
+		return false;
+	}
+
+	m_encoder = &encoder;
+	m_width = width;
+	m_height = height;
+	m_flags = flags;
+	m_decoded.resize((size_t)width * height * 3 / 2);
+	return true;
+}
+
+bool QualityHarness::encode(uint8_t* data[], int linesize[])
+{
+	if (!m_encoder)
+	{
+		return false;
+	}
+
+	bool sampled = (m_frames++ % m_interval) == 0;
+	if (sampled)
+	{
+		m_sources.push_back(SourceFrame());
+		SourceFrame& source = m_sources.back();
+		source.pts = m_encoder->get_next_pts();
+		if (!m_free_buffers.empty())
+		{
+			source.buffer.swap(m_free_buffers.back());
+			m_free_buffers.pop_back();
+		}
+		source.buffer.resize(m_decoded.size());
+
+		uint8_t* planes[3];
+		int planeLinesize[3];
+		get_planes(source.buffer.data(), m_width, m_height, planes, planeLinesize);
+		for (int i = 0; i < 3; i++)
+		{
+			int rowSize = i ? m_width / 2 : m_width;
+			int rows = i ? m_height / 2 : m_height;
+			for (int y = 0; y < rows; y++)
+			{
+				memcpy(planes[i] + (size_t)y * planeLinesize[i], data[i] + (size_t)y * linesize[i], rowSize);
+			}
+		}
+	}
+
+	if (!m_encoder->send_video_data(m_width, m_height, data, linesize))
+	{
+		if (sampled)
+		{
+			m_free_buffers.push_back(std::vector<uint8_t>());
+			m_free_buffers.back().swap(m_sources.back().buffer);
+			m_sources.pop_back();
+		}
+		return false;
+	}
+
+	return process_packets();
+}
+
+bool QualityHarness::drain()
+{
+	if (!m_encoder || !m_encoder->send_end_of_stream() || !process_packets() || !m_decoder.send_end_of_stream())
+	{
+		return false;
+	}
+
+	bool ok = receive_frames();
+
+	// the frames the decoder didn't output
+	while (!m_sources.empty())
+	{
+		m_free_buffers.push_back(std::vector<uint8_t>());
+		m_free_buffers.back().swap(m_sources.front().buffer);
+		m_sources.pop_front();
+	}
+
+	return ok;
+}
+
+bool QualityHarness::process_packets()
+{
+	AVPacket* packet;
+	while ((packet = m_encoder->receive_packet()) != NULL)
+	{
+		if (m_packet_callback)
+		{
+			m_packet_callback(packet, m_packet_opaque);
+		}
+
+		bool sent = m_decoder.send_video_data(packet->data, packet->size, packet->pts);
+		m_encoder->end_receive_packet();
+		if (!sent || !receive_frames())
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool QualityHarness::receive_frames()
+{
+	uint8_t* planes[3];
+	int linesize[3];
+	get_planes(m_decoded.data(), m_width, m_height, planes, linesize);
+
+	int width;
+	int height;
+	int64_t pts;
+	bool dropped;
+	while (m_decoder.receive_frame(planes, linesize, m_width, m_height, width, height, pts, dropped))
+	{
+		if (width != m_width || height != m_height)
+		{
+			return false;
+		}
+
+		// the sources before it weren't output by the decoder
+		while (!m_sources.empty() && m_sources.front().pts < pts)
+		{
+			m_free_buffers.push_back(std::vector<uint8_t>());
+			m_free_buffers.back().swap(m_sources.front().buffer);
+			m_sources.pop_front();
+		}
+
+		if (m_sources.empty() || m_sources.front().pts != pts)
+		{
+			// not sampled
+			continue;
+		}
+
+		uint8_t* sourcePlanes[3];
+		int sourceLinesize[3];
+		get_planes(m_sources.front().buffer.data(), m_width, m_height, sourcePlanes, sourceLinesize);
+
+		QualityScore score;
+		score.pts = pts;
+		if (!m_metrics.compare(sourcePlanes, sourceLinesize, planes, linesize, m_flags, score.result))
+		{
+			return false;
+		}
+
+		m_free_buffers.push_back(std::vector<uint8_t>());
+		m_free_buffers.back().swap(m_sources.front().buffer);
+		m_sources.pop_front();
+
+		m_sum.psnr_y += score.result.psnr_y;
+		m_sum.psnr_u += score.result.psnr_u;
+		m_sum.psnr_v += score.result.psnr_v;
+		m_sum.psnr += score.result.psnr;
+		m_sum.ssim_y += score.result.ssim_y;
+		m_sum.ssim_u += score.result.ssim_u;
+		m_sum.ssim_v += score.result.ssim_v;
+		m_sum.ssim += score.result.ssim;
+		m_sum.fast_ssim += score.result.fast_ssim;
+		m_scored++;
+
+		if (m_scores.size() >= MAX_SCORES)
+		{
+			m_scores.pop_front();
+		}
+		m_scores.push_back(score);
+	}
+
+	// a frame larger than the encoded size, the stream isn't the one of the encoder
+	return !dropped;
+}
+
+bool QualityHarness::receive_score(QualityScore& score)
+{
+	if (m_scores.empty())
+	{
+		return false;
+	}
+
+	score = m_scores.front();
+	m_scores.pop_front();
+	return true;
+}
+
+QualityResult QualityHarness::get_average() const
+{
+	QualityResult average;
+	memset(&average, 0, sizeof(average));
+	if (m_scored == 0)
+	{
+		return average;
+	}
+
+	double count = (double)m_scored;
+	average.psnr_y = m_sum.psnr_y / count;
+	average.psnr_u = m_sum.psnr_u / count;
+	average.psnr_v = m_sum.psnr_v / count;
+	average.psnr = m_sum.psnr / count;
+	average.ssim_y = m_sum.ssim_y / count;
+	average.ssim_u = m_sum.ssim_u / count;
+	average.ssim_v = m_sum.ssim_v / count;
+	average.ssim = m_sum.ssim / count;
+	average.fast_ssim = m_sum.fast_ssim / count;
+	return average;
+}
@@ -0,0 +1,135 @@
+#ifndef _H_QUALITY_HARNESS_H_
+#define _H_QUALITY_HARNESS_H_
+
+#include <stdint.h>
+#include <vector>
+#include <deque>
+
+#include "ffmpeg_encoder.h"
+#include "ffmpeg_decoder.h"
+#include "quality_metrics.h"
+
+/**
+* the quality of one decoded frame, pts is the pts of the encoder
+*/
+struct QualityScore
+{
+	int64_t pts;
+	QualityResult result;
+};
+
+/**
+* measures the quality of an FFmpegEncoder on its own frames.
+*
+* the frames are encoded by the encoder of the caller(with its preset and bitrate), the
+* packets are decoded by an internal FFmpegDecoder, and each sampled frame is compared
+* with a copy of its source by QualityMetrics. only the sampled frames are copied, so a
+* live stream can be scored e.g. every 25th frame. the packets can still be sent on by the
+* packet callback.
+*/
+class QualityHarness
+{
+public:
+	/**
+	 * @brief called with each encoded packet before it's decoded, the packet is valid in the call
+	 */
+	typedef void (*PacketCallback)(AVPacket* packet, void* opaque);
+
+	QualityHarness();
+	virtual ~QualityHarness();
+
+	/**
+	 * @brief initialize
+	 *
+	 * @param encoder -- the encoder initialized with the width, the height and AV_PIX_FMT_YUV420P,
+	 *                   it must outlive the harness and its packets are only received by the harness
+	 *        width -- the frame width
+	 *        height -- the frame height
+	 *        threads -- the threads of QualityMetrics, see QualityMetrics::init
+	 *        flags -- QualityFlags
+	 *
+	 * @return true -- successful
+	 *         false -- failed
+	 */
+	bool init(FFmpegEncoder& encoder, int width, int height, int threads, int flags);
+
+	/**
+	 * @brief score every interval-th frame, the default is 1(all the frames)
+	 */
+	void set_sample_interval(int interval)
+	{
+		m_interval = interval > 0 ? interval : 1;
+	}
+
+	void set_packet_callback(PacketCallback callback, void* opaque)
+	{
+		m_packet_callback = callback;
+		m_packet_opaque = opaque;
+	}
+
+	/**
+	 * @brief encode a YUV420P frame, decode the packets and score the sampled frames
+	 *
+	 * @return true -- successful
+	 *         false -- failed
+	 */
+	bool encode(uint8_t* data[], int linesize[]);
+
+	/**
+	 * @brief end the stream, the delayed frames of the encoder and the decoder are scored
+	 */
+	bool drain();
+
+	/**
+	 * @brief the scores in the display order, each score is received once
+	 *
+	 * @return true -- a score was received
+	 *         false -- no more scores
+	 */
+	bool receive_score(QualityScore& score);
+
+	/**
+	 * @brief the mean of all the scores, the PSNR is the mean of the per frame PSNR
+	 */
+	QualityResult get_average() const;
+
+	uint64_t get_scored_frames() const
+	{
+		return m_scored;
+	}
+
+private:
+	struct SourceFrame
+	{
+		int64_t pts;
+		std::vector<uint8_t> buffer;
+	};
+
+	bool process_packets();
+	bool receive_frames();
+
+private:
+	FFmpegEncoder* m_encoder;
+	FFmpegDecoder m_decoder;
+	QualityMetrics m_metrics;
+
+	int m_width;
+	int m_height;
+	int m_flags;
+	int m_interval;
+	uint64_t m_frames;
+
+	// the copies of the sampled frames waiting for their decoded frames, by pts
+	std::deque<SourceFrame> m_sources;
+	std::vector<std::vector<uint8_t> > m_free_buffers;
+	std::vector<uint8_t> m_decoded;
+
+	std::deque<QualityScore> m_scores;
+	QualityResult m_sum;
+	uint64_t m_scored;
+
+	PacketCallback m_packet_callback;
+	void* m_packet_opaque;
+};
+
+#endif
@@ -0,0 +1,595 @@
+#include "quality_metrics.h"
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+#define QUALITY_METRICS_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+namespace
+{
+	const int MAX_WIDTH = 16384;
+	// the rows of a band, the SSIM bands are in rows of windows(4 pixels)
+	const int SSE_BAND_ROWS = 64;
+	const int SSIM_BAND_ROWS = 16;
+	const int DOWNSCALE_BAND_ROWS = 64;
+	const double MAX_PSNR = 100.0;
+
+	uint64_t sse_row_c(const uint8_t* a, const uint8_t* b, int width)
+	{
+		uint64_t sse = 0;
+		for (int i = 0; i < width; i++)
+		{
+			int diff = a[i] - b[i];
+			sse += (uint32_t)(diff * diff);
+		}
+		return sse;
+	}
+
+	// the sums of the 4x4 blocks: sum a, sum b, sum a*a + b*b, sum a*b
+	void ssim_4x4_c(const uint8_t* a, int a_linesize, const uint8_t* b, int b_linesize, int blocks, int* sums)
+	{
+		for (int i = 0; i < blocks; i++)
+		{
+			int s1 = 0;
+			int s2 = 0;
+			int ss = 0;
+			int s12 = 0;
+			for (int y = 0; y < 4; y++)
+			{
+				const uint8_t* pa = a + y * a_linesize + i * 4;
+				const uint8_t* pb = b + y * b_linesize + i * 4;
+				for (int x = 0; x < 4; x++)
+				{
+					s1 += pa[x];
+					s2 += pb[x];
+					ss += pa[x] * pa[x] + pb[x] * pb[x];
+					s12 += pa[x] * pb[x];
+				}
+			}
+
+			sums[i * 4 + 0] = s1;
+			sums[i * 4 + 1] = s2;
+			sums[i * 4 + 2] = ss;
+			sums[i * 4 + 3] = s12;
+		}
+	}
+
+	void downscale_row_c(const uint8_t* src, int linesize, uint8_t* dst, int width)
+	{
+		const uint8_t* next = src + linesize;
+		for (int i = 0; i < width; i++)
+		{
+			dst[i] = (uint8_t)((src[i * 2] + src[i * 2 + 1] + next[i * 2] + next[i * 2 + 1] + 2) >> 2);
+		}
+	}
+
+#ifdef QUALITY_METRICS_X86
+	uint64_t sse_row_sse2(const uint8_t* a, const uint8_t* b, int width)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		// the 32 bits lanes can't overflow within MAX_WIDTH pixels
+		__m128i acc = zero;
+		int i = 0;
+		for (; i + 16 <= width; i += 16)
+		{
+			__m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+			__m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+			__m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+			__m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+			acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+		}
+
+		__m128i sum = _mm_add_epi64(_mm_unpacklo_epi32(acc, zero), _mm_unpackhi_epi32(acc, zero));
+		sum = _mm_add_epi64(sum, _mm_srli_si128(sum, 8));
+		uint64_t sse;
+		_mm_storel_epi64((__m128i*)&sse, sum);
+		return sse + sse_row_c(a + i, b + i, width - i);
+	}
+
+	// a 32 bits lane of the pair sums, lanes 0 + 1 and 2 + 3
+	inline void add_pairs(__m128i v, int* first, int* second)
+	{
+		v = _mm_add_epi32(v, _mm_srli_epi64(v, 32));
+		*first = _mm_cvtsi128_si32(v);
+		*second = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+	}
+
+	void ssim_4x4_sse2(const uint8_t* a, int a_linesize, const uint8_t* b, int b_linesize, int blocks, int* sums)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i ones = _mm_set1_epi16(1);
+		int i = 0;
+		for (; i + 2 <= blocks; i += 2)
+		{
+			__m128i s1 = zero;
+			__m128i s2 = zero;
+			__m128i ss = zero;
+			__m128i s12 = zero;
+			for (int y = 0; y < 4; y++)
+			{
+				__m128i va = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(a + y * a_linesize + i * 4)), zero);
+				__m128i vb = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(b + y * b_linesize + i * 4)), zero);
+				s1 = _mm_add_epi16(s1, va);
+				s2 = _mm_add_epi16(s2, vb);
+				ss = _mm_add_epi32(ss, _mm_add_epi32(_mm_madd_epi16(va, va), _mm_madd_epi16(vb, vb)));
+				s12 = _mm_add_epi32(s12, _mm_madd_epi16(va, vb));
+			}
+
+			int* out = sums + i * 4;
+			add_pairs(_mm_madd_epi16(s1, ones), out + 0, out + 4);
+			add_pairs(_mm_madd_epi16(s2, ones), out + 1, out + 5);
+			add_pairs(ss, out + 2, out + 6);
+			add_pairs(s12, out + 3, out + 7);
+		}
+
+		ssim_4x4_c(a + i * 4, a_linesize, b + i * 4, b_linesize, blocks - i, sums + i * 4);
+	}
+
+	void downscale_row_sse2(const uint8_t* src, int linesize, uint8_t* dst, int width)
+	{
+		const __m128i mask = _mm_set1_epi16(0xFF);
+		const __m128i two = _mm_set1_epi16(2);
+		const uint8_t* next = src + linesize;
+		int i = 0;
+		for (; i + 16 <= width; i += 16)
+		{
+			__m128i out[2];
+			for (int j = 0; j < 2; j++)
+			{
+				__m128i r0 = _mm_loadu_si128((const __m128i*)(src + i * 2 + j * 16));
+				__m128i r1 = _mm_loadu_si128((const __m128i*)(next + i * 2 + j * 16));
+				__m128i sum = _mm_add_epi16(_mm_and_si128(r0, mask), _mm_srli_epi16(r0, 8));
+				sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_and_si128(r1, mask), _mm_srli_epi16(r1, 8)));
+				out[j] = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+			}
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(out[0], out[1]));
+		}
+
+		downscale_row_c(src + i * 2, linesize, dst + i, width - i);
+	}
+
+#if defined(__GNUC__)
+	__attribute__((target("avx2")))
+#endif
+	uint64_t sse_row_avx2(const uint8_t* a, const uint8_t* b, int width)
+	{
+		const __m256i zero = _mm256_setzero_si256();
+		__m256i acc = zero;
+		int i = 0;
+		for (; i + 32 <= width; i += 32)
+		{
+			__m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+			__m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+			__m256i lo = _mm256_sub_epi16(_mm256_unpacklo_epi8(va, zero), _mm256_unpacklo_epi8(vb, zero));
+			__m256i hi = _mm256_sub_epi16(_mm256_unpackhi_epi8(va, zero), _mm256_unpackhi_epi8(vb, zero));
+			acc = _mm256_add_epi32(acc, _mm256_add_epi32(_mm256_madd_epi16(lo, lo), _mm256_madd_epi16(hi, hi)));
+		}
+
+		__m256i sum = _mm256_add_epi64(_mm256_unpacklo_epi32(acc, zero), _mm256_unpackhi_epi32(acc, zero));
+		__m128i half = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+		half = _mm_add_epi64(half, _mm_srli_si128(half, 8));
+		uint64_t sse;
+		_mm_storel_epi64((__m128i*)&sse, half);
+		return sse + sse_row_sse2(a + i, b + i, width - i);
+	}
+
+#if defined(__GNUC__)
+	__attribute__((target("avx2")))
+#endif
+	void ssim_4x4_avx2(const uint8_t* a, int a_linesize, const uint8_t* b, int b_linesize, int blocks, int* sums)
+	{
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i ones = _mm256_set1_epi16(1);
+		int i = 0;
+		for (; i + 4 <= blocks; i += 4)
+		{
+			__m256i s1 = zero;
+			__m256i s2 = zero;
+			__m256i ss = zero;
+			__m256i s12 = zero;
+			for (int y = 0; y < 4; y++)
+			{
+				__m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a + y * a_linesize + i * 4)));
+				__m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(b + y * b_linesize + i * 4)));
+				s1 = _mm256_add_epi16(s1, va);
+				s2 = _mm256_add_epi16(s2, vb);
+				ss = _mm256_add_epi32(ss, _mm256_add_epi32(_mm256_madd_epi16(va, va), _mm256_madd_epi16(vb, vb)));
+				s12 = _mm256_add_epi32(s12, _mm256_madd_epi16(va, vb));
+			}
+
+			// the sums of block k are in the lanes 2k and 2k + 1
+			__m256i v[4] = { _mm256_madd_epi16(s1, ones), _mm256_madd_epi16(s2, ones), ss, s12 };
+			int* out = sums + i * 4;
+			for (int j = 0; j < 4; j++)
+			{
+				int lanes[8];
+				_mm256_storeu_si256((__m256i*)lanes, _mm256_add_epi32(v[j], _mm256_srli_epi64(v[j], 32)));
+				out[j] = lanes[0];
+				out[4 + j] = lanes[2];
+				out[8 + j] = lanes[4];
+				out[12 + j] = lanes[6];
+			}
+		}
+
+		ssim_4x4_sse2(a + i * 4, a_linesize, b + i * 4, b_linesize, blocks - i, sums + i * 4);
+	}
+
+	bool cpu_has_avx2()
+	{
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 1);
+		// OSXSAVE and AVX
+		if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0)
+		{
+			return false;
+		}
+		if ((_xgetbv(0) & 6) != 6)
+		{
+			return false;
+		}
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#else
+		return __builtin_cpu_supports("avx2") != 0;
+#endif
+	}
+#endif
+
+	// the SSIM of an 8x8 window from the sums of its 4 blocks, the integer form of x264
+	float ssim_window(int s1, int s2, int ss, int s12)
+	{
+		static const int c1 = (int)(.01 * .01 * 255 * 255 * 64 + .5);
+		static const int c2 = (int)(.03 * .03 * 255 * 255 * 64 * 63 + .5);
+		int vars = ss * 64 - s1 * s1 - s2 * s2;
+		int covar = s12 * 64 - s1 * s2;
+		return (float)(2 * s1 * s2 + c1) * (float)(2 * covar + c2) /
+			((float)(s1 * s1 + s2 * s2 + c1) * (float)(vars + c2));
+	}
+
+	double get_psnr(uint64_t sse, uint64_t pixels)
+	{
+		if (sse == 0 || pixels == 0)
+		{
+			return MAX_PSNR;
+		}
+
+		double psnr = 10.0 * log10(255.0 * 255.0 * (double)pixels / (double)sse);
+		return psnr < MAX_PSNR ? psnr : MAX_PSNR;
+	}
+
+	void (*get_downscale_func())(const uint8_t* src, int linesize, uint8_t* dst, int width)
+	{
+#ifdef QUALITY_METRICS_X86
+		return downscale_row_sse2;
+#else
+		return downscale_row_c;
+#endif
+	}
+}
+
+QualityMetrics::QualityMetrics()
+{
+	m_initialized = false;
+	m_stop = false;
+	m_width = 0;
+	m_height = 0;
+	m_small_linesize = 0;
+	m_next = 0;
+	m_running = 0;
+	m_generation = 0;
+
+#ifdef QUALITY_METRICS_X86
+	bool avx2 = cpu_has_avx2();
+	m_sse_func = avx2 ? sse_row_avx2 : sse_row_sse2;
+	m_ssim_func = avx2 ? ssim_4x4_avx2 : ssim_4x4_sse2;
+#else
+	m_sse_func = sse_row_c;
+	m_ssim_func = ssim_4x4_c;
+#endif
+}
+
+QualityMetrics::~QualityMetrics()
+{
+	free_context();
+}
+
+void QualityMetrics::free_context()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_work_cond.notify_all();
+
+	for (size_t i = 0; i < m_threads.size(); i++)
+	{
+		m_threads[i].join();
+	}
+	m_threads.clear();
+	m_stop = false;
+
+	m_jobs.clear();
+	m_ssim_sums.clear();
+	m_small_ref.clear();
+	m_small_dist.clear();
+
+	m_initialized = false;
+}
+
+bool QualityMetrics::init(int width, int height, int threads)
+{
+	free_context();
+
+	if (width < 16 || height < 16 || width > MAX_WIDTH || (width & 1) || (height & 1))
+	{
+		return false;
+	}
+
+	if (threads <= 0)
+	{
+		threads = (int)std::thread::hardware_concurrency();
+		if (threads <= 0)
+		{
+			threads = 1;
+		}
+	}
+
+	m_width = width;
+	m_height = height;
+	m_small_linesize = width / 2;
+	m_small_ref.resize((size_t)m_small_linesize * (height / 2));
+	m_small_dist.resize(m_small_ref.size());
+
+	// two rows of blocks of the luma, the widest plane
+	m_ssim_sums.resize(threads);
+	for (int i = 0; i < threads; i++)
+	{
+		m_ssim_sums[i].resize((size_t)(width / 4) * 4 * 2);
+	}
+
+	// the caller of compare() is one of the threads
+	for (int i = 1; i < threads; i++)
+	{
+		m_threads.push_back(std::thread(&QualityMetrics::worker_loop, this, i));
+	}
+
+	m_initialized = true;
+	return true;
+}
+
+void QualityMetrics::add_jobs(JobType type, int plane, const uint8_t* ref, int ref_linesize, const uint8_t* dist, int dist_linesize,
+	int width, int height, int rows)
+{
+	int bandRows = (type == JOB_SSE) ? SSE_BAND_ROWS : (type == JOB_SSIM) ? SSIM_BAND_ROWS : DOWNSCALE_BAND_ROWS;
+
+	for (int row = 0; row < rows; row += bandRows)
+	{
+		Job job;
+		memset(&job, 0, sizeof(job));
+		job.type = type;
+		job.plane = plane;
+		job.ref = ref;
+		job.dist = dist;
+		job.ref_linesize = ref_linesize;
+		job.dist_linesize = dist_linesize;
+		job.width = width;
+		job.height = height;
+		job.row_begin = row;
+		job.row_end = (row + bandRows < rows) ? row + bandRows : rows;
+		m_jobs.push_back(job);
+	}
+}
+
+void QualityMetrics::run_job(Job& job, int thread)
+{
+	if (job.type == JOB_SSE)
+	{
+		for (int y = job.row_begin; y < job.row_end; y++)
+		{
+			job.sse += m_sse_func(job.ref + (size_t)y * job.ref_linesize, job.dist + (size_t)y * job.dist_linesize, job.width);
+		}
+	}
+	else if (job.type == JOB_DOWNSCALE)
+	{
+		void (*downscale)(const uint8_t*, int, uint8_t*, int) = get_downscale_func();
+		for (int y = job.row_begin; y < job.row_end; y++)
+		{
+			downscale(job.ref + (size_t)y * 2 * job.ref_linesize, job.ref_linesize, job.ref_out + (size_t)y * job.out_linesize, job.width / 2);
+			downscale(job.dist + (size_t)y * 2 * job.dist_linesize, job.dist_linesize, job.dist_out + (size_t)y * job.out_linesize, job.width / 2);
+		}
+	}
+	else
+	{
+		// the window row y covers the block rows y and y + 1
+		int blocks = job.width / 4;
+		int* rows[2] = { m_ssim_sums[thread].data(), m_ssim_sums[thread].data() + blocks * 4 };
+		m_ssim_func(job.ref + (size_t)job.row_begin * 4 * job.ref_linesize, job.ref_linesize,
+			job.dist + (size_t)job.row_begin * 4 * job.dist_linesize, job.dist_linesize, blocks, rows[0]);
+
+		double ssim = 0.0;
+		for (int y = job.row_begin; y < job.row_end; y++)
+		{
+			m_ssim_func(job.ref + (size_t)(y + 1) * 4 * job.ref_linesize, job.ref_linesize,
+				job.dist + (size_t)(y + 1) * 4 * job.dist_linesize, job.dist_linesize, blocks, rows[1]);
+
+			float rowSsim = 0.0f;
+			for (int x = 0; x < blocks - 1; x++)
+			{
+				const int* s0 = rows[0] + x * 4;
+				const int* s1 = rows[1] + x * 4;
+				rowSsim += ssim_window(s0[0] + s0[4] + s1[0] + s1[4], s0[1] + s0[5] + s1[1] + s1[5],
+					s0[2] + s0[6] + s1[2] + s1[6], s0[3] + s0[7] + s1[3] + s1[7]);
+			}
+			ssim += rowSsim;
+
+			int* swap = rows[0];
+			rows[0] = rows[1];
+			rows[1] = swap;
+		}
+		job.ssim = ssim;
+	}
+}
+
+void QualityMetrics::run_jobs(int thread)
+{
+	int count = (int)m_jobs.size();
+	int index;
+	while ((index = m_next.fetch_add(1)) < count)
+	{
+		run_job(m_jobs[index], thread);
+	}
+}
+
+void QualityMetrics::worker_loop(int thread)
+{
+	uint64_t generation = 0;
+
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_work_cond.wait(lock, [&] { return m_stop || m_generation != generation; });
+			if (m_stop)
+			{
+				return;
+			}
+			generation = m_generation;
+		}
+
+		run_jobs(thread);
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (--m_running == 0)
+			{
+				m_done_cond.notify_all();
+			}
+		}
+	}
+}
+
+void QualityMetrics::run_parallel()
+{
+	m_next = 0;
+	if (m_threads.empty() || m_jobs.size() == 1)
+	{
+		run_jobs(0);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_running = (int)m_threads.size();
+		m_generation++;
+	}
+	m_work_cond.notify_all();
+
+	run_jobs(0);
+
+	// every worker checks in, so none of them is still reading m_jobs
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_done_cond.wait(lock, [&] { return m_running == 0; });
+}
+
+bool QualityMetrics::compare(const uint8_t* const ref[], const int ref_linesize[],
+	const uint8_t* const dist[], const int dist_linesize[], int flags, QualityResult& result)
+{
+	memset(&result, 0, sizeof(result));
+	if (!m_initialized)
+	{
+		return false;
+	}
+
+	int widths[3] = { m_width, m_width / 2, m_width / 2 };
+	int heights[3] = { m_height, m_height / 2, m_height / 2 };
+
+	m_jobs.clear();
+	for (int i = 0; i < 3; i++)
+	{
+		if (flags & QUALITY_PSNR)
+		{
+			add_jobs(JOB_SSE, i, ref[i], ref_linesize[i], dist[i], dist_linesize[i], widths[i], heights[i], heights[i]);
+		}
+		if (flags & QUALITY_SSIM)
+		{
+			add_jobs(JOB_SSIM, i, ref[i], ref_linesize[i], dist[i], dist_linesize[i], widths[i], heights[i], heights[i] / 4 - 1);
+		}
+	}
+
+	size_t downscaleJobs = m_jobs.size();
+	if (flags & QUALITY_FAST_SSIM)
+	{
+		add_jobs(JOB_DOWNSCALE, 0, ref[0], ref_linesize[0], dist[0], dist_linesize[0], m_width, m_height, m_height / 2);
+		for (size_t i = downscaleJobs; i < m_jobs.size(); i++)
+		{
+			m_jobs[i].ref_out = m_small_ref.data();
+			m_jobs[i].dist_out = m_small_dist.data();
+			m_jobs[i].out_linesize = m_small_linesize;
+		}
+	}
+
+	if (m_jobs.empty())
+	{
+		return true;
+	}
+
+	run_parallel();
+
+	// the sums in the job order, so the result doesn't depend on the threads
+	uint64_t sse[3] = { 0, 0, 0 };
+	double ssim[3] = { 0.0, 0.0, 0.0 };
+	for (size_t i = 0; i < downscaleJobs; i++)
+	{
+		sse[m_jobs[i].plane] += m_jobs[i].sse;
+		ssim[m_jobs[i].plane] += m_jobs[i].ssim;
+	}
+
+	uint64_t pixels[3];
+	for (int i = 0; i < 3; i++)
+	{
+		pixels[i] = (uint64_t)widths[i] * heights[i];
+	}
+
+	if (flags & QUALITY_PSNR)
+	{
+		result.psnr_y = get_psnr(sse[0], pixels[0]);
+		result.psnr_u = get_psnr(sse[1], pixels[1]);
+		result.psnr_v = get_psnr(sse[2], pixels[2]);
+		result.psnr = get_psnr(sse[0] + sse[1] + sse[2], pixels[0] + pixels[1] + pixels[2]);
+	}
+
+	if (flags & QUALITY_SSIM)
+	{
+		double* planes[3] = { &result.ssim_y, &result.ssim_u, &result.ssim_v };
+		for (int i = 0; i < 3; i++)
+		{
+			*planes[i] = ssim[i] / ((double)(widths[i] / 4 - 1) * (heights[i] / 4 - 1));
+		}
+		result.ssim = (result.ssim_y * 4 + result.ssim_u + result.ssim_v) / 6;
+	}
+
+	if (flags & QUALITY_FAST_SSIM)
+	{
+		int width = m_width / 2;
+		int height = m_height / 2;
+		m_jobs.clear();
+		add_jobs(JOB_SSIM, 0, m_small_ref.data(), m_small_linesize, m_small_dist.data(), m_small_linesize,
+			width, height, height / 4 - 1);
+		run_parallel();
+
+		double sum = 0.0;
+		for (size_t i = 0; i < m_jobs.size(); i++)
+		{
+			sum += m_jobs[i].ssim;
+		}
+		result.fast_ssim = sum / ((double)(width / 4 - 1) * (height / 4 - 1));
+	}
+
+	return true;
+}
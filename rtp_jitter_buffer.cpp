@@ -0,0 +1,572 @@
+#include "rtp_jitter_buffer.h"
+#include <string.h>
+#include <new>
+
+namespace
+{
+	const int RTP_HEADER_SIZE = 12;
+	const int MAX_CAPACITY = 16384;
+
+	// RFC-3550 A.1, a jump larger than these needs two packets in a row to restart
+	const int MAX_DROPOUT = 3000;
+	const int MAX_MISORDER = 100;
+
+	// the target delay in units of the interarrival jitter
+	const double JITTER_FACTOR = 4.0;
+	// added to the target delay per late packet
+	const int64_t LATE_BOOST_US = 10000;
+
+	const uint8_t START_CODE[4] = { 0, 0, 0, 1 };
+
+	bool parse_rtp_header(const uint8_t* data, size_t size, size_t& payload_offset, size_t& payload_size)
+	{
+		if (size < RTP_HEADER_SIZE || (data[0] >> 6) != 2)
+		{
+			return false;
+		}
+
+		size_t offset = RTP_HEADER_SIZE + (data[0] & 0x0F) * 4;
+		if (data[0] & 0x10)
+		{
+			if (offset + 4 > size)
+			{
+				return false;
+			}
+			offset += 4 + (size_t)((data[offset + 2] << 8) | data[offset + 3]) * 4;
+		}
+
+		size_t end = size;
+		if (data[0] & 0x20)
+		{
+			uint8_t padding = data[size - 1];
+			if (padding == 0 || padding > size)
+			{
+				return false;
+			}
+			end -= padding;
+		}
+
+		if (offset > end)
+		{
+			return false;
+		}
+
+		payload_offset = offset;
+		payload_size = end - offset;
+		return true;
+	}
+}
+
+RtpJitterBuffer::RtpJitterBuffer()
+{
+	m_buffer = NULL;
+	m_max_packet_size = 0;
+	m_mask = 0;
+	m_clock_rate = 90000;
+
+	m_min_delay_us = 5000;
+	m_max_delay_us = 200000;
+
+	m_popped = NULL;
+	m_lost = 0;
+	m_late = 0;
+	m_duplicate = 0;
+
+	reset();
+}
+
+RtpJitterBuffer::~RtpJitterBuffer()
+{
+	free_context();
+}
+
+void RtpJitterBuffer::free_context()
+{
+	m_slots.clear();
+	m_popped = NULL;
+
+	if (m_buffer)
+	{
+		delete[] m_buffer;
+		m_buffer = NULL;
+	}
+}
+
+bool RtpJitterBuffer::init(int capacity, size_t max_packet_size, int clock_rate)
+{
+	free_context();
+
+	if (capacity <= 0 || max_packet_size < RTP_HEADER_SIZE || clock_rate <= 0)
+	{
+		return false;
+	}
+
+	int slotCount = 16;
+	while (slotCount < capacity && slotCount < MAX_CAPACITY)
+	{
+		slotCount <<= 1;
+	}
+
+	m_buffer = new (std::nothrow) uint8_t[(size_t)slotCount * max_packet_size];
+	if (!m_buffer)
+	{
+		return false;
+	}
+
+	m_slots.resize(slotCount);
+	for (int i = 0; i < slotCount; i++)
+	{
+		m_slots[i].data = m_buffer + (size_t)i * max_packet_size;
+	}
+
+	m_max_packet_size = max_packet_size;
+	m_mask = (uint16_t)(slotCount - 1);
+	m_clock_rate = clock_rate;
+
+	m_lost = 0;
+	m_late = 0;
+	m_duplicate = 0;
+	reset();
+	return true;
+}
+
+void RtpJitterBuffer::set_delay_range(int min_ms, int max_ms)
+{
+	m_min_delay_us = (int64_t)min_ms * 1000;
+	m_max_delay_us = (int64_t)max_ms * 1000;
+	if (m_max_delay_us < m_min_delay_us)
+	{
+		m_max_delay_us = m_min_delay_us;
+	}
+	update_target_delay();
+}
+
+void RtpJitterBuffer::clear_slots()
+{
+	for (size_t i = 0; i < m_slots.size(); i++)
+	{
+		m_slots[i].used = false;
+	}
+	m_count = 0;
+	m_popped = NULL;
+}
+
+void RtpJitterBuffer::reset()
+{
+	clear_slots();
+
+	m_started = false;
+	m_next_sequence = 0;
+	m_discontinuity = false;
+	m_bad_sequence = -1;
+
+	m_has_transit = false;
+	m_last_transit = 0;
+	m_jitter = 0;
+	m_late_boost_us = 0;
+	update_target_delay();
+}
+
+void RtpJitterBuffer::update_target_delay()
+{
+	int64_t delay = (int64_t)(JITTER_FACTOR * m_jitter * 1000000 / m_clock_rate) + m_late_boost_us;
+	if (delay < m_min_delay_us)
+	{
+		delay = m_min_delay_us;
+	}
+	else if (delay > m_max_delay_us)
+	{
+		delay = m_max_delay_us;
+	}
+	m_target_delay_us = delay;
+}
+
+void RtpJitterBuffer::update_jitter(uint32_t timestamp, int64_t arrival_us)
+{
+	// the arrival time in timestamp units, the wrap around is fine for the differences
+	uint32_t arrival = (uint32_t)(int64_t)((double)arrival_us * m_clock_rate / 1000000);
+	uint32_t transit = arrival - timestamp;
+	if (m_has_transit)
+	{
+		int32_t d = (int32_t)(transit - m_last_transit);
+		m_jitter += ((d < 0 ? -(double)d : (double)d) - m_jitter) / 16;
+	}
+	m_last_transit = transit;
+	m_has_transit = true;
+
+	update_target_delay();
+}
+
+bool RtpJitterBuffer::push_packet(const uint8_t* data, size_t size, int64_t arrival_us)
+{
+	if (m_slots.empty() || size > m_max_packet_size)
+	{
+		return false;
+	}
+
+	size_t payloadOffset;
+	size_t payloadSize;
+	if (!parse_rtp_header(data, size, payloadOffset, payloadSize))
+	{
+		return false;
+	}
+
+	uint16_t sequence = (uint16_t)((data[2] << 8) | data[3]);
+	uint32_t timestamp = ((uint32_t)data[4] << 24) | ((uint32_t)data[5] << 16) | ((uint32_t)data[6] << 8) | data[7];
+
+	if (!m_started)
+	{
+		m_next_sequence = sequence;
+		m_started = true;
+	}
+
+	// the slot of the last popped packet is kept until end_pop_packet, so the window is one less
+	int window = (int)m_slots.size() - 1;
+	int diff = (int16_t)(uint16_t)(sequence - m_next_sequence);
+	bool far = diff < -MAX_MISORDER || (diff >= MAX_DROPOUT && diff >= window);
+	if (far && sequence != m_bad_sequence)
+	{
+		// a stray packet, or the sender restarted, see the next one
+		m_bad_sequence = (sequence + 1) & 0xFFFF;
+		return true;
+	}
+
+	if (far || diff >= window)
+	{
+		// restarted or ran a whole ring ahead, the buffered packets are given up
+		m_lost += m_count;
+		clear_slots();
+		m_next_sequence = sequence;
+		m_discontinuity = true;
+		m_has_transit = false;
+		diff = 0;
+	}
+	m_bad_sequence = -1;
+
+	update_jitter(timestamp, arrival_us);
+
+	if (diff < 0)
+	{
+		// its place was released or skipped, wait longer for the holes from now on
+		m_late++;
+		m_late_boost_us += LATE_BOOST_US;
+		if (m_late_boost_us > m_max_delay_us)
+		{
+			m_late_boost_us = m_max_delay_us;
+		}
+		update_target_delay();
+		return true;
+	}
+
+	Slot& slot = m_slots[sequence & m_mask];
+	if (slot.used)
+	{
+		m_duplicate++;
+		return true;
+	}
+
+	memcpy(slot.data, data, size);
+	slot.payload_offset = payloadOffset;
+	slot.payload_size = payloadSize;
+	slot.sequence = sequence;
+	slot.timestamp = timestamp;
+	slot.payload_type = data[1] & 0x7F;
+	slot.marker = (data[1] & 0x80) != 0;
+	slot.arrival_us = arrival_us;
+	slot.used = true;
+	m_count++;
+
+	return true;
+}
+
+RtpJitterBuffer::Slot* RtpJitterBuffer::find_next_slot(int& skipped)
+{
+	if (m_count == 0)
+	{
+		return NULL;
+	}
+
+	// the buffered packets are all in the window after m_next_sequence
+	for (int i = 0; i < (int)m_slots.size(); i++)
+	{
+		Slot& slot = m_slots[(uint16_t)(m_next_sequence + i) & m_mask];
+		if (slot.used && &slot != m_popped)
+		{
+			skipped = i;
+			return &slot;
+		}
+	}
+
+	return NULL;
+}
+
+bool RtpJitterBuffer::pop_packet(RtpPacket& packet, int64_t now_us)
+{
+	end_pop_packet();
+
+	int skipped;
+	Slot* slot = find_next_slot(skipped);
+	if (!slot)
+	{
+		return false;
+	}
+
+	if (skipped > 0)
+	{
+		// the hole is known since the packet after it arrived
+		if (now_us - slot->arrival_us < m_target_delay_us)
+		{
+			return false;
+		}
+
+		m_lost += skipped;
+		m_discontinuity = true;
+	}
+	else if (m_late_boost_us > 0)
+	{
+		m_late_boost_us -= (m_late_boost_us >> 8) + 1;
+		if (m_late_boost_us < 0)
+		{
+			m_late_boost_us = 0;
+		}
+		update_target_delay();
+	}
+
+	packet.payload = slot->data + slot->payload_offset;
+	packet.payload_size = slot->payload_size;
+	packet.sequence = slot->sequence;
+	packet.timestamp = slot->timestamp;
+	packet.payload_type = slot->payload_type;
+	packet.marker = slot->marker;
+	packet.discontinuity = m_discontinuity;
+	packet.arrival_us = slot->arrival_us;
+
+	m_discontinuity = false;
+	m_next_sequence = slot->sequence + 1;
+	m_count--;
+	m_popped = slot;
+	return true;
+}
+
+void RtpJitterBuffer::end_pop_packet()
+{
+	if (m_popped)
+	{
+		m_popped->used = false;
+		m_popped = NULL;
+	}
+}
+
+int64_t RtpJitterBuffer::get_wait_time(int64_t now_us)
+{
+	int skipped;
+	Slot* slot = find_next_slot(skipped);
+	if (!slot)
+	{
+		return -1;
+	}
+
+	if (skipped == 0)
+	{
+		return 0;
+	}
+
+	int64_t wait = slot->arrival_us + m_target_delay_us - now_us;
+	return wait > 0 ? wait : 0;
+}
+
+RtpH264Depacketizer::RtpH264Depacketizer()
+{
+	m_size = 0;
+	m_timestamp = 0;
+	m_active = false;
+	m_broken = false;
+	m_in_fragment = false;
+	m_discontinuity = false;
+	m_dropped = 0;
+}
+
+RtpH264Depacketizer::~RtpH264Depacketizer()
+{
+}
+
+bool RtpH264Depacketizer::init(size_t max_frame_size)
+{
+	if (max_frame_size == 0)
+	{
+		return false;
+	}
+
+	try
+	{
+		m_buffer.resize(max_frame_size);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return false;
+	}
+
+	m_dropped = 0;
+	reset();
+	return true;
+}
+
+void RtpH264Depacketizer::reset()
+{
+	m_size = 0;
+	m_active = false;
+	m_broken = false;
+	m_in_fragment = false;
+	m_discontinuity = false;
+}
+
+void RtpH264Depacketizer::drop_frame()
+{
+	m_size = 0;
+	m_active = false;
+	m_broken = false;
+	m_in_fragment = false;
+	m_discontinuity = true;
+	m_dropped++;
+}
+
+bool RtpH264Depacketizer::append(const uint8_t* data, size_t size, bool start_code)
+{
+	size_t needed = size + (start_code ? sizeof(START_CODE) : 0);
+	if (m_size + needed > m_buffer.size())
+	{
+		return false;
+	}
+
+	if (start_code)
+	{
+		memcpy(&m_buffer[m_size], START_CODE, sizeof(START_CODE));
+		m_size += sizeof(START_CODE);
+	}
+	memcpy(&m_buffer[m_size], data, size);
+	m_size += size;
+	return true;
+}
+
+bool RtpH264Depacketizer::append_payload(const uint8_t* payload, size_t size)
+{
+	if (size < 1)
+	{
+		return false;
+	}
+
+	uint8_t type = payload[0] & 0x1F;
+	if (type >= 1 && type <= 23)
+	{
+		// single NAL unit packet
+		return append(payload, size, true);
+	}
+	else if (type == 24)
+	{
+		// STAP-A, | header | size(16) | NAL unit | size(16) | NAL unit | ...
+		size_t offset = 1;
+		while (offset + 2 <= size)
+		{
+			size_t nalSize = (payload[offset] << 8) | payload[offset + 1];
+			offset += 2;
+			if (nalSize == 0 || offset + nalSize > size || !append(payload + offset, nalSize, true))
+			{
+				return false;
+			}
+			offset += nalSize;
+		}
+		return true;
+	}
+	else if (type == 28)
+	{
+		// FU-A, | indicator | S|E|R|type | fragment |
+		if (size < 2)
+		{
+			return false;
+		}
+
+		uint8_t header = payload[1];
+		if (header & 0x80)
+		{
+			uint8_t nal = (payload[0] & 0xE0) | (header & 0x1F);
+			if (!append(&nal, 1, true))
+			{
+				return false;
+			}
+			m_in_fragment = true;
+		}
+		else if (!m_in_fragment)
+		{
+			// the start of the fragmented NAL unit was lost
+			return false;
+		}
+
+		if (!append(payload + 2, size - 2, false))
+		{
+			return false;
+		}
+
+		if (header & 0x40)
+		{
+			m_in_fragment = false;
+		}
+		return true;
+	}
+
+	return false;
+}
+
+bool RtpH264Depacketizer::push_packet(const RtpPacket& packet, RtpFrame& frame)
+{
+	if (m_buffer.empty())
+	{
+		return false;
+	}
+
+	if (m_active && packet.timestamp != m_timestamp)
+	{
+		// the previous access unit never got its marker
+		drop_frame();
+	}
+
+	if (packet.discontinuity)
+	{
+		// the lost packets may belong to this access unit
+		m_broken = true;
+		m_discontinuity = true;
+	}
+
+	if (!m_active)
+	{
+		m_active = true;
+		m_timestamp = packet.timestamp;
+		m_size = 0;
+		m_in_fragment = false;
+	}
+
+	if (!m_broken && !append_payload(packet.payload, packet.payload_size))
+	{
+		m_broken = true;
+	}
+
+	if (!packet.marker)
+	{
+		return false;
+	}
+
+	if (m_broken || m_size == 0)
+	{
+		drop_frame();
+		return false;
+	}
+
+	frame.data = &m_buffer[0];
+	frame.size = m_size;
+	frame.timestamp = m_timestamp;
+	frame.discontinuity = m_discontinuity;
+
+	// the data stays until the next packet starts a new access unit
+	m_active = false;
+	m_discontinuity = false;
+	return true;
+}
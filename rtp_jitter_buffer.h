@@ -0,0 +1,273 @@
+#ifndef _H_RTP_JITTER_BUFFER_H_
+#define _H_RTP_JITTER_BUFFER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/**
+ RFC-3550 -- RTP fixed header
+
+ |0               |1               |2               |3               |
+ |V=2|P|X|  CC   |M|     PT      |       sequence number           |
+ |                           timestamp                               |
+ |                             SSRC                                  |
+ |                     CSRC list(CC * 4 bytes)                       |
+ |  header extension(if X), 4 bytes header + length * 4 bytes        |
+*/
+
+/**
+* a packet released by the RtpJitterBuffer
+*/
+struct RtpPacket
+{
+	const uint8_t* payload;
+	size_t payload_size;
+	uint16_t sequence;
+	uint32_t timestamp;
+	uint8_t payload_type;
+	bool marker;
+	// packets before this one were lost or dropped
+	bool discontinuity;
+	int64_t arrival_us;
+};
+
+/**
+* the adaptive jitter buffer for one RTP stream, it puts the reordered packets back in
+* sequence order.
+*
+* the packets are copied into a ring of fixed size slots indexed by the sequence number,
+* nothing is allocated per packet. the next packet in order is released at once, the
+* buffer only waits when there is a hole. a hole is waited for the target delay, which
+* follows the interarrival jitter(RFC-3550 6.4.1) of the stream:
+*
+*   target delay = clamp(4 * jitter + late boost, min delay, max delay)
+*
+* then the missing packets are counted as lost and the next packet is released with the
+* discontinuity flag. a packet arriving after its place was released or skipped is late,
+* it's dropped and the target delay is raised by the late boost, which decays as packets
+* are released in time. when the packets run a whole ring ahead, the buffered packets
+* are dropped and the buffer restarts from the newest one.
+*
+* it's not thread safe, push and pop from the receiving thread.
+*/
+class RtpJitterBuffer
+{
+public:
+	RtpJitterBuffer();
+	virtual ~RtpJitterBuffer();
+
+	/**
+	 * @brief initialize
+	 *
+	 * @param capacity -- the slot count, rounded up to a power of 2, at most 16384.
+	 *                    it should hold max delay * packet rate packets
+	 *        max_packet_size -- the largest RTP packet, e.g. 1500
+	 *        clock_rate -- the RTP timestamp clock, 90000 for video
+	 *
+	 * @return true -- successful
+	 *         false -- failed
+	 */
+	bool init(int capacity, size_t max_packet_size, int clock_rate = 90000);
+
+	/**
+	 * @brief the range of the target delay, the default is 5 - 200 ms
+	 */
+	void set_delay_range(int min_ms, int max_ms);
+
+	/**
+	 * @brief buffer a received RTP packet
+	 *
+	 * @param data -- the RTP packet with its header
+	 *        size -- the packet size
+	 *        arrival_us -- the receiving time, microseconds like av_gettime()
+	 *
+	 * @return true -- buffered, or dropped as late or duplicate
+	 *         false -- not a valid RTP packet, or larger than max_packet_size
+	 */
+	bool push_packet(const uint8_t* data, size_t size, int64_t arrival_us);
+
+	/**
+	 * @brief release the next packet in sequence order
+	 *
+	 * @param packet -- [output] the packet, the payload points into the buffer
+	 *        now_us -- the current time, microseconds
+	 *
+	 * @return true -- got a packet, call end_pop_packet when done with it
+	 *         false -- no packet is ready, see get_wait_time
+	 */
+	bool pop_packet(RtpPacket& packet, int64_t now_us);
+	void end_pop_packet();
+
+	/**
+	 * @brief the time until pop_packet has a packet, e.g. for the receiving timeout
+	 *
+	 * @return microseconds, 0 if a packet is ready, -1 if the buffer is empty
+	 */
+	int64_t get_wait_time(int64_t now_us);
+
+	/**
+	 * @brief drop all the buffered packets, the next pushed packet starts the sequence
+	 */
+	void reset();
+
+	int get_target_delay_ms() const
+	{
+		return (int)(m_target_delay_us / 1000);
+	}
+
+	double get_jitter_ms() const
+	{
+		return m_jitter * 1000.0 / m_clock_rate;
+	}
+
+	// the buffered packets
+	int get_count() const
+	{
+		return m_count;
+	}
+
+	uint64_t get_lost_count() const
+	{
+		return m_lost;
+	}
+
+	uint64_t get_late_count() const
+	{
+		return m_late;
+	}
+
+	uint64_t get_duplicate_count() const
+	{
+		return m_duplicate;
+	}
+
+private:
+	struct Slot
+	{
+		uint8_t* data;
+		size_t payload_offset;
+		size_t payload_size;
+		uint16_t sequence;
+		uint32_t timestamp;
+		uint8_t payload_type;
+		bool marker;
+		bool used;
+		int64_t arrival_us;
+	};
+
+	void free_context();
+	void clear_slots();
+	void update_jitter(uint32_t timestamp, int64_t arrival_us);
+	void update_target_delay();
+	Slot* find_next_slot(int& skipped);
+
+private:
+	std::vector<Slot> m_slots;
+	uint8_t* m_buffer;
+	size_t m_max_packet_size;
+	uint16_t m_mask;
+	int m_clock_rate;
+
+	bool m_started;
+	uint16_t m_next_sequence;
+	int m_count;
+	bool m_discontinuity;
+	Slot* m_popped;
+	// RFC-3550 restart detection, the sequence after the last far jump
+	int m_bad_sequence;
+
+	bool m_has_transit;
+	uint32_t m_last_transit;
+	// timestamp units
+	double m_jitter;
+
+	int64_t m_min_delay_us;
+	int64_t m_max_delay_us;
+	int64_t m_late_boost_us;
+	int64_t m_target_delay_us;
+
+	uint64_t m_lost;
+	uint64_t m_late;
+	uint64_t m_duplicate;
+};
+
+/**
+* a complete H.264 access unit from the RtpH264Depacketizer
+*/
+struct RtpFrame
+{
+	// Annex-B, with 4 bytes start codes
+	const uint8_t* data;
+	size_t size;
+	uint32_t timestamp;
+	// frames before this one were lost or dropped
+	bool discontinuity;
+};
+
+/**
+* RFC-6184 depacketizer, it assembles the in-order packets of the RtpJitterBuffer into
+* Annex-B access units for FFmpegDecoder::send_video_data.
+*
+* single NAL unit, STAP-A and FU-A packets are supported. an access unit ends at the
+* marker bit. an access unit with a lost packet(the discontinuity flag, a FU-A without
+* its start, or a new timestamp before the marker) is dropped instead of being output
+* broken, and the next output frame has the discontinuity flag.
+*/
+class RtpH264Depacketizer
+{
+public:
+	RtpH264Depacketizer();
+	virtual ~RtpH264Depacketizer();
+
+	/**
+	 * @brief initialize
+	 *
+	 * @param max_frame_size -- the largest access unit, a larger one is dropped
+	 *
+	 * @return true -- successful
+	 *         false -- failed
+	 */
+	bool init(size_t max_frame_size);
+
+	/**
+	 * @brief add the next packet
+	 *
+	 * @param packet -- the packet from RtpJitterBuffer::pop_packet
+	 *        frame -- [output] the completed access unit, it's valid until the next call
+	 *
+	 * @return true -- a frame was completed
+	 *         false -- the frame isn't complete yet, or it was dropped
+	 */
+	bool push_packet(const RtpPacket& packet, RtpFrame& frame);
+
+	/**
+	 * @brief drop the incomplete access unit
+	 */
+	void reset();
+
+	/**
+	 * @brief the count of the dropped access units
+	 */
+	uint64_t get_dropped_count() const
+	{
+		return m_dropped;
+	}
+
+private:
+	bool append(const uint8_t* data, size_t size, bool start_code);
+	bool append_payload(const uint8_t* payload, size_t size);
+	void drop_frame();
+
+private:
+	std::vector<uint8_t> m_buffer;
+	size_t m_size;
+	uint32_t m_timestamp;
+	bool m_active;
+	bool m_broken;
+	bool m_in_fragment;
+	bool m_discontinuity;
+	uint64_t m_dropped;
+};
+
+#endif
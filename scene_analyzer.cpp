@@ -0,0 +1,226 @@
+#include "scene_analyzer.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+#define SCENE_ANALYZER_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+namespace
+{
+	const int BLOCK_SIZE = 16;
+	// every 4th row of a block is compared
+	const int SAMPLE_ROWS = 4;
+	const int SAMPLE_STEP = BLOCK_SIZE / SAMPLE_ROWS;
+
+#ifndef SCENE_ANALYZER_X86
+	void sad_blocks_c(const uint8_t* cur, const uint8_t* ref, int blocks, uint32_t* sads)
+	{
+		for (int i = 0; i < blocks; i++)
+		{
+			uint32_t sad = 0;
+			for (int j = 0; j < BLOCK_SIZE; j++)
+			{
+				int diff = cur[j] - ref[j];
+				sad += diff < 0 ? -diff : diff;
+			}
+			sads[i] += sad;
+			cur += BLOCK_SIZE;
+			ref += BLOCK_SIZE;
+		}
+	}
+#else
+	void sad_blocks_sse2(const uint8_t* cur, const uint8_t* ref, int blocks, uint32_t* sads)
+	{
+		for (int i = 0; i < blocks; i++)
+		{
+			__m128i a = _mm_loadu_si128((const __m128i*)(cur + i * BLOCK_SIZE));
+			__m128i b = _mm_loadu_si128((const __m128i*)(ref + i * BLOCK_SIZE));
+			__m128i sad = _mm_sad_epu8(a, b);
+			sads[i] += (uint32_t)(_mm_cvtsi128_si32(sad) + _mm_extract_epi16(sad, 4));
+		}
+	}
+
+#if defined(__GNUC__)
+	__attribute__((target("avx2")))
+#endif
+	void sad_blocks_avx2(const uint8_t* cur, const uint8_t* ref, int blocks, uint32_t* sads)
+	{
+		int i = 0;
+		for (; i + 2 <= blocks; i += 2)
+		{
+			__m256i a = _mm256_loadu_si256((const __m256i*)(cur + i * BLOCK_SIZE));
+			__m256i b = _mm256_loadu_si256((const __m256i*)(ref + i * BLOCK_SIZE));
+			// four 64 bits sums, the lower two for block i, the upper two for block i + 1
+			__m256i sad = _mm256_sad_epu8(a, b);
+			__m128i lo = _mm256_castsi256_si128(sad);
+			__m128i hi = _mm256_extracti128_si256(sad, 1);
+			sads[i] += (uint32_t)(_mm_cvtsi128_si32(lo) + _mm_extract_epi16(lo, 4));
+			sads[i + 1] += (uint32_t)(_mm_cvtsi128_si32(hi) + _mm_extract_epi16(hi, 4));
+		}
+
+		if (i < blocks)
+		{
+			sad_blocks_sse2(cur + i * BLOCK_SIZE, ref + i * BLOCK_SIZE, blocks - i, sads + i);
+		}
+	}
+
+	bool cpu_has_avx2()
+	{
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 1);
+		// OSXSAVE and AVX
+		if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0)
+		{
+			return false;
+		}
+		if ((_xgetbv(0) & 6) != 6)
+		{
+			return false;
+		}
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#else
+		return __builtin_cpu_supports("avx2") != 0;
+#endif
+	}
+#endif
+}
+
+SceneAnalyzer::SceneAnalyzer()
+{
+	m_width = 0;
+	m_height = 0;
+	m_blocks_x = 0;
+	m_blocks_y = 0;
+	m_block_threshold = 0;
+	m_skip_ratio = 0.0f;
+	m_scene_change_ratio = 1.0f;
+	m_max_skip_frames = 0;
+	m_skipped = 0;
+	m_has_reference = false;
+
+#ifdef SCENE_ANALYZER_X86
+	m_sad_func = cpu_has_avx2() ? sad_blocks_avx2 : sad_blocks_sse2;
+#else
+	m_sad_func = sad_blocks_c;
+#endif
+}
+
+SceneAnalyzer::~SceneAnalyzer()
+{
+}
+
+bool SceneAnalyzer::init(int width, int height, int pixel_threshold, float skip_ratio, float scene_change_ratio, int max_skip_frames)
+{
+	if (width < BLOCK_SIZE || height < BLOCK_SIZE || pixel_threshold < 0)
+	{
+		return false;
+	}
+
+	// the right and bottom edges which don't fill a whole block are ignored
+	m_width = width;
+	m_height = height;
+	m_blocks_x = width / BLOCK_SIZE;
+	m_blocks_y = height / BLOCK_SIZE;
+	m_block_threshold = (uint32_t)pixel_threshold * BLOCK_SIZE * SAMPLE_ROWS;
+	m_skip_ratio = skip_ratio;
+	m_scene_change_ratio = scene_change_ratio;
+	m_max_skip_frames = max_skip_frames;
+	m_skipped = 0;
+
+	m_reference.resize((size_t)m_blocks_y * SAMPLE_ROWS * m_blocks_x * BLOCK_SIZE);
+	m_sads.resize(m_blocks_x);
+	m_has_reference = false;
+
+	return true;
+}
+
+void SceneAnalyzer::update_reference(const uint8_t* luma, int linesize)
+{
+	size_t rowSize = (size_t)m_blocks_x * BLOCK_SIZE;
+	uint8_t* dst = m_reference.data();
+
+	for (int by = 0; by < m_blocks_y; by++)
+	{
+		for (int r = 0; r < SAMPLE_ROWS; r++)
+		{
+			memcpy(dst, luma + (size_t)(by * BLOCK_SIZE + r * SAMPLE_STEP) * linesize, rowSize);
+			dst += rowSize;
+		}
+	}
+
+	m_has_reference = true;
+}
+
+SceneAnalyzer::Decision SceneAnalyzer::analyze(const uint8_t* luma, int linesize, Result* result)
+{
+	int totalBlocks = m_blocks_x * m_blocks_y;
+	int changedBlocks = totalBlocks;
+
+	if (m_has_reference)
+	{
+		size_t rowSize = (size_t)m_blocks_x * BLOCK_SIZE;
+		const uint8_t* ref = m_reference.data();
+
+		changedBlocks = 0;
+		for (int by = 0; by < m_blocks_y; by++)
+		{
+			memset(m_sads.data(), 0, m_sads.size() * sizeof(uint32_t));
+			for (int r = 0; r < SAMPLE_ROWS; r++)
+			{
+				m_sad_func(luma + (size_t)(by * BLOCK_SIZE + r * SAMPLE_STEP) * linesize, ref, m_blocks_x, m_sads.data());
+				ref += rowSize;
+			}
+
+			for (int bx = 0; bx < m_blocks_x; bx++)
+			{
+				if (m_sads[bx] > m_block_threshold)
+				{
+					changedBlocks++;
+				}
+			}
+		}
+	}
+
+	float ratio = totalBlocks > 0 ? (float)changedBlocks / totalBlocks : 1.0f;
+
+	Decision decision;
+	if (!m_has_reference || ratio > m_scene_change_ratio)
+	{
+		decision = FRAME_SCENE_CHANGE;
+	}
+	else if (ratio < m_skip_ratio && (m_max_skip_frames <= 0 || m_skipped < m_max_skip_frames))
+	{
+		decision = FRAME_SKIP;
+	}
+	else
+	{
+		decision = FRAME_ENCODE;
+	}
+
+	// the skipped frames are compared with the last encoded one, so the slow changes add up
+	if (decision == FRAME_SKIP)
+	{
+		m_skipped++;
+	}
+	else
+	{
+		m_skipped = 0;
+		update_reference(luma, linesize);
+	}
+
+	if (result)
+	{
+		result->decision = decision;
+		result->changed_ratio = ratio;
+		result->changed_blocks = changedBlocks;
+		result->total_blocks = totalBlocks;
+	}
+
+	return decision;
+}
\ No newline at end of file
@@ -0,0 +1,94 @@
+#ifndef _H_SCENE_ANALYZER_H_
+#define _H_SCENE_ANALYZER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/**
+* static scene detection before encoding.
+*
+* the luma plane is split into 16x16 blocks, and every 4th row of each block is
+* compared with the last encoded frame by SAD(SSE2/AVX2 when available).
+* a frame with too few changed blocks can be skipped, a frame with most of
+* the blocks changed is a scene change and should be encoded as an IDR frame.
+*/
+class SceneAnalyzer
+{
+public:
+	enum Decision
+	{
+		FRAME_SKIP = 0,
+		FRAME_ENCODE,
+		FRAME_SCENE_CHANGE
+	};
+
+	struct Result
+	{
+		Decision decision;
+		// the ratio of the changed blocks, [0, 1]
+		float changed_ratio;
+		int changed_blocks;
+		int total_blocks;
+	};
+
+	SceneAnalyzer();
+	virtual ~SceneAnalyzer();
+
+	/**
+	 * @brief initialize
+	 *
+	 * @param width -- the image width
+	 *        height -- the image height
+	 *        pixel_threshold -- the mean absolute difference per pixel of a changed block
+	 *        skip_ratio -- a frame with the changed ratio below it is skipped
+	 *        scene_change_ratio -- a frame with the changed ratio above it is a scene change
+	 *        max_skip_frames -- the max continuous skipped frames, 0 means no limit
+	 *
+	 * @return true -- successful
+	 *         false -- failed
+	 */
+	bool init(int width, int height, int pixel_threshold, float skip_ratio, float scene_change_ratio, int max_skip_frames);
+
+	/**
+	 * @brief analyze the frame, the frame is the new reference unless it is skipped
+	 *
+	 * @param luma -- the Y plane
+	 *        linesize -- the Y plane line size
+	 *        result -- [output] the details, can be NULL
+	 *
+	 * @return the decision
+	 */
+	Decision analyze(const uint8_t* luma, int linesize, Result* result = NULL);
+
+	/**
+	 * @brief forget the reference, the next frame is always encoded
+	 */
+	void reset()
+	{
+		m_has_reference = false;
+	}
+
+private:
+	void update_reference(const uint8_t* luma, int linesize);
+
+private:
+	int m_width;
+	int m_height;
+	int m_blocks_x;
+	int m_blocks_y;
+	uint32_t m_block_threshold;
+	float m_skip_ratio;
+	float m_scene_change_ratio;
+	int m_max_skip_frames;
+	int m_skipped;
+
+	bool m_has_reference;
+	// the sampled luma rows of the last encoded frame
+	std::vector<uint8_t> m_reference;
+	std::vector<uint32_t> m_sads;
+
+	void (*m_sad_func)(const uint8_t* cur, const uint8_t* ref, int blocks, uint32_t* sads);
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,608 @@
+#include "shm_frame_ring.h"
+#include <string.h>
+#include <atomic>
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+namespace
+{
+	const uint32_t SHM_RING_MAGIC = 0x46524d52; // "RMRF"
+	const uint32_t SHM_RING_VERSION = 1;
+	const int SHM_LINE_ALIGN = 32;
+	const size_t SHM_PAGE_SIZE = 4096;
+
+	size_t align_up(size_t size, size_t align)
+	{
+		return (size + align - 1) & ~(align - 1);
+	}
+}
+
+struct ShmSlotInfo
+{
+	// 2 * sequence + 1 while writing, 2 * sequence + 2 when published
+	std::atomic<uint64_t> state;
+	int32_t width;
+	int32_t height;
+	int64_t pts;
+};
+
+struct ShmReaderInfo
+{
+	std::atomic<uint32_t> active;
+	std::atomic<int32_t> pid;
+	// the next frame to read
+	std::atomic<uint64_t> position;
+};
+
+// the control area, mapped read-write by the writer and the readers
+struct ShmRingHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slot_count;
+	uint32_t policy;
+	uint64_t slot_size;
+	int32_t max_width;
+	int32_t max_height;
+	int32_t linesize[3];
+	uint32_t plane_offset[3];
+
+	// the published frame count
+	std::atomic<uint64_t> write_sequence;
+	// the futex word, changed on every publish
+	std::atomic<uint32_t> notify;
+	std::atomic<uint32_t> waiters;
+
+	ShmReaderInfo readers[SHM_RING_MAX_READERS];
+	ShmSlotInfo slots[1];
+};
+
+#ifdef __linux__
+namespace
+{
+	size_t control_size(int slots)
+	{
+		return align_up(sizeof(ShmRingHeader) + sizeof(ShmSlotInfo) * (slots - 1), SHM_PAGE_SIZE);
+	}
+
+	// not FUTEX_PRIVATE_FLAG, the word is shared between processes
+	void futex_wait(std::atomic<uint32_t>* word, uint32_t value, int timeout_ms)
+	{
+		struct timespec timeout;
+		timeout.tv_sec = timeout_ms / 1000;
+		timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+		syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT, value, timeout_ms < 0 ? NULL : &timeout, NULL, 0);
+	}
+
+	void futex_wake(std::atomic<uint32_t>* word)
+	{
+		syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+	}
+
+	int64_t now_ms()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	}
+}
+#endif
+
+ShmFrameWriter::ShmFrameWriter()
+{
+	m_fd = -1;
+	m_header = NULL;
+	m_control_size = 0;
+	m_slots = NULL;
+	m_slots_size = 0;
+
+	m_max_width = 0;
+	m_max_height = 0;
+	m_writing = false;
+	m_previous_state = 0;
+	m_dropped = 0;
+}
+
+ShmFrameWriter::~ShmFrameWriter()
+{
+	close();
+}
+
+bool ShmFrameWriter::create(const char* name, int slots, int max_width, int max_height, ShmDropPolicy policy)
+{
+	close();
+
+#ifdef __linux__
+	if (!name || slots < 2 || max_width <= 0 || max_height <= 0)
+	{
+		return false;
+	}
+
+	int linesize[3];
+	linesize[0] = (int)align_up(max_width, SHM_LINE_ALIGN);
+	linesize[1] = (int)align_up((max_width + 1) / 2, SHM_LINE_ALIGN);
+	linesize[2] = linesize[1];
+	int chromaHeight = (max_height + 1) / 2;
+
+	size_t slotSize = align_up((size_t)linesize[0] * max_height + (size_t)linesize[1] * chromaHeight * 2, SHM_PAGE_SIZE);
+	size_t controlSize = control_size(slots);
+	size_t slotsSize = slotSize * slots;
+
+	shm_unlink(name);
+	int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	if (ftruncate(fd, (off_t)(controlSize + slotsSize)) != 0)
+	{
+		::close(fd);
+		shm_unlink(name);
+		return false;
+	}
+
+	void* control = mmap(NULL, controlSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	void* data = mmap(NULL, slotsSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)controlSize);
+	if (control == MAP_FAILED || data == MAP_FAILED)
+	{
+		if (control != MAP_FAILED)
+		{
+			munmap(control, controlSize);
+		}
+		if (data != MAP_FAILED)
+		{
+			munmap(data, slotsSize);
+		}
+		::close(fd);
+		shm_unlink(name);
+		return false;
+	}
+
+	// the new segment is zero filled, so the atomics start at 0
+	ShmRingHeader* header = (ShmRingHeader*)control;
+	header->version = SHM_RING_VERSION;
+	header->slot_count = slots;
+	header->policy = policy;
+	header->slot_size = slotSize;
+	header->max_width = max_width;
+	header->max_height = max_height;
+	header->plane_offset[0] = 0;
+	header->plane_offset[1] = (uint32_t)((size_t)linesize[0] * max_height);
+	header->plane_offset[2] = (uint32_t)(header->plane_offset[1] + (size_t)linesize[1] * chromaHeight);
+	for (int i = 0; i < 3; i++)
+	{
+		header->linesize[i] = linesize[i];
+	}
+	std::atomic_thread_fence(std::memory_order_release);
+	// the readers check it last
+	header->magic = SHM_RING_MAGIC;
+
+	m_name = name;
+	m_fd = fd;
+	m_header = header;
+	m_control_size = controlSize;
+	m_slots = (uint8_t*)data;
+	m_slots_size = slotsSize;
+	m_max_width = max_width;
+	m_max_height = max_height;
+	m_writing = false;
+	m_dropped = 0;
+	return true;
+#else
+	(void)name;
+	(void)slots;
+	(void)max_width;
+	(void)max_height;
+	(void)policy;
+	return false;
+#endif
+}
+
+void ShmFrameWriter::close()
+{
+#ifdef __linux__
+	if (m_header)
+	{
+		munmap(m_header, m_control_size);
+		m_header = NULL;
+	}
+
+	if (m_slots)
+	{
+		munmap(m_slots, m_slots_size);
+		m_slots = NULL;
+	}
+
+	if (m_fd >= 0)
+	{
+		::close(m_fd);
+		m_fd = -1;
+		shm_unlink(m_name.c_str());
+	}
+#endif
+
+	m_name.clear();
+	m_writing = false;
+}
+
+bool ShmFrameWriter::reader_blocks(uint64_t sequence)
+{
+#ifdef __linux__
+	for (int i = 0; i < SHM_RING_MAX_READERS; i++)
+	{
+		ShmReaderInfo& reader = m_header->readers[i];
+		if (!reader.active.load(std::memory_order_acquire))
+		{
+			continue;
+		}
+
+		uint64_t position = reader.position.load(std::memory_order_acquire);
+		if (sequence < position + m_header->slot_count)
+		{
+			continue;
+		}
+
+		// a crashed reader must not stop the stream
+		pid_t pid = reader.pid.load(std::memory_order_relaxed);
+		if (pid > 0 && kill(pid, 0) != 0 && errno == ESRCH)
+		{
+			reader.active.store(0, std::memory_order_release);
+			continue;
+		}
+
+		return true;
+	}
+#else
+	(void)sequence;
+#endif
+
+	return false;
+}
+
+bool ShmFrameWriter::begin_frame(uint8_t* data[3], int linesize[3])
+{
+	if (!m_header)
+	{
+		return false;
+	}
+
+	uint64_t sequence = m_header->write_sequence.load(std::memory_order_relaxed);
+	if (m_header->policy == SHM_DROP_NEWEST && reader_blocks(sequence))
+	{
+		// counted by the caller, it may have had no frame at all
+		return false;
+	}
+
+	ShmSlotInfo& slot = m_header->slots[sequence % m_header->slot_count];
+	if (!m_writing)
+	{
+		m_previous_state = slot.state.load(std::memory_order_relaxed);
+	}
+	slot.state.store(2 * sequence + 1, std::memory_order_relaxed);
+	// the readers of the old frame see the odd state before any new data
+	std::atomic_thread_fence(std::memory_order_release);
+
+	uint8_t* base = m_slots + (sequence % m_header->slot_count) * m_header->slot_size;
+	for (int i = 0; i < 3; i++)
+	{
+		data[i] = base + m_header->plane_offset[i];
+		linesize[i] = m_header->linesize[i];
+	}
+
+	m_writing = true;
+	return true;
+}
+
+bool ShmFrameWriter::commit_frame(int width, int height, int64_t pts)
+{
+	if (!m_header || !m_writing)
+	{
+		return false;
+	}
+
+	uint64_t sequence = m_header->write_sequence.load(std::memory_order_relaxed);
+	ShmSlotInfo& slot = m_header->slots[sequence % m_header->slot_count];
+	slot.width = width;
+	slot.height = height;
+	slot.pts = pts;
+	slot.state.store(2 * sequence + 2, std::memory_order_release);
+	m_header->write_sequence.store(sequence + 1, std::memory_order_release);
+	m_writing = false;
+
+#ifdef __linux__
+	m_header->notify.fetch_add(1, std::memory_order_acq_rel);
+	if (m_header->waiters.load(std::memory_order_acquire))
+	{
+		futex_wake(&m_header->notify);
+	}
+#endif
+
+	return true;
+}
+
+void ShmFrameWriter::abort_frame()
+{
+	if (!m_header || !m_writing)
+	{
+		return;
+	}
+
+	uint64_t sequence = m_header->write_sequence.load(std::memory_order_relaxed);
+	ShmSlotInfo& slot = m_header->slots[sequence % m_header->slot_count];
+	// the slot data wasn't touched, so the old frame is intact again
+	slot.state.store(m_previous_state, std::memory_order_release);
+	m_writing = false;
+}
+
+bool ShmFrameWriter::write_frame(const AVFrame* frame)
+{
+	if (frame->format != AV_PIX_FMT_YUV420P && frame->format != AV_PIX_FMT_YUVJ420P)
+	{
+		return false;
+	}
+
+	if (frame->width > m_max_width || frame->height > m_max_height)
+	{
+		return false;
+	}
+
+	uint8_t* data[3];
+	int linesize[3];
+	if (!begin_frame(data, linesize))
+	{
+		if (m_header)
+		{
+			drop_frame();
+		}
+		return false;
+	}
+
+	for (int i = 0; i < 3; i++)
+	{
+		int width = i ? (frame->width + 1) / 2 : frame->width;
+		int height = i ? (frame->height + 1) / 2 : frame->height;
+		for (int y = 0; y < height; y++)
+		{
+			memcpy(data[i] + (size_t)y * linesize[i], frame->data[i] + (size_t)y * frame->linesize[i], width);
+		}
+	}
+
+	return commit_frame(frame->width, frame->height, frame->pts);
+}
+
+ShmFrameReader::ShmFrameReader()
+{
+	m_fd = -1;
+	m_header = NULL;
+	m_control_size = 0;
+	m_slots = NULL;
+	m_slots_size = 0;
+
+	m_reader_index = -1;
+	m_reading = false;
+	m_position = 0;
+	m_dropped = 0;
+}
+
+ShmFrameReader::~ShmFrameReader()
+{
+	close();
+}
+
+bool ShmFrameReader::open(const char* name)
+{
+	close();
+
+#ifdef __linux__
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	// the fixed part first, then the whole control area
+	ShmRingHeader* header = (ShmRingHeader*)mmap(NULL, sizeof(ShmRingHeader), PROT_READ, MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED)
+	{
+		::close(fd);
+		return false;
+	}
+
+	uint32_t magic = header->magic;
+	std::atomic_thread_fence(std::memory_order_acquire);
+	uint32_t slots = header->slot_count;
+	size_t slotsSize = header->slot_size * slots;
+	bool valid = magic == SHM_RING_MAGIC && header->version == SHM_RING_VERSION && slots >= 2;
+	munmap(header, sizeof(ShmRingHeader));
+	if (!valid)
+	{
+		::close(fd);
+		return false;
+	}
+
+	size_t controlSize = control_size(slots);
+	void* control = mmap(NULL, controlSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	// the frames are read-only for the readers
+	void* data = mmap(NULL, slotsSize, PROT_READ, MAP_SHARED, fd, (off_t)controlSize);
+	if (control == MAP_FAILED || data == MAP_FAILED)
+	{
+		if (control != MAP_FAILED)
+		{
+			munmap(control, controlSize);
+		}
+		if (data != MAP_FAILED)
+		{
+			munmap(data, slotsSize);
+		}
+		::close(fd);
+		return false;
+	}
+
+	m_fd = fd;
+	m_header = (ShmRingHeader*)control;
+	m_control_size = controlSize;
+	m_slots = (const uint8_t*)data;
+	m_slots_size = slotsSize;
+
+	for (int i = 0; i < SHM_RING_MAX_READERS; i++)
+	{
+		ShmReaderInfo& reader = m_header->readers[i];
+		uint32_t expected = 0;
+		if (reader.active.compare_exchange_strong(expected, 1, std::memory_order_acq_rel))
+		{
+			m_position = m_header->write_sequence.load(std::memory_order_acquire);
+			reader.pid.store((int32_t)getpid(), std::memory_order_relaxed);
+			reader.position.store(m_position, std::memory_order_release);
+			m_reader_index = i;
+			break;
+		}
+	}
+
+	if (m_reader_index < 0)
+	{
+		close();
+		return false;
+	}
+
+	m_dropped = 0;
+	return true;
+#else
+	(void)name;
+	return false;
+#endif
+}
+
+void ShmFrameReader::close()
+{
+#ifdef __linux__
+	if (m_header && m_reader_index >= 0)
+	{
+		m_header->readers[m_reader_index].active.store(0, std::memory_order_release);
+	}
+
+	if (m_header)
+	{
+		munmap(m_header, m_control_size);
+		m_header = NULL;
+	}
+
+	if (m_slots)
+	{
+		munmap((void*)m_slots, m_slots_size);
+		m_slots = NULL;
+	}
+
+	if (m_fd >= 0)
+	{
+		::close(m_fd);
+		m_fd = -1;
+	}
+#endif
+
+	m_reader_index = -1;
+	m_reading = false;
+}
+
+bool ShmFrameReader::acquire_frame(ShmFrame& frame, int timeout_ms)
+{
+#ifdef __linux__
+	if (!m_header || m_reading)
+	{
+		return false;
+	}
+
+	int64_t deadline = timeout_ms > 0 ? now_ms() + timeout_ms : 0;
+	uint32_t slots = m_header->slot_count;
+
+	while (true)
+	{
+		uint32_t notify = m_header->notify.load(std::memory_order_acquire);
+		uint64_t written = m_header->write_sequence.load(std::memory_order_acquire);
+
+		if (m_position < written)
+		{
+			// a whole ring behind, the frames were overwritten
+			if (written - m_position > slots)
+			{
+				m_dropped += written - 1 - m_position;
+				m_position = written - 1;
+			}
+
+			ShmSlotInfo& slot = m_header->slots[m_position % slots];
+			if (slot.state.load(std::memory_order_acquire) != 2 * m_position + 2)
+			{
+				// being overwritten now, skip to the newest frame
+				m_dropped += written - 1 - m_position;
+				m_position = written - 1;
+				continue;
+			}
+
+			const uint8_t* base = m_slots + (m_position % slots) * m_header->slot_size;
+			for (int i = 0; i < 3; i++)
+			{
+				frame.data[i] = base + m_header->plane_offset[i];
+				frame.linesize[i] = m_header->linesize[i];
+			}
+			frame.width = slot.width;
+			frame.height = slot.height;
+			frame.pts = slot.pts;
+			frame.sequence = m_position;
+
+			m_reading = true;
+			return true;
+		}
+
+		int waitMs = timeout_ms;
+		if (timeout_ms == 0)
+		{
+			return false;
+		}
+		else if (timeout_ms > 0)
+		{
+			waitMs = (int)(deadline - now_ms());
+			if (waitMs <= 0)
+			{
+				return false;
+			}
+		}
+
+		m_header->waiters.fetch_add(1, std::memory_order_acq_rel);
+		// returns at once if a frame was published after the notify value was read
+		futex_wait(&m_header->notify, notify, waitMs);
+		m_header->waiters.fetch_sub(1, std::memory_order_acq_rel);
+	}
+#else
+	(void)frame;
+	(void)timeout_ms;
+	return false;
+#endif
+}
+
+bool ShmFrameReader::release_frame()
+{
+	if (!m_header || !m_reading)
+	{
+		return false;
+	}
+
+	// the data loads must be done before the state is checked again
+	std::atomic_thread_fence(std::memory_order_acquire);
+	ShmSlotInfo& slot = m_header->slots[m_position % m_header->slot_count];
+	bool intact = slot.state.load(std::memory_order_relaxed) == 2 * m_position + 2;
+
+	m_position++;
+	m_header->readers[m_reader_index].position.store(m_position, std::memory_order_release);
+	m_reading = false;
+	return intact;
+}
@@ -0,0 +1,204 @@
+#ifndef _H_SHM_FRAME_RING_H_
+#define _H_SHM_FRAME_RING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+/**
+* shared memory frame transport between processes(linux only).
+*
+* the writer creates a POSIX shared memory segment(/dev/shm/<name>) holding a ring of
+* fixed size YUV420P frame slots, the readers in other processes map the frames
+* read-only and get them without any copy. the ring is lock free, a slot is guarded
+* by a sequence number, the readers sleep on a futex in the segment.
+*
+* up to SHM_RING_MAX_READERS readers, each one keeps its own position. a slow reader
+* is handled by the drop policy of the writer.
+*/
+
+constexpr int SHM_RING_MAX_READERS = 16;
+
+enum ShmDropPolicy
+{
+	// the writer never waits, a reader that falls a whole ring behind skips to the newest frame
+	SHM_DROP_OLDEST = 0,
+	// the writer drops the new frames while the slowest reader is a whole ring behind
+	SHM_DROP_NEWEST
+};
+
+/**
+* a frame mapped from the ring
+*/
+struct ShmFrame
+{
+	const uint8_t* data[3];
+	int linesize[3];
+	int width;
+	int height;
+	int64_t pts;
+	uint64_t sequence;
+};
+
+struct ShmRingHeader;
+
+class ShmFrameWriter
+{
+public:
+	ShmFrameWriter();
+	virtual ~ShmFrameWriter();
+
+	/**
+	 * @brief create the segment, an existing one with the same name is replaced
+	 *
+	 * @param name -- the segment name, e.g. "/camera1"
+	 *        slots -- the frame slot count
+	 *        max_width, max_height -- the largest frame size
+	 *        policy -- the drop policy for the slow readers
+	 *
+	 * @return true -- successful
+	 *         false -- failed
+	 */
+	bool create(const char* name, int slots, int max_width, int max_height, ShmDropPolicy policy);
+
+	/**
+	 * @brief unmap and unlink the segment, the readers keep their mappings
+	 */
+	void close();
+
+	/**
+	 * @brief get the planes of the next slot, write the frame into them directly,
+	 * e.g. FFmpegDecoder::receive_frame(data, linesize, ...), then commit_frame, or
+	 * abort_frame if nothing was written. the oldest frame is unpublished meanwhile.
+	 *
+	 * @param data -- [output] the planes
+	 *        linesize -- [output] the plane line sizes, for the max width
+	 *
+	 * @return true -- successful
+	 *         false -- the frame must be dropped by SHM_DROP_NEWEST(see drop_frame), or not created
+	 */
+	bool begin_frame(uint8_t* data[3], int linesize[3]);
+
+	/**
+	 * @brief publish the frame written after begin_frame and wake the readers
+	 */
+	bool commit_frame(int width, int height, int64_t pts);
+
+	/**
+	 * @brief give the slot of begin_frame back untouched, e.g. the decoder had no frame.
+	 * the oldest frame is published again, it's not a drop. the planes must not have been
+	 * written, the readers of the oldest frame would not notice it.
+	 */
+	void abort_frame();
+
+	/**
+	 * @brief count a frame the caller dropped because begin_frame failed, see get_dropped_count
+	 */
+	void drop_frame()
+	{
+		m_dropped++;
+	}
+
+	/**
+	 * @brief copy a YUV420P frame into the next slot and publish it
+	 */
+	bool write_frame(const AVFrame* frame);
+
+	int get_max_width() const
+	{
+		return m_max_width;
+	}
+
+	int get_max_height() const
+	{
+		return m_max_height;
+	}
+
+	uint64_t get_dropped_count() const
+	{
+		return m_dropped;
+	}
+
+private:
+	bool reader_blocks(uint64_t sequence);
+
+private:
+	std::string m_name;
+	int m_fd;
+	ShmRingHeader* m_header;
+	size_t m_control_size;
+	uint8_t* m_slots;
+	size_t m_slots_size;
+
+	int m_max_width;
+	int m_max_height;
+	bool m_writing;
+	// the state of the slot before begin_frame, for abort_frame
+	uint64_t m_previous_state;
+	uint64_t m_dropped;
+};
+
+class ShmFrameReader
+{
+public:
+	ShmFrameReader();
+	virtual ~ShmFrameReader();
+
+	/**
+	 * @brief open the segment created by a ShmFrameWriter, the reading starts from
+	 * the next published frame
+	 *
+	 * @return true -- successful
+	 *         false -- no segment, or all the reader places are taken
+	 */
+	bool open(const char* name);
+
+	void close();
+
+	/**
+	 * @brief get the next frame, the planes point into the read-only mapping
+	 *
+	 * @param frame -- [output] the frame
+	 *        timeout_ms -- the max wait, 0 returns immediately, -1 waits forever
+	 *
+	 * @return true -- got a frame, call release_frame when done with it
+	 *         false -- timeout
+	 */
+	bool acquire_frame(ShmFrame& frame, int timeout_ms);
+
+	/**
+	 * @brief finish with the frame of acquire_frame
+	 *
+	 * @return true -- the frame was intact
+	 *         false -- the writer overwrote the slot meanwhile(SHM_DROP_OLDEST only),
+	 *                  the data read from it is not reliable
+	 */
+	bool release_frame();
+
+	/**
+	 * @brief the frames skipped because this reader was too slow
+	 */
+	uint64_t get_dropped_count() const
+	{
+		return m_dropped;
+	}
+
+private:
+	int m_fd;
+	ShmRingHeader* m_header;
+	size_t m_control_size;
+	const uint8_t* m_slots;
+	size_t m_slots_size;
+
+	int m_reader_index;
+	bool m_reading;
+	uint64_t m_position;
+	uint64_t m_dropped;
+};
+
+#endif
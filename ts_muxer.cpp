@@ -0,0 +1,378 @@
+#include "ts_muxer.h"
+#include <string.h>
+
+namespace
+{
+	const int TS_PAYLOAD_SIZE = TS_PACKET_SIZE - 4;
+	// the TS packets are handed to the sink in blocks
+	const int TS_BUFFER_PACKETS = 64;
+
+	const uint16_t PAT_PID = 0x0000;
+	const uint16_t PMT_PID = 0x1000;
+	const uint16_t VIDEO_PID = 0x0100;
+	const uint8_t STREAM_TYPE_H264 = 0x1B;
+	const uint16_t PROGRAM_NUMBER = 1;
+
+	// the PTS/DTS are ahead of the PCR, so the decoder buffer can fill
+	const int64_t TS_DELAY = 63000;
+	const int TS_CLOCK = 90000;
+
+	const uint8_t g_aud[6] = { 0, 0, 0, 1, 0x09, 0xF0 };
+
+	uint32_t crc32_mpeg(const uint8_t* data, size_t size)
+	{
+		uint32_t crc = 0xFFFFFFFF;
+		for (size_t i = 0; i < size; i++)
+		{
+			crc ^= (uint32_t)data[i] << 24;
+			for (int j = 0; j < 8; j++)
+			{
+				crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : (crc << 1);
+			}
+		}
+		return crc;
+	}
+
+	void write_timestamp(uint8_t* p, int prefix, int64_t ts)
+	{
+		ts &= 0x1FFFFFFFFLL;
+		p[0] = (uint8_t)((prefix << 4) | ((ts >> 29) & 0x0E) | 1);
+		p[1] = (uint8_t)(ts >> 22);
+		p[2] = (uint8_t)(((ts >> 14) & 0xFE) | 1);
+		p[3] = (uint8_t)(ts >> 7);
+		p[4] = (uint8_t)(((ts << 1) & 0xFE) | 1);
+	}
+
+	void write_pcr(uint8_t* p, int64_t pcr)
+	{
+		pcr &= 0x1FFFFFFFFLL;
+		p[0] = (uint8_t)(pcr >> 25);
+		p[1] = (uint8_t)(pcr >> 17);
+		p[2] = (uint8_t)(pcr >> 9);
+		p[3] = (uint8_t)(pcr >> 1);
+		p[4] = (uint8_t)(((pcr & 1) << 7) | 0x7E);
+		p[5] = 0;
+	}
+
+	// write a PSI section into a TS packet, the section is padded with 0xFF
+	void write_section(uint8_t* pkt, uint16_t pid, uint8_t cc, const uint8_t* section, size_t size)
+	{
+		pkt[0] = 0x47;
+		pkt[1] = 0x40 | (uint8_t)(pid >> 8);
+		pkt[2] = (uint8_t)pid;
+		pkt[3] = 0x10 | (cc & 0x0F);
+		pkt[4] = 0; // pointer_field
+
+		memcpy(pkt + 5, section, size);
+
+		uint32_t crc = crc32_mpeg(section, size);
+		uint8_t* p = pkt + 5 + size;
+		p[0] = (uint8_t)(crc >> 24);
+		p[1] = (uint8_t)(crc >> 16);
+		p[2] = (uint8_t)(crc >> 8);
+		p[3] = (uint8_t)crc;
+
+		memset(p + 4, 0xFF, TS_PACKET_SIZE - (p + 4 - pkt));
+	}
+}
+
+TSMuxer::TSMuxer()
+{
+	m_sink = NULL;
+	m_time_base.num = 1;
+	m_time_base.den = 25;
+	m_segment_duration = 0;
+	m_segment_start = 0;
+	m_started = false;
+
+	m_pat_cc = 0;
+	m_pmt_cc = 0;
+	m_video_cc = 0;
+	m_ts_count = 0;
+}
+
+TSMuxer::~TSMuxer()
+{
+}
+
+bool TSMuxer::init(MuxerSink* sink, AVRational time_base, int segment_duration_ms)
+{
+	if (!sink || time_base.num <= 0 || time_base.den <= 0 || segment_duration_ms <= 0)
+	{
+		return false;
+	}
+
+	m_sink = sink;
+	m_time_base = time_base;
+	m_segment_duration = (int64_t)segment_duration_ms * TS_CLOCK / 1000;
+	m_segment_start = 0;
+	m_started = false;
+
+	m_pat_cc = 0;
+	m_pmt_cc = 0;
+	m_video_cc = 0;
+
+	m_ts_buffer.resize(TS_PACKET_SIZE * TS_BUFFER_PACKETS);
+	m_ts_count = 0;
+
+	return m_remuxer.init(H264Remuxer::FORMAT_ANNEXB, H264Remuxer::FORMAT_ANNEXB,
+		H264Remuxer::FLAG_STRIP_AUD | H264Remuxer::FLAG_INSERT_PARAMETER_SETS);
+}
+
+bool TSMuxer::write_packet(const AVPacket* packet)
+{
+	// a missing timestamp is taken from the other one, a packet without both can't be placed
+	if (!packet || (packet->pts == AV_NOPTS_VALUE && packet->dts == AV_NOPTS_VALUE))
+	{
+		return false;
+	}
+
+	int64_t pts = packet->pts == AV_NOPTS_VALUE ? packet->dts : packet->pts;
+	int64_t dts = packet->dts == AV_NOPTS_VALUE ? packet->pts : packet->dts;
+	return write_packet(packet->data, packet->size, pts, dts);
+}
+
+bool TSMuxer::write_packet(const uint8_t* data, size_t size, int64_t pts, int64_t dts)
+{
+	if (!m_sink)
+	{
+		return false;
+	}
+
+	if (!m_remuxer.process(data, size))
+	{
+		return false;
+	}
+
+	bool key = m_remuxer.is_key_frame();
+	if (!m_started && !key)
+	{
+		// the decoder can't start before the first key frame
+		return true;
+	}
+
+	AVRational clock = { 1, TS_CLOCK };
+	int64_t dts90k = av_rescale_q(dts, m_time_base, clock);
+	int64_t pts90k = av_rescale_q(pts, m_time_base, clock);
+
+	if (key)
+	{
+		if (!m_started || dts90k - m_segment_start >= m_segment_duration)
+		{
+			if (!flush_ts_packets())
+			{
+				return false;
+			}
+
+			m_sink->begin_fragment(dts90k, true);
+			m_segment_start = dts90k;
+			m_started = true;
+		}
+
+		if (!write_psi())
+		{
+			return false;
+		}
+	}
+
+	if (!write_pes(pts90k, dts90k, key))
+	{
+		return false;
+	}
+
+	return flush_ts_packets();
+}
+
+bool TSMuxer::finish()
+{
+	if (!m_sink)
+	{
+		return false;
+	}
+
+	return flush_ts_packets() && m_sink->flush();
+}
+
+uint8_t* TSMuxer::next_ts_packet()
+{
+	if (m_ts_count == TS_BUFFER_PACKETS)
+	{
+		if (!flush_ts_packets())
+		{
+			return NULL;
+		}
+	}
+
+	return m_ts_buffer.data() + TS_PACKET_SIZE * m_ts_count++;
+}
+
+bool TSMuxer::flush_ts_packets()
+{
+	if (m_ts_count == 0)
+	{
+		return true;
+	}
+
+	size_t len = TS_PACKET_SIZE * m_ts_count;
+	m_ts_count = 0;
+	return m_sink->write(m_ts_buffer.data(), len);
+}
+
+bool TSMuxer::write_psi()
+{
+	uint8_t section[32];
+	uint8_t* pkt;
+
+	// PAT
+	section[0] = 0x00; // table_id
+	section[1] = 0xB0; // section_syntax_indicator, section_length = 13
+	section[2] = 13;
+	section[3] = 0x00; // transport_stream_id = 1
+	section[4] = 0x01;
+	section[5] = 0xC1; // version 0, current_next_indicator
+	section[6] = 0x00;
+	section[7] = 0x00;
+	section[8] = (uint8_t)(PROGRAM_NUMBER >> 8);
+	section[9] = (uint8_t)PROGRAM_NUMBER;
+	section[10] = 0xE0 | (uint8_t)(PMT_PID >> 8);
+	section[11] = (uint8_t)PMT_PID;
+
+	pkt = next_ts_packet();
+	if (!pkt)
+	{
+		return false;
+	}
+	write_section(pkt, PAT_PID, m_pat_cc++, section, 12);
+
+	// PMT with one H264 stream
+	section[0] = 0x02;
+	section[1] = 0xB0; // section_length = 18
+	section[2] = 18;
+	section[3] = (uint8_t)(PROGRAM_NUMBER >> 8);
+	section[4] = (uint8_t)PROGRAM_NUMBER;
+	section[5] = 0xC1;
+	section[6] = 0x00;
+	section[7] = 0x00;
+	section[8] = 0xE0 | (uint8_t)(VIDEO_PID >> 8); // PCR_PID
+	section[9] = (uint8_t)VIDEO_PID;
+	section[10] = 0xF0; // program_info_length = 0
+	section[11] = 0x00;
+	section[12] = STREAM_TYPE_H264;
+	section[13] = 0xE0 | (uint8_t)(VIDEO_PID >> 8);
+	section[14] = (uint8_t)VIDEO_PID;
+	section[15] = 0xF0; // ES_info_length = 0
+	section[16] = 0x00;
+
+	pkt = next_ts_packet();
+	if (!pkt)
+	{
+		return false;
+	}
+	write_section(pkt, PMT_PID, m_pmt_cc++, section, 17);
+
+	return true;
+}
+
+bool TSMuxer::write_pes(int64_t pts, int64_t dts, bool key)
+{
+	// the PES header, the video PES_packet_length is unbounded
+	uint8_t* h = m_pes_header;
+	h[0] = 0;
+	h[1] = 0;
+	h[2] = 1;
+	h[3] = 0xE0;
+	h[4] = 0;
+	h[5] = 0;
+	h[6] = 0x80;
+	size_t headerSize;
+	if (pts != dts)
+	{
+		h[7] = 0xC0;
+		h[8] = 10;
+		write_timestamp(h + 9, 3, pts + TS_DELAY);
+		write_timestamp(h + 14, 1, dts + TS_DELAY);
+		headerSize = 19;
+	}
+	else
+	{
+		h[7] = 0x80;
+		h[8] = 5;
+		write_timestamp(h + 9, 2, pts + TS_DELAY);
+		headerSize = 14;
+	}
+
+	// the AUD is mandatory for H264 in MPEG-TS
+	m_payload.clear();
+	H264Segment segment = { m_pes_header, headerSize };
+	m_payload.push_back(segment);
+	segment.data = g_aud;
+	segment.size = sizeof(g_aud);
+	m_payload.push_back(segment);
+	const std::vector<H264Segment>& nals = m_remuxer.get_segments();
+	m_payload.insert(m_payload.end(), nals.begin(), nals.end());
+
+	size_t total = headerSize + sizeof(g_aud) + m_remuxer.get_output_size();
+	size_t index = 0;
+	size_t offset = 0;
+	bool first = true;
+
+	while (total > 0)
+	{
+		uint8_t* pkt = next_ts_packet();
+		if (!pkt)
+		{
+			return false;
+		}
+
+		// the first packet carries the PCR and the random access indicator
+		size_t afSize = first ? 8 : 0;
+		size_t payloadSize = total < TS_PAYLOAD_SIZE - afSize ? total : TS_PAYLOAD_SIZE - afSize;
+		afSize = TS_PAYLOAD_SIZE - payloadSize;
+
+		pkt[0] = 0x47;
+		pkt[1] = (first ? 0x40 : 0x00) | (uint8_t)(VIDEO_PID >> 8);
+		pkt[2] = (uint8_t)VIDEO_PID;
+		pkt[3] = (afSize ? 0x30 : 0x10) | (m_video_cc++ & 0x0F);
+
+		uint8_t* p = pkt + 4;
+		if (afSize > 0)
+		{
+			p[0] = (uint8_t)(afSize - 1);
+			if (afSize > 1)
+			{
+				size_t used = 2;
+				p[1] = 0;
+				if (first)
+				{
+					p[1] = 0x10 | (key ? 0x40 : 0);
+					write_pcr(p + 2, dts);
+					used += 6;
+				}
+				// stuffing for the last packet
+				memset(p + used, 0xFF, afSize - used);
+			}
+			p += afSize;
+		}
+
+		size_t left = payloadSize;
+		while (left > 0)
+		{
+			const H264Segment& src = m_payload[index];
+			size_t len = src.size - offset < left ? src.size - offset : left;
+			memcpy(p, src.data + offset, len);
+			p += len;
+			left -= len;
+			offset += len;
+			if (offset == src.size)
+			{
+				index++;
+				offset = 0;
+			}
+		}
+
+		total -= payloadSize;
+		first = false;
+	}
+
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,99 @@
+#ifndef _H_TS_MUXER_H_
+#define _H_TS_MUXER_H_
+
+#include <stdint.h>
+#include <vector>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+#include "h264_remuxer.h"
+#include "muxer_sink.h"
+
+//the MPEG-TS packet size
+constexpr int TS_PACKET_SIZE = 188;
+
+/**
+* streaming MPEG-TS muxer for the H264 Annex-B packets of FFmpegEncoder.
+*
+* every access unit becomes one PES and is written as 188 bytes TS packets,
+* the PAT/PMT are repeated before every key frame. the NAL payloads are copied
+* straight into the TS packets, and at most one access unit is buffered.
+*/
+class TSMuxer
+{
+public:
+	TSMuxer();
+	virtual ~TSMuxer();
+
+	/**
+	 * @brief initialize
+	 *
+	 * @param sink -- the output, it must be valid until finish()
+	 *        time_base -- the time base of the packet timestamps
+	 *        segment_duration_ms -- the target segment duration, MuxerSink::begin_fragment
+	 *                               is called before the next key frame once it is reached
+	 *
+	 * @return true -- successful
+	 *         false -- failed
+	 */
+	bool init(MuxerSink* sink, AVRational time_base, int segment_duration_ms);
+
+	/**
+	 * @brief write an encoded packet
+	 *
+	 * @param packet -- the Annex-B packet, a missing pts or dts is taken from the other one
+	 *
+	 * @return true -- successful
+	 *         false -- failed, or the packet has neither pts nor dts
+	 */
+	bool write_packet(const AVPacket* packet);
+
+	/**
+	 * @brief write an encoded access unit
+	 *
+	 * @param data -- the Annex-B data
+	 *        size -- the data size
+	 *        pts -- the presentation timestamp, in time_base
+	 *        dts -- the decode timestamp, in time_base
+	 *
+	 * @return true -- successful
+	 *         false -- failed
+	 */
+	bool write_packet(const uint8_t* data, size_t size, int64_t pts, int64_t dts);
+
+	/**
+	 * @brief flush the sink
+	 */
+	bool finish();
+
+private:
+	bool write_psi();
+	bool write_pes(int64_t pts, int64_t dts, bool key);
+	uint8_t* next_ts_packet();
+	bool flush_ts_packets();
+
+private:
+	MuxerSink* m_sink;
+	AVRational m_time_base;
+	int64_t m_segment_duration;
+	int64_t m_segment_start;
+	bool m_started;
+
+	H264Remuxer m_remuxer;
+
+	uint8_t m_pat_cc;
+	uint8_t m_pmt_cc;
+	uint8_t m_video_cc;
+
+	// the PES header, the AUD and the NAL units of the current access unit
+	uint8_t m_pes_header[32];
+	std::vector<H264Segment> m_payload;
+
+	std::vector<uint8_t> m_ts_buffer;
+	size_t m_ts_count;
+};
+
+#endif
\ No newline at end of file